@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <math.h>
+#include <gtk/gtk.h>
+
+#include <epoxy/gl.h>
+
+#include <gthree/gthree.h>
+#include "utils.h"
+
+/* Fills a flat grid with many small static meshes and looks at a
+ * small part of it, then reports how much CPU time a render takes
+ * with and without the scene keeping a bounding volume hierarchy.
+ * Almost all of the meshes are culled, so this is mostly the cost
+ * of the culling itself.
+ *
+ * Before that it checks that growing the bounds of a geometry brings
+ * an off screen mesh into view, as the cached culling state has to
+ * notice that without the mesh itself changing. */
+
+#define N_FRAMES 20
+#define SPACING 4
+
+static const int grid_sizes[] = { 10000, 50000, 100000 };
+
+GthreeScene *scene;
+GthreePerspectiveCamera *camera;
+GthreeGroup *grid;
+GthreeGeometry *geometry;
+GthreeMaterial *material;
+gboolean *done_ptr;
+
+static void
+init_scene (void)
+{
+  scene = gthree_scene_new ();
+
+  camera = gthree_perspective_camera_new (30, 1, 1, 10000);
+  gthree_object_set_position_xyz (GTHREE_OBJECT (camera), 0, 20, 40);
+  gthree_object_look_at (GTHREE_OBJECT (camera), graphene_vec3_zero ());
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (camera));
+
+  grid = gthree_group_new ();
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (grid));
+
+  geometry = gthree_geometry_new_box (1, 1, 1, 1, 1, 1);
+  material = GTHREE_MATERIAL (gthree_mesh_basic_material_new ());
+}
+
+static void
+fill_grid (int n_meshes)
+{
+  int side = ceil (sqrt (n_meshes));
+  int i;
+
+  gthree_object_destroy_all_children (GTHREE_OBJECT (grid));
+
+  for (i = 0; i < n_meshes; i++)
+    {
+      GthreeMesh *mesh = gthree_mesh_new (geometry, material);
+      gthree_object_set_position_xyz (GTHREE_OBJECT (mesh),
+                                      (i % side - side / 2) * SPACING,
+                                      0,
+                                      (i / side - side / 2) * SPACING);
+      gthree_object_add_child (GTHREE_OBJECT (grid), GTHREE_OBJECT (mesh));
+    }
+}
+
+static void
+time_renders (GthreeRenderer *renderer,
+              int             n_meshes,
+              gboolean        use_bvh)
+{
+  const GthreeRenderInfo *info;
+  gint64 start, total = 0;
+  int i;
+
+  gthree_scene_set_use_bvh (scene, use_bvh);
+
+  /* The first frame uploads buffers, builds programs and refits the tree */
+  gthree_renderer_render (renderer, scene, GTHREE_CAMERA (camera));
+
+  for (i = 0; i < N_FRAMES; i++)
+    {
+      start = g_get_monotonic_time ();
+      gthree_renderer_render (renderer, scene, GTHREE_CAMERA (camera));
+      total += g_get_monotonic_time () - start;
+    }
+
+  glFinish ();
+
+  info = gthree_renderer_get_info (renderer);
+  g_print ("%6d meshes, bvh %-3s: %8.1f us/frame, %u drawn, %u culled\n",
+           n_meshes, use_bvh ? "on" : "off",
+           (double) total / N_FRAMES,
+           info->objects_drawn, info->objects_culled);
+}
+
+static void
+check_geometry_bounds (GthreeRenderer *renderer,
+                       gboolean        use_bvh)
+{
+  g_autoptr(GthreeGeometry) far_geometry = gthree_geometry_new_box (1, 1, 1, 1, 1, 1);
+  GthreeGroup *parent = gthree_group_new ();
+  GthreeMesh *mesh = gthree_mesh_new (far_geometry, material);
+  const GthreeRenderInfo *info;
+  graphene_point3d_t center;
+  graphene_sphere_t sphere;
+  guint drawn_before;
+
+  gthree_scene_set_use_bvh (scene, use_bvh);
+
+  /* Far behind the camera, in a group so whole subtree culling applies */
+  gthree_object_set_position_xyz (GTHREE_OBJECT (parent), 0, 0, 5000);
+  gthree_object_add_child (GTHREE_OBJECT (parent), GTHREE_OBJECT (mesh));
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (parent));
+
+  gthree_renderer_render (renderer, scene, GTHREE_CAMERA (camera));
+  info = gthree_renderer_get_info (renderer);
+  drawn_before = info->objects_drawn;
+
+  /* Now the bounds say it reaches the origin, which is in view */
+  graphene_point3d_init (&center, 0, 0, -5000);
+  graphene_sphere_init (&sphere, &center, 1);
+  gthree_geometry_set_bounding_sphere (far_geometry, &sphere);
+
+  gthree_renderer_render (renderer, scene, GTHREE_CAMERA (camera));
+  info = gthree_renderer_get_info (renderer);
+
+  g_print ("geometry bounds change, bvh %-3s: %s\n",
+           use_bvh ? "on" : "off",
+           info->objects_drawn == drawn_before + 1 ? "ok" : "FAILED, mesh still culled");
+
+  gthree_object_destroy (GTHREE_OBJECT (parent));
+}
+
+static gboolean
+render_area (GtkGLArea    *gl_area,
+             GdkGLContext *context)
+{
+  static gboolean benchmarked = FALSE;
+  GthreeRenderer *renderer;
+  int i;
+
+  if (benchmarked)
+    return FALSE;
+
+  benchmarked = TRUE;
+
+  renderer = gthree_area_get_renderer (GTHREE_AREA (gl_area));
+
+  fill_grid (grid_sizes[0]);
+  check_geometry_bounds (renderer, FALSE);
+  check_geometry_bounds (renderer, TRUE);
+
+  for (i = 0; i < G_N_ELEMENTS (grid_sizes); i++)
+    {
+      fill_grid (grid_sizes[i]);
+      time_renders (renderer, grid_sizes[i], FALSE);
+      time_renders (renderer, grid_sizes[i], TRUE);
+    }
+
+  *done_ptr = TRUE;
+
+  return FALSE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GtkWidget *window, *box, *area;
+  gboolean done = FALSE;
+
+  window = examples_init ("Culling benchmark", &box, &done);
+  done_ptr = &done;
+
+  init_scene ();
+
+  area = gthree_area_new (scene, GTHREE_CAMERA (camera));
+  g_signal_connect (area, "render", G_CALLBACK (render_area), NULL);
+  gtk_widget_set_hexpand (area, TRUE);
+  gtk_widget_set_vexpand (area, TRUE);
+  gtk_box_append (GTK_BOX (box), area);
+  gtk_widget_show (area);
+
+  gtk_widget_show (window);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <math.h>
+#include <gtk/gtk.h>
+
+#include <epoxy/gl.h>
+
+#include <gthree/gthree.h>
+#include "utils.h"
+
+/* A field of detailed spheres, each turned into a chain of simplified
+ * levels of detail at startup. The camera flies back and forth, and the
+ * wireframe shows the levels switching. */
+
+#define GRID_SIZE 10
+#define SPACING 40
+
+GthreePerspectiveCamera *camera;
+
+static GthreeScene *
+init_scene (void)
+{
+  GthreeScene *scene;
+  GthreeGroup *field;
+  GthreeGeometry *geometry;
+  GthreeMeshBasicMaterial *material;
+  gint64 start;
+  int x, z;
+
+  scene = gthree_scene_new ();
+
+  field = gthree_group_new ();
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (field));
+
+  geometry = gthree_geometry_new_sphere (10, 64, 48);
+  material = gthree_mesh_basic_material_new ();
+  gthree_mesh_basic_material_set_color (material, green ());
+  gthree_mesh_material_set_is_wireframe (GTHREE_MESH_MATERIAL (material), TRUE);
+
+  for (x = 0; x < GRID_SIZE; x++)
+    for (z = 0; z < GRID_SIZE; z++)
+      {
+        GthreeMesh *mesh = gthree_mesh_new (geometry, GTHREE_MATERIAL (material));
+
+        gthree_object_set_position_xyz (GTHREE_OBJECT (mesh),
+                                        (x - GRID_SIZE / 2) * SPACING,
+                                        0,
+                                        -z * SPACING);
+        gthree_object_add_child (GTHREE_OBJECT (field), GTHREE_OBJECT (mesh));
+      }
+
+  /* The spheres all share a geometry, so it is only simplified once */
+  start = g_get_monotonic_time ();
+  gthree_object_generate_lods (GTHREE_OBJECT (field), 4, 0.25, 0.01, 100);
+  g_print ("Generated levels of detail in %.1f ms\n",
+           (g_get_monotonic_time () - start) / 1000.0);
+
+  return scene;
+}
+
+static gboolean
+tick (GtkWidget     *widget,
+      GdkFrameClock *frame_clock,
+      gpointer       user_data)
+{
+  static gint64 first_frame_time = 0;
+  graphene_vec3_t center;
+  gint64 frame_time;
+  float relative_time;
+
+  frame_time = gdk_frame_clock_get_frame_time (frame_clock);
+  if (first_frame_time == 0)
+    first_frame_time = frame_time;
+  relative_time = (frame_time - first_frame_time) / (float) G_USEC_PER_SEC;
+
+  gthree_object_set_position_xyz (GTHREE_OBJECT (camera),
+                                  0, 40,
+                                  100 + 300 * (1 - cos (relative_time * 0.5)));
+  graphene_vec3_init (&center, 0, 0, -GRID_SIZE * SPACING / 2);
+  gthree_object_look_at (GTHREE_OBJECT (camera), &center);
+
+  gtk_widget_queue_draw (widget);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+resize_area (GthreeArea *area,
+             gint width,
+             gint height,
+             GthreePerspectiveCamera *camera)
+{
+  gthree_perspective_camera_set_aspect (camera, (float)width / (float)(height));
+}
+
+int
+main (int argc, char *argv[])
+{
+  GtkWidget *window, *box, *area;
+  GthreeScene *scene;
+  gboolean done = FALSE;
+
+  window = examples_init ("Levels of detail", &box, &done);
+
+  scene = init_scene ();
+  camera = gthree_perspective_camera_new (30, 1, 1, 10000);
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (camera));
+
+  area = gthree_area_new (scene, GTHREE_CAMERA (camera));
+  g_signal_connect (area, "resize", G_CALLBACK (resize_area), camera);
+  gtk_widget_set_hexpand (area, TRUE);
+  gtk_widget_set_vexpand (area, TRUE);
+  gtk_box_append (GTK_BOX (box), area);
+  gtk_widget_show (area);
+
+  gtk_widget_add_tick_callback (GTK_WIDGET (area), tick, area, NULL);
+
+  gtk_widget_show (window);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return EXIT_SUCCESS;
+}
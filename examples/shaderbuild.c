@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <gtk/gtk.h>
+
+#include <epoxy/gl.h>
+
+#include <gthree/gthree.h>
+#include "utils.h"
+
+/* Builds the programs for a set of materials under every combination
+ * of light counts and fog, and reports how long generating the shader
+ * source took per program. This is run twice: the first pass starts
+ * with nothing cached, the second uses a fresh renderer so all the
+ * programs are built again, but the expanded shader text is reused. */
+
+#define MAX_DIRECTIONAL 3
+#define MAX_POINT 2
+
+GthreeScene *scene;
+GthreePerspectiveCamera *camera;
+GthreeGroup *lights;
+gboolean *done_ptr;
+
+static void
+init_scene (void)
+{
+  GthreeGeometry *geometry;
+  GthreeMaterial *materials[6];
+  int i;
+
+  scene = gthree_scene_new ();
+
+  camera = gthree_perspective_camera_new (30, 1, 1, 10000);
+  gthree_object_set_position_xyz (GTHREE_OBJECT (camera), 0, 0, 400);
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (camera));
+
+  lights = gthree_group_new ();
+  gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (lights));
+
+  geometry = gthree_geometry_new_sphere (40, 16, 12);
+
+  materials[0] = GTHREE_MATERIAL (gthree_mesh_basic_material_new ());
+  materials[1] = GTHREE_MATERIAL (gthree_mesh_lambert_material_new ());
+  materials[2] = GTHREE_MATERIAL (gthree_mesh_phong_material_new ());
+  materials[3] = GTHREE_MATERIAL (gthree_mesh_standard_material_new ());
+  materials[4] = GTHREE_MATERIAL (gthree_mesh_toon_material_new ());
+  materials[5] = GTHREE_MATERIAL (gthree_mesh_normal_material_new ());
+
+  for (i = 0; i < G_N_ELEMENTS (materials); i++)
+    {
+      GthreeMesh *mesh = gthree_mesh_new (geometry, materials[i]);
+      gthree_object_set_position_xyz (GTHREE_OBJECT (mesh), (i - 2.5) * 100, 0, 0);
+      gthree_object_add_child (GTHREE_OBJECT (scene), GTHREE_OBJECT (mesh));
+      g_object_unref (materials[i]);
+    }
+
+  g_object_unref (geometry);
+}
+
+static void
+set_lights (int n_directional,
+            int n_point)
+{
+  int i;
+
+  gthree_object_destroy_all_children (GTHREE_OBJECT (lights));
+
+  for (i = 0; i < n_directional; i++)
+    {
+      GthreeDirectionalLight *light = gthree_directional_light_new (white (), 1);
+      gthree_object_add_child (GTHREE_OBJECT (lights), GTHREE_OBJECT (light));
+    }
+
+  for (i = 0; i < n_point; i++)
+    {
+      GthreePointLight *light = gthree_point_light_new (white (), 1, 0);
+      gthree_object_add_child (GTHREE_OBJECT (lights), GTHREE_OBJECT (light));
+    }
+}
+
+static void
+build_all_permutations (GthreeRenderer *renderer,
+                        const char     *label)
+{
+  g_autoptr(GthreeFog) fog = gthree_fog_new_linear (white (), 1, 1000);
+  guint n_programs, n_evicted, n_built;
+  gint64 source_time, compile_time;
+  gint64 start_source_time, start_compile_time;
+  guint start_built;
+  int d, p, f;
+
+  /* Keep everything, so the program count is the number of permutations */
+  gthree_renderer_set_max_unused_programs (renderer, G_MAXUINT);
+
+  gthree_renderer_get_program_stats (renderer, &n_programs, NULL, &n_evicted,
+                                     &start_source_time, &start_compile_time);
+  start_built = n_programs + n_evicted;
+
+  for (d = 0; d <= MAX_DIRECTIONAL; d++)
+    for (p = 0; p <= MAX_POINT; p++)
+      for (f = 0; f < 2; f++)
+        {
+          set_lights (d, p);
+          gthree_scene_set_fog (scene, f ? fog : NULL);
+
+          while (!gthree_renderer_compile (renderer, scene, GTHREE_CAMERA (camera)))
+            g_usleep (1000);
+        }
+
+  gthree_scene_set_fog (scene, NULL);
+
+  gthree_renderer_get_program_stats (renderer, &n_programs, NULL, &n_evicted,
+                                     &source_time, &compile_time);
+  n_built = n_programs + n_evicted - start_built;
+  source_time -= start_source_time;
+  compile_time -= start_compile_time;
+
+  g_print ("%s: %u programs, source generation %.1f us/program, total build %.1f us/program\n",
+           label, n_built,
+           n_built ? (double) source_time / n_built : 0.0,
+           n_built ? (double) compile_time / n_built : 0.0);
+}
+
+static gboolean
+render_area (GtkGLArea    *gl_area,
+             GdkGLContext *context)
+{
+  static gboolean benchmarked = FALSE;
+  GthreeRenderer *renderer;
+
+  if (benchmarked)
+    return FALSE;
+
+  benchmarked = TRUE;
+
+  build_all_permutations (gthree_area_get_renderer (GTHREE_AREA (gl_area)), "cold");
+
+  renderer = gthree_renderer_new ();
+  build_all_permutations (renderer, "warm");
+  g_object_unref (renderer);
+
+  *done_ptr = TRUE;
+
+  return FALSE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GtkWidget *window, *box, *area;
+  gboolean done = FALSE;
+
+  window = examples_init ("Shader build benchmark", &box, &done);
+  done_ptr = &done;
+
+  init_scene ();
+
+  area = gthree_area_new (scene, GTHREE_CAMERA (camera));
+  g_signal_connect (area, "render", G_CALLBACK (render_area), NULL);
+  gtk_widget_set_hexpand (area, TRUE);
+  gtk_widget_set_vexpand (area, TRUE);
+  gtk_box_append (GTK_BOX (box), area);
+  gtk_widget_show (area);
+
+  gtk_widget_show (window);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return EXIT_SUCCESS;
+}
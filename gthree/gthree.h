@@ -19,8 +19,11 @@
 #include <gthree/gthreematerial.h>
 #include <gthree/gthreemesh.h>
 #include <gthree/gthreeskinnedmesh.h>
+#include <gthree/gthreeinstancedmesh.h>
 #include <gthree/gthreeobject.h>
 #include <gthree/gthreegroup.h>
+#include <gthree/gthreelod.h>
+#include <gthree/gthreesimplify.h>
 #include <gthree/gthreerenderer.h>
 #include <gthree/gthreescene.h>
 #include <gthree/gthreetexture.h>
@@ -32,6 +35,7 @@
 #include <gthree/gthreepointlight.h>
 #include <gthree/gthreespotlight.h>
 #include <gthree/gthreedirectionallight.h>
+#include <gthree/gthreedirectionallightshadow.h>
 #include <gthree/gthreehemispherelight.h>
 #include <gthree/gthreemeshlambertmaterial.h>
 #include <gthree/gthreemeshphongmaterial.h>
@@ -25,6 +25,9 @@ typedef struct {
   int update_range_count;
 } GthreeAttributeArrayRealizeData;
 
+static guint next_layout_serial = 0;
+static guint next_content_serial = 0;
+
 static gsize attribute_type_size[] = { 8, 4, 4, 4, 2, 2, 1, 1};
 static int attribute_type_gl[] = {
    GL_DOUBLE,
@@ -914,6 +917,8 @@ struct _GthreeAttribute {
   int item_offset;  /* typically 0, but not if interleaved or stacked */
   int count;        /* May be smaller than the entire array if stacking */
   gboolean normalized;
+  guint layout_serial;
+  guint content_serial;
 };
 
 typedef struct {
@@ -1052,6 +1057,8 @@ gthree_attribute_new_from_uint32 (const char           *name,
 static void
 gthree_attribute_init (GthreeAttribute *attribute)
 {
+  attribute->layout_serial = gthree_layout_serial_next ();
+  attribute->content_serial = ++next_content_serial;
 }
 
 static void
@@ -1126,6 +1133,7 @@ void
 gthree_attribute_set_needs_update (GthreeAttribute *attribute)
 {
   gthree_resource_mark_dirty (GTHREE_RESOURCE (attribute));
+  attribute->content_serial = ++next_content_serial;
 }
 
 void
@@ -1137,6 +1145,8 @@ gthree_attribute_set_array (GthreeAttribute      *attribute,
   if (attribute->array)
     gthree_attribute_array_unref (attribute->array);
   attribute->array = array;
+  attribute->layout_serial = gthree_layout_serial_next ();
+  attribute->content_serial = ++next_content_serial;
 }
 
 int
@@ -1235,7 +1245,10 @@ gthree_attribute_real_unrealize (GthreeResource *resource,
 {
   GthreeAttribute *attribute = GTHREE_ATTRIBUTE (resource);
   if (gthree_resource_is_realized_for (resource, renderer))
-    gthree_attribute_array_unrealize (attribute->array, renderer);
+    {
+      gthree_attribute_array_unrealize (attribute->array, renderer);
+      attribute->layout_serial = gthree_layout_serial_next ();
+    }
 }
 
 guint8 *
@@ -1631,7 +1644,8 @@ gthree_attribute_get_point3d (GthreeAttribute      *attribute,
   gthree_attribute_array_get_point3d (attribute->array, index, attribute->item_offset, point);
 }
 
-static void
+/* Returns the number of bytes uploaded */
+static gsize
 gthree_attribute_array_update (GthreeAttributeArray *array,
                                GthreeAttributeArrayRealizeData *data,
                                gboolean allocate,
@@ -1639,26 +1653,34 @@ gthree_attribute_array_update (GthreeAttributeArray *array,
 {
   int usage = array->dynamic ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW;
   int element_size = attribute_type_size[array->type];
+  gsize size;
+
+  /* The element array binding is part of the vertex array object state, so
+     upload through a target that doesn't affect whatever vao is bound */
+  if (buffer_type == GL_ELEMENT_ARRAY_BUFFER)
+    buffer_type = GL_COPY_WRITE_BUFFER;
 
   glBindBuffer (buffer_type, data->gl_buffer);
   if (allocate || !array->dynamic)
     {
-      glBufferData (buffer_type, gthree_attribute_array_get_len (array) * element_size,
-                    &array->data[0], usage);
+      size = gthree_attribute_array_get_len (array) * element_size;
+      glBufferData (buffer_type, size, &array->data[0], usage);
     }
   else if (data->update_range_count == -1)
     {
       // Not using update ranges
-      glBufferSubData (buffer_type, 0,
-                       gthree_attribute_array_get_len (array) * element_size, &array->data[0]);
+      size = gthree_attribute_array_get_len (array) * element_size;
+      glBufferSubData (buffer_type, 0, size, &array->data[0]);
     }
   else
     {
-      glBufferSubData (buffer_type, data->update_range_offset * element_size,
-                       data->update_range_count * element_size,
+      size = data->update_range_count * element_size;
+      glBufferSubData (buffer_type, data->update_range_offset * element_size, size,
                        ((guint8 *)&array->data[0]) + data->update_range_offset * element_size);
       data->update_range_count = -1; // reset range
     }
+
+  return size;
 }
 
 void
@@ -1672,16 +1694,36 @@ gthree_attribute_update (GthreeAttribute *attribute, GthreeRenderer *renderer, g
     {
       gthree_attribute_array_realize (array, array_data);
       gthree_resource_set_realized_for (GTHREE_RESOURCE (attribute), renderer);
+      attribute->layout_serial = gthree_layout_serial_next ();
       allocate = TRUE;
     }
 
   if (gthree_resource_get_dirty_for (GTHREE_RESOURCE (attribute), renderer))
     {
-      gthree_attribute_array_update (array, array_data, allocate, buffer_type);
+      gsize size = gthree_attribute_array_update (array, array_data, allocate, buffer_type);
+      gthree_renderer_count_buffer_upload (renderer, size);
       gthree_resource_mark_clean_for (GTHREE_RESOURCE (attribute), renderer);
     }
 }
 
+guint
+gthree_layout_serial_next (void)
+{
+  return ++next_layout_serial;
+}
+
+guint
+gthree_attribute_get_layout_serial (GthreeAttribute *attribute)
+{
+  return attribute->layout_serial;
+}
+
+guint
+gthree_attribute_get_content_serial (GthreeAttribute *attribute)
+{
+  return attribute->content_serial;
+}
+
 int
 gthree_attribute_get_gl_buffer (GthreeAttribute *attribute, GthreeRenderer *renderer)
 {
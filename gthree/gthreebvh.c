@@ -0,0 +1,635 @@
+#include <math.h>
+
+#include "gthreeprivate.h"
+
+/* A dynamic AABB tree, used to frustum cull large scenes.
+ *
+ * Leaves hold a box that is a bit larger than the bounds of what they
+ * represent, so small movements don't change the tree. When a leaf
+ * does move outside its box it is removed and reinserted, picking the
+ * sibling by the surface area heuristic and rebalancing with tree
+ * rotations on the way up. This is the same approach as the Box2D
+ * b2DynamicTree.
+ */
+
+#define NULL_NODE -1
+
+/* Leaf boxes are grown by this fraction of their largest extent */
+#define FAT_MARGIN 0.1f
+
+typedef struct {
+  float min[3];
+  float max[3];
+} BvhBox;
+
+typedef struct {
+  BvhBox box;
+  gpointer data;
+  int parent; /* Next free node when on the free list */
+  int child1;
+  int child2;
+  int height; /* 0 for leaves, -1 when free */
+  guint dirty : 1;
+  guint empty : 1;
+} BvhNode;
+
+struct _GthreeBvh {
+  GArray *nodes;
+  int root;
+  int free_list;
+  guint n_leaves;
+
+  GArray *dirty; /* Leaf ids, may contain ids freed since */
+  GArray *stack;
+};
+
+#define NODE(_bvh, _id) (&g_array_index ((_bvh)->nodes, BvhNode, (_id)))
+
+static inline gboolean
+is_leaf (BvhNode *node)
+{
+  return node->child1 == NULL_NODE;
+}
+
+static inline void
+box_union (const BvhBox *a,
+           const BvhBox *b,
+           BvhBox       *res)
+{
+  for (int i = 0; i < 3; i++)
+    {
+      res->min[i] = MIN (a->min[i], b->min[i]);
+      res->max[i] = MAX (a->max[i], b->max[i]);
+    }
+}
+
+static inline gboolean
+box_contains (const BvhBox *outer,
+              const BvhBox *inner)
+{
+  for (int i = 0; i < 3; i++)
+    {
+      if (inner->min[i] < outer->min[i] ||
+          inner->max[i] > outer->max[i])
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static inline float
+box_area (const BvhBox *box)
+{
+  float dx = box->max[0] - box->min[0];
+  float dy = box->max[1] - box->min[1];
+  float dz = box->max[2] - box->min[2];
+
+  return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static void
+box_from_graphene (BvhBox               *box,
+                   const graphene_box_t *gbox)
+{
+  graphene_point3d_t min, max;
+
+  graphene_box_get_min (gbox, &min);
+  graphene_box_get_max (gbox, &max);
+
+  box->min[0] = min.x;
+  box->min[1] = min.y;
+  box->min[2] = min.z;
+  box->max[0] = max.x;
+  box->max[1] = max.y;
+  box->max[2] = max.z;
+}
+
+static void
+box_fatten (BvhBox *box)
+{
+  float extent = 0;
+  float margin;
+
+  for (int i = 0; i < 3; i++)
+    extent = MAX (extent, box->max[i] - box->min[i]);
+
+  margin = extent * FAT_MARGIN;
+  for (int i = 0; i < 3; i++)
+    {
+      box->min[i] -= margin;
+      box->max[i] += margin;
+    }
+}
+
+GthreeBvh *
+gthree_bvh_new (void)
+{
+  GthreeBvh *bvh = g_new0 (GthreeBvh, 1);
+
+  bvh->nodes = g_array_new (FALSE, FALSE, sizeof (BvhNode));
+  bvh->root = NULL_NODE;
+  bvh->free_list = NULL_NODE;
+  bvh->dirty = g_array_new (FALSE, FALSE, sizeof (int));
+  bvh->stack = g_array_new (FALSE, FALSE, sizeof (int));
+
+  return bvh;
+}
+
+void
+gthree_bvh_free (GthreeBvh *bvh)
+{
+  g_array_unref (bvh->nodes);
+  g_array_unref (bvh->dirty);
+  g_array_unref (bvh->stack);
+  g_free (bvh);
+}
+
+guint
+gthree_bvh_get_n_leaves (GthreeBvh *bvh)
+{
+  return bvh->n_leaves;
+}
+
+static int
+allocate_node (GthreeBvh *bvh)
+{
+  BvhNode *node;
+  int id;
+
+  if (bvh->free_list != NULL_NODE)
+    {
+      id = bvh->free_list;
+      bvh->free_list = NODE (bvh, id)->parent;
+    }
+  else
+    {
+      id = bvh->nodes->len;
+      g_array_set_size (bvh->nodes, id + 1);
+    }
+
+  node = NODE (bvh, id);
+  memset (node, 0, sizeof (BvhNode));
+  node->parent = NULL_NODE;
+  node->child1 = NULL_NODE;
+  node->child2 = NULL_NODE;
+
+  return id;
+}
+
+static void
+free_node (GthreeBvh *bvh,
+           int        id)
+{
+  BvhNode *node = NODE (bvh, id);
+
+  node->parent = bvh->free_list;
+  node->height = -1;
+  node->data = NULL;
+  bvh->free_list = id;
+}
+
+static void
+update_node (GthreeBvh *bvh,
+             int        id)
+{
+  BvhNode *node = NODE (bvh, id);
+  BvhNode *child1 = NODE (bvh, node->child1);
+  BvhNode *child2 = NODE (bvh, node->child2);
+
+  node->height = 1 + MAX (child1->height, child2->height);
+  box_union (&child1->box, &child2->box, &node->box);
+}
+
+/* Rotates the tree at a if it is imbalanced, returns the new subtree root */
+static int
+balance (GthreeBvh *bvh,
+         int        ia)
+{
+  BvhNode *a = NODE (bvh, ia);
+  BvhNode *b, *c;
+  int ib, ic, diff;
+
+  if (is_leaf (a) || a->height < 2)
+    return ia;
+
+  ib = a->child1;
+  ic = a->child2;
+  b = NODE (bvh, ib);
+  c = NODE (bvh, ic);
+
+  diff = c->height - b->height;
+
+  if (diff > 1)
+    {
+      /* Rotate c up */
+      int i_f = c->child1;
+      int ig = c->child2;
+      BvhNode *f = NODE (bvh, i_f);
+      BvhNode *g = NODE (bvh, ig);
+
+      c->child1 = ia;
+      c->parent = a->parent;
+      a->parent = ic;
+
+      if (c->parent != NULL_NODE)
+        {
+          BvhNode *p = NODE (bvh, c->parent);
+          if (p->child1 == ia)
+            p->child1 = ic;
+          else
+            p->child2 = ic;
+        }
+      else
+        bvh->root = ic;
+
+      if (f->height > g->height)
+        {
+          c->child2 = i_f;
+          a->child2 = ig;
+          g->parent = ia;
+        }
+      else
+        {
+          c->child2 = ig;
+          a->child2 = i_f;
+          f->parent = ia;
+        }
+
+      update_node (bvh, ia);
+      update_node (bvh, ic);
+
+      return ic;
+    }
+
+  if (diff < -1)
+    {
+      /* Rotate b up */
+      int id = b->child1;
+      int ie = b->child2;
+      BvhNode *d = NODE (bvh, id);
+      BvhNode *e = NODE (bvh, ie);
+
+      b->child1 = ia;
+      b->parent = a->parent;
+      a->parent = ib;
+
+      if (b->parent != NULL_NODE)
+        {
+          BvhNode *p = NODE (bvh, b->parent);
+          if (p->child1 == ia)
+            p->child1 = ib;
+          else
+            p->child2 = ib;
+        }
+      else
+        bvh->root = ib;
+
+      if (d->height > e->height)
+        {
+          b->child2 = id;
+          a->child1 = ie;
+          e->parent = ia;
+        }
+      else
+        {
+          b->child2 = ie;
+          a->child1 = id;
+          d->parent = ia;
+        }
+
+      update_node (bvh, ia);
+      update_node (bvh, ib);
+
+      return ib;
+    }
+
+  return ia;
+}
+
+static void
+refit_ancestors (GthreeBvh *bvh,
+                 int        index)
+{
+  while (index != NULL_NODE)
+    {
+      index = balance (bvh, index);
+      update_node (bvh, index);
+      index = NODE (bvh, index)->parent;
+    }
+}
+
+static void
+insert_leaf (GthreeBvh *bvh,
+             int        leaf)
+{
+  BvhBox leaf_box = NODE (bvh, leaf)->box;
+  BvhBox combined;
+  int index, sibling, old_parent, new_parent;
+
+  if (bvh->root == NULL_NODE)
+    {
+      bvh->root = leaf;
+      NODE (bvh, leaf)->parent = NULL_NODE;
+      return;
+    }
+
+  /* Find the best sibling */
+  index = bvh->root;
+  while (!is_leaf (NODE (bvh, index)))
+    {
+      BvhNode *node = NODE (bvh, index);
+      BvhNode *child1 = NODE (bvh, node->child1);
+      BvhNode *child2 = NODE (bvh, node->child2);
+      float area, combined_area, cost, inheritance_cost, cost1, cost2;
+
+      area = box_area (&node->box);
+      box_union (&node->box, &leaf_box, &combined);
+      combined_area = box_area (&combined);
+
+      /* Cost of making a new parent for this node and the leaf */
+      cost = 2.0f * combined_area;
+
+      /* Minimum cost of pushing the leaf further down the tree */
+      inheritance_cost = 2.0f * (combined_area - area);
+
+      box_union (&child1->box, &leaf_box, &combined);
+      cost1 = box_area (&combined) + inheritance_cost;
+      if (!is_leaf (child1))
+        cost1 -= box_area (&child1->box);
+
+      box_union (&child2->box, &leaf_box, &combined);
+      cost2 = box_area (&combined) + inheritance_cost;
+      if (!is_leaf (child2))
+        cost2 -= box_area (&child2->box);
+
+      if (cost < cost1 && cost < cost2)
+        break;
+
+      index = cost1 < cost2 ? node->child1 : node->child2;
+    }
+
+  sibling = index;
+
+  /* Create a new parent, this may reallocate the nodes */
+  new_parent = allocate_node (bvh);
+  old_parent = NODE (bvh, sibling)->parent;
+
+  NODE (bvh, new_parent)->parent = old_parent;
+  box_union (&leaf_box, &NODE (bvh, sibling)->box, &NODE (bvh, new_parent)->box);
+  NODE (bvh, new_parent)->height = NODE (bvh, sibling)->height + 1;
+  NODE (bvh, new_parent)->child1 = sibling;
+  NODE (bvh, new_parent)->child2 = leaf;
+  NODE (bvh, sibling)->parent = new_parent;
+  NODE (bvh, leaf)->parent = new_parent;
+
+  if (old_parent != NULL_NODE)
+    {
+      if (NODE (bvh, old_parent)->child1 == sibling)
+        NODE (bvh, old_parent)->child1 = new_parent;
+      else
+        NODE (bvh, old_parent)->child2 = new_parent;
+    }
+  else
+    bvh->root = new_parent;
+
+  refit_ancestors (bvh, NODE (bvh, leaf)->parent);
+}
+
+static void
+remove_leaf (GthreeBvh *bvh,
+             int        leaf)
+{
+  int parent, grand_parent, sibling;
+
+  if (leaf == bvh->root)
+    {
+      bvh->root = NULL_NODE;
+      return;
+    }
+
+  parent = NODE (bvh, leaf)->parent;
+  grand_parent = NODE (bvh, parent)->parent;
+  sibling = NODE (bvh, parent)->child1 == leaf ? NODE (bvh, parent)->child2 : NODE (bvh, parent)->child1;
+
+  if (grand_parent != NULL_NODE)
+    {
+      if (NODE (bvh, grand_parent)->child1 == parent)
+        NODE (bvh, grand_parent)->child1 = sibling;
+      else
+        NODE (bvh, grand_parent)->child2 = sibling;
+      NODE (bvh, sibling)->parent = grand_parent;
+      free_node (bvh, parent);
+
+      refit_ancestors (bvh, grand_parent);
+    }
+  else
+    {
+      bvh->root = sibling;
+      NODE (bvh, sibling)->parent = NULL_NODE;
+      free_node (bvh, parent);
+    }
+}
+
+/* Returns the id of the new leaf. An empty box is never reported
+ * by queries, this is used for objects without bounds. */
+int
+gthree_bvh_insert (GthreeBvh            *bvh,
+                   const graphene_box_t *box,
+                   gpointer              data)
+{
+  int leaf = allocate_node (bvh);
+  BvhNode *node = NODE (bvh, leaf);
+
+  node->data = data;
+  node->empty = graphene_box_equal (box, graphene_box_empty ());
+  box_from_graphene (&node->box, node->empty ? graphene_box_zero () : box);
+  box_fatten (&node->box);
+
+  insert_leaf (bvh, leaf);
+  bvh->n_leaves++;
+
+  return leaf;
+}
+
+void
+gthree_bvh_remove (GthreeBvh *bvh,
+                   int        leaf)
+{
+  g_assert (is_leaf (NODE (bvh, leaf)));
+
+  remove_leaf (bvh, leaf);
+  free_node (bvh, leaf);
+  bvh->n_leaves--;
+}
+
+/* Returns TRUE if the leaf had to be reinserted */
+gboolean
+gthree_bvh_move (GthreeBvh            *bvh,
+                 int                   leaf,
+                 const graphene_box_t *box)
+{
+  BvhNode *node = NODE (bvh, leaf);
+  gboolean empty = graphene_box_equal (box, graphene_box_empty ());
+  BvhBox new_box;
+
+  box_from_graphene (&new_box, empty ? graphene_box_zero () : box);
+
+  if (node->empty == empty && box_contains (&node->box, &new_box))
+    return FALSE;
+
+  remove_leaf (bvh, leaf);
+
+  node = NODE (bvh, leaf);
+  node->box = new_box;
+  node->empty = empty;
+  box_fatten (&node->box);
+
+  insert_leaf (bvh, leaf);
+
+  return TRUE;
+}
+
+void
+gthree_bvh_mark_dirty (GthreeBvh *bvh,
+                       int        leaf)
+{
+  BvhNode *node = NODE (bvh, leaf);
+
+  if (node->dirty)
+    return;
+
+  node->dirty = TRUE;
+  g_array_append_val (bvh->dirty, leaf);
+}
+
+/* Calls @func for every leaf marked dirty since the last call */
+void
+gthree_bvh_foreach_dirty (GthreeBvh     *bvh,
+                          GthreeBvhFunc  func,
+                          gpointer       user_data)
+{
+  guint i;
+
+  for (i = 0; i < bvh->dirty->len; i++)
+    {
+      int leaf = g_array_index (bvh->dirty, int, i);
+      BvhNode *node = NODE (bvh, leaf);
+
+      /* Skip ids that were freed or reused since being marked */
+      if (node->height != 0 || !node->dirty)
+        continue;
+
+      node->dirty = FALSE;
+      func (leaf, node->data, user_data);
+    }
+
+  g_array_set_size (bvh->dirty, 0);
+}
+
+typedef enum {
+  CULL_OUTSIDE,
+  CULL_INTERSECTS,
+  CULL_INSIDE,
+} CullResult;
+
+static CullResult
+classify_box (const float   planes[6][4],
+              const BvhBox *box)
+{
+  CullResult res = CULL_INSIDE;
+
+  for (int i = 0; i < 6; i++)
+    {
+      const float *p = planes[i];
+      float far_dist, near_dist;
+
+      /* Distance of the corners furthest along and against the normal */
+      far_dist = p[3] +
+        p[0] * (p[0] > 0 ? box->max[0] : box->min[0]) +
+        p[1] * (p[1] > 0 ? box->max[1] : box->min[1]) +
+        p[2] * (p[2] > 0 ? box->max[2] : box->min[2]);
+      if (far_dist < 0)
+        return CULL_OUTSIDE;
+
+      near_dist = p[3] +
+        p[0] * (p[0] > 0 ? box->min[0] : box->max[0]) +
+        p[1] * (p[1] > 0 ? box->min[1] : box->max[1]) +
+        p[2] * (p[2] > 0 ? box->min[2] : box->max[2]);
+      if (near_dist < 0)
+        res = CULL_INTERSECTS;
+    }
+
+  return res;
+}
+
+/* Calls @func for every leaf whose box intersects @frustum. Whole
+ * subtrees are rejected or accepted with a single test. */
+void
+gthree_bvh_query_frustum (GthreeBvh                *bvh,
+                          const graphene_frustum_t *frustum,
+                          GthreeBvhFrustumFunc      func,
+                          gpointer                  user_data)
+{
+  graphene_plane_t gplanes[6];
+  float planes[6][4];
+  GArray *stack = bvh->stack;
+  int i;
+
+  if (bvh->root == NULL_NODE)
+    return;
+
+  graphene_frustum_get_planes (frustum, gplanes);
+  for (i = 0; i < 6; i++)
+    {
+      graphene_vec3_t normal;
+
+      graphene_plane_get_normal (&gplanes[i], &normal);
+      planes[i][0] = graphene_vec3_get_x (&normal);
+      planes[i][1] = graphene_vec3_get_y (&normal);
+      planes[i][2] = graphene_vec3_get_z (&normal);
+      planes[i][3] = graphene_plane_get_constant (&gplanes[i]);
+    }
+
+  /* Entries are node ids, negated and offset by one for subtrees
+   * known to be fully inside, which need no more tests */
+  g_array_set_size (stack, 0);
+  g_array_append_val (stack, bvh->root);
+
+  while (stack->len > 0)
+    {
+      int id = g_array_index (stack, int, stack->len - 1);
+      gboolean inside = id < 0;
+      BvhNode *node;
+
+      g_array_set_size (stack, stack->len - 1);
+
+      if (inside)
+        id = -id - 1;
+
+      node = NODE (bvh, id);
+
+      if (!inside)
+        {
+          CullResult res = classify_box (planes, &node->box);
+
+          if (res == CULL_OUTSIDE)
+            continue;
+
+          inside = res == CULL_INSIDE;
+        }
+
+      if (is_leaf (node))
+        {
+          if (!node->empty)
+            func (id, node->data, inside, user_data);
+        }
+      else
+        {
+          int child1 = inside ? -node->child1 - 1 : node->child1;
+          int child2 = inside ? -node->child2 - 1 : node->child2;
+
+          g_array_append_val (stack, child1);
+          g_array_append_val (stack, child2);
+        }
+    }
+}
@@ -0,0 +1,412 @@
+#include <math.h>
+#include <string.h>
+#include <epoxy/gl.h>
+
+#include "gthreeprivate.h"
+#include "gthreepointlight.h"
+#include "gthreespotlight.h"
+
+/* Clustered forward lighting.
+ *
+ * The view frustum is split into a grid of clusters: screen space tiles,
+ * each cut into slices that grow exponentially with the distance from
+ * the camera. Every frame the point and spot lights are binned into the
+ * clusters their range touches, and the shaders only loop over the
+ * lights of the cluster the fragment is in.
+ *
+ * The lights, the range of each cluster in the light index list and the
+ * index list itself are uploaded as textures, so the number of lights
+ * is not compiled into the programs and changing it never rebuilds them.
+ *
+ * Binning is conservative: a light goes in every cluster overlapping the
+ * screen space box of its range, which is cheap and never misses a lit
+ * fragment, at the cost of some wasted shader iterations for big lights.
+ */
+
+#define N_CLUSTERS (GTHREE_CLUSTER_GRID_X * GTHREE_CLUSTER_GRID_Y * GTHREE_CLUSTER_GRID_Z)
+
+/* Must match getClusteredDirectLightIrradiance() in lights_pars_begin.glsl */
+typedef struct {
+  float position[4];  /* View space, w is 1 for spot lights */
+  float color[4];     /* Times intensity, w is the distance */
+  float direction[4]; /* View space, towards the light, w is the decay */
+  float cone[4];      /* Cosine of the cone and penumbra angles */
+} ClusterLight;
+
+typedef struct {
+  guint8 min_x, max_x;
+  guint8 min_y, max_y;
+  guint8 min_z, max_z;
+} ClusterRange;
+
+enum {
+  TEXTURE_LIGHTS,
+  TEXTURE_GRID,
+  TEXTURE_INDICES,
+};
+
+struct _GthreeLightClusters {
+  graphene_matrix_t projection;
+  float near;
+  float slice_scale;
+
+  GArray *lights;      /* ClusterLight */
+  GArray *ranges;      /* ClusterRange, per light */
+  GArray *indices;     /* guint32, the lights of each cluster in order */
+  guint32 grid[N_CLUSTERS * 2]; /* First index and number of lights */
+
+  GLuint textures[GTHREE_CLUSTER_N_TEXTURES];
+  guint light_rows;    /* Allocated size of the textures */
+  guint index_rows;
+};
+
+GthreeLightClusters *
+gthree_light_clusters_new (void)
+{
+  GthreeLightClusters *clusters = g_new0 (GthreeLightClusters, 1);
+
+  clusters->lights = g_array_new (FALSE, FALSE, sizeof (ClusterLight));
+  clusters->ranges = g_array_new (FALSE, FALSE, sizeof (ClusterRange));
+  clusters->indices = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  return clusters;
+}
+
+void
+gthree_light_clusters_free (GthreeLightClusters *clusters)
+{
+  if (clusters->textures[0])
+    glDeleteTextures (GTHREE_CLUSTER_N_TEXTURES, clusters->textures);
+
+  g_array_unref (clusters->lights);
+  g_array_unref (clusters->ranges);
+  g_array_unref (clusters->indices);
+  g_free (clusters);
+}
+
+/* Starts collecting lights for a frame seen from @camera, whose matrices
+ * must be up to date. Also returns the parameters the shaders need to
+ * find the depth slice of a fragment. */
+void
+gthree_light_clusters_begin (GthreeLightClusters *clusters,
+                             GthreeCamera        *camera,
+                             float                params[4])
+{
+  float near = gthree_camera_get_near (camera);
+  float far = gthree_camera_get_far (camera);
+
+  /* Orthographic cameras can have the near plane at the eye */
+  if (near <= 0)
+    near = far * 1e-4f;
+
+  clusters->projection = *gthree_camera_get_projection_matrix (camera);
+  clusters->near = near;
+  clusters->slice_scale = GTHREE_CLUSTER_GRID_Z / logf (far / near);
+
+  g_array_set_size (clusters->lights, 0);
+
+  params[0] = clusters->near;
+  params[1] = clusters->slice_scale;
+  params[2] = 0;
+  params[3] = 0;
+}
+
+/* Adds a point or spot light, returns FALSE for other kinds of lights */
+gboolean
+gthree_light_clusters_add_light (GthreeLightClusters *clusters,
+                                 GthreeLight         *light,
+                                 GthreeCamera        *camera)
+{
+  const graphene_matrix_t *view_matrix = gthree_camera_get_world_inverse_matrix (camera);
+  ClusterLight cl = { { 0 } };
+  graphene_vec4_t position, view_position;
+  graphene_vec3_t color;
+
+  if (!GTHREE_IS_POINT_LIGHT (light) && !GTHREE_IS_SPOT_LIGHT (light))
+    return FALSE;
+
+  graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (light)), 3, &position);
+  graphene_matrix_transform_vec4 (view_matrix, &position, &view_position);
+  graphene_vec4_to_float (&view_position, cl.position);
+
+  graphene_vec3_scale (gthree_light_get_color (light), gthree_light_get_intensity (light), &color);
+  graphene_vec3_to_float (&color, cl.color);
+
+  if (GTHREE_IS_POINT_LIGHT (light))
+    {
+      GthreePointLight *point = GTHREE_POINT_LIGHT (light);
+
+      cl.position[3] = 0;
+      cl.color[3] = gthree_point_light_get_distance (point);
+      cl.direction[3] = gthree_point_light_get_decay (point);
+    }
+  else
+    {
+      GthreeSpotLight *spot = GTHREE_SPOT_LIGHT (light);
+      GthreeObject *target = gthree_spot_light_get_target (spot);
+      float angle = gthree_spot_light_get_angle (spot);
+      graphene_vec4_t target_position, direction;
+      graphene_vec3_t direction3;
+
+      graphene_matrix_get_row (gthree_object_get_world_matrix (target), 3, &target_position);
+      graphene_vec4_subtract (&position, &target_position, &direction);
+      graphene_vec4_get_xyz (&direction, &direction3);
+      graphene_matrix_transform_vec3 (view_matrix, &direction3, &direction3);
+      graphene_vec3_normalize (&direction3, &direction3);
+      graphene_vec3_to_float (&direction3, cl.direction);
+
+      cl.position[3] = 1;
+      cl.color[3] = gthree_spot_light_get_distance (spot);
+      cl.direction[3] = gthree_spot_light_get_decay (spot);
+      cl.cone[0] = cosf (angle);
+      cl.cone[1] = cosf (angle * (1 - gthree_spot_light_get_penumbra (spot)));
+    }
+
+  /* Completely black lights can't light anything */
+  if (cl.color[0] <= 0 && cl.color[1] <= 0 && cl.color[2] <= 0)
+    return TRUE;
+
+  g_array_append_val (clusters->lights, cl);
+
+  return TRUE;
+}
+
+guint
+gthree_light_clusters_get_n_lights (GthreeLightClusters *clusters)
+{
+  return clusters->lights->len;
+}
+
+static int
+depth_to_slice (GthreeLightClusters *clusters,
+                float                depth)
+{
+  int slice = floorf (logf (depth / clusters->near) * clusters->slice_scale);
+
+  return CLAMP (slice, 0, GTHREE_CLUSTER_GRID_Z - 1);
+}
+
+static int
+ndc_to_tile (float ndc,
+             int   n_tiles)
+{
+  int tile = floorf ((ndc * 0.5f + 0.5f) * n_tiles);
+
+  return CLAMP (tile, 0, n_tiles - 1);
+}
+
+/* Finds the clusters touched by the range of a light, returns FALSE if
+ * it is entirely out of view */
+static gboolean
+light_get_range (GthreeLightClusters *clusters,
+                 const ClusterLight  *cl,
+                 ClusterRange        *range)
+{
+  float radius = cl->color[3];
+  float depth = - cl->position[2];
+  float min_x, max_x, min_y, max_y;
+  int i;
+
+  range->min_x = 0;
+  range->max_x = GTHREE_CLUSTER_GRID_X - 1;
+  range->min_y = 0;
+  range->max_y = GTHREE_CLUSTER_GRID_Y - 1;
+  range->min_z = 0;
+  range->max_z = GTHREE_CLUSTER_GRID_Z - 1;
+
+  /* Zero distance means the light has no limit */
+  if (radius <= 0)
+    return TRUE;
+
+  if (depth + radius < clusters->near)
+    return FALSE;
+
+  range->min_z = depth_to_slice (clusters, MAX (depth - radius, clusters->near));
+  range->max_z = depth_to_slice (clusters, depth + radius);
+
+  /* If the light reaches behind the near plane, the screen space box
+   * can't be found by projecting, but then it is likely big anyway */
+  if (depth - radius < clusters->near)
+    return TRUE;
+
+  min_x = min_y = G_MAXFLOAT;
+  max_x = max_y = -G_MAXFLOAT;
+
+  for (i = 0; i < 8; i++)
+    {
+      graphene_vec4_t corner;
+      float x, y, w;
+
+      graphene_vec4_init (&corner,
+                          cl->position[0] + ((i & 1) ? radius : -radius),
+                          cl->position[1] + ((i & 2) ? radius : -radius),
+                          cl->position[2] + ((i & 4) ? radius : -radius),
+                          1);
+      graphene_matrix_transform_vec4 (&clusters->projection, &corner, &corner);
+
+      w = graphene_vec4_get_w (&corner);
+      x = graphene_vec4_get_x (&corner) / w;
+      y = graphene_vec4_get_y (&corner) / w;
+
+      min_x = MIN (min_x, x);
+      max_x = MAX (max_x, x);
+      min_y = MIN (min_y, y);
+      max_y = MAX (max_y, y);
+    }
+
+  if (max_x < -1 || min_x > 1 || max_y < -1 || min_y > 1)
+    return FALSE;
+
+  range->min_x = ndc_to_tile (min_x, GTHREE_CLUSTER_GRID_X);
+  range->max_x = ndc_to_tile (max_x, GTHREE_CLUSTER_GRID_X);
+  range->min_y = ndc_to_tile (min_y, GTHREE_CLUSTER_GRID_Y);
+  range->max_y = ndc_to_tile (max_y, GTHREE_CLUSTER_GRID_Y);
+
+  return TRUE;
+}
+
+static inline int
+cluster_index (int x, int y, int z)
+{
+  /* Same layout as the grid texture, one row per depth slice */
+  return (z * GTHREE_CLUSTER_GRID_Y + y) * GTHREE_CLUSTER_GRID_X + x;
+}
+
+/* Counting sort of the light indices by cluster */
+static void
+bin_lights (GthreeLightClusters *clusters)
+{
+  guint32 *grid = clusters->grid;
+  guint32 total = 0;
+  int i, x, y, z;
+
+  memset (grid, 0, sizeof (clusters->grid));
+  g_array_set_size (clusters->ranges, clusters->lights->len);
+
+  for (i = 0; i < clusters->lights->len; i++)
+    {
+      ClusterLight *cl = &g_array_index (clusters->lights, ClusterLight, i);
+      ClusterRange *range = &g_array_index (clusters->ranges, ClusterRange, i);
+
+      if (!light_get_range (clusters, cl, range))
+        {
+          range->min_z = 1;
+          range->max_z = 0;
+          continue;
+        }
+
+      for (z = range->min_z; z <= range->max_z; z++)
+        for (y = range->min_y; y <= range->max_y; y++)
+          for (x = range->min_x; x <= range->max_x; x++)
+            grid[cluster_index (x, y, z) * 2 + 1]++;
+    }
+
+  for (i = 0; i < N_CLUSTERS; i++)
+    {
+      grid[i * 2] = total;
+      total += grid[i * 2 + 1];
+      grid[i * 2 + 1] = 0;
+    }
+
+  g_array_set_size (clusters->indices, total);
+
+  for (i = 0; i < clusters->lights->len; i++)
+    {
+      ClusterRange *range = &g_array_index (clusters->ranges, ClusterRange, i);
+
+      for (z = range->min_z; z <= range->max_z; z++)
+        for (y = range->min_y; y <= range->max_y; y++)
+          for (x = range->min_x; x <= range->max_x; x++)
+            {
+              guint32 *cluster = &grid[cluster_index (x, y, z) * 2];
+
+              g_array_index (clusters->indices, guint32, cluster[0] + cluster[1]++) = i;
+            }
+    }
+}
+
+static void
+init_texture (GLuint texture)
+{
+  glBindTexture (GL_TEXTURE_2D, texture);
+  /* Only read with texelFetch(), but must be complete without mipmaps */
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+static guint
+grow_rows (guint rows,
+           guint needed)
+{
+  rows = MAX (rows, 16);
+  while (rows < needed)
+    rows *= 2;
+  return rows;
+}
+
+/* Bins the lights and uploads the textures, binding them to the texture
+ * units starting at @first_unit, in the order of the samplers
+ * clusterLightData, clusterGrid and clusterLightIndices */
+void
+gthree_light_clusters_update (GthreeLightClusters *clusters,
+                              guint                first_unit)
+{
+  guint n_lights = clusters->lights->len;
+  guint n_index_rows;
+
+  bin_lights (clusters);
+
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+
+  if (clusters->textures[0] == 0)
+    {
+      glGenTextures (GTHREE_CLUSTER_N_TEXTURES, clusters->textures);
+
+      glActiveTexture (GL_TEXTURE0 + first_unit + TEXTURE_GRID);
+      init_texture (clusters->textures[TEXTURE_GRID]);
+      glTexImage2D (GL_TEXTURE_2D, 0, GL_RG32UI,
+                    GTHREE_CLUSTER_GRID_X * GTHREE_CLUSTER_GRID_Y, GTHREE_CLUSTER_GRID_Z,
+                    0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+
+      glActiveTexture (GL_TEXTURE0 + first_unit + TEXTURE_LIGHTS);
+      init_texture (clusters->textures[TEXTURE_LIGHTS]);
+      glActiveTexture (GL_TEXTURE0 + first_unit + TEXTURE_INDICES);
+      init_texture (clusters->textures[TEXTURE_INDICES]);
+    }
+
+  glActiveTexture (GL_TEXTURE0 + first_unit + TEXTURE_LIGHTS);
+  glBindTexture (GL_TEXTURE_2D, clusters->textures[TEXTURE_LIGHTS]);
+  if (n_lights > clusters->light_rows)
+    {
+      clusters->light_rows = grow_rows (clusters->light_rows, n_lights);
+      glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA32F, 4, clusters->light_rows,
+                    0, GL_RGBA, GL_FLOAT, NULL);
+    }
+  if (n_lights > 0)
+    glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, 4, n_lights,
+                     GL_RGBA, GL_FLOAT, clusters->lights->data);
+
+  glActiveTexture (GL_TEXTURE0 + first_unit + TEXTURE_GRID);
+  glBindTexture (GL_TEXTURE_2D, clusters->textures[TEXTURE_GRID]);
+  glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0,
+                   GTHREE_CLUSTER_GRID_X * GTHREE_CLUSTER_GRID_Y, GTHREE_CLUSTER_GRID_Z,
+                   GL_RG_INTEGER, GL_UNSIGNED_INT, clusters->grid);
+
+  /* Pad to whole rows, the padding is never read */
+  n_index_rows = (clusters->indices->len + GTHREE_CLUSTER_INDEX_WIDTH - 1) / GTHREE_CLUSTER_INDEX_WIDTH;
+  g_array_set_size (clusters->indices, n_index_rows * GTHREE_CLUSTER_INDEX_WIDTH);
+
+  glActiveTexture (GL_TEXTURE0 + first_unit + TEXTURE_INDICES);
+  glBindTexture (GL_TEXTURE_2D, clusters->textures[TEXTURE_INDICES]);
+  if (n_index_rows > clusters->index_rows || clusters->index_rows == 0)
+    {
+      clusters->index_rows = grow_rows (clusters->index_rows, n_index_rows);
+      glTexImage2D (GL_TEXTURE_2D, 0, GL_R32UI, GTHREE_CLUSTER_INDEX_WIDTH, clusters->index_rows,
+                    0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    }
+  if (n_index_rows > 0)
+    glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, GTHREE_CLUSTER_INDEX_WIDTH, n_index_rows,
+                     GL_RED_INTEGER, GL_UNSIGNED_INT, clusters->indices->data);
+
+  glActiveTexture (GL_TEXTURE0);
+}
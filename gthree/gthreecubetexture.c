@@ -110,6 +110,7 @@ gthree_cube_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer,
             {
               glTexImage2D (GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, gl_format, width, height, 0, gl_format, gl_type,
                             gdk_pixbuf_get_pixels (cube_pixbufs[i]));
+              gthree_renderer_count_texture_upload (renderer, (gsize) width * height * gdk_pixbuf_get_n_channels (cube_pixbufs[i]));
             }
 #ifdef TODO
           else
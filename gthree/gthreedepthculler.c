@@ -0,0 +1,451 @@
+#include <math.h>
+
+#include "gthreeprivate.h"
+
+/* Software occlusion culling.
+ *
+ * The triangles of the meshes flagged as occluders are rasterized into
+ * a small depth buffer on the CPU, and objects are tested by comparing
+ * the nearest depth of their screen space bounding box with the depth
+ * buffer under it. If every pixel it covers already has something
+ * nearer, the object is hidden. This is all plain C with no GL, so the
+ * results are available right away, unlike occlusion queries.
+ *
+ * Rasterization is split into horizontal bands which are rendered in
+ * parallel on a thread pool when there is enough work. The inner loops
+ * are simple enough for the compiler to vectorize.
+ *
+ * Everything here errs on the side of visible: occluders only fill
+ * pixels they fully cover, with their farthest depth, and tested boxes
+ * check every pixel they touch against their nearest depth.
+ */
+
+#define DEPTH_BUFFER_WIDTH 256
+#define MIN_DEPTH_BUFFER_HEIGHT 32
+#define MAX_DEPTH_BUFFER_HEIGHT 256
+
+/* Don't bother with threads for fewer triangles than this */
+#define MIN_TRIANGLES_PER_BAND 256
+#define MIN_ROWS_PER_BAND 8
+
+/* Vertices closer to the eye than this (in clip space w) are not projected */
+#define MIN_W 1e-5f
+
+typedef struct {
+  float x, y, z; /* In depth buffer pixels, z in [0, 1] */
+} ScreenVertex;
+
+typedef struct {
+  ScreenVertex v[3];
+  int min_y, max_y;
+} ScreenTriangle;
+
+typedef struct {
+  int first_row;
+  int end_row;
+} Band;
+
+struct _GthreeDepthCuller {
+  graphene_matrix_t view_projection_matrix;
+  float view_projection[16];
+  int width;
+  int height;
+  float *depth;
+
+  GArray *triangles; /* ScreenTriangle */
+  GArray *clip_vertices; /* x, y, z, w per vertex, scratch */
+
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond cond;
+  int n_bands_left;
+};
+
+GthreeDepthCuller *
+gthree_depth_culler_new (void)
+{
+  GthreeDepthCuller *culler = g_new0 (GthreeDepthCuller, 1);
+
+  culler->triangles = g_array_new (FALSE, FALSE, sizeof (ScreenTriangle));
+  culler->clip_vertices = g_array_new (FALSE, FALSE, sizeof (float) * 4);
+  g_mutex_init (&culler->mutex);
+  g_cond_init (&culler->cond);
+
+  return culler;
+}
+
+void
+gthree_depth_culler_free (GthreeDepthCuller *culler)
+{
+  if (culler->pool)
+    g_thread_pool_free (culler->pool, FALSE, TRUE);
+
+  g_mutex_clear (&culler->mutex);
+  g_cond_clear (&culler->cond);
+  g_array_unref (culler->triangles);
+  g_array_unref (culler->clip_vertices);
+  g_free (culler->depth);
+  g_free (culler);
+}
+
+/* Starts a new frame. aspect is the width / height of the viewport */
+void
+gthree_depth_culler_begin (GthreeDepthCuller       *culler,
+                           const graphene_matrix_t *view_projection,
+                           float                    aspect)
+{
+  int width = DEPTH_BUFFER_WIDTH;
+  int height = CLAMP ((int) roundf (DEPTH_BUFFER_WIDTH / aspect),
+                      MIN_DEPTH_BUFFER_HEIGHT, MAX_DEPTH_BUFFER_HEIGHT);
+
+  if (width != culler->width || height != culler->height)
+    {
+      culler->width = width;
+      culler->height = height;
+      g_free (culler->depth);
+      culler->depth = g_new (float, width * height);
+    }
+
+  culler->view_projection_matrix = *view_projection;
+  graphene_matrix_to_float (view_projection, culler->view_projection);
+  g_array_set_size (culler->triangles, 0);
+}
+
+static inline void
+transform_point (const float *m,
+                 float        x,
+                 float        y,
+                 float        z,
+                 float       *out)
+{
+  /* graphene matrices transform row vectors */
+  out[0] = x * m[0] + y * m[4] + z * m[8]  + m[12];
+  out[1] = x * m[1] + y * m[5] + z * m[9]  + m[13];
+  out[2] = x * m[2] + y * m[6] + z * m[10] + m[14];
+  out[3] = x * m[3] + y * m[7] + z * m[11] + m[15];
+}
+
+static inline void
+project (GthreeDepthCuller *culler,
+         const float       *clip,
+         ScreenVertex      *v)
+{
+  float inv_w = 1.0f / clip[3];
+
+  v->x = (clip[0] * inv_w * 0.5f + 0.5f) * culler->width;
+  v->y = (0.5f - clip[1] * inv_w * 0.5f) * culler->height;
+  v->z = clip[2] * inv_w * 0.5f + 0.5f;
+}
+
+static void
+add_triangle (GthreeDepthCuller *culler,
+              const float       *c0,
+              const float       *c1,
+              const float       *c2)
+{
+  ScreenTriangle t;
+  float min_x, max_x, min_y, max_y;
+  int i;
+
+  /* Skip triangles crossing the near plane, dropping part of an
+   * occluder only makes the culling less effective */
+  if (c0[3] < MIN_W || c1[3] < MIN_W || c2[3] < MIN_W)
+    return;
+
+  project (culler, c0, &t.v[0]);
+  project (culler, c1, &t.v[1]);
+  project (culler, c2, &t.v[2]);
+
+  min_x = max_x = t.v[0].x;
+  min_y = max_y = t.v[0].y;
+  for (i = 1; i < 3; i++)
+    {
+      min_x = MIN (min_x, t.v[i].x);
+      max_x = MAX (max_x, t.v[i].x);
+      min_y = MIN (min_y, t.v[i].y);
+      max_y = MAX (max_y, t.v[i].y);
+    }
+
+  if (max_x < 0 || min_x > culler->width ||
+      max_y < 0 || min_y > culler->height)
+    return;
+
+  t.min_y = MAX ((int) floorf (min_y), 0);
+  t.max_y = MIN ((int) ceilf (max_y), culler->height - 1);
+
+  g_array_append_val (culler->triangles, t);
+}
+
+/* Adds the triangles of geometry, as transformed by world_matrix, as occluders */
+void
+gthree_depth_culler_add_geometry (GthreeDepthCuller       *culler,
+                                  const graphene_matrix_t *world_matrix,
+                                  GthreeGeometry          *geometry)
+{
+  GthreeAttribute *position = gthree_geometry_get_position (geometry);
+  GthreeAttribute *index = gthree_geometry_get_index (geometry);
+  graphene_matrix_t mvp;
+  float m[16];
+  float *clip;
+  int n_vertices, n_indexes, i;
+
+  if (position == NULL)
+    return;
+
+  graphene_matrix_multiply (world_matrix, &culler->view_projection_matrix, &mvp);
+  graphene_matrix_to_float (&mvp, m);
+
+  n_vertices = gthree_attribute_get_count (position);
+  g_array_set_size (culler->clip_vertices, n_vertices);
+  clip = (float *) culler->clip_vertices->data;
+
+  for (i = 0; i < n_vertices; i++)
+    {
+      float x, y, z;
+
+      gthree_attribute_get_xyz (position, i, &x, &y, &z);
+      transform_point (m, x, y, z, &clip[i * 4]);
+    }
+
+  if (index)
+    {
+      n_indexes = gthree_attribute_get_count (index);
+      for (i = 0; i + 2 < n_indexes; i += 3)
+        {
+          guint i0 = gthree_attribute_get_uint (index, i);
+          guint i1 = gthree_attribute_get_uint (index, i + 1);
+          guint i2 = gthree_attribute_get_uint (index, i + 2);
+
+          if (i0 < n_vertices && i1 < n_vertices && i2 < n_vertices)
+            add_triangle (culler, &clip[i0 * 4], &clip[i1 * 4], &clip[i2 * 4]);
+        }
+    }
+  else
+    {
+      for (i = 0; i + 2 < n_vertices; i += 3)
+        add_triangle (culler, &clip[i * 4], &clip[(i + 1) * 4], &clip[(i + 2) * 4]);
+    }
+}
+
+guint
+gthree_depth_culler_get_n_triangles (GthreeDepthCuller *culler)
+{
+  return culler->triangles->len;
+}
+
+static inline float
+edge (const ScreenVertex *a,
+      const ScreenVertex *b,
+      float               x,
+      float               y)
+{
+  return (b->x - a->x) * (y - a->y) - (b->y - a->y) * (x - a->x);
+}
+
+/* Only pixels the triangle covers entirely are written, with the
+ * farthest depth the triangle has over them, so the buffer never claims
+ * to hide anything the real occluder doesn't. Edge functions and depth
+ * are linear in screen space, so their extremes over a pixel are at the
+ * corners: the value at the center plus or minus half the gradients.
+ */
+static void
+rasterize_triangle (GthreeDepthCuller    *culler,
+                    const ScreenTriangle *t,
+                    int                   first_row,
+                    int                   end_row)
+{
+  const ScreenVertex *v0 = &t->v[0], *v1 = &t->v[1], *v2 = &t->v[2];
+  float area, inv_area;
+  float dx0, dy0, dx1, dy1, dx2, dy2;
+  float margin0, margin1, margin2, z_margin;
+  int min_x, max_x, min_y, max_y, x, y;
+
+  area = edge (v0, v1, v2->x, v2->y);
+  if (fabsf (area) < 1e-8f)
+    return;
+  inv_area = 1.0f / area;
+
+  /* Gradients of the barycentric weights */
+  dx0 = (v1->y - v2->y) * inv_area;
+  dy0 = (v2->x - v1->x) * inv_area;
+  dx1 = (v2->y - v0->y) * inv_area;
+  dy1 = (v0->x - v2->x) * inv_area;
+  dx2 = (v0->y - v1->y) * inv_area;
+  dy2 = (v1->x - v0->x) * inv_area;
+
+  margin0 = 0.5f * (fabsf (dx0) + fabsf (dy0));
+  margin1 = 0.5f * (fabsf (dx1) + fabsf (dy1));
+  margin2 = 0.5f * (fabsf (dx2) + fabsf (dy2));
+  z_margin = 0.5f * (fabsf (dx0 * v0->z + dx1 * v1->z + dx2 * v2->z) +
+                     fabsf (dy0 * v0->z + dy1 * v1->z + dy2 * v2->z));
+
+  min_x = MAX ((int) floorf (MIN (v0->x, MIN (v1->x, v2->x))), 0);
+  max_x = MIN ((int) ceilf (MAX (v0->x, MAX (v1->x, v2->x))), culler->width - 1);
+  min_y = MAX (t->min_y, first_row);
+  max_y = MIN (t->max_y, end_row - 1);
+
+  for (y = min_y; y <= max_y; y++)
+    {
+      float *row = culler->depth + y * culler->width;
+      float py = y + 0.5f;
+
+      for (x = min_x; x <= max_x; x++)
+        {
+          float px = x + 0.5f;
+          /* Barycentric weights, all positive inside whatever the winding */
+          float w0 = edge (v1, v2, px, py) * inv_area;
+          float w1 = edge (v2, v0, px, py) * inv_area;
+          float w2 = edge (v0, v1, px, py) * inv_area;
+          float z;
+
+          if (w0 < margin0 || w1 < margin1 || w2 < margin2)
+            continue;
+
+          z = w0 * v0->z + w1 * v1->z + w2 * v2->z + z_margin;
+          row[x] = MIN (row[x], z);
+        }
+    }
+}
+
+static void
+rasterize_band (GthreeDepthCuller *culler,
+                int                first_row,
+                int                end_row)
+{
+  guint i;
+  int y;
+
+  for (y = first_row; y < end_row; y++)
+    {
+      float *row = culler->depth + y * culler->width;
+      int x;
+
+      for (x = 0; x < culler->width; x++)
+        row[x] = 1.0f;
+    }
+
+  for (i = 0; i < culler->triangles->len; i++)
+    {
+      const ScreenTriangle *t = &g_array_index (culler->triangles, ScreenTriangle, i);
+
+      if (t->max_y < first_row || t->min_y >= end_row)
+        continue;
+
+      rasterize_triangle (culler, t, first_row, end_row);
+    }
+}
+
+static void
+rasterize_band_thread (gpointer data,
+                       gpointer user_data)
+{
+  GthreeDepthCuller *culler = user_data;
+  Band *band = data;
+
+  rasterize_band (culler, band->first_row, band->end_row);
+
+  g_mutex_lock (&culler->mutex);
+  if (--culler->n_bands_left == 0)
+    g_cond_signal (&culler->cond);
+  g_mutex_unlock (&culler->mutex);
+}
+
+/* Renders all the occluders added since gthree_depth_culler_begin() */
+void
+gthree_depth_culler_rasterize (GthreeDepthCuller *culler)
+{
+  int n_bands, rows_per_band, i;
+  Band *bands;
+
+  n_bands = MIN (g_get_num_processors (), culler->height / MIN_ROWS_PER_BAND);
+  n_bands = MIN (n_bands, (int) (culler->triangles->len / MIN_TRIANGLES_PER_BAND));
+
+  if (n_bands <= 1)
+    {
+      rasterize_band (culler, 0, culler->height);
+      return;
+    }
+
+  if (culler->pool == NULL)
+    culler->pool = g_thread_pool_new (rasterize_band_thread, culler,
+                                      g_get_num_processors () - 1, FALSE, NULL);
+
+  rows_per_band = (culler->height + n_bands - 1) / n_bands;
+  bands = g_newa (Band, n_bands);
+  for (i = 0; i < n_bands; i++)
+    {
+      bands[i].first_row = i * rows_per_band;
+      bands[i].end_row = MIN ((i + 1) * rows_per_band, culler->height);
+    }
+
+  /* The calling thread does the first band itself */
+  culler->n_bands_left = n_bands - 1;
+  for (i = 1; i < n_bands; i++)
+    g_thread_pool_push (culler->pool, &bands[i], NULL);
+
+  rasterize_band (culler, bands[0].first_row, bands[0].end_row);
+
+  g_mutex_lock (&culler->mutex);
+  while (culler->n_bands_left > 0)
+    g_cond_wait (&culler->cond, &culler->mutex);
+  g_mutex_unlock (&culler->mutex);
+}
+
+/* Returns FALSE if the box is hidden behind the occluders */
+gboolean
+gthree_depth_culler_test_box (GthreeDepthCuller    *culler,
+                              const graphene_box_t *box)
+{
+  graphene_point3d_t min, max;
+  float min_x = G_MAXFLOAT, max_x = -G_MAXFLOAT;
+  float min_y = G_MAXFLOAT, max_y = -G_MAXFLOAT;
+  float min_z = G_MAXFLOAT;
+  int x0, x1, y0, y1, x, y;
+  int i;
+
+  graphene_box_get_min (box, &min);
+  graphene_box_get_max (box, &max);
+
+  for (i = 0; i < 8; i++)
+    {
+      float clip[4];
+      ScreenVertex v;
+
+      transform_point (culler->view_projection,
+                       (i & 1) ? max.x : min.x,
+                       (i & 2) ? max.y : min.y,
+                       (i & 4) ? max.z : min.z,
+                       clip);
+
+      /* Crosses the near plane, so it covers the eye */
+      if (clip[3] < MIN_W)
+        return TRUE;
+
+      project (culler, clip, &v);
+      min_x = MIN (min_x, v.x);
+      max_x = MAX (max_x, v.x);
+      min_y = MIN (min_y, v.y);
+      max_y = MAX (max_y, v.y);
+      min_z = MIN (min_z, v.z);
+    }
+
+  x0 = MAX ((int) floorf (min_x), 0);
+  x1 = MIN ((int) ceilf (max_x), culler->width);
+  y0 = MAX ((int) floorf (min_y), 0);
+  y1 = MIN ((int) ceilf (max_y), culler->height);
+
+  /* Off screen, leave that to frustum culling */
+  if (x0 >= x1 || y0 >= y1)
+    return TRUE;
+
+  for (y = y0; y < y1; y++)
+    {
+      const float *row = culler->depth + y * culler->width;
+
+      for (x = x0; x < x1; x++)
+        if (row[x] >= min_z)
+          return TRUE;
+    }
+
+  return FALSE;
+}
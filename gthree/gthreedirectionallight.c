@@ -36,9 +36,11 @@ gthree_directional_light_new (const graphene_vec3_t *color,
 static float zerov3[3] = { 0, 0, 0 };
 static float white[3] = { 1, 1, 1 };
 static int i0 = 0;
+static int i1 = 1;
 static float f0 = 0.0;
 static float f1 = 1.0;
 static float zerov2[2] = { 0, 0 };
+static float unit_rect[4] = { 0, 0, 1, 1 };
 
 static GthreeUniformsDefinition light_uniforms[] = {
   {"direction", GTHREE_UNIFORM_TYPE_VECTOR3, &zerov3},
@@ -47,6 +49,8 @@ static GthreeUniformsDefinition light_uniforms[] = {
   {"shadowBias", GTHREE_UNIFORM_TYPE_FLOAT, &f0 },
   {"shadowRadius", GTHREE_UNIFORM_TYPE_FLOAT, &f1 },
   {"shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2, &zerov2 },
+  {"shadowCascades", GTHREE_UNIFORM_TYPE_INT, &i1 },
+  {"shadowMapRect", GTHREE_UNIFORM_TYPE_VECTOR4, &unit_rect },
 };
 
 static void
@@ -112,6 +116,10 @@ gthree_directional_light_real_setup (GthreeLight *light,
   const graphene_matrix_t *view_matrix = gthree_camera_get_world_inverse_matrix (camera);
   GthreeTexture *shadow_map_texture = NULL;
   graphene_matrix_t shadow_matrix;
+  graphene_matrix_t cascade_matrix[GTHREE_MAX_SHADOW_CASCADES];
+  GthreeDirectionalLightShadow *cascaded = NULL;
+  int n_cascades = 1;
+  int i;
 
   graphene_vec3_scale (gthree_light_get_color (light), intensity, &color);
   gthree_uniforms_set_vec3 (priv->uniforms, "color", &color);
@@ -131,27 +139,46 @@ gthree_directional_light_real_setup (GthreeLight *light,
     {
       GthreeLightShadow *shadow = gthree_light_get_shadow (light);
       graphene_vec2_t size;
+      graphene_vec4_t rect;
 
       gthree_uniforms_set_float (priv->uniforms, "shadowBias", gthree_light_shadow_get_bias (shadow));
       gthree_uniforms_set_float (priv->uniforms, "shadowRadius", gthree_light_shadow_get_radius (shadow));
 
-      graphene_vec2_init (&size,
-                          gthree_light_shadow_get_map_width (shadow),
-                          gthree_light_shadow_get_map_height (shadow));
+      gthree_light_shadow_get_map_info (shadow, &size, &rect);
       gthree_uniforms_set_vec2 (priv->uniforms, "shadowMapSize", &size);
+      gthree_uniforms_set_vec4 (priv->uniforms, "shadowMapRect", &rect);
 
       GthreeRenderTarget *shadow_map = gthree_light_shadow_get_map (shadow);
       if (shadow_map)
-        shadow_map_texture = gthree_render_target_get_texture (shadow_map);
+        shadow_map_texture = gthree_render_target_get_output_texture (shadow_map);
 
       shadow_matrix = *gthree_light_shadow_get_matrix (shadow);
+
+      n_cascades = gthree_directional_light_shadow_get_n_cascades (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow));
+      if (n_cascades > 1)
+        {
+          cascaded = GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow);
+          setup->hash.shadow_cascades = TRUE;
+        }
     }
   else
     graphene_matrix_init_identity (&shadow_matrix);
 
+  gthree_uniforms_set_int (priv->uniforms, "shadowCascades", n_cascades);
+
+  /* Unused cascades are never read, they are only there to keep the stride */
+  for (i = 0; i < GTHREE_MAX_SHADOW_CASCADES; i++)
+    {
+      if (cascaded && i < n_cascades)
+        cascade_matrix[i] = *gthree_directional_light_shadow_get_cascade_matrix (cascaded, i);
+      else
+        graphene_matrix_init_identity (&cascade_matrix[i]);
+    }
+
   g_ptr_array_add (setup->directional, priv->uniforms);
   g_ptr_array_add (setup->directional_shadow_map, shadow_map_texture);
   g_array_append_val (setup->directional_shadow_map_matrix, shadow_matrix);
+  g_array_append_vals (setup->directional_shadow_cascade_matrix, cascade_matrix, GTHREE_MAX_SHADOW_CASCADES);
 
   GTHREE_LIGHT_CLASS (gthree_directional_light_parent_class)->setup (light, camera, setup);
 }
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <string.h>
 #include <epoxy/gl.h>
 
 #include "gthreeorthographiccamera.h"
@@ -7,7 +8,18 @@
 #include "gthreeprivate.h"
 
 typedef struct {
-  int dummy;
+  int n_cascades;
+  float split_lambda;
+  float max_distance;
+
+  /* left, right, top, bottom of each cascade in shadow camera space,
+   * as computed by the last gthree_directional_light_shadow_update_cascades() */
+  float cascade_bounds[GTHREE_MAX_SHADOW_CASCADES][4];
+  /* The bounds the shadow camera had before that */
+  float camera_bounds[4];
+
+  /* Maps from the coordinates in the shadow matrix to those of each cascade */
+  graphene_matrix_t cascade_matrix[GTHREE_MAX_SHADOW_CASCADES];
 } GthreeDirectionalLightShadowPrivate;
 
 
@@ -22,8 +34,15 @@ gthree_directional_light_shadow_new (void)
 static void
 gthree_directional_light_shadow_init (GthreeDirectionalLightShadow *directional)
 {
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (directional);
   g_autoptr(GthreeOrthographicCamera) camera = NULL;
 
+  priv->n_cascades = 1;
+  priv->split_lambda = 0.5;
+  priv->max_distance = 0;
+  for (int i = 0; i < GTHREE_MAX_SHADOW_CASCADES; i++)
+    graphene_matrix_init_identity (&priv->cascade_matrix[i]);
+
   camera = gthree_orthographic_camera_new (-5, 5, 5, -5, 0.5, 500);
   gthree_light_shadow_set_camera (GTHREE_LIGHT_SHADOW (directional), GTHREE_CAMERA (camera));
 }
@@ -42,3 +61,331 @@ gthree_directional_light_shadow_class_init (GthreeDirectionalLightShadowClass *k
 
   gobject_class->finalize = gthree_directional_light_shadow_finalize;
 }
+
+/**
+ * gthree_directional_light_shadow_set_n_cascades:
+ * @shadow: a #GthreeDirectionalLightShadow
+ * @n_cascades: the number of cascades, 1 to 4
+ *
+ * Splits the view frustum of the camera being rendered into @n_cascades
+ * slices along the view direction, and gives each slice its own shadow
+ * map, fitted tightly around it. The slices close to the viewer cover
+ * a smaller area, so they get more shadow map texels per world unit.
+ *
+ * All the cascades are packed into one texture, with each cascade
+ * getting the size set with gthree_light_shadow_set_map_size().
+ *
+ * With cascades the left, right, top and bottom of the shadow camera
+ * are computed each frame, only its position, direction and near and
+ * far planes are used. Those must still cover all the shadow casters.
+ *
+ * The default is 1, which uses the shadow camera as is.
+ */
+void
+gthree_directional_light_shadow_set_n_cascades (GthreeDirectionalLightShadow *shadow,
+                                                int                           n_cascades)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  g_return_if_fail (n_cascades >= 1 && n_cascades <= GTHREE_MAX_SHADOW_CASCADES);
+
+  if (priv->n_cascades == n_cascades)
+    return;
+
+  priv->n_cascades = n_cascades;
+
+  /* The map has a different layout, make the renderer create a new one */
+  gthree_light_shadow_set_map (GTHREE_LIGHT_SHADOW (shadow), NULL);
+}
+
+int
+gthree_directional_light_shadow_get_n_cascades (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  return priv->n_cascades;
+}
+
+/**
+ * gthree_directional_light_shadow_set_cascade_split_lambda:
+ * @shadow: a #GthreeDirectionalLightShadow
+ * @lambda: the blend factor, between 0 and 1
+ *
+ * Sets how the cascade split distances are picked. At 0 the view
+ * distance is split in equal parts, at 1 the splits grow
+ * logarithmically, giving most of the resolution to the area close
+ * to the viewer. The default is 0.5, which is a blend of the two.
+ */
+void
+gthree_directional_light_shadow_set_cascade_split_lambda (GthreeDirectionalLightShadow *shadow,
+                                                          float                         lambda)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  priv->split_lambda = CLAMP (lambda, 0.0, 1.0);
+}
+
+float
+gthree_directional_light_shadow_get_cascade_split_lambda (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  return priv->split_lambda;
+}
+
+/**
+ * gthree_directional_light_shadow_set_cascade_max_distance:
+ * @shadow: a #GthreeDirectionalLightShadow
+ * @distance: the distance from the camera, or 0
+ *
+ * Limits the cascades to cover the view frustum up to @distance from
+ * the camera, there are no shadows past that. If this is 0 (the default)
+ * the cascades go up to the far plane of the camera.
+ */
+void
+gthree_directional_light_shadow_set_cascade_max_distance (GthreeDirectionalLightShadow *shadow,
+                                                          float                         distance)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  priv->max_distance = MAX (distance, 0);
+}
+
+float
+gthree_directional_light_shadow_get_cascade_max_distance (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  return priv->max_distance;
+}
+
+/* Where cascade @cascade goes in the map, in units of the per cascade map size */
+void
+gthree_directional_light_shadow_get_cascade_tile (GthreeDirectionalLightShadow *shadow,
+                                                  int                           cascade,
+                                                  int                          *x,
+                                                  int                          *y)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+  int columns = MIN (priv->n_cascades, 2);
+
+  /* This has to match getCascadedShadow() in shadowmap_pars_fragment.glsl */
+  *x = cascade % columns;
+  *y = cascade / columns;
+}
+
+void
+gthree_directional_light_shadow_get_atlas_size (GthreeDirectionalLightShadow *shadow,
+                                                int                          *columns,
+                                                int                          *rows)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  *columns = MIN (priv->n_cascades, 2);
+  *rows = (priv->n_cascades + 1) / 2;
+}
+
+/* Fits the cascades to the view frustum of @camera. The shadow camera
+ * must already be positioned and pointed at the light target.
+ *
+ * The splits use the "practical split scheme", blending uniform and
+ * logarithmic splits. Each cascade is fitted to the bounding sphere
+ * of its frustum slice rather than the slice itself, so its size does
+ * not change when the camera rotates, and is moved in whole shadow map
+ * texels so the edges of shadows don't shimmer when the camera moves.
+ * @tile_width and @tile_height are the size in pixels each cascade is
+ * actually rendered at, which can be less than the map size when the
+ * shadow atlas or the texture size limit shrink it.
+ *
+ * Returns %TRUE if any cascade changed since the last call. */
+gboolean
+gthree_directional_light_shadow_update_cascades (GthreeDirectionalLightShadow *shadow,
+                                                 GthreeCamera                 *camera,
+                                                 int                           tile_width,
+                                                 int                           tile_height)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+  GthreeLightShadow *light_shadow = GTHREE_LIGHT_SHADOW (shadow);
+  GthreeCamera *shadow_camera = gthree_light_shadow_get_camera (light_shadow);
+  GthreeOrthographicCamera *ortho;
+  graphene_matrix_t inverse_projection, view_to_light;
+  graphene_vec3_t near_corners[4], far_corners[4];
+  float near, far, camera_depth, split_near;
+  gboolean changed = FALSE;
+  int i, j;
+
+  near = gthree_camera_get_near (camera);
+  far = gthree_camera_get_far (camera);
+  camera_depth = far - near;
+  if (camera_depth <= 0 || tile_width <= 0 || tile_height <= 0)
+    return FALSE;
+
+  if (priv->max_distance > 0)
+    far = CLAMP (priv->max_distance, near, far);
+
+  /* The corners of the near and far planes, in view space */
+  if (!graphene_matrix_inverse (gthree_camera_get_projection_matrix (camera), &inverse_projection))
+    return FALSE;
+
+  for (i = 0; i < 4; i++)
+    {
+      graphene_vec4_t corner;
+      float x = (i & 1) ? 1 : -1;
+      float y = (i & 2) ? 1 : -1;
+
+      graphene_vec4_init (&corner, x, y, -1, 1);
+      graphene_matrix_transform_vec4 (&inverse_projection, &corner, &corner);
+      graphene_vec4_get_xyz (&corner, &near_corners[i]);
+      graphene_vec3_scale (&near_corners[i], 1.0 / graphene_vec4_get_w (&corner), &near_corners[i]);
+
+      graphene_vec4_init (&corner, x, y, 1, 1);
+      graphene_matrix_transform_vec4 (&inverse_projection, &corner, &corner);
+      graphene_vec4_get_xyz (&corner, &far_corners[i]);
+      graphene_vec3_scale (&far_corners[i], 1.0 / graphene_vec4_get_w (&corner), &far_corners[i]);
+    }
+
+  ortho = GTHREE_ORTHOGRAPHIC_CAMERA (shadow_camera);
+  priv->camera_bounds[0] = gthree_orthographic_camera_get_left (ortho);
+  priv->camera_bounds[1] = gthree_orthographic_camera_get_right (ortho);
+  priv->camera_bounds[2] = gthree_orthographic_camera_get_top (ortho);
+  priv->camera_bounds[3] = gthree_orthographic_camera_get_bottom (ortho);
+
+  graphene_matrix_multiply (gthree_object_get_world_matrix (GTHREE_OBJECT (camera)),
+                            gthree_camera_get_world_inverse_matrix (shadow_camera),
+                            &view_to_light);
+
+  split_near = near;
+  for (i = 0; i < priv->n_cascades; i++)
+    {
+      float p = (i + 1) / (float) priv->n_cascades;
+      float uniform_split = near + (far - near) * p;
+      float log_split = near > 0 ? near * powf (far / near, p) : uniform_split;
+      float split_far = priv->split_lambda * log_split + (1 - priv->split_lambda) * uniform_split;
+      graphene_vec3_t corners[8], center;
+      graphene_point3d_t light_center;
+      float radius, texel_x, texel_y, cx, cy;
+      float bounds[4];
+
+      /* Depth changes linearly along each edge from the near to the far plane */
+      graphene_vec3_init (&center, 0, 0, 0);
+      for (j = 0; j < 4; j++)
+        {
+          graphene_vec3_interpolate (&near_corners[j], &far_corners[j],
+                                     (split_near - near) / camera_depth,
+                                     &corners[j]);
+          graphene_vec3_interpolate (&near_corners[j], &far_corners[j],
+                                     (split_far - near) / camera_depth,
+                                     &corners[j + 4]);
+          graphene_vec3_add (&center, &corners[j], &center);
+          graphene_vec3_add (&center, &corners[j + 4], &center);
+        }
+      graphene_vec3_scale (&center, 1.0 / 8, &center);
+
+      radius = 0;
+      for (j = 0; j < 8; j++)
+        {
+          graphene_vec3_t d;
+          graphene_vec3_subtract (&corners[j], &center, &d);
+          radius = MAX (radius, graphene_vec3_length (&d));
+        }
+      /* Round up so float noise doesn't change the size every frame */
+      radius = ceilf (radius * 16) / 16;
+
+      graphene_matrix_transform_point3d (&view_to_light,
+                                         graphene_point3d_init (&light_center,
+                                                                graphene_vec3_get_x (&center),
+                                                                graphene_vec3_get_y (&center),
+                                                                graphene_vec3_get_z (&center)),
+                                         &light_center);
+
+      texel_x = 2 * radius / tile_width;
+      texel_y = 2 * radius / tile_height;
+      cx = floorf (light_center.x / texel_x) * texel_x;
+      cy = floorf (light_center.y / texel_y) * texel_y;
+
+      bounds[0] = cx - radius;
+      bounds[1] = cx + radius;
+      bounds[2] = cy + radius;
+      bounds[3] = cy - radius;
+
+      if (memcmp (bounds, priv->cascade_bounds[i], sizeof (bounds)) != 0)
+        {
+          memcpy (priv->cascade_bounds[i], bounds, sizeof (bounds));
+          changed = TRUE;
+        }
+
+      split_near = split_far;
+    }
+
+  return changed;
+}
+
+/* Sets the shadow camera projection to the one of @cascade, or back
+ * to the one it had before gthree_directional_light_shadow_update_cascades()
+ * if @cascade is -1 */
+void
+gthree_directional_light_shadow_set_cascade (GthreeDirectionalLightShadow *shadow,
+                                             int                           cascade)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+  GthreeCamera *shadow_camera = gthree_light_shadow_get_camera (GTHREE_LIGHT_SHADOW (shadow));
+  GthreeOrthographicCamera *ortho = GTHREE_ORTHOGRAPHIC_CAMERA (shadow_camera);
+  float *bounds = cascade < 0 ? priv->camera_bounds : priv->cascade_bounds[cascade];
+
+  gthree_orthographic_camera_set_left (ortho, bounds[0]);
+  gthree_orthographic_camera_set_right (ortho, bounds[1]);
+  gthree_orthographic_camera_set_top (ortho, bounds[2]);
+  gthree_orthographic_camera_set_bottom (ortho, bounds[3]);
+  gthree_camera_update (shadow_camera);
+}
+
+/* Sets the shadow matrix to map world space to the map coordinates of the
+ * first cascade, and the cascade matrices to map from those to each
+ * cascade. Ortho projections are affine, so the shaders can interpolate
+ * the first and get the others per fragment. */
+void
+gthree_directional_light_shadow_update_matrices (GthreeDirectionalLightShadow *shadow)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+  GthreeLightShadow *light_shadow = GTHREE_LIGHT_SHADOW (shadow);
+  GthreeCamera *shadow_camera = gthree_light_shadow_get_camera (light_shadow);
+  graphene_matrix_t *shadow_matrix = gthree_light_shadow_get_matrix (light_shadow);
+  graphene_matrix_t bias, first, first_inverse;
+  graphene_point3d_t p;
+  int columns, rows;
+  int i;
+
+  graphene_matrix_init_scale (&bias, 0.5, 0.5, 0.5);
+  graphene_matrix_translate (&bias, graphene_point3d_init (&p, 0.5, 0.5, 0.5));
+
+  gthree_directional_light_shadow_get_atlas_size (shadow, &columns, &rows);
+
+  for (i = 0; i < priv->n_cascades; i++)
+    {
+      gthree_directional_light_shadow_set_cascade (shadow, i);
+      graphene_matrix_multiply (gthree_camera_get_projection_matrix (shadow_camera),
+                                &bias, &priv->cascade_matrix[i]);
+    }
+
+  /* The first cascade is in the bottom left tile of the map */
+  first = priv->cascade_matrix[0];
+  graphene_matrix_scale (&first, 1.0 / columns, 1.0 / rows, 1);
+  graphene_matrix_inverse (&first, &first_inverse);
+
+  graphene_matrix_multiply (gthree_camera_get_world_inverse_matrix (shadow_camera),
+                            &first, shadow_matrix);
+
+  for (i = 0; i < priv->n_cascades; i++)
+    graphene_matrix_multiply (&first_inverse, &priv->cascade_matrix[i], &priv->cascade_matrix[i]);
+
+  gthree_directional_light_shadow_set_cascade (shadow, -1);
+}
+
+const graphene_matrix_t *
+gthree_directional_light_shadow_get_cascade_matrix (GthreeDirectionalLightShadow *shadow,
+                                                    int                           cascade)
+{
+  GthreeDirectionalLightShadowPrivate *priv = gthree_directional_light_shadow_get_instance_private (shadow);
+
+  return &priv->cascade_matrix[cascade];
+}
@@ -31,6 +31,22 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (GthreeDirectionalLightShadow, g_object_unref)
 GTHREE_API
 GType gthree_directional_light_shadow_get_type (void) G_GNUC_CONST;
 
+GTHREE_API
+void  gthree_directional_light_shadow_set_n_cascades             (GthreeDirectionalLightShadow *shadow,
+                                                                  int                           n_cascades);
+GTHREE_API
+int   gthree_directional_light_shadow_get_n_cascades             (GthreeDirectionalLightShadow *shadow);
+GTHREE_API
+void  gthree_directional_light_shadow_set_cascade_split_lambda   (GthreeDirectionalLightShadow *shadow,
+                                                                  float                         lambda);
+GTHREE_API
+float gthree_directional_light_shadow_get_cascade_split_lambda   (GthreeDirectionalLightShadow *shadow);
+GTHREE_API
+void  gthree_directional_light_shadow_set_cascade_max_distance   (GthreeDirectionalLightShadow *shadow,
+                                                                  float                         distance);
+GTHREE_API
+float gthree_directional_light_shadow_get_cascade_max_distance   (GthreeDirectionalLightShadow *shadow);
+
 G_END_DECLS
 
 #endif /* __GTHREE_DIRECTIONALLIGHT_H__ */
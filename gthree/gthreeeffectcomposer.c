@@ -147,6 +147,8 @@ gthree_effect_composer_render (GthreeEffectComposer *composer,
   if (current_render_target)
     g_object_ref (current_render_target);
 
+  gthree_renderer_push_gpu_timer (renderer, "effect composer");
+
   mask_active = FALSE;
   for (i = 0; i < priv->passes->len; i++)
     {
@@ -166,9 +168,11 @@ gthree_effect_composer_render (GthreeEffectComposer *composer,
 
       last_pass_rendered_to_buffer = !rendered_to_screen;
 
+      gthree_renderer_push_gpu_timer (renderer, G_OBJECT_TYPE_NAME (pass));
       gthree_pass_render (pass, renderer,
                           priv->write_buffer, priv->read_buffer,
                           delta_time, rendered_to_screen, mask_active);
+      gthree_renderer_pop_gpu_timer (renderer);
 
       if (pass->need_swap)
         {
@@ -201,12 +205,16 @@ gthree_effect_composer_render (GthreeEffectComposer *composer,
 
   if (!rendered_to_screen && priv->render_to_screen)
     {
+      gthree_renderer_push_gpu_timer (renderer, "final copy");
       gthree_pass_render (priv->copy_pass, renderer,
                           priv->write_buffer, priv->read_buffer,
                           delta_time, TRUE, mask_active);
+      gthree_renderer_pop_gpu_timer (renderer);
     }
 
   gthree_renderer_set_render_target (renderer, current_render_target, 0, 0);
+
+  gthree_renderer_pop_gpu_timer (renderer);
 }
 
 void
@@ -96,11 +96,13 @@ typedef enum {
 typedef enum {
   GTHREE_TEXTURE_FORMAT_RGBA,
   GTHREE_TEXTURE_FORMAT_RGB,
+  GTHREE_TEXTURE_FORMAT_DEPTH,
 } GthreeTextureFormat;
 
 typedef enum {
   GTHREE_DATA_TYPE_UNSIGNED_BYTE,
   GTHREE_DATA_TYPE_BYTE,
+  GTHREE_DATA_TYPE_UNSIGNED_INT,
 } GthreeDataType;
 
 typedef enum {
@@ -153,8 +155,14 @@ typedef enum {
  GTHREE_SHADOW_MAP_TYPE_BASIC,
  GTHREE_SHADOW_MAP_TYPE_PCF,
  GTHREE_SHADOW_MAP_TYPE_PCF_SOFT,
+ GTHREE_SHADOW_MAP_TYPE_PCF_HARDWARE,
 } GthreeShadowMapType;
 
+typedef enum {
+ GTHREE_LOD_METRIC_DISTANCE,
+ GTHREE_LOD_METRIC_SCREEN_SIZE,
+} GthreeLodMetric;
+
 G_END_DECLS
 
 #endif /* __GTHREE_ENUM_H__ */
@@ -22,9 +22,18 @@ typedef struct {
 
   guint bounding_box_set;
   guint bounding_sphere_set;
+  /* Bumped whenever the bounds above are dropped or replaced */
+  guint bounds_serial;
 
   gint draw_range_start;
   gint draw_range_count;
+  guint draw_range_serial;
+
+  /* Bumped whenever the set of attributes, or their buffers, change */
+  guint layout_serial;
+  guint attributes_serial;
+
+  guint id;
 } GthreeGeometryPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeGeometry, gthree_geometry, G_TYPE_OBJECT);
@@ -40,12 +49,16 @@ static void
 gthree_geometry_init (GthreeGeometry *geometry)
 {
   GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+  static guint next_id = 0;
 
   priv->attributes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)drop_attribute);
   priv->groups = g_array_new (FALSE, TRUE, sizeof (GthreeGeometryGroup));
 
   priv->draw_range_start = 0;
   priv->draw_range_count = -1;
+
+  priv->layout_serial = gthree_layout_serial_next ();
+  priv->id = ++next_id;
 }
 
 static void
@@ -93,7 +106,11 @@ gthree_geometry_add_attribute (GthreeGeometry  *geometry,
 
   name = g_intern_string (name);
 
-  g_hash_table_insert (priv->attributes, (char *)name, g_object_ref (attribute));
+  if (g_hash_table_lookup (priv->attributes, name) != attribute)
+    {
+      g_hash_table_insert (priv->attributes, (char *)name, g_object_ref (attribute));
+      priv->layout_serial = gthree_layout_serial_next ();
+    }
 
   return attribute;
 }
@@ -105,6 +122,7 @@ gthree_geometry_invalidate_bounds (GthreeGeometry  *geometry)
 
   priv->bounding_box_set = FALSE;
   priv->bounding_sphere_set = FALSE;
+  priv->bounds_serial = gthree_layout_serial_next ();
 }
 
 void
@@ -113,7 +131,8 @@ gthree_geometry_remove_attribute (GthreeGeometry  *geometry,
 {
   GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
 
-  g_hash_table_remove (priv->attributes, name);
+  if (g_hash_table_remove (priv->attributes, name))
+    priv->layout_serial = gthree_layout_serial_next ();
 }
 
 GthreeAttribute *
@@ -170,6 +189,7 @@ gthree_geometry_get_wireframe_index (GthreeGeometry *geometry)
               gthree_attribute_set_uint (priv->wireframe_index, i * 2 + 4, c);
               gthree_attribute_set_uint (priv->wireframe_index, i * 2 + 5, a);
             }
+          priv->layout_serial = gthree_layout_serial_next ();
         }
       else
         {
@@ -191,6 +211,40 @@ gthree_geometry_set_index (GthreeGeometry  *geometry,
   g_clear_object (&priv->index);
   g_clear_object (&priv->wireframe_index);
   priv->index = index;
+  priv->layout_serial = gthree_layout_serial_next ();
+}
+
+/* A new geometry drawing other triangles out of the same vertices. The
+ * attributes are shared, not copied, so they are only uploaded once. */
+GthreeGeometry *
+gthree_geometry_new_with_shared_attributes (GthreeGeometry  *geometry,
+                                            GthreeAttribute *index)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+  GthreeGeometry *copy = gthree_geometry_new ();
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, priv->attributes);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    gthree_geometry_add_attribute (copy, key, value);
+
+  if (priv->morph_attributes)
+    {
+      g_hash_table_iter_init (&iter, priv->morph_attributes);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          GPtrArray *attributes = value;
+          guint i;
+
+          for (i = 0; i < attributes->len; i++)
+            gthree_geometry_add_morph_attribute (copy, key, g_ptr_array_index (attributes, i));
+        }
+    }
+
+  gthree_geometry_set_index (copy, index);
+
+  return copy;
 }
 
 GthreeAttribute *
@@ -318,6 +372,7 @@ gthree_geometry_add_group (GthreeGeometry  *geometry,
   GthreeGeometryGroup group = { start, count, material_index };
 
   g_array_append_val (priv->groups, group);
+  gthree_render_lists_invalidate ();
 }
 
 void
@@ -325,7 +380,7 @@ gthree_geometry_clear_groups (GthreeGeometry  *geometry)
 {
   GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
   g_array_set_size (priv->groups, 0);
-
+  gthree_render_lists_invalidate ();
 }
 
 int
@@ -373,8 +428,13 @@ gthree_geometry_set_draw_range (GthreeGeometry  *geometry,
                                 int count)
 {
   GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  if (priv->draw_range_start == start && priv->draw_range_count == count)
+    return;
+
   priv->draw_range_start = start;
   priv->draw_range_count = count;
+  priv->draw_range_serial = gthree_layout_serial_next ();
 }
 
 
@@ -492,6 +552,7 @@ gthree_geometry_set_bounding_sphere  (GthreeGeometry          *geometry,
 
   priv->bounding_sphere_set = TRUE;
   priv->bounding_sphere = *sphere;
+  priv->bounds_serial = gthree_layout_serial_next ();
 }
 
 const graphene_box_t *
@@ -535,6 +596,7 @@ gthree_geometry_set_bounding_box  (GthreeGeometry       *geometry,
 
   priv->bounding_box = *box;
   priv->bounding_box_set = TRUE;
+  priv->bounds_serial = gthree_layout_serial_next ();
 }
 
 void
@@ -668,6 +730,7 @@ gthree_geometry_update (GthreeGeometry *geometry,
   GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
   GthreeAttribute *attribute;
   GHashTableIter iter;
+  guint attributes_serial = 0;
 
   if (priv->index)
     gthree_attribute_update (priv->index, renderer, GL_ELEMENT_ARRAY_BUFFER);
@@ -679,6 +742,14 @@ gthree_geometry_update (GthreeGeometry *geometry,
     {
       // TODO: Only do this once per frame
       gthree_attribute_update (attribute, renderer, GL_ARRAY_BUFFER);
+      attributes_serial += gthree_attribute_get_layout_serial (attribute);
+    }
+
+  /* Serials only grow, so the sum changes if any attribute got a new buffer */
+  if (attributes_serial != priv->attributes_serial)
+    {
+      priv->attributes_serial = attributes_serial;
+      priv->layout_serial = gthree_layout_serial_next ();
     }
 
   if (priv->morph_attributes != NULL)
@@ -702,6 +773,58 @@ gthree_geometry_update (GthreeGeometry *geometry,
     }
 }
 
+guint
+gthree_geometry_get_id (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  return priv->id;
+}
+
+guint
+gthree_geometry_get_layout_serial (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+
+  return priv->layout_serial;
+}
+
+/* Changes when the positions, the index or the draw range change,
+ * i.e. when rendering only the depth of the geometry could differ */
+guint
+gthree_geometry_get_shape_serial (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+  GthreeAttribute *position = gthree_geometry_get_position (geometry);
+  guint serial = priv->layout_serial + priv->draw_range_serial;
+
+  /* Serials only grow, so the sum changes if any of them does */
+  if (position)
+    serial += gthree_attribute_get_content_serial (position);
+  if (priv->index)
+    serial += gthree_attribute_get_content_serial (priv->index);
+
+  return serial;
+}
+
+/* Changes when the bounds are invalidated or set, or the positions
+ * change, i.e. when objects using the geometry may have moved. The
+ * geometry doesn't know its users, so they poll this, see
+ * gthree_object_check_geometry_bounds() */
+guint
+gthree_geometry_get_bounds_serial (GthreeGeometry *geometry)
+{
+  GthreeGeometryPrivate *priv = gthree_geometry_get_instance_private (geometry);
+  GthreeAttribute *position = gthree_geometry_get_position (geometry);
+  guint serial = priv->bounds_serial + priv->layout_serial;
+
+  /* Serials only grow, so the sum changes if any of them does */
+  if (position)
+    serial += gthree_attribute_get_content_serial (position);
+
+  return serial;
+}
+
 void
 gthree_geometry_fill_render_list (GthreeGeometry   *geometry,
                                   GthreeRenderList *list,
@@ -0,0 +1,242 @@
+#include <epoxy/gl.h>
+
+#include "gthreerenderer.h"
+#include "gthreeprivate.h"
+
+/* GPU timing of nested render phases.
+ *
+ * Each phase writes a GL_TIMESTAMP query when it starts and ends, so
+ * phases can nest (unlike GL_TIME_ELAPSED). A frame is everything
+ * between an outermost push and its pop. Finished frames are kept in a
+ * small ring and read back once the GPU has caught up, which is checked
+ * without blocking. If the GPU falls so far behind that the ring is
+ * full, new frames are not timed until a slot frees up.
+ */
+
+#define GPU_TIMER_FRAMES 4
+
+typedef struct {
+  char *name;
+  int depth;
+  guint begin_query;
+  guint end_query;
+} GpuTimerPhase;
+
+typedef struct {
+  GArray *queries; /* GLuint, reused between frames */
+  guint n_used_queries;
+  GArray *phases;  /* GpuTimerPhase */
+} GpuTimerFrame;
+
+struct _GthreeGpuTimer {
+  GpuTimerFrame frames[GPU_TIMER_FRAMES];
+  guint first_pending;
+  guint n_pending;
+
+  GpuTimerFrame *recording; /* NULL between frames, or if this frame is skipped */
+  GArray *open_phases; /* Stack of indexes into recording->phases, -1 if not recorded */
+
+  GArray *timings; /* GthreeGpuTiming for the last frame read back */
+};
+
+static void
+clear_phase (GpuTimerPhase *phase)
+{
+  g_free (phase->name);
+}
+
+static void
+clear_timing (GthreeGpuTiming *timing)
+{
+  g_free ((char *)timing->name);
+}
+
+GthreeGpuTimer *
+gthree_gpu_timer_new (void)
+{
+  GthreeGpuTimer *timer = g_new0 (GthreeGpuTimer, 1);
+  int i;
+
+  for (i = 0; i < GPU_TIMER_FRAMES; i++)
+    {
+      GpuTimerFrame *frame = &timer->frames[i];
+
+      frame->queries = g_array_new (FALSE, FALSE, sizeof (GLuint));
+      frame->phases = g_array_new (FALSE, FALSE, sizeof (GpuTimerPhase));
+      g_array_set_clear_func (frame->phases, (GDestroyNotify)clear_phase);
+    }
+
+  timer->open_phases = g_array_new (FALSE, FALSE, sizeof (int));
+  timer->timings = g_array_new (FALSE, FALSE, sizeof (GthreeGpuTiming));
+  g_array_set_clear_func (timer->timings, (GDestroyNotify)clear_timing);
+
+  return timer;
+}
+
+/* Needs the GL context to be current */
+void
+gthree_gpu_timer_free (GthreeGpuTimer *timer)
+{
+  int i;
+
+  for (i = 0; i < GPU_TIMER_FRAMES; i++)
+    {
+      GpuTimerFrame *frame = &timer->frames[i];
+
+      if (frame->queries->len > 0)
+        glDeleteQueries (frame->queries->len, (GLuint *)frame->queries->data);
+      g_array_unref (frame->queries);
+      g_array_unref (frame->phases);
+    }
+
+  g_array_unref (timer->open_phases);
+  g_array_unref (timer->timings);
+  g_free (timer);
+}
+
+int
+gthree_gpu_timer_get_depth (GthreeGpuTimer *timer)
+{
+  return timer->open_phases->len;
+}
+
+static void
+write_timestamp (GpuTimerFrame *frame,
+                 guint         *query_index)
+{
+  GLuint query;
+
+  if (frame->n_used_queries == frame->queries->len)
+    {
+      glGenQueries (1, &query);
+      g_array_append_val (frame->queries, query);
+    }
+
+  *query_index = frame->n_used_queries++;
+  query = g_array_index (frame->queries, GLuint, *query_index);
+  glQueryCounter (query, GL_TIMESTAMP);
+}
+
+void
+gthree_gpu_timer_push (GthreeGpuTimer *timer,
+                       const char     *name)
+{
+  int phase_index = -1;
+
+  if (timer->open_phases->len == 0)
+    {
+      if (timer->n_pending < GPU_TIMER_FRAMES)
+        {
+          timer->recording = &timer->frames[(timer->first_pending + timer->n_pending) % GPU_TIMER_FRAMES];
+          g_array_set_size (timer->recording->phases, 0);
+          timer->recording->n_used_queries = 0;
+        }
+      else
+        timer->recording = NULL;
+    }
+
+  if (timer->recording)
+    {
+      GpuTimerPhase phase;
+
+      phase.name = g_strdup (name);
+      phase.depth = timer->open_phases->len;
+      write_timestamp (timer->recording, &phase.begin_query);
+      phase.end_query = phase.begin_query;
+
+      phase_index = timer->recording->phases->len;
+      g_array_append_val (timer->recording->phases, phase);
+    }
+
+  g_array_append_val (timer->open_phases, phase_index);
+}
+
+static void
+read_back_frame (GthreeGpuTimer *timer,
+                 GpuTimerFrame  *frame)
+{
+  guint i;
+
+  g_array_set_size (timer->timings, 0);
+
+  for (i = 0; i < frame->phases->len; i++)
+    {
+      GpuTimerPhase *phase = &g_array_index (frame->phases, GpuTimerPhase, i);
+      GLuint64 begin = 0, end = 0;
+      GthreeGpuTiming timing;
+
+      glGetQueryObjectui64v (g_array_index (frame->queries, GLuint, phase->begin_query), GL_QUERY_RESULT, &begin);
+      glGetQueryObjectui64v (g_array_index (frame->queries, GLuint, phase->end_query), GL_QUERY_RESULT, &end);
+
+      timing.name = g_steal_pointer (&phase->name);
+      timing.depth = phase->depth;
+      timing.gpu_time = end > begin ? end - begin : 0;
+      g_array_append_val (timer->timings, timing);
+    }
+}
+
+/* Reads back every finished frame whose results are available,
+ * returns TRUE if the timings changed */
+static gboolean
+collect_frames (GthreeGpuTimer *timer)
+{
+  gboolean changed = FALSE;
+
+  while (timer->n_pending > 0)
+    {
+      GpuTimerFrame *frame = &timer->frames[timer->first_pending];
+      GLuint last_query = g_array_index (frame->queries, GLuint, frame->n_used_queries - 1);
+      GLint available = 0;
+
+      /* Timestamps complete in order, so if the last one is there all are */
+      glGetQueryObjectiv (last_query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+        break;
+
+      read_back_frame (timer, frame);
+      changed = TRUE;
+
+      timer->first_pending = (timer->first_pending + 1) % GPU_TIMER_FRAMES;
+      timer->n_pending--;
+    }
+
+  return changed;
+}
+
+/* Returns TRUE if this ended a frame and new timings were read back */
+gboolean
+gthree_gpu_timer_pop (GthreeGpuTimer *timer)
+{
+  int phase_index;
+
+  if (timer->open_phases->len == 0)
+    return FALSE;
+
+  phase_index = g_array_index (timer->open_phases, int, timer->open_phases->len - 1);
+  g_array_set_size (timer->open_phases, timer->open_phases->len - 1);
+
+  if (phase_index >= 0)
+    {
+      GpuTimerPhase *phase = &g_array_index (timer->recording->phases, GpuTimerPhase, phase_index);
+      write_timestamp (timer->recording, &phase->end_query);
+    }
+
+  if (timer->open_phases->len > 0)
+    return FALSE;
+
+  if (timer->recording)
+    {
+      timer->n_pending++;
+      timer->recording = NULL;
+    }
+
+  return collect_frames (timer);
+}
+
+const GthreeGpuTiming *
+gthree_gpu_timer_get_timings (GthreeGpuTimer *timer,
+                              guint          *n_timings)
+{
+  *n_timings = timer->timings->len;
+  return (const GthreeGpuTiming *)timer->timings->data;
+}
@@ -0,0 +1,452 @@
+#include <math.h>
+#include <epoxy/gl.h>
+
+#include "gthreeinstancedmesh.h"
+#include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
+#include "gthreeraycaster.h"
+#include "gthreeattribute.h"
+
+typedef struct {
+  int count;
+  int max_count;
+
+  GthreeAttribute *instance_matrix; /* mat4 per instance */
+  GthreeAttribute *instance_color; /* vec3 per instance, created on first use */
+
+  /* Union of all instance bounding spheres, in object space */
+  graphene_sphere_t bounding_sphere;
+  gboolean bounding_sphere_set;
+  guint geometry_bounds_serial; /* Of the geometry it was computed from */
+
+  /* Used to raycast one instance at a time through the GthreeMesh code */
+  GthreeMesh *raycast_mesh;
+} GthreeInstancedMeshPrivate;
+
+enum {
+  PROP_0,
+
+  PROP_COUNT,
+
+  N_PROPS
+};
+
+static GParamSpec *obj_props[N_PROPS] = { NULL, };
+
+G_DEFINE_TYPE_WITH_PRIVATE (GthreeInstancedMesh, gthree_instanced_mesh, GTHREE_TYPE_MESH)
+
+GthreeInstancedMesh *
+gthree_instanced_mesh_new (GthreeGeometry *geometry,
+                           GthreeMaterial *material,
+                           int             count)
+{
+  g_autoptr(GPtrArray) materials = g_ptr_array_new_with_free_func (g_object_unref);
+
+  if (material)
+    g_ptr_array_add (materials, g_object_ref (material));
+
+  return g_object_new (gthree_instanced_mesh_get_type (),
+                       "geometry", geometry,
+                       "materials", materials,
+                       "count", count,
+                       NULL);
+}
+
+static void
+gthree_instanced_mesh_init (GthreeInstancedMesh *mesh)
+{
+}
+
+static void
+gthree_instanced_mesh_finalize (GObject *obj)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_clear_object (&priv->instance_matrix);
+  g_clear_object (&priv->instance_color);
+  g_clear_object (&priv->raycast_mesh);
+
+  G_OBJECT_CLASS (gthree_instanced_mesh_parent_class)->finalize (obj);
+}
+
+static void
+gthree_instanced_mesh_allocate (GthreeInstancedMesh *mesh,
+                                int count)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  graphene_matrix_t identity;
+  int i;
+
+  g_clear_object (&priv->instance_matrix);
+  g_clear_object (&priv->instance_color);
+
+  priv->count = count;
+  priv->max_count = count;
+
+  priv->instance_matrix = gthree_attribute_new ("instanceMatrix", GTHREE_ATTRIBUTE_TYPE_FLOAT,
+                                                MAX (count, 1), 16, FALSE);
+  gthree_attribute_set_dynamic (priv->instance_matrix, TRUE);
+
+  graphene_matrix_init_identity (&identity);
+  for (i = 0; i < count; i++)
+    graphene_matrix_to_float (&identity, gthree_attribute_peek_float_at (priv->instance_matrix, i));
+
+  priv->bounding_sphere_set = FALSE;
+}
+
+static void
+gthree_instanced_mesh_update (GthreeObject *object,
+                              GthreeRenderer *renderer)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  GTHREE_OBJECT_CLASS (gthree_instanced_mesh_parent_class)->update (object, renderer);
+
+  gthree_attribute_update (priv->instance_matrix, renderer, GL_ARRAY_BUFFER);
+  if (priv->instance_color)
+    gthree_attribute_update (priv->instance_color, renderer, GL_ARRAY_BUFFER);
+}
+
+static gboolean
+gthree_instanced_mesh_in_frustum (GthreeObject *object,
+                                  const graphene_frustum_t *frustum)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  graphene_sphere_t sphere;
+
+  if (priv->count == 0 ||
+      gthree_mesh_get_geometry (GTHREE_MESH (mesh)) == NULL)
+    return FALSE;
+
+  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
+                                    gthree_instanced_mesh_get_bounding_sphere (mesh),
+                                    &sphere);
+
+  return graphene_frustum_intersects_sphere (frustum, &sphere);
+}
+
+static gboolean
+gthree_instanced_mesh_get_bounding_sphere_vfunc (GthreeObject      *object,
+                                                 graphene_sphere_t *sphere)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  if (priv->count == 0 ||
+      gthree_mesh_get_geometry (GTHREE_MESH (mesh)) == NULL)
+    return FALSE;
+
+  *sphere = *gthree_instanced_mesh_get_bounding_sphere (mesh);
+  return TRUE;
+}
+
+static void
+gthree_instanced_mesh_raycast (GthreeObject *object,
+                               GthreeRaycaster *raycaster,
+                               GPtrArray *intersections)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (object);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (mesh));
+  g_autoptr(GPtrArray) materials = NULL;
+  g_autoptr(GPtrArray) instance_intersections = NULL;
+  graphene_sphere_t world_sphere;
+  int i, j;
+
+  if (priv->count == 0 || geometry == NULL ||
+      gthree_mesh_get_n_materials (GTHREE_MESH (mesh)) == 0)
+    return;
+
+  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object),
+                                    gthree_instanced_mesh_get_bounding_sphere (mesh),
+                                    &world_sphere);
+  if (!graphene_ray_intersects_sphere (gthree_raycaster_get_ray (raycaster), &world_sphere))
+    return;
+
+  /* The geometry is construct-only, so a different one needs a new helper */
+  if (priv->raycast_mesh == NULL ||
+      gthree_mesh_get_geometry (priv->raycast_mesh) != geometry)
+    {
+      g_clear_object (&priv->raycast_mesh);
+      priv->raycast_mesh = gthree_mesh_new (geometry, NULL);
+    }
+
+  g_object_get (mesh, "materials", &materials, NULL);
+  gthree_mesh_set_materials (priv->raycast_mesh, materials);
+
+  /* No free func, the hits are moved over to intersections */
+  instance_intersections = g_ptr_array_new ();
+
+  for (i = 0; i < priv->count; i++)
+    {
+      graphene_matrix_t instance_world_matrix;
+
+      gthree_attribute_get_matrix (priv->instance_matrix, i, &instance_world_matrix);
+      graphene_matrix_multiply (&instance_world_matrix,
+                                gthree_object_get_world_matrix (object),
+                                &instance_world_matrix);
+      gthree_object_set_world_matrix (GTHREE_OBJECT (priv->raycast_mesh), &instance_world_matrix);
+
+      gthree_object_raycast (GTHREE_OBJECT (priv->raycast_mesh), raycaster, instance_intersections);
+
+      for (j = 0; j < instance_intersections->len; j++)
+        {
+          GthreeRayIntersection *intersection = g_ptr_array_index (instance_intersections, j);
+
+          g_set_object (&intersection->object, object);
+          intersection->instance_id = i;
+          g_ptr_array_add (intersections, intersection);
+        }
+
+      g_ptr_array_set_size (instance_intersections, 0);
+    }
+}
+
+static void
+gthree_instanced_mesh_set_property (GObject *obj,
+                                    guint prop_id,
+                                    const GValue *value,
+                                    GParamSpec *pspec)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+
+  switch (prop_id)
+    {
+    case PROP_COUNT:
+      gthree_instanced_mesh_allocate (mesh, g_value_get_int (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_instanced_mesh_get_property (GObject *obj,
+                                    guint prop_id,
+                                    GValue *value,
+                                    GParamSpec *pspec)
+{
+  GthreeInstancedMesh *mesh = GTHREE_INSTANCED_MESH (obj);
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  switch (prop_id)
+    {
+    case PROP_COUNT:
+      g_value_set_int (value, priv->count);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_instanced_mesh_class_init (GthreeInstancedMeshClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GthreeObjectClass *object_class = GTHREE_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = gthree_instanced_mesh_set_property;
+  gobject_class->get_property = gthree_instanced_mesh_get_property;
+  gobject_class->finalize = gthree_instanced_mesh_finalize;
+
+  object_class->in_frustum = gthree_instanced_mesh_in_frustum;
+  object_class->get_bounding_sphere = gthree_instanced_mesh_get_bounding_sphere_vfunc;
+  object_class->update = gthree_instanced_mesh_update;
+  object_class->raycast = gthree_instanced_mesh_raycast;
+
+  obj_props[PROP_COUNT] =
+    g_param_spec_int ("count", "Count", "Number of instances",
+                      0, G_MAXINT, 0,
+                      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (gobject_class, N_PROPS, obj_props);
+}
+
+/* Number of instances drawn, at most the count the mesh was created with */
+int
+gthree_instanced_mesh_get_count (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->count;
+}
+
+void
+gthree_instanced_mesh_set_count (GthreeInstancedMesh *mesh,
+                                 int count)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (count >= 0 && count <= priv->max_count);
+
+  priv->count = count;
+  priv->bounding_sphere_set = FALSE;
+  gthree_object_bounds_changed (GTHREE_OBJECT (mesh));
+}
+
+int
+gthree_instanced_mesh_get_max_count (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->max_count;
+}
+
+void
+gthree_instanced_mesh_set_matrix_at (GthreeInstancedMesh     *mesh,
+                                     int                      index,
+                                     const graphene_matrix_t *matrix)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  graphene_matrix_to_float (matrix, gthree_attribute_peek_float_at (priv->instance_matrix, index));
+  gthree_attribute_set_needs_update (priv->instance_matrix);
+  priv->bounding_sphere_set = FALSE;
+  gthree_object_bounds_changed (GTHREE_OBJECT (mesh));
+}
+
+void
+gthree_instanced_mesh_get_matrix_at (GthreeInstancedMesh *mesh,
+                                     int                  index,
+                                     graphene_matrix_t   *matrix)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  gthree_attribute_get_matrix (priv->instance_matrix, index, matrix);
+}
+
+void
+gthree_instanced_mesh_set_color_at (GthreeInstancedMesh   *mesh,
+                                    int                    index,
+                                    const graphene_vec3_t *color)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  int i;
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  if (priv->instance_color == NULL)
+    {
+      priv->instance_color = gthree_attribute_new ("instanceColor", GTHREE_ATTRIBUTE_TYPE_FLOAT,
+                                                   priv->max_count, 3, FALSE);
+      gthree_attribute_set_dynamic (priv->instance_color, TRUE);
+      for (i = 0; i < priv->max_count; i++)
+        gthree_attribute_set_xyz (priv->instance_color, i, 1, 1, 1);
+    }
+
+  gthree_attribute_set_vec3 (priv->instance_color, index, color);
+  gthree_attribute_set_needs_update (priv->instance_color);
+}
+
+void
+gthree_instanced_mesh_get_color_at (GthreeInstancedMesh *mesh,
+                                    int                  index,
+                                    graphene_vec3_t     *color)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  g_return_if_fail (index >= 0 && index < priv->max_count);
+
+  if (priv->instance_color == NULL)
+    graphene_vec3_init (color, 1, 1, 1);
+  else
+    gthree_attribute_get_vec3 (priv->instance_color, index, color);
+}
+
+GthreeAttribute *
+gthree_instanced_mesh_get_instance_matrix (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->instance_matrix;
+}
+
+/* NULL unless gthree_instanced_mesh_set_color_at() has been called */
+GthreeAttribute *
+gthree_instanced_mesh_get_instance_color (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  return priv->instance_color;
+}
+
+/* Call this if you modified the instance matrix attribute directly, or the geometry bounds changed */
+void
+gthree_instanced_mesh_invalidate_bounds (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+
+  priv->bounding_sphere_set = FALSE;
+  gthree_object_bounds_changed (GTHREE_OBJECT (mesh));
+}
+
+const graphene_sphere_t *
+gthree_instanced_mesh_get_bounding_sphere (GthreeInstancedMesh *mesh)
+{
+  GthreeInstancedMeshPrivate *priv = gthree_instanced_mesh_get_instance_private (mesh);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (mesh));
+
+  if (geometry != NULL && priv->bounding_sphere_set &&
+      priv->geometry_bounds_serial != gthree_geometry_get_bounds_serial (geometry))
+    priv->bounding_sphere_set = FALSE;
+
+  if (!priv->bounding_sphere_set)
+    {
+      const graphene_sphere_t *geometry_sphere;
+      graphene_sphere_t *spheres;
+      graphene_box_t box;
+      graphene_point3d_t center;
+      float radius = 0.f;
+      int i;
+
+      if (geometry == NULL || priv->count == 0)
+        {
+          graphene_sphere_init (&priv->bounding_sphere, graphene_point3d_zero (), 0);
+          priv->bounding_sphere_set = TRUE;
+          return &priv->bounding_sphere;
+        }
+
+      priv->geometry_bounds_serial = gthree_geometry_get_bounds_serial (geometry);
+      geometry_sphere = gthree_geometry_get_bounding_sphere (geometry);
+      spheres = g_new (graphene_sphere_t, priv->count);
+
+      graphene_box_init_from_box (&box, graphene_box_empty ());
+      for (i = 0; i < priv->count; i++)
+        {
+          graphene_matrix_t m;
+          graphene_box_t sphere_box;
+
+          gthree_attribute_get_matrix (priv->instance_matrix, i, &m);
+          graphene_matrix_transform_sphere (&m, geometry_sphere, &spheres[i]);
+          graphene_sphere_get_bounding_box (&spheres[i], &sphere_box);
+          graphene_box_union (&box, &sphere_box, &box);
+        }
+
+      graphene_box_get_center (&box, &center);
+      for (i = 0; i < priv->count; i++)
+        {
+          graphene_point3d_t sphere_center;
+
+          graphene_sphere_get_center (&spheres[i], &sphere_center);
+          radius = fmaxf (radius,
+                          graphene_point3d_distance (&center, &sphere_center, NULL) +
+                          graphene_sphere_get_radius (&spheres[i]));
+        }
+
+      g_free (spheres);
+
+      graphene_sphere_init (&priv->bounding_sphere, &center, radius);
+      priv->bounding_sphere_set = TRUE;
+    }
+
+  return &priv->bounding_sphere;
+}
@@ -15,7 +15,14 @@ gthree_light_setup_hash_equal (GthreeLightSetupHash *a,
     a->num_spot == b->num_spot &&
     a->num_hemi == b->num_hemi &&
     a->num_shadow == b->num_shadow &&
-    a->obj_receive_shadow == b->obj_receive_shadow;
+    a->obj_receive_shadow == b->obj_receive_shadow &&
+    a->clustered == b->clustered &&
+    a->max_object_lights == b->max_object_lights &&
+    a->num_point_shadow == b->num_point_shadow &&
+    a->num_spot_shadow == b->num_spot_shadow &&
+    a->shadow_cascades == b->shadow_cascades &&
+    a->shadow_atlas == b->shadow_atlas &&
+    a->shadow_map_type == b->shadow_map_type;
 }
 
 
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <string.h>
 #include <epoxy/gl.h>
 
 #include "gthreelightshadow.h"
@@ -14,7 +15,22 @@ typedef struct {
 
   GthreeRenderTarget *map;
 
+  /* The part of the map we use, if the map is a shadow atlas shared
+   * with other lights, see gthree_light_shadow_set_atlas_region() */
+  gboolean in_atlas;
+  int atlas_x;
+  int atlas_y;
+  int atlas_width;
+  int atlas_height;
+  float atlas_scale;
+
   graphene_matrix_t matrix;
+
+  /* What the map was last rendered from, see gthree_light_shadow_update_cache() */
+  gboolean cache_valid;
+  graphene_matrix_t cache_matrix;
+  graphene_matrix_t cache_projection;
+  GArray *cache_casters; /* GthreeShadowCaster */
 } GthreeLightShadowPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeLightShadow, gthree_light_shadow, G_TYPE_OBJECT);
@@ -31,6 +47,8 @@ gthree_light_shadow_init (GthreeLightShadow *light_shadow)
   priv->map_height = 512;
 
   graphene_matrix_init_identity (&priv->matrix);
+
+  priv->cache_casters = g_array_new (FALSE, FALSE, sizeof (GthreeShadowCaster));
 }
 
 static void
@@ -41,6 +59,7 @@ gthree_light_shadow_finalize (GObject *obj)
 
   g_clear_object (&priv->camera);
   g_clear_object (&priv->map);
+  g_array_unref (priv->cache_casters);
 
   G_OBJECT_CLASS (gthree_light_shadow_parent_class)->finalize (obj);
 }
@@ -81,6 +100,7 @@ gthree_light_shadow_set_camera (GthreeLightShadow *shadow,
   GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
 
   g_set_object (&priv->camera, camera);
+  priv->cache_valid = FALSE;
 }
 
 int
@@ -108,6 +128,7 @@ gthree_light_shadow_set_map_size (GthreeLightShadow *shadow,
 
   priv->map_width = width;
   priv->map_height = height;
+  priv->cache_valid = FALSE;
 }
 
 GthreeRenderTarget *
@@ -125,6 +146,7 @@ gthree_light_shadow_set_map (GthreeLightShadow *shadow,
   GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
 
   g_set_object (&priv->map, map);
+  priv->cache_valid = FALSE;
 }
 
 graphene_matrix_t *
@@ -135,6 +157,133 @@ gthree_light_shadow_get_matrix (GthreeLightShadow *shadow)
   return &priv->matrix;
 }
 
+void
+gthree_light_shadow_invalidate_cache (GthreeLightShadow *shadow)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  priv->cache_valid = FALSE;
+}
+
+/* Returns TRUE if the map is still what rendering @casters with the
+ * current shadow matrix and @projection would give. Otherwise this
+ * remembers them, expecting the map to be rendered again. Nothing else
+ * in the scene matters: @casters records which objects are drawn into
+ * the map and the state they are drawn in, and changes to the map
+ * itself, its size or its atlas region drop the cache. */
+gboolean
+gthree_light_shadow_update_cache (GthreeLightShadow       *shadow,
+                                  const graphene_matrix_t *projection,
+                                  GArray                  *casters)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  if (priv->cache_valid &&
+      graphene_matrix_equal_fast (&priv->cache_matrix, &priv->matrix) &&
+      graphene_matrix_equal_fast (&priv->cache_projection, projection) &&
+      priv->cache_casters->len == casters->len &&
+      memcmp (priv->cache_casters->data, casters->data,
+              casters->len * sizeof (GthreeShadowCaster)) == 0)
+    return TRUE;
+
+  priv->cache_valid = TRUE;
+  priv->cache_matrix = priv->matrix;
+  priv->cache_projection = *projection;
+  g_array_set_size (priv->cache_casters, 0);
+  g_array_append_vals (priv->cache_casters, casters->data, casters->len);
+
+  return FALSE;
+}
+
+/* Makes the map the region of @atlas at @x, @y, with the map size scaled
+ * by @scale, or if @atlas is %NULL takes the map out of the atlas */
+void
+gthree_light_shadow_set_atlas_region (GthreeLightShadow  *shadow,
+                                      GthreeRenderTarget *atlas,
+                                      int                 x,
+                                      int                 y,
+                                      int                 width,
+                                      int                 height,
+                                      float               scale)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  if (atlas == NULL)
+    {
+      if (priv->in_atlas)
+        {
+          priv->in_atlas = FALSE;
+          gthree_light_shadow_set_map (shadow, NULL);
+        }
+      return;
+    }
+
+  if (priv->in_atlas &&
+      priv->map == atlas &&
+      priv->atlas_x == x &&
+      priv->atlas_y == y &&
+      priv->atlas_width == width &&
+      priv->atlas_height == height &&
+      priv->atlas_scale == scale)
+    return;
+
+  priv->in_atlas = TRUE;
+  priv->atlas_x = x;
+  priv->atlas_y = y;
+  priv->atlas_width = width;
+  priv->atlas_height = height;
+  priv->atlas_scale = scale;
+  gthree_light_shadow_set_map (shadow, atlas);
+}
+
+gboolean
+gthree_light_shadow_get_atlas_region (GthreeLightShadow *shadow,
+                                      int               *x,
+                                      int               *y,
+                                      float             *scale)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  if (!priv->in_atlas)
+    return FALSE;
+
+  *x = priv->atlas_x;
+  *y = priv->atlas_y;
+  *scale = priv->atlas_scale;
+  return TRUE;
+}
+
+/* The size of the map (per face or cascade) as rendered, and the part of
+ * the map texture it is in, as a uv offset in xy and scale in zw. These
+ * are the shadowMapSize and shadowMapRect light uniforms. */
+void
+gthree_light_shadow_get_map_info (GthreeLightShadow *shadow,
+                                  graphene_vec2_t   *size,
+                                  graphene_vec4_t   *rect)
+{
+  GthreeLightShadowPrivate *priv = gthree_light_shadow_get_instance_private (shadow);
+
+  if (priv->in_atlas && priv->map)
+    {
+      float atlas_width = gthree_render_target_get_width (priv->map);
+      float atlas_height = gthree_render_target_get_height (priv->map);
+
+      graphene_vec2_init (size,
+                          (int) (priv->map_width * priv->atlas_scale),
+                          (int) (priv->map_height * priv->atlas_scale));
+      graphene_vec4_init (rect,
+                          priv->atlas_x / atlas_width,
+                          priv->atlas_y / atlas_height,
+                          priv->atlas_width / atlas_width,
+                          priv->atlas_height / atlas_height);
+    }
+  else
+    {
+      graphene_vec2_init (size, priv->map_width, priv->map_height);
+      graphene_vec4_init (rect, 0, 0, 1, 1);
+    }
+}
+
 float
 gthree_light_shadow_get_bias (GthreeLightShadow *shadow)
 {
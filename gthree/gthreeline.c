@@ -94,6 +94,20 @@ gthree_line_in_frustum (GthreeObject *object,
   return graphene_frustum_intersects_sphere (frustum, &sphere);
 }
 
+static gboolean
+gthree_line_get_bounding_sphere (GthreeObject      *object,
+                                 graphene_sphere_t *sphere)
+{
+  GthreeLine *line = GTHREE_LINE (object);
+  GthreeLinePrivate *priv = gthree_line_get_instance_private (line);
+
+  if (!priv->geometry)
+    return FALSE;
+
+  *sphere = *gthree_geometry_get_bounding_sphere (priv->geometry);
+  return TRUE;
+}
+
 static void
 gthree_line_set_property (GObject *obj,
                           guint prop_id,
@@ -107,10 +121,13 @@ gthree_line_set_property (GObject *obj,
     {
     case PROP_GEOMETRY:
       g_set_object (&priv->geometry, g_value_get_object (value));
+      gthree_object_bounds_changed (GTHREE_OBJECT (line));
+      gthree_render_lists_invalidate ();
       break;
 
     case PROP_MATERIAL:
       g_set_object (&priv->material, g_value_get_object (value));
+      gthree_render_lists_invalidate ();
       break;
 
     default:
@@ -142,6 +159,19 @@ gthree_line_get_property (GObject *obj,
     }
 }
 
+static gboolean
+gthree_line_update_matrix_world (GthreeObject *object,
+                                 gboolean      force)
+{
+  GthreeLine *line = GTHREE_LINE (object);
+  GthreeLinePrivate *priv = gthree_line_get_instance_private (line);
+
+  force = GTHREE_OBJECT_CLASS (gthree_line_parent_class)->update_matrix_world (object, force);
+  gthree_object_check_geometry_bounds (object, priv->geometry);
+
+  return force;
+}
+
 static void
 gthree_line_class_init (GthreeLineClass *klass)
 {
@@ -153,6 +183,8 @@ gthree_line_class_init (GthreeLineClass *klass)
   gobject_class->finalize = gthree_line_finalize;
 
   object_class->in_frustum = gthree_line_in_frustum;
+  object_class->get_bounding_sphere = gthree_line_get_bounding_sphere;
+  object_class->update_matrix_world = gthree_line_update_matrix_world;
   object_class->update = gthree_line_update;
   object_class->fill_render_list = gthree_line_fill_render_list;
 
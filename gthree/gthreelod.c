@@ -0,0 +1,482 @@
+#include <math.h>
+
+#include "gthreelod.h"
+#include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
+#include "gthreetypebuiltins.h"
+
+typedef struct {
+  GthreeObject *object;
+  float threshold;
+} GthreeLODLevel;
+
+typedef struct {
+  GArray *levels; /* GthreeLODLevel, from most to least detailed */
+  GthreeLodMetric metric;
+  float hysteresis;
+  int current_level;
+  gboolean auto_update;
+} GthreeLODPrivate;
+
+enum {
+  PROP_0,
+
+  PROP_METRIC,
+  PROP_HYSTERESIS,
+  PROP_AUTO_UPDATE,
+
+  N_PROPS
+};
+
+static GParamSpec *obj_props[N_PROPS] = { NULL, };
+
+G_DEFINE_TYPE_WITH_PRIVATE (GthreeLOD, gthree_lod, GTHREE_TYPE_OBJECT)
+
+/**
+ * gthree_lod_new:
+ *
+ * Creates an object that shows one of several versions of the same
+ * thing, each with less detail than the previous one, depending on
+ * how far it is from the camera. Add the versions with
+ * gthree_lod_add_level().
+ *
+ * Returns: (transfer full): a new #GthreeLOD
+ */
+GthreeLOD *
+gthree_lod_new (void)
+{
+  return g_object_new (gthree_lod_get_type (),
+                       NULL);
+}
+
+static void
+clear_level (GthreeLODLevel *level)
+{
+  g_object_unref (level->object);
+}
+
+static void
+gthree_lod_init (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  priv->levels = g_array_new (FALSE, FALSE, sizeof (GthreeLODLevel));
+  g_array_set_clear_func (priv->levels, (GDestroyNotify)clear_level);
+  priv->auto_update = TRUE;
+}
+
+static void
+gthree_lod_finalize (GObject *obj)
+{
+  GthreeLOD *lod = GTHREE_LOD (obj);
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  g_array_unref (priv->levels);
+
+  G_OBJECT_CLASS (gthree_lod_parent_class)->finalize (obj);
+}
+
+static void
+gthree_lod_set_property (GObject *obj,
+                         guint prop_id,
+                         const GValue *value,
+                         GParamSpec *pspec)
+{
+  GthreeLOD *lod = GTHREE_LOD (obj);
+
+  switch (prop_id)
+    {
+    case PROP_METRIC:
+      gthree_lod_set_metric (lod, g_value_get_enum (value));
+      break;
+
+    case PROP_HYSTERESIS:
+      gthree_lod_set_hysteresis (lod, g_value_get_float (value));
+      break;
+
+    case PROP_AUTO_UPDATE:
+      gthree_lod_set_auto_update (lod, g_value_get_boolean (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_lod_get_property (GObject *obj,
+                         guint prop_id,
+                         GValue *value,
+                         GParamSpec *pspec)
+{
+  GthreeLOD *lod = GTHREE_LOD (obj);
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  switch (prop_id)
+    {
+    case PROP_METRIC:
+      g_value_set_enum (value, priv->metric);
+      break;
+
+    case PROP_HYSTERESIS:
+      g_value_set_float (value, priv->hysteresis);
+      break;
+
+    case PROP_AUTO_UPDATE:
+      g_value_set_boolean (value, priv->auto_update);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
+    }
+}
+
+static void
+gthree_lod_class_init (GthreeLODClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = gthree_lod_set_property;
+  gobject_class->get_property = gthree_lod_get_property;
+  gobject_class->finalize = gthree_lod_finalize;
+
+  obj_props[PROP_METRIC] =
+    g_param_spec_enum ("metric", "Metric", "What the level thresholds are compared with",
+                       GTHREE_TYPE_LOD_METRIC,
+                       GTHREE_LOD_METRIC_DISTANCE,
+                       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
+  obj_props[PROP_HYSTERESIS] =
+    g_param_spec_float ("hysteresis", "Hysteresis", "How far past a threshold to go before switching back",
+                        0.f, 1.f, 0.f,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
+  obj_props[PROP_AUTO_UPDATE] =
+    g_param_spec_boolean ("auto-update", "Auto update", "Pick the level when rendering",
+                          TRUE,
+                          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
+
+  g_object_class_install_properties (gobject_class, N_PROPS, obj_props);
+}
+
+/* Levels are switched on the way up, so sort them by the value they
+ * switch at. For screen sizes smaller means less detail, so invert
+ * those. */
+static float
+level_key (GthreeLODPrivate     *priv,
+           const GthreeLODLevel *level)
+{
+  if (priv->metric == GTHREE_LOD_METRIC_DISTANCE)
+    return level->threshold;
+
+  /* Like a distance of 0, a size of 0 means from the start */
+  return level->threshold > 0 ? 1.0f / level->threshold : 0;
+}
+
+static void
+show_level (GthreeLOD *lod,
+            int        level)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+  int i;
+
+  priv->current_level = level;
+
+  for (i = 0; i < priv->levels->len; i++)
+    {
+      GthreeObject *object = g_array_index (priv->levels, GthreeLODLevel, i).object;
+
+      /* Ignore levels that were removed from the lod */
+      if (gthree_object_get_parent (object) != GTHREE_OBJECT (lod))
+        continue;
+
+      /* Not the visible property, that is left to the application */
+      gthree_object_set_lod_hidden (object, i != level);
+    }
+}
+
+static void
+sort_levels (GthreeLODPrivate *priv)
+{
+  int i, j;
+
+  /* Insertion sort, it's stable and there are only a handful of levels */
+  for (i = 1; i < priv->levels->len; i++)
+    {
+      GthreeLODLevel level = g_array_index (priv->levels, GthreeLODLevel, i);
+      float key = level_key (priv, &level);
+
+      for (j = i; j > 0 && level_key (priv, &g_array_index (priv->levels, GthreeLODLevel, j - 1)) > key; j--)
+        g_array_index (priv->levels, GthreeLODLevel, j) = g_array_index (priv->levels, GthreeLODLevel, j - 1);
+
+      g_array_index (priv->levels, GthreeLODLevel, j) = level;
+    }
+}
+
+/**
+ * gthree_lod_add_level:
+ * @lod: a #GthreeLOD
+ * @object: the version of the object to show at this level
+ * @threshold: where this level starts being used
+ *
+ * Adds @object as a child of @lod, to be shown instead of the more
+ * detailed levels once @threshold is crossed. With
+ * %GTHREE_LOD_METRIC_DISTANCE the threshold is the distance from the
+ * camera, and with %GTHREE_LOD_METRIC_SCREEN_SIZE it is the fraction of
+ * the viewport height covered by the bounds of @lod, under which this
+ * level is used. The threshold of the most detailed level is ignored.
+ */
+void
+gthree_lod_add_level (GthreeLOD    *lod,
+                      GthreeObject *object,
+                      float         threshold)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+  GthreeLODLevel level;
+
+  g_return_if_fail (GTHREE_IS_OBJECT (object));
+
+  level.object = g_object_ref (object);
+  level.threshold = fabsf (threshold);
+  g_array_append_val (priv->levels, level);
+  sort_levels (priv);
+
+  gthree_object_add_child (GTHREE_OBJECT (lod), object);
+
+  /* Until the next update show the most detailed level */
+  show_level (lod, 0);
+}
+
+int
+gthree_lod_get_n_levels (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->levels->len;
+}
+
+/**
+ * gthree_lod_get_level_object:
+ * @lod: a #GthreeLOD
+ * @level: the index of the level, 0 being the most detailed
+ *
+ * Returns: (transfer none): the object shown at @level
+ */
+GthreeObject *
+gthree_lod_get_level_object (GthreeLOD *lod,
+                             int        level)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  g_return_val_if_fail (level >= 0 && level < priv->levels->len, NULL);
+
+  return g_array_index (priv->levels, GthreeLODLevel, level).object;
+}
+
+float
+gthree_lod_get_level_threshold (GthreeLOD *lod,
+                                int        level)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  g_return_val_if_fail (level >= 0 && level < priv->levels->len, 0);
+
+  return g_array_index (priv->levels, GthreeLODLevel, level).threshold;
+}
+
+/* The level picked by the last gthree_lod_update() */
+int
+gthree_lod_get_current_level (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->current_level;
+}
+
+void
+gthree_lod_set_metric (GthreeLOD       *lod,
+                       GthreeLodMetric  metric)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  if (priv->metric == metric)
+    return;
+
+  priv->metric = metric;
+  sort_levels (priv);
+
+  g_object_notify_by_pspec (G_OBJECT (lod), obj_props[PROP_METRIC]);
+}
+
+GthreeLodMetric
+gthree_lod_get_metric (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->metric;
+}
+
+/**
+ * gthree_lod_set_hysteresis:
+ * @lod: a #GthreeLOD
+ * @hysteresis: a fraction of the threshold, between 0 and 1
+ *
+ * Once a level is in use, keeps using it until the camera is this
+ * fraction of the threshold back on the other side of it. This avoids
+ * flipping between two levels every frame when the camera hovers
+ * around a threshold.
+ */
+void
+gthree_lod_set_hysteresis (GthreeLOD *lod,
+                           float      hysteresis)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  hysteresis = CLAMP (hysteresis, 0.f, 1.f);
+  if (priv->hysteresis == hysteresis)
+    return;
+
+  priv->hysteresis = hysteresis;
+
+  g_object_notify_by_pspec (G_OBJECT (lod), obj_props[PROP_HYSTERESIS]);
+}
+
+float
+gthree_lod_get_hysteresis (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->hysteresis;
+}
+
+/**
+ * gthree_lod_set_auto_update:
+ * @lod: a #GthreeLOD
+ * @auto_update: whether the renderer picks the level
+ *
+ * If @auto_update is %TRUE, which is the default, the renderer calls
+ * gthree_lod_update() with its camera every frame. Otherwise the level
+ * only changes when the application calls it.
+ */
+void
+gthree_lod_set_auto_update (GthreeLOD *lod,
+                            gboolean   auto_update)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  auto_update = !!auto_update;
+  if (priv->auto_update == auto_update)
+    return;
+
+  priv->auto_update = auto_update;
+
+  g_object_notify_by_pspec (G_OBJECT (lod), obj_props[PROP_AUTO_UPDATE]);
+}
+
+gboolean
+gthree_lod_get_auto_update (GthreeLOD *lod)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+
+  return priv->auto_update;
+}
+
+/* Fraction of the viewport height covered by the bounds of the lod */
+static float
+get_screen_size (GthreeLOD               *lod,
+                 GthreeCamera            *camera,
+                 const graphene_point3d_t *camera_position)
+{
+  const graphene_matrix_t *projection = gthree_camera_get_projection_matrix (camera);
+  graphene_point3d_t center;
+  graphene_sphere_t sphere;
+  graphene_box_t box;
+  float radius, scale;
+
+  if (gthree_object_get_subtree_box (GTHREE_OBJECT (lod), &box))
+    {
+      graphene_box_get_bounding_sphere (&box, &sphere);
+      graphene_sphere_get_center (&sphere, &center);
+      radius = graphene_sphere_get_radius (&sphere);
+    }
+  else
+    {
+      /* Nothing to measure, treat it as a unit sphere */
+      const graphene_matrix_t *world = gthree_object_get_world_matrix (GTHREE_OBJECT (lod));
+
+      graphene_point3d_init (&center,
+                             graphene_matrix_get_x_translation (world),
+                             graphene_matrix_get_y_translation (world),
+                             graphene_matrix_get_z_translation (world));
+      radius = 1;
+    }
+
+  /* The vertical scale of the projection, 1 / tan (fov / 2) for perspective */
+  scale = graphene_matrix_get_value (projection, 1, 1);
+
+  /* Orthographic projections don't divide by the distance */
+  if (graphene_matrix_get_value (projection, 2, 3) == 0)
+    return radius * scale;
+
+  return radius * scale / MAX (graphene_point3d_distance (&center, camera_position, NULL), 1e-6f);
+}
+
+/**
+ * gthree_lod_update:
+ * @lod: a #GthreeLOD
+ * @camera: the camera the scene is rendered with
+ *
+ * Picks the level to use for @camera and stops drawing all the others,
+ * without changing their #GthreeObject:visible property. The
+ * renderer does this itself unless auto-update is turned off. The shadow
+ * pass draws whatever level was picked for the camera.
+ */
+void
+gthree_lod_update (GthreeLOD    *lod,
+                   GthreeCamera *camera)
+{
+  GthreeLODPrivate *priv = gthree_lod_get_instance_private (lod);
+  const graphene_matrix_t *camera_world = gthree_object_get_world_matrix (GTHREE_OBJECT (camera));
+  const graphene_matrix_t *world = gthree_object_get_world_matrix (GTHREE_OBJECT (lod));
+  graphene_point3d_t camera_position, position;
+  float value;
+  int level, i;
+
+  if (priv->levels->len == 0)
+    return;
+
+  graphene_point3d_init (&camera_position,
+                         graphene_matrix_get_x_translation (camera_world),
+                         graphene_matrix_get_y_translation (camera_world),
+                         graphene_matrix_get_z_translation (camera_world));
+
+  if (priv->metric == GTHREE_LOD_METRIC_DISTANCE)
+    {
+      graphene_point3d_init (&position,
+                             graphene_matrix_get_x_translation (world),
+                             graphene_matrix_get_y_translation (world),
+                             graphene_matrix_get_z_translation (world));
+      value = graphene_point3d_distance (&camera_position, &position, NULL);
+    }
+  else
+    {
+      float size = get_screen_size (lod, camera, &camera_position);
+
+      value = size > 0 ? 1.0f / size : G_MAXFLOAT;
+    }
+
+  level = 0;
+  for (i = 1; i < priv->levels->len; i++)
+    {
+      float key = level_key (priv, &g_array_index (priv->levels, GthreeLODLevel, i));
+
+      /* Stay on levels we already reached until we are well back */
+      if (i <= priv->current_level)
+        key *= 1.0f - priv->hysteresis;
+
+      if (value < key)
+        break;
+
+      level = i;
+    }
+
+  show_level (lod, level);
+}
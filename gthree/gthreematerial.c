@@ -27,6 +27,8 @@ typedef struct {
 
   GthreeShader *shader;
   guint32 valid_for_renderer_id;
+  guint id;
+  guint serial;
 
   GArray *clipping_planes;
   gboolean clip_intersection;
@@ -84,7 +86,10 @@ static void
 gthree_material_init (GthreeMaterial *material)
 {
   GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
+  static guint next_id = 0;
 
+  priv->id = ++next_id;
+  priv->serial = gthree_layout_serial_next ();
   priv->visible = TRUE;
   priv->transparent = FALSE;
   priv->opacity = 1.0;
@@ -368,7 +373,7 @@ gthree_material_set_is_visible (GthreeMaterial *material,
 
   priv->visible = !!visible;
 
-  priv->valid_for_renderer_id = 0;
+  gthree_material_set_needs_update (material);
 }
 
 float
@@ -421,7 +426,11 @@ gthree_material_set_is_transparent (GthreeMaterial *material,
 {
   GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
 
-  priv->transparent = !!transparent;
+  transparent = !!transparent;
+  if (priv->transparent != transparent)
+    gthree_render_lists_invalidate ();
+
+  priv->transparent = transparent;
 
   gthree_material_set_needs_update (material);
 }
@@ -459,6 +468,7 @@ gthree_material_set_needs_update (GthreeMaterial *material)
   GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
 
   priv->valid_for_renderer_id = 0;
+  priv->serial = gthree_layout_serial_next ();
 }
 
 void
@@ -658,6 +668,22 @@ gthree_material_get_properties (GthreeMaterial  *material)
   return &priv->properties;
 }
 
+guint
+gthree_material_get_id (GthreeMaterial *material)
+{
+  GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
+  return priv->id;
+}
+
+/* Changes whenever gthree_material_set_needs_update() is called, i.e.
+ * whenever anything affecting how the material renders changes */
+guint
+gthree_material_get_serial (GthreeMaterial *material)
+{
+  GthreeMaterialPrivate *priv = gthree_material_get_instance_private (material);
+  return priv->serial;
+}
+
 GArray *
 gthree_material_get_clipping_planes (GthreeMaterial *material)
 {
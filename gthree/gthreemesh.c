@@ -9,6 +9,7 @@
 
 typedef struct {
   GthreeGeometry *geometry;
+  GthreeGeometry *occluder_geometry;
   GPtrArray *materials;
   GthreeDrawMode draw_mode;
 
@@ -65,6 +66,7 @@ gthree_mesh_finalize (GObject *obj)
   GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
 
   g_clear_object (&priv->geometry);
+  g_clear_object (&priv->occluder_geometry);
   g_ptr_array_unref (priv->materials);
 
   if (priv->morph_target_influences)
@@ -184,6 +186,20 @@ gthree_mesh_in_frustum (GthreeObject *object,
   return graphene_frustum_intersects_sphere (frustum, &sphere);
 }
 
+static gboolean
+gthree_mesh_get_bounding_sphere (GthreeObject      *object,
+                                 graphene_sphere_t *sphere)
+{
+  GthreeMesh *mesh = GTHREE_MESH (object);
+  GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
+
+  if (!priv->geometry)
+    return FALSE;
+
+  *sphere = *gthree_geometry_get_bounding_sphere (priv->geometry);
+  return TRUE;
+}
+
 static GthreeRayIntersection *
 check_intersection (GthreeObject *object,
                     GthreeMaterial *material,
@@ -503,6 +519,8 @@ gthree_mesh_set_property (GObject *obj,
     {
     case PROP_GEOMETRY:
       g_set_object (&priv->geometry, g_value_get_object (value));
+      gthree_object_bounds_changed (GTHREE_OBJECT (mesh));
+      gthree_render_lists_invalidate ();
       break;
 
     case PROP_MATERIALS:
@@ -575,6 +593,8 @@ gthree_mesh_set_materials (GthreeMesh *mesh,
       if (src)
         g_ptr_array_index (priv->materials, i) = g_object_ref (src);
     }
+
+  gthree_render_lists_invalidate ();
 }
 
 void
@@ -583,6 +603,7 @@ gthree_mesh_add_material (GthreeMesh *mesh,
 {
   GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
   g_ptr_array_add (priv->materials, g_object_ref (material));
+  gthree_render_lists_invalidate ();
 }
 
 void
@@ -598,6 +619,7 @@ gthree_mesh_set_material (GthreeMesh *mesh,
 
   old_material = g_ptr_array_index (priv->materials, index);
   g_ptr_array_index (priv->materials, index) = g_object_ref (material);
+  gthree_render_lists_invalidate ();
 }
 
 GthreeGeometry *
@@ -608,6 +630,52 @@ gthree_mesh_get_geometry (GthreeMesh *mesh)
   return priv->geometry;
 }
 
+/**
+ * gthree_mesh_set_occluder_geometry:
+ * @mesh: a #GthreeMesh
+ * @geometry: (nullable): a simplified version of the mesh geometry
+ *
+ * Sets the geometry used when the mesh is an occluder in software
+ * occlusion culling, instead of the normal geometry. This should have
+ * few triangles and must not stick out of the normal geometry, or it
+ * would hide things that are visible.
+ */
+void
+gthree_mesh_set_occluder_geometry (GthreeMesh     *mesh,
+                                   GthreeGeometry *geometry)
+{
+  GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
+
+  g_set_object (&priv->occluder_geometry, geometry);
+}
+
+/**
+ * gthree_mesh_get_occluder_geometry:
+ * @mesh: a #GthreeMesh
+ *
+ * Returns: (transfer none) (nullable): the geometry set with gthree_mesh_set_occluder_geometry()
+ */
+GthreeGeometry *
+gthree_mesh_get_occluder_geometry (GthreeMesh *mesh)
+{
+  GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
+
+  return priv->occluder_geometry;
+}
+
+static gboolean
+gthree_mesh_update_matrix_world (GthreeObject *object,
+                                 gboolean      force)
+{
+  GthreeMesh *mesh = GTHREE_MESH (object);
+  GthreeMeshPrivate *priv = gthree_mesh_get_instance_private (mesh);
+
+  force = GTHREE_OBJECT_CLASS (gthree_mesh_parent_class)->update_matrix_world (object, force);
+  gthree_object_check_geometry_bounds (object, priv->geometry);
+
+  return force;
+}
+
 static void
 gthree_mesh_class_init (GthreeMeshClass *klass)
 {
@@ -619,6 +687,8 @@ gthree_mesh_class_init (GthreeMeshClass *klass)
   gobject_class->finalize = gthree_mesh_finalize;
 
   object_class->in_frustum = gthree_mesh_in_frustum;
+  object_class->get_bounding_sphere = gthree_mesh_get_bounding_sphere;
+  object_class->update_matrix_world = gthree_mesh_update_matrix_world;
   object_class->update = gthree_mesh_update;
   object_class->fill_render_list = gthree_mesh_fill_render_list;
   object_class->raycast = gthree_mesh_raycast;
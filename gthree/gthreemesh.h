@@ -54,6 +54,11 @@ void            gthree_mesh_add_material         (GthreeMesh     *mesh,
 GTHREE_API
 GthreeGeometry *gthree_mesh_get_geometry         (GthreeMesh     *mesh);
 GTHREE_API
+void            gthree_mesh_set_occluder_geometry (GthreeMesh    *mesh,
+                                                   GthreeGeometry *geometry);
+GTHREE_API
+GthreeGeometry *gthree_mesh_get_occluder_geometry (GthreeMesh    *mesh);
+GTHREE_API
 GthreeDrawMode  gthree_mesh_get_draw_mode        (GthreeMesh     *mesh);
 GTHREE_API
 void            gthree_mesh_set_draw_mode        (GthreeMesh     *mesh,
@@ -3,6 +3,11 @@
 
 #include "gthreeobjectprivate.h"
 #include "gthreemesh.h"
+#include "gthreelight.h"
+#include "gthreelod.h"
+#include "gthreeskinnedmesh.h"
+#include "gthreescene.h"
+#include "gthreeprivate.h"
 
 #include <graphene.h>
 
@@ -40,6 +45,7 @@ typedef struct {
   gboolean visible;
   gboolean cast_shadow;
   gboolean receive_shadow;
+  gboolean is_occluder;
   guint32 layer_mask;
 
   GthreeBeforeRenderCallback before_render_cb;
@@ -54,6 +60,21 @@ typedef struct {
   gint n_children;
   gint age;
 
+  /* Leaf in the bounding volume hierarchy of bvh_scene, or -1 */
+  GthreeScene *bvh_scene;
+  int bvh_leaf;
+  guint32 bvh_serial;
+  gboolean bvh_inside; /* Entirely in the frustum at bvh_serial */
+
+  /* Changes whenever the world space bounds may have changed */
+  guint32 bounds_serial;
+  /* Last seen by gthree_object_check_geometry_bounds() */
+  guint32 geometry_bounds_serial;
+
+  /* World space bounds of this object and all its descendants. If
+   * valid, so are those of all descendants. */
+  graphene_box_t subtree_box;
+
   guint realized : 1;
   guint in_destruction : 1;
   guint euler_valid : 1;
@@ -62,6 +83,14 @@ typedef struct {
   guint matrix_need_update : 1;
 
   guint frustum_culled : 1;
+  guint lod_hidden : 1; /* A level its GthreeLOD parent isn't using */
+  guint subtree_bounds_valid : 1;
+  guint subtree_empty : 1;     /* Nothing in the subtree has bounds */
+  guint subtree_unbounded : 1; /* Something in the subtree must never be culled */
+  guint subtree_has_lights : 1;
+  guint subtree_has_occluders : 1;
+  guint subtree_has_lods : 1;
+  guint subtree_has_skins : 1; /* Skinned meshes */
 } GthreeObjectPrivate;
 
 enum
@@ -90,6 +119,7 @@ static gboolean gthree_object_real_update_matrix_world (GthreeObject *object,
 static void gthree_object_real_set_direct_uniforms  (GthreeObject *object,
                                                      GthreeProgram *program,
                                                      GthreeRenderer *renderer);
+static void invalidate_subtree_bounds (GthreeObject *object);
 
 GthreeObject *
 gthree_object_new ()
@@ -133,6 +163,7 @@ gthree_object_init (GthreeObject *object)
   priv->visible = TRUE;
   priv->layer_mask = 1;
   priv->frustum_culled = TRUE;
+  priv->bvh_leaf = -1;
 
   graphene_matrix_init_identity (&priv->matrix);
   graphene_matrix_init_identity (&priv->world_matrix);
@@ -375,10 +406,36 @@ gthree_object_set_visible (GthreeObject *object,
     return;
 
   priv->visible = visible;
+  gthree_render_lists_invalidate ();
 
   g_object_notify_by_pspec (G_OBJECT (object), obj_props[PROP_VISIBLE]);
 }
 
+/* Whether the object is visible and not an unused level of a LOD. The
+ * level switching is kept apart from the visible property so it doesn't
+ * override what the application set. */
+gboolean
+gthree_object_get_shown (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->visible && !priv->lod_hidden;
+}
+
+void
+gthree_object_set_lod_hidden (GthreeObject *object,
+                              gboolean      hidden)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  hidden = !!hidden;
+  if (priv->lod_hidden == hidden)
+    return;
+
+  priv->lod_hidden = hidden;
+  gthree_render_lists_invalidate ();
+}
+
 gboolean
 gthree_object_get_cast_shadow (GthreeObject *object)
 {
@@ -397,6 +454,7 @@ gthree_object_set_cast_shadow (GthreeObject *object,
     return;
 
   priv->cast_shadow = cast_shadow;
+  gthree_render_lists_invalidate ();
 }
 
 gboolean
@@ -419,6 +477,39 @@ gthree_object_set_receive_shadow (GthreeObject *object,
   priv->receive_shadow = receive_shadow;
 }
 
+gboolean
+gthree_object_get_is_occluder (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->is_occluder;
+}
+
+/**
+ * gthree_object_set_is_occluder:
+ * @object: a #GthreeObject
+ * @is_occluder: whether the object hides what is behind it
+ *
+ * Marks a mesh as an occluder for software occlusion culling, see
+ * gthree_renderer_set_software_occlusion_culling(). Good occluders are
+ * large, opaque and have few triangles, like walls and floors. Use
+ * gthree_mesh_set_occluder_geometry() to give a mesh a simpler shape
+ * for this.
+ */
+void
+gthree_object_set_is_occluder (GthreeObject *object,
+                               gboolean      is_occluder)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  is_occluder = !!is_occluder;
+  if (priv->is_occluder == is_occluder)
+    return;
+
+  priv->is_occluder = is_occluder;
+  invalidate_subtree_bounds (object);
+}
+
 void
 gthree_object_show (GthreeObject *object)
 {
@@ -446,6 +537,7 @@ gthree_object_set_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask = 1 << layer;
+  gthree_render_lists_invalidate ();
 }
 
 void
@@ -455,6 +547,7 @@ gthree_object_enable_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask |= 1 << layer;
+  gthree_render_lists_invalidate ();
 }
 
 void
@@ -464,6 +557,7 @@ gthree_object_disable_layer (GthreeObject *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
 
   priv->layer_mask &= ~ (1 << layer);
+  gthree_render_lists_invalidate ();
 }
 
 void
@@ -853,6 +947,7 @@ gthree_object_set_world_matrix (GthreeObject *object, const graphene_matrix_t *m
 
   priv->world_matrix = *matrix;
   priv->world_matrix_need_update = FALSE;
+  gthree_object_bounds_changed (object);
 
   // TODO: decompose matrix into position, quat, scale
 }
@@ -876,6 +971,7 @@ gthree_object_real_update_matrix_world (GthreeObject *object,
                                   &priv->world_matrix);
 
       priv->world_matrix_need_update = FALSE;
+      gthree_object_bounds_changed (object);
       force = TRUE;
     }
 
@@ -944,6 +1040,29 @@ gthree_object_get_world_matrix_floats (GthreeObject *object,
 }
 
 
+static void
+invalidate_subtree_bounds (GthreeObject *object)
+{
+  /* Ancestors of an invalid object are never valid, so we can stop early */
+  while (object != NULL && PRIV (object)->subtree_bounds_valid)
+    {
+      PRIV (object)->subtree_bounds_valid = FALSE;
+      object = PRIV (object)->parent;
+    }
+}
+
+static GthreeScene *
+get_scene (GthreeObject *object)
+{
+  while (PRIV (object)->parent != NULL)
+    object = PRIV (object)->parent;
+
+  if (GTHREE_IS_SCENE (object))
+    return GTHREE_SCENE (object);
+
+  return NULL;
+}
+
 void
 gthree_object_add_child (GthreeObject              *object,
                          GthreeObject              *child)
@@ -951,6 +1070,7 @@ gthree_object_add_child (GthreeObject              *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
   GthreeObjectPrivate *child_priv = gthree_object_get_instance_private (child);
   GthreeObject *last_child;
+  GthreeScene *scene;
   GObject *obj;
 
   if (child_priv->parent != NULL)
@@ -1001,6 +1121,13 @@ gthree_object_add_child (GthreeObject              *object,
 
   priv->age += 1;
 
+  invalidate_subtree_bounds (object);
+  gthree_render_lists_invalidate ();
+
+  scene = get_scene (object);
+  if (scene)
+    gthree_scene_bvh_add_subtree (scene, child);
+
   g_signal_emit (child, object_signals[PARENT_SET], 0, NULL);
 
   g_object_thaw_notify (obj);
@@ -1013,6 +1140,7 @@ gthree_object_remove_child (GthreeObject                 *object,
   GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
   GthreeObjectPrivate *child_priv = gthree_object_get_instance_private (child);
   GthreeObject *prev_sibling, *next_sibling;
+  GthreeScene *scene;
   GObject *obj;
 
   g_return_if_fail (GTHREE_IS_OBJECT (object));
@@ -1024,6 +1152,10 @@ gthree_object_remove_child (GthreeObject                 *object,
   obj = G_OBJECT (object);
   g_object_freeze_notify (obj);
 
+  scene = get_scene (object);
+  if (scene)
+    gthree_scene_bvh_remove_subtree (scene, child);
+
   prev_sibling = child_priv->prev_sibling;
   next_sibling = child_priv->next_sibling;
 
@@ -1042,11 +1174,15 @@ gthree_object_remove_child (GthreeObject                 *object,
   child_priv->parent = NULL;
   child_priv->prev_sibling = NULL;
   child_priv->next_sibling = NULL;
+  child_priv->lod_hidden = FALSE;
 
   priv->n_children -= 1;
 
   priv->age += 1;
 
+  invalidate_subtree_bounds (object);
+  gthree_render_lists_invalidate ();
+
   g_signal_emit (child, object_signals[PARENT_SET], 0, object);
 
   g_object_thaw_notify (obj);
@@ -1145,6 +1281,267 @@ gthree_object_destroy_all_children (GthreeObject *object)
   g_assert (priv->n_children == 0);
 }
 
+/* Gets the bounds of the object itself in object space, not including
+ * its children. Returns FALSE if it has no bounds. */
+gboolean
+gthree_object_get_bounding_sphere (GthreeObject      *object,
+                                   graphene_sphere_t *sphere)
+{
+  GthreeObjectClass *class = GTHREE_OBJECT_GET_CLASS(object);
+
+  if (class->get_bounding_sphere)
+    return class->get_bounding_sphere (object, sphere);
+
+  return FALSE;
+}
+
+gboolean
+gthree_object_has_bounds (GthreeObject *object)
+{
+  return GTHREE_OBJECT_GET_CLASS(object)->get_bounding_sphere != NULL;
+}
+
+/* Call when the world space bounds of the object may have changed */
+void
+gthree_object_bounds_changed (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->bounds_serial++;
+  invalidate_subtree_bounds (object);
+
+  if (priv->bvh_scene)
+    gthree_scene_bvh_mark_dirty (priv->bvh_scene, priv->bvh_leaf);
+}
+
+guint32
+gthree_object_get_bounds_serial (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->bounds_serial;
+}
+
+/* Geometries can't tell the objects using them that their bounds
+ * changed, so objects whose bounds come from a geometry call this from
+ * their update_matrix_world vfunc, which runs for every object in the
+ * scene every frame. Returns TRUE if the bounds changed. */
+gboolean
+gthree_object_check_geometry_bounds (GthreeObject   *object,
+                                     GthreeGeometry *geometry)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+  guint32 serial = geometry ? gthree_geometry_get_bounds_serial (geometry) : 0;
+
+  if (serial == priv->geometry_bounds_serial)
+    return FALSE;
+
+  priv->geometry_bounds_serial = serial;
+  gthree_object_bounds_changed (object);
+
+  return TRUE;
+}
+
+static void
+update_subtree_bounds (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+  GthreeObjectClass *class = GTHREE_OBJECT_GET_CLASS (object);
+  graphene_sphere_t sphere;
+  GthreeObject *child;
+
+  if (priv->subtree_bounds_valid)
+    return;
+
+  priv->subtree_empty = TRUE;
+  priv->subtree_unbounded = FALSE;
+  priv->subtree_has_lights = GTHREE_IS_LIGHT (object);
+  priv->subtree_has_occluders = priv->is_occluder;
+  priv->subtree_has_lods = GTHREE_IS_LOD (object);
+  priv->subtree_has_skins = GTHREE_IS_SKINNED_MESH (object);
+
+  if (class->get_bounding_sphere)
+    {
+      if (!priv->frustum_culled)
+        priv->subtree_unbounded = TRUE;
+      else if (class->get_bounding_sphere (object, &sphere))
+        {
+          graphene_matrix_transform_sphere (&priv->world_matrix, &sphere, &sphere);
+          graphene_sphere_get_bounding_box (&sphere, &priv->subtree_box);
+          priv->subtree_empty = FALSE;
+        }
+    }
+  else if (class->in_frustum || class->raycast)
+    {
+      /* Culled or picked by some other means, we can't tell where it is */
+      priv->subtree_unbounded = TRUE;
+    }
+
+  for (child = priv->first_child; child != NULL; child = PRIV (child)->next_sibling)
+    {
+      GthreeObjectPrivate *child_priv = PRIV (child);
+
+      update_subtree_bounds (child);
+
+      priv->subtree_unbounded |= child_priv->subtree_unbounded;
+      priv->subtree_has_lights |= child_priv->subtree_has_lights;
+      priv->subtree_has_occluders |= child_priv->subtree_has_occluders;
+      priv->subtree_has_lods |= child_priv->subtree_has_lods;
+      priv->subtree_has_skins |= child_priv->subtree_has_skins;
+
+      if (child_priv->subtree_empty)
+        continue;
+
+      if (priv->subtree_empty)
+        priv->subtree_box = child_priv->subtree_box;
+      else
+        graphene_box_union (&priv->subtree_box, &child_priv->subtree_box, &priv->subtree_box);
+      priv->subtree_empty = FALSE;
+    }
+
+  priv->subtree_bounds_valid = TRUE;
+}
+
+/* Returns FALSE if nothing the renderer draws in the subtree rooted at
+ * object can be in the frustum. Relies on up to date world matrices. */
+gboolean
+gthree_object_subtree_in_frustum (GthreeObject             *object,
+                                  const graphene_frustum_t *frustum)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  update_subtree_bounds (object);
+
+  if (priv->subtree_unbounded)
+    return TRUE;
+
+  if (priv->subtree_empty)
+    return FALSE;
+
+  return graphene_frustum_intersects_box (frustum, &priv->subtree_box);
+}
+
+/* Returns FALSE if the ray can't hit anything in the subtree rooted at object */
+gboolean
+gthree_object_subtree_intersects_ray (GthreeObject         *object,
+                                      const graphene_ray_t *ray)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  update_subtree_bounds (object);
+
+  if (priv->subtree_unbounded)
+    return TRUE;
+
+  if (priv->subtree_empty)
+    return FALSE;
+
+  return graphene_ray_intersects_box (ray, &priv->subtree_box);
+}
+
+/* Gets the world space box around everything in the subtree rooted at
+ * object, returns FALSE if there is nothing or it is unbounded */
+gboolean
+gthree_object_get_subtree_box (GthreeObject   *object,
+                               graphene_box_t *box)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  update_subtree_bounds (object);
+
+  if (priv->subtree_unbounded || priv->subtree_empty)
+    return FALSE;
+
+  *box = priv->subtree_box;
+  return TRUE;
+}
+
+gboolean
+gthree_object_subtree_has_lights (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  update_subtree_bounds (object);
+
+  return priv->subtree_has_lights;
+}
+
+gboolean
+gthree_object_subtree_has_occluders (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  update_subtree_bounds (object);
+
+  return priv->subtree_has_occluders;
+}
+
+gboolean
+gthree_object_subtree_has_lods (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  update_subtree_bounds (object);
+
+  return priv->subtree_has_lods;
+}
+
+gboolean
+gthree_object_subtree_has_skins (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  update_subtree_bounds (object);
+
+  return priv->subtree_has_skins;
+}
+
+int
+gthree_object_get_bvh_leaf (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->bvh_leaf;
+}
+
+void
+gthree_object_set_bvh_leaf (GthreeObject *object,
+                            GthreeScene  *scene,
+                            int           leaf)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->bvh_scene = scene;
+  priv->bvh_leaf = leaf;
+}
+
+guint32
+gthree_object_get_bvh_serial (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->bvh_serial;
+}
+
+gboolean
+gthree_object_get_bvh_inside (GthreeObject *object)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  return priv->bvh_inside;
+}
+
+void
+gthree_object_set_bvh_serial (GthreeObject *object,
+                              guint32       serial,
+                              gboolean      inside)
+{
+  GthreeObjectPrivate *priv = gthree_object_get_instance_private (object);
+
+  priv->bvh_serial = serial;
+  priv->bvh_inside = inside;
+}
+
 void
 gthree_object_update (GthreeObject *object,
                       GthreeRenderer *renderer)
@@ -1393,7 +1790,7 @@ _gthree_object_traverse_visible (GthreeObject                *object,
   GthreeObjectIter iter;
   GthreeObject *child;
 
-  if (!priv->visible)
+  if (!priv->visible || priv->lod_hidden)
     return TRUE;
 
   if (!callback (object, user_data))
@@ -14,6 +14,35 @@ void       gthree_object_fill_render_list (GthreeObject   *object,
 void       gthree_object_call_before_render_callback (GthreeObject   *object,
                                                       GthreeScene    *scene,
                                                       GthreeCamera   *camera);
+gboolean   gthree_object_get_bounding_sphere (GthreeObject      *object,
+                                              graphene_sphere_t *sphere);
+gboolean   gthree_object_has_bounds          (GthreeObject      *object);
+gboolean   gthree_object_get_shown           (GthreeObject      *object);
+void       gthree_object_set_lod_hidden      (GthreeObject      *object,
+                                              gboolean           hidden);
+void       gthree_object_bounds_changed      (GthreeObject      *object);
+guint32    gthree_object_get_bounds_serial   (GthreeObject      *object);
+gboolean   gthree_object_check_geometry_bounds (GthreeObject    *object,
+                                                GthreeGeometry  *geometry);
+gboolean   gthree_object_subtree_in_frustum  (GthreeObject             *object,
+                                              const graphene_frustum_t *frustum);
+gboolean   gthree_object_subtree_intersects_ray (GthreeObject         *object,
+                                                 const graphene_ray_t *ray);
+gboolean   gthree_object_get_subtree_box     (GthreeObject      *object,
+                                              graphene_box_t    *box);
+gboolean   gthree_object_subtree_has_lights  (GthreeObject      *object);
+gboolean   gthree_object_subtree_has_occluders (GthreeObject    *object);
+gboolean   gthree_object_subtree_has_lods    (GthreeObject      *object);
+gboolean   gthree_object_subtree_has_skins   (GthreeObject      *object);
+int        gthree_object_get_bvh_leaf        (GthreeObject      *object);
+void       gthree_object_set_bvh_leaf        (GthreeObject      *object,
+                                              GthreeScene       *scene,
+                                              int                leaf);
+guint32    gthree_object_get_bvh_serial      (GthreeObject      *object);
+gboolean   gthree_object_get_bvh_inside      (GthreeObject      *object);
+void       gthree_object_set_bvh_serial      (GthreeObject      *object,
+                                              guint32            serial,
+                                              gboolean           inside);
 
 G_END_DECLS
 
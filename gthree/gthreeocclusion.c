@@ -0,0 +1,300 @@
+#include <epoxy/gl.h>
+
+#include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
+
+/* Occlusion culling with temporal coherence.
+ *
+ * Every object drawn by the renderer gets a state saying whether it was
+ * hidden the last time it was tested. Hidden objects are skipped, and
+ * after the opaque pass their bounding box is drawn, without writing
+ * anything, inside a GL_ANY_SAMPLES_PASSED query. Visible objects are
+ * re-tested the same way every few frames. Results are picked up at
+ * the start of a later frame once they are available, so we never wait
+ * for the GPU, at the cost of objects appearing a frame late when they
+ * come into view.
+ */
+
+/* Visible objects are re-tested every this many frames, staggered */
+#define VISIBLE_TEST_INTERVAL 4
+
+/* States for objects that haven't been drawn in this many frames are dropped */
+#define MAX_UNSEEN_FRAMES 256
+
+typedef struct {
+  GthreeOcclusionCuller *culler;
+  GthreeObject *object; /* NULL once the object is gone */
+  GLuint query;         /* 0 unless a query is in flight */
+  guint last_seen;
+  guint stagger;
+  guint occluded : 1;
+  guint in_tests : 1;
+  guint in_pending : 1;
+} OcclusionState;
+
+struct _GthreeOcclusionCuller {
+  GHashTable *states; /* GthreeObject -> OcclusionState */
+  GPtrArray *tests;   /* States to query this frame */
+  GPtrArray *pending; /* States with a query in flight */
+  GArray *free_queries;
+  guint frame;
+  guint n_occluded;
+};
+
+static void state_weak_notify (gpointer  data,
+                               GObject  *where_the_object_was);
+
+static void
+maybe_free_state (OcclusionState *state)
+{
+  if (state->object == NULL && !state->in_tests && !state->in_pending)
+    g_free (state);
+}
+
+static void
+state_destroy (OcclusionState *state)
+{
+  if (state->object)
+    {
+      g_object_weak_unref (G_OBJECT (state->object), state_weak_notify, state);
+      state->object = NULL;
+    }
+
+  maybe_free_state (state);
+}
+
+static void
+state_weak_notify (gpointer  data,
+                   GObject  *where_the_object_was)
+{
+  OcclusionState *state = data;
+
+  g_hash_table_steal (state->culler->states, where_the_object_was);
+  state->object = NULL;
+
+  maybe_free_state (state);
+}
+
+GthreeOcclusionCuller *
+gthree_occlusion_culler_new (void)
+{
+  GthreeOcclusionCuller *culler = g_new0 (GthreeOcclusionCuller, 1);
+
+  culler->states = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)state_destroy);
+  culler->tests = g_ptr_array_new ();
+  culler->pending = g_ptr_array_new ();
+  culler->free_queries = g_array_new (FALSE, FALSE, sizeof (GLuint));
+
+  return culler;
+}
+
+/* Needs the GL context to be current */
+void
+gthree_occlusion_culler_free (GthreeOcclusionCuller *culler)
+{
+  guint i;
+
+  /* States of objects that are gone are only in these arrays */
+  for (i = 0; i < culler->tests->len; i++)
+    {
+      OcclusionState *state = g_ptr_array_index (culler->tests, i);
+
+      state->in_tests = FALSE;
+      maybe_free_state (state);
+    }
+
+  for (i = 0; i < culler->pending->len; i++)
+    {
+      OcclusionState *state = g_ptr_array_index (culler->pending, i);
+
+      g_array_append_val (culler->free_queries, state->query);
+      state->in_pending = FALSE;
+      maybe_free_state (state);
+    }
+
+  /* Frees the rest */
+  g_hash_table_unref (culler->states);
+
+  if (culler->free_queries->len > 0)
+    glDeleteQueries (culler->free_queries->len, (GLuint *)culler->free_queries->data);
+
+  g_ptr_array_unref (culler->tests);
+  g_ptr_array_unref (culler->pending);
+  g_array_unref (culler->free_queries);
+  g_free (culler);
+}
+
+static void
+collect_results (GthreeOcclusionCuller *culler)
+{
+  int i;
+
+  for (i = culler->pending->len - 1; i >= 0; i--)
+    {
+      OcclusionState *state = g_ptr_array_index (culler->pending, i);
+      GLuint available = 0, any_samples = 0;
+
+      glGetQueryObjectuiv (state->query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+        continue;
+
+      glGetQueryObjectuiv (state->query, GL_QUERY_RESULT, &any_samples);
+      state->occluded = any_samples == 0;
+
+      g_array_append_val (culler->free_queries, state->query);
+      state->query = 0;
+
+      state->in_pending = FALSE;
+      g_ptr_array_remove_index_fast (culler->pending, i);
+      maybe_free_state (state);
+    }
+}
+
+static gboolean
+is_unseen (gpointer key,
+           gpointer value,
+           gpointer user_data)
+{
+  OcclusionState *state = value;
+  GthreeOcclusionCuller *culler = user_data;
+
+  return !state->in_pending && culler->frame - state->last_seen > MAX_UNSEEN_FRAMES;
+}
+
+/* Picks up any query results that are available, call before drawing */
+void
+gthree_occlusion_culler_begin_frame (GthreeOcclusionCuller *culler)
+{
+  guint i;
+
+  culler->frame++;
+  culler->n_occluded = 0;
+
+  for (i = 0; i < culler->tests->len; i++)
+    {
+      OcclusionState *state = g_ptr_array_index (culler->tests, i);
+
+      state->in_tests = FALSE;
+      maybe_free_state (state);
+    }
+  g_ptr_array_set_size (culler->tests, 0);
+
+  collect_results (culler);
+
+  if (culler->frame % MAX_UNSEEN_FRAMES == 0)
+    g_hash_table_foreach_remove (culler->states, is_unseen, culler);
+}
+
+/* Returns TRUE if the object should be skipped this frame. This also
+ * decides which objects get tested after the opaque pass. */
+gboolean
+gthree_occlusion_culler_is_occluded (GthreeOcclusionCuller *culler,
+                                     GthreeObject          *object)
+{
+  OcclusionState *state = g_hash_table_lookup (culler->states, object);
+
+  if (state == NULL)
+    {
+      state = g_new0 (OcclusionState, 1);
+      state->culler = culler;
+      state->object = object;
+      state->last_seen = culler->frame - 1;
+      state->stagger = g_hash_table_size (culler->states);
+      g_object_weak_ref (G_OBJECT (object), state_weak_notify, state);
+      g_hash_table_insert (culler->states, object, state);
+    }
+
+  /* Objects can have several render items, only look at the first */
+  if (state->last_seen != culler->frame)
+    {
+      state->last_seen = culler->frame;
+
+      if (state->occluded)
+        culler->n_occluded++;
+
+      if (state->query == 0 &&
+          (state->occluded || (culler->frame + state->stagger) % VISIBLE_TEST_INTERVAL == 0))
+        {
+          state->in_tests = TRUE;
+          g_ptr_array_add (culler->tests, state);
+        }
+    }
+
+  return state->occluded;
+}
+
+guint
+gthree_occlusion_culler_get_n_occluded (GthreeOcclusionCuller *culler)
+{
+  return culler->n_occluded;
+}
+
+static GLuint
+get_query (GthreeOcclusionCuller *culler)
+{
+  GLuint query;
+
+  if (culler->free_queries->len == 0)
+    {
+      glGenQueries (1, &query);
+      return query;
+    }
+
+  query = g_array_index (culler->free_queries, GLuint, culler->free_queries->len - 1);
+  g_array_set_size (culler->free_queries, culler->free_queries->len - 1);
+  return query;
+}
+
+/* Issues the queries for the objects that need testing, calling
+ * draw_box to draw each bounding box. Boxes that contain the eye would
+ * be clipped by the near plane, so those objects are just assumed to be
+ * visible. Returns the number of queries issued. */
+guint
+gthree_occlusion_culler_run_tests (GthreeOcclusionCuller     *culler,
+                                   const graphene_point3d_t  *eye,
+                                   float                      near,
+                                   GthreeOcclusionDrawFunc    draw_box,
+                                   gpointer                   user_data)
+{
+  guint n_queries = 0;
+  guint i;
+
+  for (i = 0; i < culler->tests->len; i++)
+    {
+      OcclusionState *state = g_ptr_array_index (culler->tests, i);
+      graphene_sphere_t sphere;
+      graphene_box_t box, near_box;
+
+      if (state->object == NULL || state->query != 0)
+        continue;
+
+      if (!gthree_object_get_bounding_sphere (state->object, &sphere))
+        {
+          state->occluded = FALSE;
+          continue;
+        }
+
+      graphene_matrix_transform_sphere (gthree_object_get_world_matrix (state->object), &sphere, &sphere);
+      graphene_sphere_get_bounding_box (&sphere, &box);
+
+      /* The corners of the near plane are further away than near, how much
+       * depends on the field of view, so be generous. */
+      graphene_box_expand_scalar (&box, 4 * near, &near_box);
+      if (graphene_box_contains_point (&near_box, eye))
+        {
+          state->occluded = FALSE;
+          continue;
+        }
+
+      state->query = get_query (culler);
+      glBeginQuery (GL_ANY_SAMPLES_PASSED, state->query);
+      draw_box (&box, user_data);
+      glEndQuery (GL_ANY_SAMPLES_PASSED);
+
+      state->in_pending = TRUE;
+      g_ptr_array_add (culler->pending, state);
+      n_queries++;
+    }
+
+  return n_queries;
+}
@@ -43,6 +43,7 @@ static float f0 = 0.0;
 static float f1 = 1.0;
 static float f1000 = 1000.0;
 static float zerov2[2] = { 0, 0 };
+static float unit_rect[4] = { 0, 0, 1, 1 };
 
 static GthreeUniformsDefinition light_uniforms[] = {
   {"position", GTHREE_UNIFORM_TYPE_VECTOR3, &zerov3},
@@ -55,6 +56,7 @@ static GthreeUniformsDefinition light_uniforms[] = {
   {"shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2, &zerov2 },
   {"shadowCameraNear", GTHREE_UNIFORM_TYPE_FLOAT, &f1 },
   {"shadowCameraFar", GTHREE_UNIFORM_TYPE_FLOAT, &f1000 },
+  {"shadowMapRect", GTHREE_UNIFORM_TYPE_VECTOR4, &unit_rect },
 };
 
 static void
@@ -117,21 +119,21 @@ gthree_point_light_real_setup (GthreeLight *light,
       GthreeLightShadow *shadow = gthree_light_get_shadow (light);
       GthreeCamera *shadow_camera = gthree_light_shadow_get_camera (shadow);
       graphene_vec2_t size;
+      graphene_vec4_t rect;
 
       gthree_uniforms_set_float (priv->uniforms, "shadowBias", gthree_light_shadow_get_bias (shadow));
       gthree_uniforms_set_float (priv->uniforms, "shadowRadius", gthree_light_shadow_get_radius (shadow));
 
-      graphene_vec2_init (&size,
-                          gthree_light_shadow_get_map_width (shadow),
-                          gthree_light_shadow_get_map_height (shadow));
+      gthree_light_shadow_get_map_info (shadow, &size, &rect);
       gthree_uniforms_set_vec2 (priv->uniforms, "shadowMapSize", &size);
+      gthree_uniforms_set_vec4 (priv->uniforms, "shadowMapRect", &rect);
 
       gthree_uniforms_set_float (priv->uniforms, "shadowCameraNear", gthree_camera_get_near (shadow_camera));
       gthree_uniforms_set_float (priv->uniforms, "shadowCameraFar", gthree_camera_get_far (shadow_camera));
 
       GthreeRenderTarget *shadow_map = gthree_light_shadow_get_map (shadow);
       if (shadow_map)
-        shadow_map_texture = gthree_render_target_get_texture (shadow_map);
+        shadow_map_texture = gthree_render_target_get_output_texture (shadow_map);
 
       shadow_matrix = *gthree_light_shadow_get_matrix (shadow);
     }
@@ -90,6 +90,20 @@ gthree_points_fill_render_list (GthreeObject   *object,
   gthree_geometry_fill_render_list (priv->geometry, list, priv->material, NULL, object);
 }
 
+static gboolean
+gthree_points_get_bounding_sphere (GthreeObject      *object,
+                                   graphene_sphere_t *sphere)
+{
+  GthreePoints *points = GTHREE_POINTS (object);
+  GthreePointsPrivate *priv = gthree_points_get_instance_private (points);
+
+  if (!priv->geometry)
+    return FALSE;
+
+  *sphere = *gthree_geometry_get_bounding_sphere (priv->geometry);
+  return TRUE;
+}
+
 static gboolean
 gthree_points_in_frustum (GthreeObject *object,
                           const graphene_frustum_t *frustum)
@@ -121,6 +135,8 @@ gthree_points_set_property (GObject *obj,
     {
      case PROP_GEOMETRY:
       g_set_object (&priv->geometry, g_value_get_object (value));
+      gthree_object_bounds_changed (GTHREE_OBJECT (points));
+      gthree_render_lists_invalidate ();
       break;
 
    case PROP_MATERIAL:
@@ -171,6 +187,7 @@ gthree_points_set_material (GthreePoints *points,
   GthreePointsPrivate *priv = gthree_points_get_instance_private (points);
 
   g_set_object (&priv->material, material);
+  gthree_render_lists_invalidate ();
 }
 
 
@@ -182,6 +199,19 @@ gthree_points_get_geometry (GthreePoints *points)
   return priv->geometry;
 }
 
+static gboolean
+gthree_points_update_matrix_world (GthreeObject *object,
+                                   gboolean      force)
+{
+  GthreePoints *points = GTHREE_POINTS (object);
+  GthreePointsPrivate *priv = gthree_points_get_instance_private (points);
+
+  force = GTHREE_OBJECT_CLASS (gthree_points_parent_class)->update_matrix_world (object, force);
+  gthree_object_check_geometry_bounds (object, priv->geometry);
+
+  return force;
+}
+
 static void
 gthree_points_class_init (GthreePointsClass *klass)
 {
@@ -193,6 +223,8 @@ gthree_points_class_init (GthreePointsClass *klass)
   gobject_class->finalize = gthree_points_finalize;
 
   object_class->in_frustum = gthree_points_in_frustum;
+  object_class->get_bounding_sphere = gthree_points_get_bounding_sphere;
+  object_class->update_matrix_world = gthree_points_update_matrix_world;
   object_class->update = gthree_points_update;
   object_class->fill_render_list = gthree_points_fill_render_list;
 
@@ -7,6 +7,7 @@
 #include <gthree/gthreeinterpolant.h>
 #include <gthree/gthreekeyframetrack.h>
 #include <gthree/gthreerendertarget.h>
+#include <gthree/gthreerenderer.h>
 #include <gthree/gthreemesh.h>
 #include <gthree/gthreesprite.h>
 #include <gthree/gthreelightshadow.h>
@@ -25,8 +26,19 @@ typedef struct {
   guint8 num_shadow;
   guint8 num_hemi;
   guint8 obj_receive_shadow;
+  guint8 clustered;
+  guint8 max_object_lights;
+  guint8 num_point_shadow; /* Only counted with max_object_lights */
+  guint8 num_spot_shadow;
+  guint8 shadow_cascades;
+  guint8 shadow_atlas;
+  guint8 shadow_map_type;
 } GthreeLightSetupHash;
 
+/* Directional light shadows can have up to this many cascades, see
+ * gthree_directional_light_shadow_set_n_cascades() */
+#define GTHREE_MAX_SHADOW_CASCADES 4
+
 struct _GthreeLightSetup
 {
   graphene_vec3_t ambient;
@@ -35,6 +47,7 @@ struct _GthreeLightSetup
   GPtrArray *directional;
   GPtrArray *directional_shadow_map;
   GArray *directional_shadow_map_matrix;
+  GArray *directional_shadow_cascade_matrix; /* GTHREE_MAX_SHADOW_CASCADES per light */
   GPtrArray *point;
   GPtrArray *point_shadow_map;
   GArray *point_shadow_map_matrix;
@@ -44,6 +57,10 @@ struct _GthreeLightSetup
   GPtrArray *shadow;
   GPtrArray *hemi;
 
+  float cluster_params[4];
+
+  GthreeTexture *shadow_atlas; /* Not owned */
+
   GthreeLightSetupHash hash;
 };
 
@@ -55,6 +72,9 @@ struct _GthreeMaterialProperties
   GthreeLightSetupHash light_hash;
   guint num_clipping_planes;
   guint num_intersection;
+  guint program_id; /* Safe to read even when not valid, used for sorting */
+  guint instancing : 1;
+  guint instancing_color : 1;
 };
 
 struct  _GthreeProgramParameters {
@@ -95,11 +115,16 @@ struct  _GthreeProgramParameters {
   guint use_vertex_texture : 1;
   guint morph_targets : 1;
   guint morph_normals : 1;
+  guint instancing : 1;
+  guint instancing_color : 1;
   guint premultiplied_alpha : 1;
   guint shadow_map_enabled : 1;
   guint shadow_map_type : 2;
   guint tone_mapping : 1;
   guint physically_correct_lights : 1;
+  guint clustered_lights : 1;
+  guint shadow_cascades : 1;
+  guint shadow_atlas : 1;
   guint double_sided : 1;
   guint flip_sided : 1;
   guint depth_packing : 2;
@@ -114,6 +139,9 @@ struct  _GthreeProgramParameters {
   guint16 num_spot_lights;
   guint16 num_hemi_lights;
   guint16 num_rect_area_lights;
+  guint16 num_point_light_shadows;
+  guint16 num_spot_light_shadows;
+  guint16 max_object_lights;
 
   guint16 num_clipping_planes;
   guint16 num_clip_intersection;
@@ -122,6 +150,9 @@ struct  _GthreeProgramParameters {
 
 gboolean gthree_uniform_is_array (GthreeUniform *uniform);
 GthreeUniform *gthree_uniform_newq (GQuark name, GthreeUniformType type);
+gsize gthree_uniform_pack_std140 (GthreeUniform *uniform,
+                                  GByteArray    *data,
+                                  gsize          offset);
 
 GthreeRenderList *gthree_render_list_new ();
 void gthree_render_list_free (GthreeRenderList *list);
@@ -132,6 +163,141 @@ void gthree_render_list_push (GthreeRenderList *list,
                               GthreeMaterial *material,
                               GthreeGeometryGroup *group);
 void gthree_render_list_sort (GthreeRenderList *list);
+guint32 gthree_render_lists_get_serial (void);
+void gthree_render_lists_invalidate (void);
+
+GHashTable *gthree_shader_get_expanded_text_cache (GthreeShader *shader);
+
+typedef struct _GthreeBvh GthreeBvh;
+typedef void (*GthreeBvhFunc) (int      leaf,
+                               gpointer data,
+                               gpointer user_data);
+/* inside is TRUE if the leaf's box is entirely in the frustum */
+typedef void (*GthreeBvhFrustumFunc) (int      leaf,
+                                      gpointer data,
+                                      gboolean inside,
+                                      gpointer user_data);
+
+GthreeBvh *gthree_bvh_new (void);
+void gthree_bvh_free (GthreeBvh *bvh);
+guint gthree_bvh_get_n_leaves (GthreeBvh *bvh);
+int gthree_bvh_insert (GthreeBvh            *bvh,
+                       const graphene_box_t *box,
+                       gpointer              data);
+void gthree_bvh_remove (GthreeBvh *bvh,
+                        int        leaf);
+gboolean gthree_bvh_move (GthreeBvh            *bvh,
+                          int                   leaf,
+                          const graphene_box_t *box);
+void gthree_bvh_mark_dirty (GthreeBvh *bvh,
+                            int        leaf);
+void gthree_bvh_foreach_dirty (GthreeBvh     *bvh,
+                               GthreeBvhFunc  func,
+                               gpointer       user_data);
+void gthree_bvh_query_frustum (GthreeBvh                *bvh,
+                               const graphene_frustum_t *frustum,
+                               GthreeBvhFrustumFunc      func,
+                               gpointer                  user_data);
+
+void gthree_scene_bvh_add_subtree (GthreeScene  *scene,
+                                   GthreeObject *object);
+void gthree_scene_bvh_remove_subtree (GthreeScene  *scene,
+                                      GthreeObject *object);
+void gthree_scene_bvh_mark_dirty (GthreeScene *scene,
+                                  int          leaf);
+guint32 gthree_scene_bvh_cull (GthreeScene              *scene,
+                               const graphene_frustum_t *frustum);
+
+typedef struct _GthreeDepthCuller GthreeDepthCuller;
+
+GthreeDepthCuller *gthree_depth_culler_new (void);
+void gthree_depth_culler_free (GthreeDepthCuller *culler);
+void gthree_depth_culler_begin (GthreeDepthCuller       *culler,
+                                const graphene_matrix_t *view_projection,
+                                float                    aspect);
+void gthree_depth_culler_add_geometry (GthreeDepthCuller       *culler,
+                                       const graphene_matrix_t *world_matrix,
+                                       GthreeGeometry          *geometry);
+guint gthree_depth_culler_get_n_triangles (GthreeDepthCuller *culler);
+void gthree_depth_culler_rasterize (GthreeDepthCuller *culler);
+gboolean gthree_depth_culler_test_box (GthreeDepthCuller    *culler,
+                                      const graphene_box_t *box);
+
+#define GTHREE_CLUSTER_GRID_X 16
+#define GTHREE_CLUSTER_GRID_Y 9
+#define GTHREE_CLUSTER_GRID_Z 24
+#define GTHREE_CLUSTER_INDEX_WIDTH 1024
+#define GTHREE_CLUSTER_N_TEXTURES 3
+
+typedef struct _GthreeLightClusters GthreeLightClusters;
+
+GthreeLightClusters *gthree_light_clusters_new (void);
+void gthree_light_clusters_free (GthreeLightClusters *clusters);
+void gthree_light_clusters_begin (GthreeLightClusters *clusters,
+                                  GthreeCamera        *camera,
+                                  float                params[4]);
+gboolean gthree_light_clusters_add_light (GthreeLightClusters *clusters,
+                                          GthreeLight         *light,
+                                          GthreeCamera        *camera);
+guint gthree_light_clusters_get_n_lights (GthreeLightClusters *clusters);
+void gthree_light_clusters_update (GthreeLightClusters *clusters,
+                                   guint                first_unit);
+
+typedef struct _GthreeOcclusionCuller GthreeOcclusionCuller;
+
+typedef void (*GthreeOcclusionDrawFunc) (const graphene_box_t *box,
+                                         gpointer              user_data);
+
+GthreeOcclusionCuller *gthree_occlusion_culler_new (void);
+void gthree_occlusion_culler_free (GthreeOcclusionCuller *culler);
+void gthree_occlusion_culler_begin_frame (GthreeOcclusionCuller *culler);
+gboolean gthree_occlusion_culler_is_occluded (GthreeOcclusionCuller *culler,
+                                             GthreeObject          *object);
+guint gthree_occlusion_culler_get_n_occluded (GthreeOcclusionCuller *culler);
+guint gthree_occlusion_culler_run_tests (GthreeOcclusionCuller    *culler,
+                                        const graphene_point3d_t *eye,
+                                        float                     near,
+                                        GthreeOcclusionDrawFunc   draw_box,
+                                        gpointer                  user_data);
+
+typedef struct _GthreeGpuTimer GthreeGpuTimer;
+
+GthreeGpuTimer *gthree_gpu_timer_new (void);
+void gthree_gpu_timer_free (GthreeGpuTimer *timer);
+int gthree_gpu_timer_get_depth (GthreeGpuTimer *timer);
+void gthree_gpu_timer_push (GthreeGpuTimer *timer,
+                            const char     *name);
+gboolean gthree_gpu_timer_pop (GthreeGpuTimer *timer);
+const GthreeGpuTiming *gthree_gpu_timer_get_timings (GthreeGpuTimer *timer,
+                                                     guint          *n_timings);
+
+guint gthree_program_get_id (GthreeProgram *program);
+gboolean gthree_program_is_ready (GthreeProgram *program);
+void        gthree_program_cache_set_binary_dir   (GthreeProgramCache *cache,
+                                                   const char         *dir);
+const char *gthree_program_cache_get_binary_dir   (GthreeProgramCache *cache);
+void        gthree_program_cache_get_binary_stats (GthreeProgramCache *cache,
+                                                   guint              *hits,
+                                                   guint              *misses,
+                                                   guint              *stale);
+void        gthree_program_cache_set_material_program (GthreeProgramCache *cache,
+                                                       GthreeMaterial     *material,
+                                                       GthreeProgram      *program);
+void        gthree_program_cache_trim             (GthreeProgramCache *cache,
+                                                   gboolean            parallel_compile);
+void        gthree_program_cache_set_max_unused   (GthreeProgramCache *cache,
+                                                   guint               max_unused);
+guint       gthree_program_cache_get_max_unused   (GthreeProgramCache *cache);
+void        gthree_program_cache_get_stats        (GthreeProgramCache *cache,
+                                                   guint              *n_programs,
+                                                   guint              *n_unused,
+                                                   guint              *n_evicted,
+                                                   gint64             *source_time,
+                                                   gint64             *compile_time);
+gboolean gthree_program_update_uniform_value (GthreeProgram *program,
+                                              gint           location,
+                                              gconstpointer  value,
+                                              gsize          size);
 
 guint32 gthree_renderer_get_resource_id (GthreeRenderer *renderer);
 void gthree_renderer_mark_realized (GthreeRenderer *renderer,
@@ -145,6 +311,15 @@ void gthree_resource_mark_clean_for (GthreeResource *resource,
                                      GthreeRenderer *renderer);
 
 guint gthree_renderer_allocate_texture_unit (GthreeRenderer *renderer);
+gboolean gthree_renderer_update_uniform_value (GthreeRenderer *renderer,
+                                               gint            location,
+                                               gconstpointer   value,
+                                               gsize           size);
+void gthree_renderer_count_buffer_upload (GthreeRenderer *renderer,
+                                          gsize           bytes);
+void gthree_renderer_count_texture_upload (GthreeRenderer *renderer,
+                                           gsize           bytes);
+void gthree_renderer_count_texture_bind (GthreeRenderer *renderer);
 
 int gthree_texture_get_internal_gl_format (guint gl_format,
                                            guint gl_type);
@@ -182,6 +357,7 @@ guint gthree_render_target_get_gl_framebuffer (GthreeRenderTarget *target,
 void gthree_render_target_realize (GthreeRenderTarget *target,
                                    GthreeRenderer *renderer);
 const graphene_rect_t * gthree_render_target_get_viewport (GthreeRenderTarget *target);
+GthreeTexture *gthree_render_target_get_output_texture (GthreeRenderTarget *target);
 
 
 GthreeGeometry *gthree_geometry_parse_json (JsonObject *object);
@@ -192,6 +368,12 @@ void gthree_geometry_fill_render_list (GthreeGeometry   *geometry,
                                        GthreeMaterial   *material,
                                        GPtrArray        *materials,
                                        GthreeObject     *object);
+guint gthree_geometry_get_layout_serial (GthreeGeometry   *geometry);
+guint gthree_geometry_get_shape_serial  (GthreeGeometry   *geometry);
+guint gthree_geometry_get_bounds_serial (GthreeGeometry   *geometry);
+guint gthree_geometry_get_id            (GthreeGeometry   *geometry);
+GthreeGeometry *gthree_geometry_new_with_shared_attributes (GthreeGeometry  *geometry,
+                                                            GthreeAttribute *index);
 
 gboolean gthree_light_setup_hash_equal (GthreeLightSetupHash *a,
                                         GthreeLightSetupHash *b);
@@ -213,13 +395,61 @@ void gthree_light_shadow_set_map (GthreeLightShadow *shadow,
                                   GthreeRenderTarget *map);
 graphene_matrix_t * gthree_light_shadow_get_matrix (GthreeLightShadow *shadow);
 
+/* An object drawn into a shadow map, and the state it was drawn in.
+ * Compared with memcmp(), so initialize all of it */
+typedef struct {
+  GthreeObject *object;    /* NULL separates the faces of point lights */
+  GthreeMaterial *material;
+  guint32 bounds_serial;   /* From gthree_object_get_bounds_serial() */
+  guint32 shape_serial;    /* From gthree_geometry_get_shape_serial() */
+  guint32 material_serial; /* From gthree_material_get_serial() */
+  guint32 padding;         /* Named, so initializers zero it for memcmp() */
+} GthreeShadowCaster;
+
+void gthree_light_shadow_invalidate_cache (GthreeLightShadow *shadow);
+gboolean gthree_light_shadow_update_cache (GthreeLightShadow       *shadow,
+                                           const graphene_matrix_t *projection,
+                                           GArray                  *casters);
+void gthree_light_shadow_set_atlas_region (GthreeLightShadow  *shadow,
+                                           GthreeRenderTarget *atlas,
+                                           int                 x,
+                                           int                 y,
+                                           int                 width,
+                                           int                 height,
+                                           float               scale);
+gboolean gthree_light_shadow_get_atlas_region (GthreeLightShadow *shadow,
+                                               int               *x,
+                                               int               *y,
+                                               float             *scale);
+void gthree_light_shadow_get_map_info (GthreeLightShadow *shadow,
+                                       graphene_vec2_t   *size,
+                                       graphene_vec4_t   *rect);
+
 GthreeDirectionalLightShadow *gthree_directional_light_shadow_new (void);
+gboolean gthree_directional_light_shadow_update_cascades (GthreeDirectionalLightShadow *shadow,
+                                                          GthreeCamera                 *camera,
+                                                          int                           tile_width,
+                                                          int                           tile_height);
+void gthree_directional_light_shadow_update_matrices (GthreeDirectionalLightShadow *shadow);
+void gthree_directional_light_shadow_set_cascade (GthreeDirectionalLightShadow *shadow,
+                                                  int                           cascade);
+void gthree_directional_light_shadow_get_cascade_tile (GthreeDirectionalLightShadow *shadow,
+                                                       int                           cascade,
+                                                       int                          *x,
+                                                       int                          *y);
+void gthree_directional_light_shadow_get_atlas_size (GthreeDirectionalLightShadow *shadow,
+                                                     int                          *columns,
+                                                     int                          *rows);
+const graphene_matrix_t *gthree_directional_light_shadow_get_cascade_matrix (GthreeDirectionalLightShadow *shadow,
+                                                                             int                           cascade);
 
 GthreeSpotLightShadow *gthree_spot_light_shadow_new (void);
 void gthree_spot_light_shadow_update (GthreeSpotLightShadow *shadow,
                                       GthreeSpotLight *light);
 
 GthreeMaterialProperties *gthree_material_get_properties   (GthreeMaterial *material);
+guint                     gthree_material_get_id           (GthreeMaterial *material);
+guint                     gthree_material_get_serial       (GthreeMaterial *material);
 void                      gthree_material_mark_valid_for   (GthreeMaterial *material,
                                                             guint32         renderer_id);
 gboolean                  gthree_material_is_valid_for     (GthreeMaterial *material,
@@ -238,6 +468,13 @@ int gthree_attribute_get_gl_buffer            (GthreeAttribute *attribute,
 int gthree_attribute_get_gl_type              (GthreeAttribute *attribute);
 int gthree_attribute_get_gl_bytes_per_element (GthreeAttribute *attribute);
 
+/* Changes whenever the gl buffer or layout of the attribute changes,
+ * used to know when a vertex array object pointing to it is stale. */
+guint gthree_attribute_get_layout_serial      (GthreeAttribute *attribute);
+guint gthree_layout_serial_next               (void);
+/* Changes whenever the data of the attribute is changed or replaced */
+guint gthree_attribute_get_content_serial     (GthreeAttribute *attribute);
+
 GthreeInterpolant *gthree_interpolant_create (GType type,
                                               GthreeAttributeArray *parameter_positions,
                                               GthreeAttributeArray *sample_values);
@@ -318,8 +555,18 @@ typedef enum {
   GTHREE_RESOURCE_KIND_BUFFER,
   GTHREE_RESOURCE_KIND_FRAMEBUFFER,
   GTHREE_RESOURCE_KIND_RENDERBUFFER,
+  GTHREE_RESOURCE_KIND_VERTEX_ARRAY,
 } GthreeResourceKind;
 
+/* Binding points of the uniform blocks shared by all programs */
+typedef enum {
+  GTHREE_UNIFORM_BLOCK_CAMERA,
+  GTHREE_UNIFORM_BLOCK_LIGHTS,
+  GTHREE_UNIFORM_BLOCK_FOG,
+
+  GTHREE_UNIFORM_BLOCK_N_BLOCKS
+} GthreeUniformBlock;
+
 void gthree_renderer_lazy_delete (GthreeRenderer *renderer,
                                   GthreeResourceKind kind,
                                   guint             id);
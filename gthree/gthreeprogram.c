@@ -1,5 +1,7 @@
 #include <math.h>
+#include <errno.h>
 #include <epoxy/gl.h>
+#include <glib/gstdio.h>
 
 #include "gthreeprogram.h"
 #include "gthreeuniforms.h"
@@ -7,11 +9,36 @@
 #include "gthreerenderer.h"
 #include "gthreeprivate.h"
 
+/* Don't shadow uniforms at silly locations some drivers might hand out */
+#define MAX_SHADOWED_UNIFORM_LOCATION 4096
+
+typedef struct {
+  guint8 *data;
+  gsize size;
+} GthreeUniformValue;
+
 typedef struct {
   GHashTable *uniform_locations;
   GHashTable *attribute_locations;
+  /* Last value uploaded to each uniform location, indexed by location */
+  GthreeUniformValue *uniform_values;
+  int n_uniform_values;
 
   GLuint gl_program;
+  guint id;
+
+  /* Set until the link result has been checked, see gthree_program_finish_link() */
+  gboolean link_pending;
+  GLuint vertex_shader;
+  GLuint fragment_shader;
+  char *binary_path;
+  gint64 source_time;
+  gint64 compile_time;
+
+  /* Number of materials using this program, when it drops to zero the
+     program is put in the cache's unused queue */
+  guint n_users;
+  GList unused_link;
 
   /* Cache keys: */
   GthreeProgramCache *cache;
@@ -22,9 +49,33 @@ typedef struct {
 struct _GthreeProgramCache
 {
     GHashTable *hash;
+
+    /* On-disk cache of linked program binaries */
+    char *binary_dir;
+    char *binary_salt;
+    int binary_supported; /* -1 == not yet checked */
+    guint binary_hits;
+    guint binary_misses;
+    guint binary_stale;
+
+    /* Which program each material was last initialized with */
+    GHashTable *material_programs;
+    /* Programs without users, least recently used first */
+    GQueue unused;
+    guint max_unused;
+    guint n_evicted;
+    gint64 source_time;
+    gint64 compile_time;
 };
 
+#define DEFAULT_MAX_UNUSED_PROGRAMS 32
+
+/* Program binary files start with these two 32bit values, then the binary */
+#define PROGRAM_BINARY_MAGIC 0x42505447 /* "GTPB" */
+#define PROGRAM_BINARY_HEADER_SIZE (2 * sizeof (guint32))
+
 static void gthree_program_cache_remove (GthreeProgramCache *cache, GthreeProgram *program);
+static void gthree_program_finish_link (GthreeProgram *program);
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeProgram, gthree_program, G_TYPE_OBJECT);
 
@@ -38,6 +89,25 @@ precision_to_string (GthreePrecision prec)
   return "highp";
 }
 
+/* Shared by all programs, the renderer fills it in when the camera changes */
+static const char *camera_block =
+  "layout(std140) uniform GthreeCamera {\n"
+  "	mat4 projectionMatrix;\n"
+  "	mat4 viewMatrix;\n"
+  "	vec3 cameraPosition;\n"
+  "};\n";
+
+static void
+bind_uniform_block (GLuint              gl_program,
+                    const char         *name,
+                    GthreeUniformBlock  block)
+{
+  GLuint index = glGetUniformBlockIndex (gl_program, name);
+
+  if (index != GL_INVALID_INDEX)
+    glUniformBlockBinding (gl_program, index, block);
+}
+
 static const char *
 get_vertex_type_name (int type)
 {
@@ -57,11 +127,18 @@ GLuint
 create_shader (int type, const char *code)
 {
   GLuint shader = glCreateShader (type);
-  GLint status;
 
   glShaderSource (shader, 1, &code, NULL);
   glCompileShader (shader);
 
+  return shader;
+}
+
+static void
+check_shader (GLuint shader, int type)
+{
+  GLint status;
+
   glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
   if (status == GL_FALSE)
     {
@@ -79,7 +156,118 @@ create_shader (int type, const char *code)
       g_free (buffer);
     }
 
-  return shader;
+}
+
+static gboolean
+program_binary_supported (GthreeProgramCache *cache)
+{
+  if (cache->binary_supported == -1)
+    {
+      GLint n_formats = 0;
+
+      if ((epoxy_is_desktop_gl () && epoxy_gl_version () >= 41) ||
+          (!epoxy_is_desktop_gl () && epoxy_gl_version () >= 30) ||
+          epoxy_has_gl_extension ("GL_ARB_get_program_binary"))
+        glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &n_formats);
+
+      cache->binary_supported = n_formats > 0;
+      cache->binary_salt = g_strdup_printf ("%s\n%s\n%s",
+                                            (const char *)glGetString (GL_VENDOR),
+                                            (const char *)glGetString (GL_RENDERER),
+                                            (const char *)glGetString (GL_VERSION));
+    }
+
+  return cache->binary_supported;
+}
+
+/* The binary depends on the exact source and on the driver that compiled it */
+static char *
+program_binary_path (GthreeProgramCache *cache,
+                     const char         *vertex,
+                     const char         *fragment,
+                     const char         *index0_attribute_name)
+{
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *filename = NULL;
+
+  g_checksum_update (checksum, (const guchar *)cache->binary_salt, strlen (cache->binary_salt) + 1);
+  g_checksum_update (checksum, (const guchar *)vertex, strlen (vertex) + 1);
+  g_checksum_update (checksum, (const guchar *)fragment, strlen (fragment) + 1);
+  if (index0_attribute_name)
+    g_checksum_update (checksum, (const guchar *)index0_attribute_name, -1);
+
+  filename = g_strconcat (g_checksum_get_string (checksum), ".bin", NULL);
+  g_checksum_free (checksum);
+
+  return g_build_filename (cache->binary_dir, filename, NULL);
+}
+
+static gboolean
+load_program_binary (GthreeProgramCache *cache,
+                     GLuint              gl_program,
+                     const char         *path)
+{
+  g_autofree char *data = NULL;
+  gsize len;
+  guint32 header[2];
+  GLint status;
+
+  if (!g_file_get_contents (path, &data, &len, NULL))
+    {
+      cache->binary_misses++;
+      return FALSE;
+    }
+
+  if (len > PROGRAM_BINARY_HEADER_SIZE)
+    {
+      memcpy (header, data, PROGRAM_BINARY_HEADER_SIZE);
+      if (header[0] == PROGRAM_BINARY_MAGIC)
+        {
+          glProgramBinary (gl_program, header[1],
+                           data + PROGRAM_BINARY_HEADER_SIZE, len - PROGRAM_BINARY_HEADER_SIZE);
+          glGetProgramiv (gl_program, GL_LINK_STATUS, &status);
+          if (status == GL_TRUE)
+            {
+              cache->binary_hits++;
+              return TRUE;
+            }
+        }
+    }
+
+  /* Corrupt, or rejected by the driver. Drop it, it gets rewritten once
+     the program is linked from source */
+  cache->binary_stale++;
+  g_unlink (path);
+
+  return FALSE;
+}
+
+static void
+save_program_binary (GthreeProgramCache *cache,
+                     GLuint              gl_program,
+                     const char         *path)
+{
+  g_autofree char *data = NULL;
+  g_autoptr(GError) error = NULL;
+  GLint len = 0;
+  GLenum format;
+  guint32 header[2];
+
+  glGetProgramiv (gl_program, GL_PROGRAM_BINARY_LENGTH, &len);
+  if (len <= 0)
+    return;
+
+  data = g_malloc (PROGRAM_BINARY_HEADER_SIZE + len);
+  glGetProgramBinary (gl_program, len, &len, &format, data + PROGRAM_BINARY_HEADER_SIZE);
+
+  header[0] = PROGRAM_BINARY_MAGIC;
+  header[1] = format;
+  memcpy (data, header, PROGRAM_BINARY_HEADER_SIZE);
+
+  if (g_mkdir_with_parents (cache->binary_dir, 0755) != 0 ||
+      !g_file_set_contents (path, data, PROGRAM_BINARY_HEADER_SIZE + len, &error))
+    g_warning ("Failed to write program binary cache %s: %s\n", path,
+               error ? error->message : g_strerror (errno));
 }
 
 static void
@@ -104,8 +292,11 @@ get_uniform_locations (GthreeProgram *program)
 {
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
   GLint n, i, max_len;
+  int max_location = -1;
   char *buffer;
 
+  gthree_program_finish_link (program);
+
   priv->uniform_locations = g_hash_table_new (g_direct_hash, g_direct_equal);
 
   glGetProgramiv (priv->gl_program,  GL_ACTIVE_UNIFORM_MAX_LENGTH,  &max_len);
@@ -125,7 +316,13 @@ get_uniform_locations (GthreeProgram *program)
       location = glGetUniformLocation (priv->gl_program, buffer);
       g_hash_table_insert (priv->uniform_locations,
                            GINT_TO_POINTER (g_quark_from_string (buffer)), GINT_TO_POINTER (location));
+
+      if (location < MAX_SHADOWED_UNIFORM_LOCATION)
+        max_location = MAX (max_location, location);
     }
+
+  priv->n_uniform_values = max_location + 1;
+  priv->uniform_values = g_new0 (GthreeUniformValue, priv->n_uniform_values);
 }
 
 static void
@@ -133,18 +330,27 @@ string_replace (GString *string,
                 const gchar *find,
                 const gchar *replace)
 {
-  const gchar *at;
-  gssize pos;
+  g_autoptr(GString) res = NULL;
+  gsize find_len = strlen (find);
+  const gchar *start, *at;
 
   at = strstr (string->str, find);
+  if (at == NULL)
+    return;
+
+  /* Build the result in one pass rather than erasing and inserting in place */
+  res = g_string_sized_new (string->len);
+  start = string->str;
   while (at != NULL)
     {
-      pos = at - string->str;
-      g_string_erase (string, pos, strlen (find));
-      g_string_insert (string, pos, replace);
-
-      at = strstr (string->str, find);
+      g_string_append_len (res, start, at - start);
+      g_string_append (res, replace);
+      start = at + find_len;
+      at = strstr (start, find);
     }
+  g_string_append (res, start);
+
+  g_string_assign (string, res->str);
 }
 
 static void
@@ -165,6 +371,8 @@ replace_light_nums (GString *str, GthreeProgramParameters *parameters)
   string_replace_i (str, "NUM_RECT_AREA_LIGHTS", parameters->num_rect_area_lights);
   string_replace_i (str, "NUM_POINT_LIGHTS", parameters->num_point_lights);
   string_replace_i (str, "NUM_HEMI_LIGHTS", parameters->num_hemi_lights);
+  string_replace_i (str, "NUM_POINT_LIGHT_SHADOWS", parameters->num_point_light_shadows);
+  string_replace_i (str, "NUM_SPOT_LIGHT_SHADOWS", parameters->num_spot_light_shadows);
 }
 
 static void
@@ -194,6 +402,7 @@ unroll_replace_cb (const GMatchInfo *info,
       g_autofree char *i_s = g_strdup_printf ("[ %d ]", i);
 
       string_replace (s, "[ i ]", i_s);
+      string_replace_i (s, "UNROLLED_LOOP_INDEX", i);
       g_string_append (res, s->str);
     }
 
@@ -203,7 +412,13 @@ unroll_replace_cb (const GMatchInfo *info,
 static char *
 unroll_loops (GString *str)
 {
-  g_autoptr(GRegex) regex = g_regex_new ("#pragma unroll_loop[\\s]+?for \\( int i \\= (\\d+)\\; i < (\\d+)\\; i \\+\\+ \\) \\{([\\s\\S]+?)(?=\\})\\}", 0, 0, NULL);
+  static GRegex *regex = NULL;
+
+  if (strstr (str->str, "#pragma unroll_loop") == NULL)
+    return g_strndup (str->str, str->len);
+
+  if (regex == NULL)
+    regex = g_regex_new ("#pragma unroll_loop[\\s]+?for \\( int i \\= (\\d+)\\; i < (\\d+)\\; i \\+\\+ \\) \\{([\\s\\S]+?)(?=\\})\\}", G_REGEX_OPTIMIZE, 0, NULL);
 
   return g_regex_replace_eval (regex, str->str, str->len, 0, 0, unroll_replace_cb, NULL, NULL);
 }
@@ -284,6 +499,50 @@ parse_text_with_includes (const char *text)
   return g_string_free (s, FALSE);
 }
 
+/* Resolves includes, substitutes the light and clipping plane counts
+ * and unrolls loops in a shader body. The result only depends on
+ * those counts, so it is cached on the shader and building another
+ * permutation is just a matter of prepending the defines. */
+static const char *
+get_expanded_text (GthreeShader            *shader,
+                   char                     stage,
+                   const char              *text,
+                   GthreeProgramParameters *parameters)
+{
+  GHashTable *cache = gthree_shader_get_expanded_text_cache (shader);
+  g_autofree char *key = NULL;
+  g_autofree char *with_includes = NULL;
+  GString *s;
+  char *expanded;
+
+  /* Everything replace_light_nums() and replace_clipping_plane_nums() substitute */
+  key = g_strdup_printf ("%c %d %d %d %d %d %d %d %d %d", stage,
+                         parameters->num_dir_lights,
+                         parameters->num_spot_lights,
+                         parameters->num_rect_area_lights,
+                         parameters->num_point_lights,
+                         parameters->num_hemi_lights,
+                         parameters->num_point_light_shadows,
+                         parameters->num_spot_light_shadows,
+                         parameters->num_clipping_planes,
+                         parameters->num_clip_intersection);
+
+  expanded = g_hash_table_lookup (cache, key);
+  if (expanded)
+    return expanded;
+
+  with_includes = parse_text_with_includes (text);
+  s = g_string_new (with_includes);
+  replace_light_nums (s, parameters);
+  replace_clipping_plane_nums (s, parameters);
+  expanded = unroll_loops (s);
+  g_string_free (s, TRUE);
+
+  g_hash_table_insert (cache, g_steal_pointer (&key), expanded);
+
+  return expanded;
+}
+
 static void
 get_encoding_components (GthreeEncodingFormat encoding,
                          const char **type,
@@ -347,8 +606,9 @@ get_texel_encoding_function (GString *shader,
                           function_name, type, args);
 }
 
-GthreeProgram *
-gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, GthreeRenderer *renderer)
+static GthreeProgram *
+gthree_program_new_cached (GthreeShader *shader, GthreeProgramParameters *parameters,
+                           GthreeRenderer *renderer, GthreeProgramCache *cache)
 {
   GthreeProgram *program;
   GthreeProgramPrivate *priv;
@@ -362,14 +622,12 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
   float gamma_factor_define;
   GLuint gl_program;
   GString *vertex, *fragment;
-  g_autofree char *vertex_unrolled = NULL;
-  g_autofree char *fragment_unrolled = NULL;
   g_autofree char *vertex_expanded = NULL;
   g_autofree char *fragment_expanded = NULL;
   const char *shader_name;
-  GLuint glVertexShader, glFragmentShader;
-  GLint status;
   char formatd_buffer[G_ASCII_DTOSTR_BUF_SIZE];
+  g_autofree char *binary_path = NULL;
+  gint64 start_time = g_get_monotonic_time ();
 
   program = g_object_new (gthree_program_get_type (),
                           NULL);
@@ -402,6 +660,10 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
     {
       shadow_map_type_define = "SHADOWMAP_TYPE_PCF_SOFT";
     }
+  else if (parameters->shadow_map_type == GTHREE_SHADOW_MAP_TYPE_PCF_HARDWARE)
+    {
+      shadow_map_type_define = "SHADOWMAP_TYPE_PCF_HARDWARE";
+    }
 
   env_map_type_define = "ENVMAP_TYPE_CUBE";
   env_map_mode_define = "ENVMAP_MODE_REFLECTION";
@@ -458,6 +720,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
   if (TRUE /*! material instanceof THREE.RawShaderMaterial */)
     {
       g_string_append (vertex, "#version 130\n");
+      g_string_append (vertex, "#extension GL_ARB_uniform_buffer_object : enable\n");
       g_string_append_printf (vertex, "precision %s float;\n", precision_to_string (parameters->precision));
       g_string_append_printf (vertex, "precision %s int;\n", precision_to_string (parameters->precision));
 
@@ -529,6 +792,11 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       if (parameters->use_vertex_texture)
         g_string_append (vertex, "#define BONE_TEXTURE\n");
 
+      if (parameters->instancing)
+        g_string_append (vertex, "#define USE_INSTANCING\n");
+      if (parameters->instancing_color)
+        g_string_append (vertex, "#define USE_INSTANCING_COLOR\n");
+
       if (parameters->morph_targets)
         g_string_append (vertex, "#define USE_MORPHTARGETS\n");
       if (parameters->morph_normals && !parameters->flat_shading)
@@ -545,6 +813,20 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                                 "#define %s\n",
                                 shadow_map_type_define);
 
+      if (parameters->clustered_lights)
+        g_string_append_printf (vertex,
+                                "#define USE_CLUSTERED_LIGHTS\n"
+                                "#define CLUSTER_GRID_X %d\n"
+                                "#define CLUSTER_GRID_Y %d\n"
+                                "#define CLUSTER_GRID_Z %d\n"
+                                "#define CLUSTER_INDEX_WIDTH %d\n",
+                                GTHREE_CLUSTER_GRID_X, GTHREE_CLUSTER_GRID_Y,
+                                GTHREE_CLUSTER_GRID_Z, GTHREE_CLUSTER_INDEX_WIDTH);
+
+      if (parameters->max_object_lights > 0)
+        g_string_append_printf (vertex, "#define MAX_OBJECT_LIGHTS %d\n",
+                                parameters->max_object_lights);
+
       if (parameters->size_attenuation)
         g_string_append (vertex, "#define USE_SIZEATTENUATION\n");
 
@@ -554,13 +836,11 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       // parameters.logarithmicDepthBuffer && ( capabilities.isWebGL2 || extensions.get( 'EXT_frag_depth' ) ) ? '#define USE_LOGDEPTHBUF_EXT' : '',
 #endif
 
+        g_string_append (vertex, camera_block);
         g_string_append (vertex,
                          "uniform mat4 modelMatrix;\n"
                          "uniform mat4 modelViewMatrix;\n"
-                         "uniform mat4 projectionMatrix;\n"
-                         "uniform mat4 viewMatrix;\n"
                          "uniform mat3 normalMatrix;\n"
-                         "uniform vec3 cameraPosition;\n"
 
                          "attribute vec3 position;\n"
                          "attribute vec3 normal;\n"
@@ -574,6 +854,14 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                          "	attribute vec3 color;\n"
                          "#endif\n"
 
+                         "#ifdef USE_INSTANCING\n"
+                         "	attribute mat4 instanceMatrix;\n"
+                         "#endif\n"
+
+                         "#ifdef USE_INSTANCING_COLOR\n"
+                         "	attribute vec3 instanceColor;\n"
+                         "#endif\n"
+
                          "#ifdef USE_MORPHTARGETS\n"
                          "	attribute vec3 morphTarget0;\n"
                          "	attribute vec3 morphTarget1;\n"
@@ -601,6 +889,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       /* fragment shader prefix */
 
       g_string_append (fragment, "#version 130\n");
+      g_string_append (fragment, "#extension GL_ARB_uniform_buffer_object : enable\n");
       g_string_append_printf (fragment, "precision %s float;\n", precision_to_string (parameters->precision));
       g_string_append_printf (fragment, "precision %s int;\n", precision_to_string (parameters->precision));
 
@@ -666,6 +955,8 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
         g_string_append (fragment, "#define USE_TANGENT\n");
       if (parameters->vertex_colors)
         g_string_append (fragment, "#define USE_COLOR\n");
+      if (parameters->instancing_color)
+        g_string_append (fragment, "#define USE_INSTANCING_COLOR\n");
 
       if (parameters->gradient_map)
         g_string_append (fragment, "#define USE_GRADIENTMAP\n");
@@ -684,6 +975,29 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                                 "#define %s\n",
                                 shadow_map_type_define);
 
+      if (parameters->clustered_lights)
+        g_string_append_printf (fragment,
+                                "#define USE_CLUSTERED_LIGHTS\n"
+                                "#define CLUSTER_GRID_X %d\n"
+                                "#define CLUSTER_GRID_Y %d\n"
+                                "#define CLUSTER_GRID_Z %d\n"
+                                "#define CLUSTER_INDEX_WIDTH %d\n",
+                                GTHREE_CLUSTER_GRID_X, GTHREE_CLUSTER_GRID_Y,
+                                GTHREE_CLUSTER_GRID_Z, GTHREE_CLUSTER_INDEX_WIDTH);
+
+      if (parameters->max_object_lights > 0)
+        g_string_append_printf (fragment, "#define MAX_OBJECT_LIGHTS %d\n",
+                                parameters->max_object_lights);
+
+      if (parameters->shadow_atlas)
+        g_string_append (fragment, "#define USE_SHADOW_ATLAS\n");
+
+      if (parameters->shadow_cascades)
+        g_string_append_printf (fragment,
+                                "#define USE_SHADOW_CASCADES\n"
+                                "#define MAX_SHADOW_CASCADES %d\n",
+                                GTHREE_MAX_SHADOW_CASCADES);
+
       if (parameters->premultiplied_alpha)
         g_string_append (fragment, "#define PREMULTIPLIED_ALPHA\n");
 
@@ -698,9 +1012,7 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
       parameters.envMap && ( capabilities.isWebGL2 || extensions.get( 'EXT_shader_texture_lod' ) ) ? '#define TEXTURE_LOD_EXT' : '',
 #endif
 
-        g_string_append (fragment,
-                         "uniform mat4 viewMatrix;\n"
-                         "uniform vec3 cameraPosition;\n");
+        g_string_append (fragment, camera_block);
 #if TODO
       // ( parameters.toneMapping !== NoToneMapping ) ? '#define TONE_MAPPING' : '',
       // ( parameters.toneMapping !== NoToneMapping ) ? ShaderChunk[ 'tonemapping_pars_fragment' ] : '', // this code is required here because it is used by the toneMapping() function defined below
@@ -729,19 +1041,14 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
         }
   }
 
-  g_string_append (vertex, vertex_shader);
-  replace_light_nums (vertex, parameters);
-  replace_clipping_plane_nums (vertex, parameters);
+  /* The prefix is only defines, just the body needs expanding */
+  g_string_append (vertex, get_expanded_text (shader, 'v', vertex_shader, parameters));
+  g_string_append (fragment, get_expanded_text (shader, 'f', fragment_shader, parameters));
 
-  g_string_append (fragment, fragment_shader);
-  replace_light_nums (fragment, parameters);
-  replace_clipping_plane_nums (fragment, parameters);
+  vertex_expanded = g_string_free (vertex, FALSE);
+  fragment_expanded = g_string_free (fragment, FALSE);
 
-  vertex_unrolled = unroll_loops (vertex);
-  fragment_unrolled = unroll_loops (fragment);
-
-  vertex_expanded = parse_text_with_includes (vertex_unrolled);
-  fragment_expanded = parse_text_with_includes (fragment_unrolled);
+  priv->source_time = g_get_monotonic_time () - start_time;
 
   if (0)
     {
@@ -751,65 +1058,146 @@ gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, G
                fragment_expanded);
     }
 
-  glVertexShader = create_shader (GL_VERTEX_SHADER, vertex_expanded);
-  glFragmentShader = create_shader (GL_FRAGMENT_SHADER, fragment_expanded);
+  if (cache != NULL && cache->binary_dir != NULL && program_binary_supported (cache))
+    binary_path = program_binary_path (cache, vertex_expanded, fragment_expanded, index0AttributeName);
 
-  g_string_free (vertex, TRUE);
-  g_string_free (fragment, TRUE);
+  if (binary_path == NULL || !load_program_binary (cache, gl_program, binary_path))
+    {
+      priv->vertex_shader = create_shader (GL_VERTEX_SHADER, vertex_expanded);
+      priv->fragment_shader = create_shader (GL_FRAGMENT_SHADER, fragment_expanded);
 
-  glAttachShader (gl_program, glVertexShader);
-  glAttachShader (gl_program, glFragmentShader);
+      glAttachShader (gl_program, priv->vertex_shader);
+      glAttachShader (gl_program, priv->fragment_shader);
 
 #ifdef DEBUG_LABELS
-  if (shader_name)
-    {
-      g_autofree char *vlabel = g_strdup_printf ("%s.vert", shader_name);
-      g_autofree char *flabel = g_strdup_printf ("%s.frag", shader_name);
-      glObjectLabel (GL_SHADER, glVertexShader, strlen (vlabel), vlabel);
-      glObjectLabel (GL_SHADER, glFragmentShader, strlen (flabel), flabel);
-      glObjectLabel (GL_PROGRAM, gl_program, strlen (shader_name), shader_name);
-    }
+      if (shader_name)
+        {
+          g_autofree char *vlabel = g_strdup_printf ("%s.vert", shader_name);
+          g_autofree char *flabel = g_strdup_printf ("%s.frag", shader_name);
+          glObjectLabel (GL_SHADER, priv->vertex_shader, strlen (vlabel), vlabel);
+          glObjectLabel (GL_SHADER, priv->fragment_shader, strlen (flabel), flabel);
+          glObjectLabel (GL_PROGRAM, gl_program, strlen (shader_name), shader_name);
+        }
 #endif
 
-  if (index0AttributeName != NULL) {
+      if (index0AttributeName != NULL) {
 
-    // Force a particular attribute to index 0.
-    // because potentially expensive emulation is done by browser if attribute 0 is disabled.
-    // And, color, for example is often automatically bound to index 0 so disabling it
+        // Force a particular attribute to index 0.
+        // because potentially expensive emulation is done by browser if attribute 0 is disabled.
+        // And, color, for example is often automatically bound to index 0 so disabling it
 
-    glBindAttribLocation (gl_program, 0, index0AttributeName);
-  }
+        glBindAttribLocation (gl_program, 0, index0AttributeName);
+      }
 
-  glLinkProgram (gl_program);
+      if (binary_path != NULL)
+        glProgramParameteri (gl_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
-  glGetProgramiv (gl_program, GL_LINK_STATUS, &status);
-  if (status == GL_FALSE)
+      glLinkProgram (gl_program);
+
+      priv->binary_path = g_steal_pointer (&binary_path);
+    }
+
+  /* Don't wait for the compile and link results here, so that drivers
+     with parallel shader compilation can work in the background */
+  priv->gl_program = gl_program;
+  priv->link_pending = TRUE;
+  priv->compile_time = g_get_monotonic_time () - start_time;
+
+  return program;
+}
+
+static void
+gthree_program_finish_link (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  gint64 start_time;
+  GLint status;
+
+  if (!priv->link_pending)
+    return;
+
+  priv->link_pending = FALSE;
+  start_time = g_get_monotonic_time ();
+
+  if (priv->vertex_shader)
     {
-      GLint log_len;
-      char *buffer;
+      check_shader (priv->vertex_shader, GL_VERTEX_SHADER);
+      check_shader (priv->fragment_shader, GL_FRAGMENT_SHADER);
 
-      glGetProgramiv (gl_program, GL_INFO_LOG_LENGTH, &log_len);
+      glGetProgramiv (priv->gl_program, GL_LINK_STATUS, &status);
+      if (status == GL_FALSE)
+        {
+          GLint log_len;
+          char *buffer;
 
-      buffer = g_malloc (log_len + 1);
-      glGetProgramInfoLog (gl_program, log_len, NULL, buffer);
-      g_warning ("Linker failure: %s\n", buffer);
-      g_free (buffer);
+          glGetProgramiv (priv->gl_program, GL_INFO_LOG_LENGTH, &log_len);
+
+          buffer = g_malloc (log_len + 1);
+          glGetProgramInfoLog (priv->gl_program, log_len, NULL, buffer);
+          g_warning ("Linker failure: %s\n", buffer);
+          g_free (buffer);
+        }
+
+      // clean up
+
+      glDeleteShader (priv->vertex_shader);
+      glDeleteShader (priv->fragment_shader);
+      priv->vertex_shader = 0;
+      priv->fragment_shader = 0;
+
+      if (priv->binary_path != NULL && priv->cache != NULL && status == GL_TRUE)
+        save_program_binary (priv->cache, priv->gl_program, priv->binary_path);
+      g_clear_pointer (&priv->binary_path, g_free);
     }
 
-  // clean up
+  bind_uniform_block (priv->gl_program, "GthreeCamera", GTHREE_UNIFORM_BLOCK_CAMERA);
+  bind_uniform_block (priv->gl_program, "GthreeLights", GTHREE_UNIFORM_BLOCK_LIGHTS);
+  bind_uniform_block (priv->gl_program, "GthreeFog", GTHREE_UNIFORM_BLOCK_FOG);
 
-  glDeleteShader (glVertexShader);
-  glDeleteShader (glFragmentShader);
+  /* This is mostly waiting for the driver to finish compiling */
+  priv->compile_time += g_get_monotonic_time () - start_time;
+  if (priv->cache)
+    priv->cache->compile_time += g_get_monotonic_time () - start_time;
+}
 
-  priv->gl_program = gl_program;
+/* Returns FALSE while the driver is still compiling the program in
+ * the background. Only use with GL_KHR_parallel_shader_compile. */
+gboolean
+gthree_program_is_ready (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  GLint completed = GL_TRUE;
 
-  return program;
+  if (!priv->link_pending)
+    return TRUE;
+
+  glGetProgramiv (priv->gl_program, GL_COMPLETION_STATUS_KHR, &completed);
+
+  return completed == GL_TRUE;
+}
+
+GthreeProgram *
+gthree_program_new (GthreeShader *shader, GthreeProgramParameters *parameters, GthreeRenderer *renderer)
+{
+  return gthree_program_new_cached (shader, parameters, renderer, NULL);
 }
 
 static void
 gthree_program_init (GthreeProgram *program)
 {
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  static guint next_id = 0;
+
+  priv->id = ++next_id;
+  priv->unused_link.data = program;
+}
+
+guint
+gthree_program_get_id (GthreeProgram *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
 
+  return priv->id;
 }
 
 static void
@@ -817,6 +1205,14 @@ gthree_program_finalize (GObject *obj)
 {
   GthreeProgram *program = GTHREE_PROGRAM (obj);
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  int i;
+
+  if (priv->vertex_shader)
+    {
+      glDeleteShader (priv->vertex_shader);
+      glDeleteShader (priv->fragment_shader);
+    }
+  g_free (priv->binary_path);
 
   if (priv->gl_program)
     {
@@ -826,6 +1222,9 @@ gthree_program_finalize (GObject *obj)
 
   g_hash_table_destroy (priv->uniform_locations);
   g_hash_table_destroy (priv->attribute_locations);
+  for (i = 0; i < priv->n_uniform_values; i++)
+    g_free (priv->uniform_values[i].data);
+  g_free (priv->uniform_values);
 
   if (priv->cache)
     gthree_program_cache_remove (priv->cache, program);
@@ -846,6 +1245,7 @@ gthree_program_use (GthreeProgram *program)
 {
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
 
+  gthree_program_finish_link (program);
   glUseProgram (priv->gl_program);
 }
 
@@ -865,6 +1265,37 @@ gthree_program_lookup_uniform_location (GthreeProgram *program,
   return -1;
 }
 
+/* Returns TRUE if value differs from what was last uploaded to
+ * location in this program, and remembers it as the new value.
+ * This runs for every uniform of every draw, so the shadow copies are
+ * in a flat array indexed by location, sized when the locations are
+ * looked up after linking. */
+gboolean
+gthree_program_update_uniform_value (GthreeProgram *program,
+                                     gint           location,
+                                     gconstpointer  value,
+                                     gsize          size)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+  GthreeUniformValue *old;
+
+  if (location < 0 || location >= priv->n_uniform_values)
+    return TRUE;
+
+  old = &priv->uniform_values[location];
+  if (old->size == size && memcmp (old->data, value, size) == 0)
+    return FALSE;
+
+  if (old->size != size)
+    {
+      old->data = g_realloc (old->data, size);
+      old->size = size;
+    }
+  memcpy (old->data, value, size);
+
+  return TRUE;
+}
+
 gint
 gthree_program_lookup_uniform_location_from_string (GthreeProgram *program,
                                                     const char *uniform)
@@ -879,6 +1310,8 @@ gthree_program_lookup_attribute_location (GthreeProgram *program,
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
   gpointer location;
 
+  gthree_program_get_attribute_locations (program);
+
   if (g_hash_table_lookup_extended (priv->attribute_locations,
                                     GINT_TO_POINTER (attribute), NULL, &location))
     return GPOINTER_TO_INT (location);
@@ -903,6 +1336,8 @@ gthree_program_get_attribute_locations (GthreeProgram *program)
       GLint n, i, max_len;
       char *buffer;
 
+      gthree_program_finish_link (program);
+
       priv->attribute_locations = g_hash_table_new (g_direct_hash, g_direct_equal);
 
       glGetProgramiv (priv->gl_program,  GL_ACTIVE_ATTRIBUTE_MAX_LENGTH,  &max_len);
@@ -925,15 +1360,20 @@ gthree_program_get_attribute_locations (GthreeProgram *program)
   return priv->attribute_locations;
 }
 
+/* FNV-1a, the parameters are mostly bitfields so every bit has to
+ * affect the result */
 static guint
 gthree_program_parameters_hash (GthreeProgramParameters *params)
 {
-  guint32 *ptr = (guint32 *)params;
-  int i, len = sizeof (GthreeProgramParameters) / 4;
-  guint32 h = 0;
+  const guint8 *ptr = (const guint8 *)params;
+  int i;
+  guint32 h = 2166136261u;
 
-  for (i = 0; i < len; i++)
-    h ^= ptr[i];
+  for (i = 0; i < sizeof (GthreeProgramParameters); i++)
+    {
+      h ^= ptr[i];
+      h *= 16777619u;
+    }
 
   return h;
 }
@@ -947,8 +1387,9 @@ gthree_program_parameters_equal (GthreeProgramParameters *a, GthreeProgramParame
 static guint
 gthree_program_priv_hash (GthreeProgramPrivate *priv)
 {
-  return gthree_shader_hash (priv->shader) ^
-    gthree_program_parameters_hash (&priv->params);
+  guint h = gthree_program_parameters_hash (&priv->params);
+
+  return h ^ (gthree_shader_hash (priv->shader) + 0x9e3779b9 + (h << 6) + (h >> 2));
 }
 
 static gboolean
@@ -967,6 +1408,10 @@ gthree_program_cache_new (void)
   cache = g_new0 (GthreeProgramCache, 1);
 
   cache->hash = g_hash_table_new ((GHashFunc)gthree_program_priv_hash, (GEqualFunc)gthree_program_priv_equal);
+  cache->binary_supported = -1;
+  cache->material_programs = g_hash_table_new (NULL, NULL);
+  g_queue_init (&cache->unused);
+  cache->max_unused = DEFAULT_MAX_UNUSED_PROGRAMS;
 
   return cache;
 }
@@ -976,9 +1421,141 @@ gthree_program_cache_remove (GthreeProgramCache *cache, GthreeProgram *program)
 {
   GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
   g_hash_table_remove (cache->hash, gthree_program_get_instance_private (program));
+  if (priv->n_users == 0)
+    g_queue_unlink (&cache->unused, &priv->unused_link);
   priv->cache = NULL;
 }
 
+static void
+program_add_user (GthreeProgramCache *cache,
+                  GthreeProgram      *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  if (priv->n_users++ == 0)
+    g_queue_unlink (&cache->unused, &priv->unused_link);
+}
+
+static void
+program_remove_user (GthreeProgramCache *cache,
+                     GthreeProgram      *program)
+{
+  GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+  g_assert (priv->n_users > 0);
+  if (--priv->n_users == 0)
+    g_queue_push_tail_link (&cache->unused, &priv->unused_link);
+}
+
+static void
+material_programs_weak_notify (gpointer  data,
+                               GObject  *where_the_object_was)
+{
+  GthreeProgramCache *cache = data;
+  GthreeProgram *program;
+
+  program = g_hash_table_lookup (cache->material_programs, where_the_object_was);
+  g_hash_table_remove (cache->material_programs, where_the_object_was);
+  program_remove_user (cache, program);
+}
+
+/* Records that material now uses program, releasing whatever program
+ * it used before. Programs without users may get evicted by
+ * gthree_program_cache_trim(). */
+void
+gthree_program_cache_set_material_program (GthreeProgramCache *cache,
+                                           GthreeMaterial     *material,
+                                           GthreeProgram      *program)
+{
+  GthreeProgram *old_program;
+
+  old_program = g_hash_table_lookup (cache->material_programs, material);
+  if (old_program == program)
+    return;
+
+  program_add_user (cache, program);
+
+  if (old_program)
+    program_remove_user (cache, old_program);
+  else
+    g_object_weak_ref (G_OBJECT (material), material_programs_weak_notify, cache);
+
+  g_hash_table_insert (cache->material_programs, material, program);
+}
+
+/* Frees the least recently used programs without users until at most
+ * max_unused are left. Needs the GL context to be current, and the
+ * caller must not hold on to pointers of unused programs.
+ *
+ * Programs that were never used may still be linking, typically
+ * because gthree_renderer_compile() started them and is waiting for them
+ * to be ready before giving them to a material. Those are kept while the
+ * driver is working on them, or polling for them would start them over
+ * forever. Once done, and @parallel_compile is FALSE they always are,
+ * the link is finished and they get one more frame to be picked up
+ * before being evicted like any other, so that those whose material
+ * went away don't stay forever. */
+void
+gthree_program_cache_trim (GthreeProgramCache *cache,
+                           gboolean            parallel_compile)
+{
+  GList *l, *next;
+
+  for (l = cache->unused.head;
+       l != NULL && cache->unused.length > cache->max_unused;
+       l = next)
+    {
+      GthreeProgram *program = l->data;
+      GthreeProgramPrivate *priv = gthree_program_get_instance_private (program);
+
+      next = l->next;
+
+      if (priv->link_pending)
+        {
+          if (!parallel_compile || gthree_program_is_ready (program))
+            gthree_program_finish_link (program);
+          continue;
+        }
+
+      gthree_program_cache_remove (cache, program);
+      g_object_unref (program);
+      cache->n_evicted++;
+    }
+}
+
+void
+gthree_program_cache_set_max_unused (GthreeProgramCache *cache,
+                                     guint               max_unused)
+{
+  cache->max_unused = max_unused;
+}
+
+guint
+gthree_program_cache_get_max_unused (GthreeProgramCache *cache)
+{
+  return cache->max_unused;
+}
+
+void
+gthree_program_cache_get_stats (GthreeProgramCache *cache,
+                                guint              *n_programs,
+                                guint              *n_unused,
+                                guint              *n_evicted,
+                                gint64             *source_time,
+                                gint64             *compile_time)
+{
+  if (n_programs)
+    *n_programs = g_hash_table_size (cache->hash);
+  if (n_unused)
+    *n_unused = cache->unused.length;
+  if (n_evicted)
+    *n_evicted = cache->n_evicted;
+  if (source_time)
+    *source_time = cache->source_time;
+  if (compile_time)
+    *compile_time = cache->compile_time;
+}
+
 /* Returns instance owned by cache */
 GthreeProgram *
 gthree_program_cache_get (GthreeProgramCache *cache, GthreeShader *shader, GthreeProgramParameters *parameters, GthreeRenderer *renderer)
@@ -994,11 +1571,15 @@ gthree_program_cache_get (GthreeProgramCache *cache, GthreeShader *shader, Gthre
   if (program)
     return program;
 
-  program = gthree_program_new (shader, parameters, renderer);
+  program = gthree_program_new_cached (shader, parameters, renderer, cache);
   priv = gthree_program_get_instance_private (program);
   priv->cache = cache;
+  cache->source_time += priv->source_time;
+  cache->compile_time += priv->compile_time;
 
   g_hash_table_insert (cache->hash, gthree_program_get_instance_private (program), program);
+  /* Unused until some material picks it */
+  g_queue_push_tail_link (&cache->unused, &priv->unused_link);
 
   return program;
 }
@@ -1008,9 +1589,14 @@ gthree_program_cache_free (GthreeProgramCache *cache)
 {
   GthreeProgramPrivate *priv;
   GHashTableIter iter;
-  gpointer value;
+  gpointer key, value;
   GthreeProgram *program;
 
+  g_hash_table_iter_init (&iter, cache->material_programs);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_object_weak_unref (G_OBJECT (key), material_programs_weak_notify, cache);
+  g_hash_table_destroy (cache->material_programs);
+
   g_hash_table_iter_init (&iter, cache->hash);
   while (g_hash_table_iter_next (&iter, NULL, &value))
     {
@@ -1020,5 +1606,35 @@ gthree_program_cache_free (GthreeProgramCache *cache)
     }
 
   g_hash_table_destroy (cache->hash);
+  g_free (cache->binary_dir);
+  g_free (cache->binary_salt);
   g_free (cache);
 }
+
+void
+gthree_program_cache_set_binary_dir (GthreeProgramCache *cache,
+                                     const char         *dir)
+{
+  g_free (cache->binary_dir);
+  cache->binary_dir = g_strdup (dir);
+}
+
+const char *
+gthree_program_cache_get_binary_dir (GthreeProgramCache *cache)
+{
+  return cache->binary_dir;
+}
+
+void
+gthree_program_cache_get_binary_stats (GthreeProgramCache *cache,
+                                       guint              *hits,
+                                       guint              *misses,
+                                       guint              *stale)
+{
+  if (hits)
+    *hits = cache->binary_hits;
+  if (misses)
+    *misses = cache->binary_misses;
+  if (stale)
+    *stale = cache->binary_stale;
+}
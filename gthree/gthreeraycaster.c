@@ -1,6 +1,7 @@
 #include "gthreeraycaster.h"
 #include "gthreeperspectivecamera.h"
 #include "gthreeorthographiccamera.h"
+#include "gthreeobjectprivate.h"
 
 typedef struct {
   graphene_ray_t ray;
@@ -35,6 +36,7 @@ gthree_ray_intersection_new (GthreeObject *object)
 
   intersection->face_index = -1;
   intersection->material_index = -1;
+  intersection->instance_id = -1;
   if (object)
     intersection->object = g_object_ref (object);
 
@@ -184,7 +186,14 @@ intersect_object (GthreeRaycaster *raycaster,
                   gboolean recurse,
                   GPtrArray *intersections)
 {
-  if (!gthree_object_get_visible (object))
+  GthreeRaycasterPrivate *priv = gthree_raycaster_get_instance_private (raycaster);
+
+  if (!gthree_object_get_shown (object))
+    return;
+
+  if (recurse &&
+      gthree_object_get_n_children (object) > 0 &&
+      !gthree_object_subtree_intersects_ray (object, &priv->ray))
     return;
 
   gthree_object_raycast (object, raycaster, intersections);
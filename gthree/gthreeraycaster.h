@@ -24,6 +24,7 @@ typedef struct {
   graphene_point3d_t point;
   int face_index;             // -1 means unset
   int material_index;         // -1 means unset
+  int instance_id;            // -1 means unset, only set for GthreeInstancedMesh
   graphene_triangle_t face;   // In object coords, only if face_index set
   graphene_vec2_t uv;
   graphene_vec2_t uv2;
@@ -5,6 +5,7 @@
 #include "gthreeobjectprivate.h"
 #include "gthreemesh.h"
 #include "gthreeskinnedmesh.h"
+#include "gthreeinstancedmesh.h"
 #include "gthreelinesegments.h"
 #include "gthreeshader.h"
 #include "gthreematerial.h"
@@ -16,18 +17,30 @@
 #include "gthreemeshdistancematerial.h"
 #include "gthreemeshmaterial.h"
 #include "gthreelinebasicmaterial.h"
+#include "gthreemeshbasicmaterial.h"
 #include "gthreeprimitives.h"
 #include "gthreegroup.h"
+#include "gthreelod.h"
 #include "gthreeattribute.h"
 #include "gthreesprite.h"
 #include "gthreepoints.h"
 #include "gthreespotlight.h"
 #include "gthreepointlight.h"
+#include "gthreedirectionallight.h"
 #include "gthreefog.h"
 
 #define MAX_MORPH_TARGETS 8
 #define MAX_MORPH_NORMALS 4
 
+enum
+{
+  GPU_TIMINGS,
+
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0, };
+
 static graphene_vec3_t cube_directions[6];
 static graphene_vec3_t cube_ups[6];
 
@@ -40,8 +53,84 @@ typedef struct {
   GthreeMaterial *material;
   GthreeGeometryGroup *group;
   float z;
+  guint64 sort_key;
 } GthreeRenderListItem;
 
+typedef struct {
+  guint64 key;
+  int index;
+} GthreeRenderListSortItem;
+
+/* The GL minimum for GL_MAX_VERTEX_ATTRIBS */
+#define MAX_VERTEX_ATTRIBUTES 16
+
+/* Tracks the vertex attrib enable state of one vertex array object */
+typedef struct {
+  guint vao;
+  guint8 enabled_attributes[MAX_VERTEX_ATTRIBUTES];
+  guint8 attribute_divisors[MAX_VERTEX_ATTRIBUTES];
+} GthreeVertexArrayState;
+
+typedef struct {
+  int location;
+  GQuark name;
+} GthreeDefaultAttribute;
+
+/* std140 layouts of the GthreeCamera and GthreeFog uniform blocks */
+typedef struct {
+  float projection_matrix[16];
+  float view_matrix[16];
+  float camera_position[4];
+} GthreeCameraBlock;
+
+typedef struct {
+  float color[3];
+  float near;
+  float far;
+  float density;
+  float padding[2];
+} GthreeFogBlock;
+
+/* Light struct members in the order they are declared in lights_pars_begin.glsl */
+static const char *directional_light_members[] = {
+  "direction", "color", "shadow", "shadowBias", "shadowRadius", "shadowMapSize", "shadowCascades",
+  "shadowMapRect"
+};
+static const char *point_light_members[] = {
+  "position", "color", "distance", "decay", "shadow", "shadowBias", "shadowRadius", "shadowMapSize",
+  "shadowCameraNear", "shadowCameraFar", "shadowMapRect"
+};
+static const char *spot_light_members[] = {
+  "position", "direction", "color", "distance", "decay", "coneCos", "penumbraCos",
+  "shadow", "shadowBias", "shadowRadius", "shadowMapSize", "shadowMapRect"
+};
+static const char *hemisphere_light_members[] = {
+  "direction", "skyColor", "groundColor"
+};
+
+/* A vertex array object with the attribute setup for a particular
+ * geometry and program combination. It is set up once and then
+ * just bound, until the layout serials say the geometry changed. */
+typedef struct {
+  GthreeVertexArrayState state;
+  GthreeRenderer *renderer;
+
+  /* Key, weakly referenced */
+  GthreeGeometry *geometry;
+  GthreeProgram *program;
+  GthreeInstancedMesh *instances;
+  gboolean wireframe;
+
+  guint geometry_serial;
+  guint index_serial;
+  guint instance_matrix_serial;
+  guint instance_color_serial;
+
+  /* Program attributes not in the geometry, these get constant values
+   * which are not part of the vao state, so need reloading on bind */
+  GArray *default_attributes;
+} GthreeVertexArray;
+
 struct _GthreeRenderList {
   float current_z;
   gboolean use_background;
@@ -49,8 +138,88 @@ struct _GthreeRenderList {
   GArray *opaque;
   GArray *transparent;
   GArray *background;
+
+  /* Scratch space for sorting */
+  GArray *sort_items;
+  GArray *sort_tmp;
+};
+
+/* A point or spot light pick_object_lights() can choose, see
+ * gthree_renderer_set_max_object_lights() */
+typedef struct {
+  graphene_point3d_t position; /* World space */
+  graphene_vec3_t direction;   /* Spot lights, towards the target */
+  float angle;                 /* Spot lights */
+  float distance;
+  float strength;              /* Intensity of the brightest channel */
+  guint16 index;               /* In the point or spot light array */
+  guint8 is_spot;
+  guint8 casts_shadow;
+} ObjectLight;
+
+/* Something that may cast a shadow this frame, see
+ * collect_shadow_casters() */
+typedef struct {
+  GthreeShadowCaster caster;
+  gboolean dynamic;            /* Moves in ways the caster can't track */
+  gboolean updated;            /* gthree_object_update() was called */
+} ShadowCasterCandidate;
+
+/* A shadow map placed by update_shadow_atlas(), see
+ * gthree_renderer_set_shadow_atlas_size() */
+typedef struct {
+  GthreeLightShadow *shadow;
+  int index;                   /* In priv->shadows, to keep the order stable */
+  int width, height;           /* Of one face or cascade, unscaled */
+  int columns, rows;           /* Number of faces or cascades in each direction */
+  int x, y;
+} ShadowAtlasEntry;
+
+#define MAX_OBJECT_LIGHTS 32
+
+enum {
+  PADDING_LIGHT_DIRECTIONAL,
+  PADDING_LIGHT_POINT,
+  PADDING_LIGHT_SPOT,
+  N_PADDING_LIGHTS
 };
 
+/* A renderable object project_object() found, and what the last frame
+ * decided about it */
+typedef struct {
+  GthreeObject *object;
+  guint32 bounds_serial;  /* From gthree_object_get_bounds_serial() */
+  float z;
+  guint first_item;       /* The items it pushed to the render list */
+  guint n_items;
+  guint in_frustum : 1;
+  guint drawn : 1;        /* Its items are in the render list */
+} RetainedEntry;
+
+/* Everything in a scene a camera can see, and the render list from the
+ * last frame, kept until the scene graph changes. See
+ * gthree_renderer_set_retained_render_lists(). */
+typedef struct {
+  GthreeRenderer *renderer;
+  GthreeScene *scene;
+  GthreeCamera *camera;
+
+  gboolean valid;
+  guint32 serial;         /* From gthree_render_lists_get_serial() */
+  guint32 layer_mask;
+  gboolean sort_objects;
+  graphene_matrix_t proj_screen_matrix;
+
+  GArray *entries;
+  GPtrArray *lods;
+  GList *lights;
+  GList *shadows;
+
+  GthreeRenderList *render_list;
+  guint n_items;          /* Items in render_list, without the background */
+  gboolean keys_stale;    /* Sort keys predate the programs of new items */
+} RetainedList;
+
 typedef struct {
   GList *current_stack;
 
@@ -74,6 +243,7 @@ typedef struct {
   GthreeShadowMapType shadowmap_type;
   GPtrArray *shadowmap_depth_materials;
   GPtrArray *shadowmap_distance_materials;
+  GPtrArray *shadowmap_basic_depth_materials;
 
   gboolean local_clipping_enabled;
   GArray *clipping_planes;
@@ -84,6 +254,7 @@ typedef struct {
   GthreeProgramCache *program_cache;
 
   graphene_frustum_t frustum;
+  guint32 bvh_serial; /* From gthree_scene_bvh_cull (), 0 if not used */
   graphene_matrix_t proj_screen_matrix;
   gboolean clipping_enabled;
 
@@ -125,14 +296,57 @@ typedef struct {
   GthreeGeometry *current_geometry_program_geometry;
   GthreeProgram *current_geometry_program_program;
   gboolean current_geometry_program_wireframe;
+  GthreeInstancedMesh *current_geometry_program_instances;
 
   GthreeRenderList *current_render_list;
+  GthreeRenderList *immediate_render_list;
+
+  gboolean retained_render_lists;
+  GPtrArray *retained_lists;
 
-  guint8 new_attributes[8];
-  guint8 enabled_attributes[8];
+  guint8 new_attributes[MAX_VERTEX_ATTRIBUTES];
+  GthreeVertexArrayState *current_vertex_array;
 
   float morph_influences[8];
 
+  /* Work counters, see gthree_renderer_get_info() */
+  GthreeRenderInfo info;
+  gboolean auto_reset_info;
+
+  gboolean gpu_timing_enabled;
+  GthreeGpuTimer *gpu_timer;
+
+  gboolean occlusion_culling;
+  GthreeOcclusionCuller *occlusion_culler;
+  GthreeMesh *occlusion_box_mesh;
+
+  gboolean software_occlusion_culling;
+  GthreeDepthCuller *depth_culler;
+  gboolean depth_culler_active; /* There are occluders this frame */
+
+  gboolean clustered_lighting;
+  GthreeLightClusters *light_clusters;
+
+  GArray *shadow_casters; /* GthreeShadowCaster, for the current shadow map */
+  GArray *shadow_caster_sources; /* guint, the candidate of each shadow caster */
+  GArray *shadow_caster_candidates; /* ShadowCasterCandidate, for the current frame */
+  /* The world space bounding spheres of the candidates, one array per
+   * component so the culling loops read each of them contiguously */
+  GArray *shadow_caster_x; /* float, one per candidate */
+  GArray *shadow_caster_y; /* float, one per candidate */
+  GArray *shadow_caster_z; /* float, one per candidate */
+  GArray *shadow_caster_radius; /* float, INFINITY for candidates that are not culled */
+  GArray *shadow_caster_visible; /* guint8, one per candidate */
+
+  int shadow_atlas_size;
+  GthreeRenderTarget *shadow_atlas;
+  GArray *shadow_atlas_entries; /* ShadowAtlasEntry */
+
+  gboolean light_count_bucketing;
+  GthreeLight *padding_lights[N_PADDING_LIGHTS];
+  guint max_object_lights;
+  GArray *object_lights; /* ObjectLight */
+
   int max_textures;
   int max_vertex_textures;
   int max_texture_size;
@@ -141,8 +355,17 @@ typedef struct {
 
   gboolean supports_vertex_textures;
   gboolean supports_bone_textures;
+  gboolean supports_parallel_shader_compile;
+  gboolean supports_timer_query;
+  gboolean supports_occlusion_query;
 
-  guint vertex_array_object;
+  /* Uniform buffers shared by all programs, indexed by GthreeUniformBlock */
+  guint uniform_buffers[GTHREE_UNIFORM_BLOCK_N_BLOCKS];
+  GByteArray *lights_block;
+
+  /* Used for objects with per-draw attributes, like morph targets */
+  GthreeVertexArrayState default_vertex_array;
+  GHashTable *vertex_arrays;
 
   /* Background */
   GthreeMesh *bg_box_mesh;
@@ -164,21 +387,20 @@ static GQuark q_color;
 static GQuark q_uv;
 static GQuark q_uv2;
 static GQuark q_normal;
-static GQuark q_viewMatrix;
 static GQuark q_modelMatrix;
 static GQuark q_modelViewMatrix;
 static GQuark q_normalMatrix;
-static GQuark q_projectionMatrix;
-static GQuark q_cameraPosition;
 static GQuark q_clippingPlanes;
-static GQuark q_ambientLightColor;
-static GQuark q_directionalLights;
-static GQuark q_hemisphereLights;
-static GQuark q_pointLights;
-static GQuark q_spotLights;
 static GQuark q_bindMatrix;
 static GQuark q_bindMatrixInverse;
 static GQuark q_boneMatrices;
+static GQuark q_instanceMatrix;
+static GQuark q_instanceColor;
+static GQuark q_clusterLightData;
+static GQuark q_clusterGrid;
+static GQuark q_clusterLightIndices;
+static GQuark q_objectPointLights;
+static GQuark q_objectSpotLights;
 
 static GArray *free_resource_ids;
 static guint32 next_unused_resource_id = 0;
@@ -198,31 +420,230 @@ static void render_item (GthreeRenderer *renderer,
                          GthreeFog *fog,
                          GthreeMaterial *material,
                          GthreeRenderListItem *item);
+static void render_list_update_keys (GthreeRenderList *list);
+static void retained_list_free (RetainedList *retained);
+
+static guint
+vertex_array_hash (gconstpointer key)
+{
+  const GthreeVertexArray *va = key;
+
+  return
+    g_direct_hash (va->geometry) ^
+    (g_direct_hash (va->program) << 1) ^
+    (g_direct_hash (va->instances) << 2) ^
+    va->wireframe;
+}
+
+static gboolean
+vertex_array_equal (gconstpointer a,
+                    gconstpointer b)
+{
+  const GthreeVertexArray *va_a = a;
+  const GthreeVertexArray *va_b = b;
+
+  return
+    va_a->geometry == va_b->geometry &&
+    va_a->program == va_b->program &&
+    va_a->instances == va_b->instances &&
+    va_a->wireframe == va_b->wireframe;
+}
+
+static void vertex_array_weak_notify (gpointer  data,
+                                      GObject  *where_the_object_was);
 
 static void
-push_debug_group (const char   *format, ...)
+vertex_array_free (GthreeVertexArray *va)
 {
-#ifdef DEBUG_GROUPS
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (va->renderer);
+
+  if (va->geometry)
+    g_object_weak_unref (G_OBJECT (va->geometry), vertex_array_weak_notify, va);
+  if (va->program)
+    g_object_weak_unref (G_OBJECT (va->program), vertex_array_weak_notify, va);
+  if (va->instances)
+    g_object_weak_unref (G_OBJECT (va->instances), vertex_array_weak_notify, va);
+
+  /* Deleting the bound vao unbinds it, and a new object could show up at the same address */
+  if (priv->current_vertex_array == &va->state)
+    {
+      priv->current_vertex_array = NULL;
+      priv->current_geometry_program_geometry = NULL;
+      priv->current_geometry_program_program = NULL;
+      priv->current_geometry_program_instances = NULL;
+    }
+
+  gthree_renderer_lazy_delete (va->renderer, GTHREE_RESOURCE_KIND_VERTEX_ARRAY, va->state.vao);
+
+  g_array_unref (va->default_attributes);
+  g_free (va);
+}
+
+static void
+vertex_array_weak_notify (gpointer  data,
+                          GObject  *where_the_object_was)
+{
+  GthreeVertexArray *va = data;
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (va->renderer);
+
+  g_hash_table_steal (priv->vertex_arrays, va);
+
+  /* The weak ref of the dying object is already gone */
+  if ((GObject *)va->geometry == where_the_object_was)
+    va->geometry = NULL;
+  if ((GObject *)va->program == where_the_object_was)
+    va->program = NULL;
+  if ((GObject *)va->instances == where_the_object_was)
+    va->instances = NULL;
+
+  vertex_array_free (va);
+}
+
+static void
+upload_uniform_block (GthreeRenderer     *renderer,
+                      GthreeUniformBlock  block,
+                      const void         *data,
+                      gsize               size)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  glBindBuffer (GL_UNIFORM_BUFFER, priv->uniform_buffers[block]);
+  glBufferData (GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+  priv->info.buffer_bytes_uploaded += size;
+}
+
+static void
+upload_camera_block (GthreeRenderer *renderer,
+                     GthreeCamera   *camera)
+{
+  GthreeCameraBlock block;
+  graphene_vec4_t pos;
+
+  graphene_matrix_to_float (gthree_camera_get_projection_matrix (camera), block.projection_matrix);
+  graphene_matrix_to_float (gthree_camera_get_world_inverse_matrix (camera), block.view_matrix);
+  graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (camera)), 3, &pos);
+  graphene_vec4_to_float (&pos, block.camera_position);
+
+  upload_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_CAMERA, &block, sizeof (block));
+}
+
+static void
+upload_fog_block (GthreeRenderer *renderer,
+                  GthreeFog      *fog)
+{
+  GthreeFogBlock block = { { 0 } };
+
+  graphene_vec3_to_float (gthree_fog_get_color (fog), block.color);
+  if (gthree_fog_get_style (fog) == GTHREE_FOG_STYLE_LINEAR)
+    {
+      block.near = gthree_fog_get_near (fog);
+      block.far = gthree_fog_get_far (fog);
+    }
+  else
+    block.density = gthree_fog_get_density (fog);
+
+  upload_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_FOG, &block, sizeof (block));
+}
+
+static gsize
+pack_lights_std140 (GByteArray  *data,
+                    gsize        offset,
+                    GPtrArray   *lights,
+                    const char **members,
+                    int          n_members)
+{
+  int i, j;
+
+  for (i = 0; i < lights->len; i++)
+    {
+      GthreeUniforms *light_uniforms = g_ptr_array_index (lights, i);
+
+      /* Structs (and thus array elements) start and end at vec4 alignment */
+      offset = (offset + 15) & ~15;
+      for (j = 0; j < n_members; j++)
+        {
+          GthreeUniform *uni = gthree_uniforms_lookup_from_string (light_uniforms, members[j]);
+          g_assert (uni != NULL);
+          offset = gthree_uniform_pack_std140 (uni, data, offset);
+        }
+      offset = (offset + 15) & ~15;
+    }
+
+  return offset;
+}
+
+static void
+upload_lights_block (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeLightSetup *setup = &priv->light_setup;
+  GByteArray *data = priv->lights_block;
+  gsize offset;
+
+  /* ambientLightColor */
+  g_byte_array_set_size (data, 16);
+  memset (data->data, 0, 16);
+  graphene_vec3_to_float (&setup->ambient, (float *)data->data);
+
+  /* clusterParams */
+  g_byte_array_append (data, (guint8 *)setup->cluster_params, sizeof (setup->cluster_params));
+  offset = 32;
+
+  offset = pack_lights_std140 (data, offset, setup->directional,
+                               directional_light_members, G_N_ELEMENTS (directional_light_members));
+  offset = pack_lights_std140 (data, offset, setup->point,
+                               point_light_members, G_N_ELEMENTS (point_light_members));
+  offset = pack_lights_std140 (data, offset, setup->spot,
+                               spot_light_members, G_N_ELEMENTS (spot_light_members));
+  offset = pack_lights_std140 (data, offset, setup->hemi,
+                               hemisphere_light_members, G_N_ELEMENTS (hemisphere_light_members));
+
+  /* Pad out to the aligned end of the last struct */
+  if (data->len < offset)
+    {
+      gsize old_len = data->len;
+
+      g_byte_array_set_size (data, offset);
+      memset (data->data + old_len, 0, offset - old_len);
+    }
+
+  upload_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_LIGHTS, data->data, data->len);
+}
+
+/* Debug groups double as GPU timer phases, see gthree_renderer_set_gpu_timing_enabled() */
+static void
+push_debug_group (GthreeRenderer *renderer,
+                  const char     *format, ...)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
   gchar *message;
   va_list args;
-  int msg_len;
+
+#ifndef DEBUG_GROUPS
+  if (!priv->gpu_timing_enabled && priv->gpu_timer == NULL)
+    return;
+#endif
 
   va_start (args, format);
   message = g_strdup_vprintf (format, args);
   va_end (args);
 
-  msg_len = strlen (message);
-  glPushDebugGroupKHR (GL_DEBUG_SOURCE_APPLICATION, 0, msg_len, message);
-  g_free (message);
+#ifdef DEBUG_GROUPS
+  glPushDebugGroupKHR (GL_DEBUG_SOURCE_APPLICATION, 0, strlen (message), message);
 #endif
+
+  gthree_renderer_push_gpu_timer (renderer, message);
+  g_free (message);
 }
 
 static void
-pop_debug_group (void)
+pop_debug_group (GthreeRenderer *renderer)
 {
 #ifdef DEBUG_GROUPS
   glPopDebugGroupKHR ();
 #endif
+
+  gthree_renderer_pop_gpu_timer (renderer);
 }
 
 
@@ -307,6 +728,7 @@ gthree_renderer_init (GthreeRenderer *renderer)
   priv->auto_clear_stencil = TRUE;
   priv->clear_alpha = 1.0;
   priv->sort_objects = TRUE;
+  priv->auto_reset_info = TRUE;
   priv->width = 1;
   priv->height = 1;
   priv->pixel_ratio = 1;
@@ -326,6 +748,7 @@ gthree_renderer_init (GthreeRenderer *renderer)
   priv->light_setup.directional = g_ptr_array_new ();
   priv->light_setup.directional_shadow_map = g_ptr_array_new ();
   priv->light_setup.directional_shadow_map_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
+  priv->light_setup.directional_shadow_cascade_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
   priv->light_setup.point = g_ptr_array_new ();
   priv->light_setup.point_shadow_map = g_ptr_array_new ();
   priv->light_setup.point_shadow_map_matrix = g_array_new (FALSE, FALSE, sizeof (graphene_matrix_t));
@@ -335,7 +758,19 @@ gthree_renderer_init (GthreeRenderer *renderer)
   priv->light_setup.shadow = g_ptr_array_new ();
   priv->light_setup.hemi = g_ptr_array_new ();
 
-  priv->current_render_list = gthree_render_list_new ();
+  priv->immediate_render_list = gthree_render_list_new ();
+  priv->current_render_list = priv->immediate_render_list;
+  priv->retained_lists = g_ptr_array_new_with_free_func ((GDestroyNotify)retained_list_free);
+  priv->object_lights = g_array_new (FALSE, FALSE, sizeof (ObjectLight));
+  priv->shadow_casters = g_array_new (FALSE, FALSE, sizeof (GthreeShadowCaster));
+  priv->shadow_caster_sources = g_array_new (FALSE, FALSE, sizeof (guint));
+  priv->shadow_caster_candidates = g_array_new (FALSE, FALSE, sizeof (ShadowCasterCandidate));
+  priv->shadow_caster_x = g_array_new (FALSE, FALSE, sizeof (float));
+  priv->shadow_caster_y = g_array_new (FALSE, FALSE, sizeof (float));
+  priv->shadow_caster_z = g_array_new (FALSE, FALSE, sizeof (float));
+  priv->shadow_caster_radius = g_array_new (FALSE, FALSE, sizeof (float));
+  priv->shadow_caster_visible = g_array_new (FALSE, FALSE, sizeof (guint8));
+  priv->shadow_atlas_entries = g_array_new (FALSE, FALSE, sizeof (ShadowAtlasEntry));
 
   priv->old_blending = -1;
   priv->old_blend_equation = -1;
@@ -346,9 +781,20 @@ gthree_renderer_init (GthreeRenderer *renderer)
 
   gthree_set_default_gl_state (renderer);
 
-  /* We only use one vao, so bind it here */
-  glGenVertexArrays (1, &priv->vertex_array_object);
-  glBindVertexArray (priv->vertex_array_object);
+  glGenVertexArrays (1, &priv->default_vertex_array.vao);
+
+  glGenBuffers (GTHREE_UNIFORM_BLOCK_N_BLOCKS, priv->uniform_buffers);
+  priv->lights_block = g_byte_array_new ();
+  {
+    /* Give the blocks some storage so binding them is always valid */
+    static const guint8 zeros[sizeof (GthreeCameraBlock)] = { 0 };
+
+    upload_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_CAMERA, zeros, sizeof (GthreeCameraBlock));
+    upload_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_LIGHTS, zeros, 16);
+    upload_uniform_block (renderer, GTHREE_UNIFORM_BLOCK_FOG, zeros, sizeof (GthreeFogBlock));
+  }
+  priv->vertex_arrays = g_hash_table_new_full (vertex_array_hash, vertex_array_equal,
+                                               NULL, (GDestroyNotify)vertex_array_free);
 
   // GPU capabilities
   glGetIntegerv (GL_MAX_TEXTURE_IMAGE_UNITS, &priv->max_textures);
@@ -365,6 +811,22 @@ gthree_renderer_init (GthreeRenderer *renderer)
     priv->supports_vertex_textures &&
     epoxy_has_gl_extension("GL_ARB_texture_float");
 
+  priv->supports_parallel_shader_compile =
+    epoxy_has_gl_extension("GL_KHR_parallel_shader_compile");
+  if (priv->supports_parallel_shader_compile)
+    glMaxShaderCompilerThreadsKHR (0xFFFFFFFF);
+
+  priv->supports_timer_query =
+    epoxy_is_desktop_gl () &&
+    (epoxy_gl_version () >= 33 || epoxy_has_gl_extension("GL_ARB_timer_query"));
+
+  if (epoxy_is_desktop_gl ())
+    priv->supports_occlusion_query =
+      epoxy_gl_version () >= 33 || epoxy_has_gl_extension("GL_ARB_occlusion_query2");
+  else
+    priv->supports_occlusion_query =
+      epoxy_gl_version () >= 30 || epoxy_has_gl_extension("GL_EXT_occlusion_query_boolean");
+
   //priv->compressed_texture_formats = _glExtensionCompressedTextureS3TC ? glGetParameter( _gl.COMPRESSED_TEXTURE_FORMATS ) : [];
 
   gthree_renderer_pop_current (renderer);
@@ -390,6 +852,7 @@ gthree_renderer_finalize (GObject *obj)
 {
   GthreeRenderer *renderer = GTHREE_RENDERER (obj);
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i;
 
   g_assert (priv->realized_resources->len == 0);
 
@@ -402,6 +865,8 @@ gthree_renderer_finalize (GObject *obj)
     g_ptr_array_unref (priv->shadowmap_depth_materials);
   if (priv->shadowmap_distance_materials)
     g_ptr_array_unref (priv->shadowmap_distance_materials);
+  if (priv->shadowmap_basic_depth_materials)
+    g_ptr_array_unref (priv->shadowmap_basic_depth_materials);
 
   gthree_program_cache_free (priv->program_cache);
 
@@ -410,9 +875,11 @@ gthree_renderer_finalize (GObject *obj)
   g_array_free (priv->global_clipping_state, TRUE);
 
   g_list_free (priv->lights);
+  g_list_free (priv->shadows);
   g_ptr_array_free (priv->light_setup.directional, TRUE);
   g_ptr_array_free (priv->light_setup.directional_shadow_map, TRUE);
   g_array_free (priv->light_setup.directional_shadow_map_matrix, TRUE);
+  g_array_free (priv->light_setup.directional_shadow_cascade_matrix, TRUE);
   g_ptr_array_free (priv->light_setup.point, TRUE);
   g_ptr_array_free (priv->light_setup.point_shadow_map, TRUE);
   g_array_free (priv->light_setup.point_shadow_map_matrix, TRUE);
@@ -422,7 +889,38 @@ gthree_renderer_finalize (GObject *obj)
   g_ptr_array_free (priv->light_setup.shadow, TRUE);
   g_ptr_array_free (priv->light_setup.hemi, TRUE);
 
-  gthree_render_list_free (priv->current_render_list);
+  gthree_render_list_free (priv->immediate_render_list);
+  g_ptr_array_unref (priv->retained_lists);
+
+  g_hash_table_unref (priv->vertex_arrays);
+  glDeleteVertexArrays (1, &priv->default_vertex_array.vao);
+
+  glDeleteBuffers (GTHREE_UNIFORM_BLOCK_N_BLOCKS, priv->uniform_buffers);
+  g_byte_array_unref (priv->lights_block);
+
+  if (priv->gpu_timer)
+    gthree_gpu_timer_free (priv->gpu_timer);
+
+  if (priv->occlusion_culler)
+    gthree_occlusion_culler_free (priv->occlusion_culler);
+  g_clear_object (&priv->occlusion_box_mesh);
+  if (priv->depth_culler)
+    gthree_depth_culler_free (priv->depth_culler);
+  if (priv->light_clusters)
+    gthree_light_clusters_free (priv->light_clusters);
+  for (i = 0; i < N_PADDING_LIGHTS; i++)
+    g_clear_object (&priv->padding_lights[i]);
+  g_array_unref (priv->object_lights);
+  g_array_unref (priv->shadow_casters);
+  g_array_unref (priv->shadow_caster_sources);
+  g_array_unref (priv->shadow_caster_candidates);
+  g_array_unref (priv->shadow_caster_x);
+  g_array_unref (priv->shadow_caster_y);
+  g_array_unref (priv->shadow_caster_z);
+  g_array_unref (priv->shadow_caster_radius);
+  g_array_unref (priv->shadow_caster_visible);
+  g_array_unref (priv->shadow_atlas_entries);
+  g_clear_object (&priv->shadow_atlas);
 
   g_clear_object (&priv->bg_box_mesh);
   g_clear_object (&priv->bg_plane_mesh);
@@ -444,27 +942,41 @@ gthree_renderer_class_init (GthreeRendererClass *klass)
 {
   G_OBJECT_CLASS (klass)->finalize = gthree_renderer_finalize;
 
+  /**
+   * GthreeRenderer::gpu-timings:
+   * @renderer: the #GthreeRenderer
+   *
+   * Emitted when the GPU times of an earlier frame have been read back,
+   * see gthree_renderer_set_gpu_timing_enabled().
+   */
+  signals[GPU_TIMINGS] =
+    g_signal_new ("gpu-timings",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL,
+                  NULL,
+                  G_TYPE_NONE, 0);
+
 #define INIT_QUARK(name) q_##name = g_quark_from_static_string (#name)
   INIT_QUARK(position);
   INIT_QUARK(color);
   INIT_QUARK(uv);
   INIT_QUARK(uv2);
   INIT_QUARK(normal);
-  INIT_QUARK(viewMatrix);
   INIT_QUARK(modelMatrix);
   INIT_QUARK(modelViewMatrix);
   INIT_QUARK(normalMatrix);
-  INIT_QUARK(projectionMatrix);
-  INIT_QUARK(cameraPosition);
   INIT_QUARK(clippingPlanes);
-  INIT_QUARK(ambientLightColor);
-  INIT_QUARK(directionalLights);
-  INIT_QUARK(hemisphereLights);
-  INIT_QUARK(pointLights);
-  INIT_QUARK(spotLights);
   INIT_QUARK(bindMatrix);
   INIT_QUARK(bindMatrixInverse);
   INIT_QUARK(boneMatrices);
+  INIT_QUARK(instanceMatrix);
+  INIT_QUARK(instanceColor);
+  INIT_QUARK(clusterLightData);
+  INIT_QUARK(clusterGrid);
+  INIT_QUARK(clusterLightIndices);
+  q_objectPointLights = g_quark_from_static_string ("objectPointLights[0]");
+  q_objectSpotLights = g_quark_from_static_string ("objectSpotLights[0]");
 
   graphene_vec3_init (&cube_directions[0],  1,  0,  0);
   graphene_vec3_init (&cube_directions[1], -1,  0,  0);
@@ -531,6 +1043,9 @@ do_delete (GthreeResourceKind kind,
     case GTHREE_RESOURCE_KIND_RENDERBUFFER:
       glDeleteRenderbuffers (1, &id);
       break;
+    case GTHREE_RESOURCE_KIND_VERTEX_ARRAY:
+      glDeleteVertexArrays (1, &id);
+      break;
     }
 }
 
@@ -593,6 +1108,8 @@ gthree_renderer_unrealize (GthreeRenderer *renderer)
       /* TEST */ g_assert (!g_ptr_array_find (priv->realized_resources, resource, NULL));
     }
 
+  g_hash_table_remove_all (priv->vertex_arrays);
+
   gthree_renderer_flush_deletes (renderer);
 
   /* TODO: Move pure render unrealize here from finalize */
@@ -852,6 +1369,38 @@ gthree_renderer_set_shadow_map_enabled (GthreeRenderer     *renderer,
   priv->shadowmap_enabled = enabled;
 }
 
+GthreeShadowMapType
+gthree_renderer_get_shadow_map_type (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_type;
+}
+
+/**
+ * gthree_renderer_set_shadow_map_type:
+ * @renderer: a #GthreeRenderer
+ * @type: how shadow maps are stored and filtered
+ *
+ * Sets how shadows are looked up in the shadow maps. The default is
+ * %GTHREE_SHADOW_MAP_TYPE_PCF.
+ *
+ * With %GTHREE_SHADOW_MAP_TYPE_PCF_HARDWARE the maps are depth textures
+ * without a color buffer, so the shadow pass only writes depth, and
+ * the lighting shaders let the texture units do the depth comparison
+ * and bilinear filtering, needing a few samples where the other types
+ * unpack and compare many. The other types store the depth packed in
+ * the colors, which works everywhere.
+ */
+void
+gthree_renderer_set_shadow_map_type (GthreeRenderer     *renderer,
+                                     GthreeShadowMapType type)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadowmap_type = type;
+}
+
 gboolean
 gthree_renderer_get_shadow_map_auto_update (GthreeRenderer     *renderer)
 {
@@ -860,6 +1409,23 @@ gthree_renderer_get_shadow_map_auto_update (GthreeRenderer     *renderer)
   return priv->shadowmap_auto_update;
 }
 
+/**
+ * gthree_renderer_set_shadow_map_auto_update:
+ * @renderer: a #GthreeRenderer
+ * @auto_update: whether to keep the shadow maps up to date
+ *
+ * Sets whether the shadow maps are updated every frame. When they are,
+ * the map of a light is only rendered again if the light or its shadow
+ * camera moved, or if a caster seen by the light moved, changed shape
+ * or was added or removed. Skinned and morphed casters are assumed to
+ * change every frame. Casters that can't shadow anything in view of
+ * the camera are left out of the maps, so a caster coming into play as
+ * the camera moves also counts as added.
+ *
+ * When auto update is off, the maps are only rendered after
+ * gthree_renderer_set_shadow_map_needs_update(), which also ignores
+ * what is cached.
+ */
 void
 gthree_renderer_set_shadow_map_auto_update (GthreeRenderer     *renderer,
                                             gboolean            auto_update)
@@ -886,6 +1452,39 @@ gthree_renderer_set_shadow_map_needs_update (GthreeRenderer     *renderer,
   priv->shadowmap_needs_update = needs_update;
 }
 
+/**
+ * gthree_renderer_set_shadow_atlas_size:
+ * @renderer: a #GthreeRenderer
+ * @size: the width and height of the atlas, or 0
+ *
+ * Makes the shadow maps of all lights share one square @size by @size
+ * texture, rather than each light having its own. The shadow pass then
+ * renders into a single framebuffer, and the lighting shaders sample a
+ * single texture instead of one per shadow casting light.
+ *
+ * Each map keeps the size set with gthree_light_shadow_set_map_size(),
+ * unless they don't all fit, in which case they are all scaled down
+ * by the same power of two.
+ *
+ * The default is 0, which gives each light its own map.
+ */
+void
+gthree_renderer_set_shadow_atlas_size (GthreeRenderer     *renderer,
+                                       int                 size)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->shadow_atlas_size = MAX (size, 0);
+}
+
+int
+gthree_renderer_get_shadow_atlas_size (GthreeRenderer     *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadow_atlas_size;
+}
+
 void
 gthree_renderer_set_local_clipping_enabled (GthreeRenderer     *renderer,
                                             gboolean            enabled)
@@ -1364,6 +1963,167 @@ set_blending (GthreeRenderer *renderer,
     }
 }
 
+/* If the scene keeps a bounding volume hierarchy, objects in it that
+ * may be visible were stamped with bvh_serial by gthree_scene_bvh_cull(),
+ * so anything else can be rejected without looking at its bounds, and
+ * those it found entirely inside the frustum need no test at all. */
+static gboolean
+object_in_frustum (GthreeObject             *object,
+                   const graphene_frustum_t *frustum,
+                   guint32                   bvh_serial)
+{
+  if (!gthree_object_get_is_frustum_culled (object))
+    return TRUE;
+
+  if (bvh_serial != 0 &&
+      gthree_object_get_bvh_leaf (object) >= 0)
+    {
+      if (gthree_object_get_bvh_serial (object) != bvh_serial)
+        return FALSE;
+      if (gthree_object_get_bvh_inside (object))
+        return TRUE;
+    }
+
+  return gthree_object_is_in_frustum (object, frustum);
+}
+
+static void
+collect_occluders (GthreeRenderer *renderer,
+                   GthreeObject   *object,
+                   GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeObject *child;
+  GthreeObjectIter iter;
+
+  if (!gthree_object_get_shown (object) ||
+      !gthree_object_subtree_has_occluders (object))
+    return;
+
+  /* Animated meshes don't have their final shape in the geometry */
+  if (gthree_object_get_is_occluder (object) &&
+      GTHREE_IS_MESH (object) &&
+      !GTHREE_IS_SKINNED_MESH (object) &&
+      !GTHREE_IS_INSTANCED_MESH (object) &&
+      !gthree_mesh_has_morph_targets (GTHREE_MESH (object)) &&
+      gthree_mesh_get_draw_mode (GTHREE_MESH (object)) == GTHREE_DRAW_MODE_TRIANGLES &&
+      gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))) &&
+      object_in_frustum (object, &priv->frustum, priv->bvh_serial))
+    {
+      GthreeMesh *mesh = GTHREE_MESH (object);
+      GthreeGeometry *geometry = gthree_mesh_get_occluder_geometry (mesh);
+
+      if (geometry == NULL)
+        geometry = gthree_mesh_get_geometry (mesh);
+
+      if (geometry)
+        gthree_depth_culler_add_geometry (priv->depth_culler,
+                                          gthree_object_get_world_matrix (object),
+                                          geometry);
+    }
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    collect_occluders (renderer, child, camera);
+}
+
+/* Rasterizes the occluders in view into the software depth buffer */
+static void
+update_depth_culler (GthreeRenderer *renderer,
+                     GthreeScene    *scene,
+                     GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  float aspect = 1;
+
+  priv->depth_culler_active = FALSE;
+
+  if (!priv->software_occlusion_culling)
+    {
+      g_clear_pointer (&priv->depth_culler, gthree_depth_culler_free);
+      return;
+    }
+
+  if (priv->depth_culler == NULL)
+    priv->depth_culler = gthree_depth_culler_new ();
+
+  if (priv->current_viewport.size.height > 0)
+    aspect = priv->current_viewport.size.width / priv->current_viewport.size.height;
+
+  gthree_depth_culler_begin (priv->depth_culler, &priv->proj_screen_matrix, aspect);
+  collect_occluders (renderer, GTHREE_OBJECT (scene), camera);
+
+  if (gthree_depth_culler_get_n_triangles (priv->depth_culler) == 0)
+    return;
+
+  gthree_depth_culler_rasterize (priv->depth_culler);
+  priv->info.occluder_triangles += gthree_depth_culler_get_n_triangles (priv->depth_culler);
+  priv->depth_culler_active = TRUE;
+}
+
+static gboolean
+is_behind_occluders (GthreeRenderer *renderer,
+                     GthreeObject   *object)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  graphene_sphere_t sphere;
+  graphene_box_t box;
+
+  /* Don't let occluders hide each other, they are usually big and
+   * close to each other, so the test would mostly fail anyway */
+  if (gthree_object_get_is_occluder (object))
+    return FALSE;
+
+  if (GTHREE_IS_MESH (object) && !GTHREE_IS_INSTANCED_MESH (object) &&
+      gthree_mesh_get_geometry (GTHREE_MESH (object)) != NULL)
+    {
+      /* Tighter than the bounding sphere */
+      graphene_matrix_transform_box (gthree_object_get_world_matrix (object),
+                                     gthree_geometry_get_bounding_box (gthree_mesh_get_geometry (GTHREE_MESH (object))),
+                                     &box);
+    }
+  else if (gthree_object_get_bounding_sphere (object, &sphere))
+    {
+      graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object), &sphere, &sphere);
+      graphene_sphere_get_bounding_box (&sphere, &box);
+    }
+  else
+    return FALSE;
+
+  return !gthree_depth_culler_test_box (priv->depth_culler, &box);
+}
+
+/* Out of view subtrees are skipped by project_object(), but the levels
+ * of the LODs in them are still picked, and the skeletons of skinned
+ * meshes casting shadows still posed, as they may cast shadows into
+ * the view */
+static void
+update_culled_subtree (GthreeObject *object,
+                       GthreeCamera *camera)
+{
+  GthreeObject *child;
+  GthreeObjectIter iter;
+
+  if (!gthree_object_get_shown (object) ||
+      !(gthree_object_subtree_has_lods (object) ||
+        gthree_object_subtree_has_skins (object)))
+    return;
+
+  if (GTHREE_IS_LOD (object) && gthree_lod_get_auto_update (GTHREE_LOD (object)))
+    gthree_lod_update (GTHREE_LOD (object), camera);
+
+  if (GTHREE_IS_SKINNED_MESH (object) && gthree_object_get_cast_shadow (object))
+    {
+      GthreeSkeleton *skeleton = gthree_skinned_mesh_get_skeleton (GTHREE_SKINNED_MESH (object));
+      if (skeleton)
+        gthree_skeleton_update (skeleton);
+    }
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    update_culled_subtree (child, camera);
+}
+
 static void
 project_object (GthreeRenderer *renderer,
                 GthreeScene    *scene,
@@ -1375,9 +2135,21 @@ project_object (GthreeRenderer *renderer,
   GthreeObjectIter iter;
   float z = 0;
 
-  if (!gthree_object_get_visible (object))
+  if (!gthree_object_get_shown (object))
     return;
 
+  /* Skip whole subtrees that are out of view, unless we need their lights */
+  if (gthree_object_get_n_children (object) > 0 &&
+      !gthree_object_subtree_has_lights (object) &&
+      !gthree_object_subtree_in_frustum (object, &priv->frustum))
+    {
+      update_culled_subtree (object, camera);
+      return;
+    }
+
+  if (GTHREE_IS_LOD (object) && gthree_lod_get_auto_update (GTHREE_LOD (object)))
+    gthree_lod_update (GTHREE_LOD (object), camera);
+
   if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))))
     {
       if (GTHREE_IS_GROUP (object))
@@ -1388,9 +2160,10 @@ project_object (GthreeRenderer *renderer,
         }
       else if (GTHREE_IS_LIGHT (object))
         {
-          priv->lights = g_list_append (priv->lights, object);
+          /* Reversed once the walk is done */
+          priv->lights = g_list_prepend (priv->lights, object);
           if (gthree_object_get_cast_shadow (object))
-            priv->shadows = g_list_append (priv->shadows, object);
+            priv->shadows = g_list_prepend (priv->shadows, object);
         }
       else if (GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object))
         {
@@ -1401,8 +2174,17 @@ project_object (GthreeRenderer *renderer,
                 gthree_skeleton_update (skeleton);
             }
 
-          if (!gthree_object_get_is_frustum_culled (object) || gthree_object_is_in_frustum (object, &priv->frustum))
+          if (!object_in_frustum (object, &priv->frustum, priv->bvh_serial))
+            priv->info.objects_culled++;
+          else if (priv->depth_culler_active && is_behind_occluders (renderer, object))
+            {
+              priv->info.objects_drawn++;
+              priv->info.objects_occluded++;
+            }
+          else
             {
+              priv->info.objects_drawn++;
+
               gthree_object_update (object, renderer);
 
               if (priv->sort_objects)
@@ -1430,20 +2212,307 @@ project_object (GthreeRenderer *renderer,
     project_object (renderer, scene, child, camera);
 }
 
+static void retained_list_weak_notify (gpointer  data,
+                                       GObject  *where_the_object_was);
+
 static void
-material_apply_light_setup (GthreeUniforms *m_uniforms,
-                            GthreeLightSetup *light_setup,
-                            gboolean update_only)
+retained_list_free (RetainedList *retained)
 {
-  gthree_uniforms_set_vec3 (m_uniforms, "ambientLightColor", &light_setup->ambient);
-
-  gthree_uniforms_set_uarray (m_uniforms, "directionalLights", light_setup->directional, update_only);
-  gthree_uniforms_set_uarray (m_uniforms, "pointLights", light_setup->point, update_only);
-  gthree_uniforms_set_uarray (m_uniforms, "spotLights", light_setup->spot, update_only);
-  gthree_uniforms_set_uarray (m_uniforms, "hemisphereLights", light_setup->hemi, update_only);
+  if (retained->scene)
+    g_object_weak_unref (G_OBJECT (retained->scene), retained_list_weak_notify, retained);
+  if (retained->camera)
+    g_object_weak_unref (G_OBJECT (retained->camera), retained_list_weak_notify, retained);
+
+  g_array_unref (retained->entries);
+  g_ptr_array_unref (retained->lods);
+  g_list_free (retained->lights);
+  g_list_free (retained->shadows);
+  gthree_render_list_free (retained->render_list);
+  g_free (retained);
+}
 
+static void
+retained_list_weak_notify (gpointer  data,
+                           GObject  *where_the_object_was)
+{
+  RetainedList *retained = data;
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (retained->renderer);
+
+  /* The weak ref of the dying object is already gone */
+  if ((GObject *)retained->scene == where_the_object_was)
+    retained->scene = NULL;
+  if ((GObject *)retained->camera == where_the_object_was)
+    retained->camera = NULL;
+
+  g_ptr_array_remove_fast (priv->retained_lists, retained);
+}
+
+static RetainedList *
+get_retained_list (GthreeRenderer *renderer,
+                   GthreeScene    *scene,
+                   GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  RetainedList *retained;
+  int i;
+
+  for (i = 0; i < priv->retained_lists->len; i++)
+    {
+      retained = g_ptr_array_index (priv->retained_lists, i);
+      if (retained->scene == scene && retained->camera == camera)
+        return retained;
+    }
+
+  retained = g_new0 (RetainedList, 1);
+  retained->renderer = renderer;
+  retained->scene = scene;
+  retained->camera = camera;
+  retained->entries = g_array_new (FALSE, FALSE, sizeof (RetainedEntry));
+  retained->lods = g_ptr_array_new ();
+  retained->render_list = gthree_render_list_new ();
+
+  g_object_weak_ref (G_OBJECT (scene), retained_list_weak_notify, retained);
+  g_object_weak_ref (G_OBJECT (camera), retained_list_weak_notify, retained);
+  g_ptr_array_add (priv->retained_lists, retained);
+
+  return retained;
+}
+
+/* Like project_object(), but collects everything the camera could see
+ * from anywhere, leaving culling to project_retained() */
+static void
+retain_object (RetainedList *retained,
+               GthreeObject *object,
+               GthreeCamera *camera)
+{
+  GthreeObject *child;
+  GthreeObjectIter iter;
+
+  if (!gthree_object_get_shown (object))
+    return;
+
+  if (GTHREE_IS_LOD (object) && gthree_lod_get_auto_update (GTHREE_LOD (object)))
+    {
+      gthree_lod_update (GTHREE_LOD (object), camera);
+      g_ptr_array_add (retained->lods, object);
+    }
+
+  if (gthree_object_check_layer (object, retained->layer_mask))
+    {
+      if (GTHREE_IS_LIGHT (object))
+        {
+          retained->lights = g_list_prepend (retained->lights, object);
+          if (gthree_object_get_cast_shadow (object))
+            retained->shadows = g_list_prepend (retained->shadows, object);
+        }
+      else if (GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object))
+        {
+          RetainedEntry entry = { object };
+
+          g_array_append_val (retained->entries, entry);
+        }
+    }
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    retain_object (retained, child, camera);
+}
+
+static gboolean
+retained_list_is_current (RetainedList *retained,
+                          GthreeCamera *camera,
+                          gboolean      sort_objects)
+{
+  return
+    retained->valid &&
+    retained->serial == gthree_render_lists_get_serial () &&
+    retained->layer_mask == gthree_object_get_layer_mask (GTHREE_OBJECT (camera)) &&
+    retained->sort_objects == sort_objects;
+}
+
+/* Does the work of project_object() on the objects found in an earlier
+ * frame, and only redoes what changed. The scene graph is only walked
+ * again if its structure, visibility or materials changed, objects are
+ * only culled again if they or the camera moved, and the render list is
+ * only rebuilt or sorted again if the outcome differs. */
+static void
+project_retained (GthreeRenderer *renderer,
+                  GthreeScene    *scene,
+                  GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  RetainedList *retained = get_retained_list (renderer, scene, camera);
+  GthreeRenderList *list = retained->render_list;
+  gboolean camera_moved, refill = FALSE, resort = FALSE;
+  int i;
+
+  /* Switching levels changes visibility, which invalidates the list */
+  if (retained_list_is_current (retained, camera, priv->sort_objects))
+    {
+      for (i = 0; i < retained->lods->len; i++)
+        gthree_lod_update (g_ptr_array_index (retained->lods, i), camera);
+    }
+
+  if (!retained_list_is_current (retained, camera, priv->sort_objects))
+    {
+      g_array_set_size (retained->entries, 0);
+      g_ptr_array_set_size (retained->lods, 0);
+      g_clear_pointer (&retained->lights, g_list_free);
+      g_clear_pointer (&retained->shadows, g_list_free);
+
+      retained->layer_mask = gthree_object_get_layer_mask (GTHREE_OBJECT (camera));
+      retained->sort_objects = priv->sort_objects;
+      retain_object (retained, GTHREE_OBJECT (scene), camera);
+      retained->lights = g_list_reverse (retained->lights);
+      retained->shadows = g_list_reverse (retained->shadows);
+
+      /* After the walk, as it may have switched levels */
+      retained->serial = gthree_render_lists_get_serial ();
+      retained->valid = TRUE;
+
+      camera_moved = TRUE;
+      refill = TRUE;
+    }
+  else
+    camera_moved = !graphene_matrix_equal_fast (&retained->proj_screen_matrix, &priv->proj_screen_matrix);
+
+  retained->proj_screen_matrix = priv->proj_screen_matrix;
+
+  priv->lights = g_list_copy (retained->lights);
+  priv->shadows = g_list_copy (retained->shadows);
+
+  for (i = 0; i < retained->entries->len; i++)
+    {
+      RetainedEntry *entry = &g_array_index (retained->entries, RetainedEntry, i);
+      GthreeObject *object = entry->object;
+      guint32 bounds_serial = gthree_object_get_bounds_serial (object);
+      gboolean drawn;
+
+      if (GTHREE_IS_SKINNED_MESH (object))
+        {
+          GthreeSkeleton *skeleton = gthree_skinned_mesh_get_skeleton (GTHREE_SKINNED_MESH (object));
+          if (skeleton)
+            gthree_skeleton_update (skeleton);
+        }
+
+      /* The bounds serial also moves when the geometry bounds change,
+       * see gthree_object_check_geometry_bounds(), which ran from
+       * gthree_object_update_matrix_world() before we got here */
+      if (camera_moved || refill || entry->bounds_serial != bounds_serial)
+        {
+          gboolean in_frustum = object_in_frustum (object, &priv->frustum, priv->bvh_serial);
+
+          entry->bounds_serial = bounds_serial;
+          if (in_frustum != entry->in_frustum)
+            {
+              entry->in_frustum = in_frustum;
+              refill = TRUE;
+            }
+
+          if (in_frustum && priv->sort_objects)
+            {
+              graphene_vec4_t vector;
+              float z;
+
+              graphene_matrix_get_row (gthree_object_get_world_matrix (object), 3, &vector);
+              graphene_matrix_transform_vec4 (&priv->proj_screen_matrix, &vector, &vector);
+              z = graphene_vec4_get_z (&vector) / graphene_vec4_get_w (&vector);
+
+              if (z != entry->z)
+                {
+                  entry->z = z;
+                  resort = TRUE;
+                }
+            }
+        }
+
+      if (!entry->in_frustum)
+        {
+          priv->info.objects_culled++;
+          drawn = FALSE;
+        }
+      else
+        {
+          priv->info.objects_drawn++;
+          drawn = !(priv->depth_culler_active && is_behind_occluders (renderer, object));
+          if (!drawn)
+            priv->info.objects_occluded++;
+        }
+
+      if (drawn != entry->drawn)
+        {
+          entry->drawn = drawn;
+          refill = TRUE;
+        }
+
+      if (drawn)
+        gthree_object_update (object, renderer);
+    }
+
+  priv->current_render_list = list;
+
+  if (refill)
+    {
+      gthree_render_list_init (list);
+
+      for (i = 0; i < retained->entries->len; i++)
+        {
+          RetainedEntry *entry = &g_array_index (retained->entries, RetainedEntry, i);
+
+          if (!entry->drawn)
+            continue;
+
+          list->current_z = entry->z;
+          entry->first_item = list->items->len;
+          gthree_object_fill_render_list (entry->object, list);
+          entry->n_items = list->items->len - entry->first_item;
+        }
+
+      retained->n_items = list->items->len;
+      list->current_z = 0;
+
+      if (priv->sort_objects)
+        gthree_render_list_sort (list);
+      retained->keys_stale = TRUE;
+    }
+  else
+    {
+      /* Drop the background from the last frame */
+      g_array_set_size (list->items, retained->n_items);
+      g_array_set_size (list->background, 0);
+
+      if (priv->sort_objects && (resort || retained->keys_stale))
+        {
+          for (i = 0; i < retained->entries->len; i++)
+            {
+              RetainedEntry *entry = &g_array_index (retained->entries, RetainedEntry, i);
+              guint j;
+
+              if (!entry->drawn)
+                continue;
+
+              for (j = entry->first_item; j < entry->first_item + entry->n_items; j++)
+                g_array_index (list->items, GthreeRenderListItem, j).z = entry->z;
+            }
+
+          render_list_update_keys (list);
+          gthree_render_list_sort (list);
+          retained->keys_stale = FALSE;
+        }
+    }
+}
+
+static void
+material_apply_light_setup (GthreeUniforms *m_uniforms,
+                            GthreeLightSetup *light_setup,
+                            gboolean update_only)
+{
+  /* The light parameters are in the GthreeLights uniform block, only the
+     shadow maps and matrices are per-program uniforms */
   gthree_uniforms_set_texture_array (m_uniforms, "directionalShadowMap", light_setup->directional_shadow_map);
   gthree_uniforms_set_matrix4_array (m_uniforms, "directionalShadowMatrix", light_setup->directional_shadow_map_matrix);
+  gthree_uniforms_set_matrix4_array (m_uniforms, "directionalShadowCascadeMatrix", light_setup->directional_shadow_cascade_matrix);
+  gthree_uniforms_set_texture (m_uniforms, "shadowAtlas", light_setup->shadow_atlas);
 
   gthree_uniforms_set_texture_array (m_uniforms, "spotShadowMap", light_setup->spot_shadow_map);
   gthree_uniforms_set_matrix4_array (m_uniforms, "spotShadowMatrix", light_setup->spot_shadow_map_matrix);
@@ -1452,19 +2521,18 @@ material_apply_light_setup (GthreeUniforms *m_uniforms,
   gthree_uniforms_set_matrix4_array (m_uniforms, "pointShadowMatrix", light_setup->point_shadow_map_matrix);
 }
 
+/* Looks up (or starts building) the program needed to draw the object
+ * with the material in the current light and clipping state */
 static GthreeProgram *
-init_material (GthreeRenderer *renderer,
-               GthreeMaterial *material,
-               GthreeFog *fog,
-               GthreeObject *object)
+get_material_program (GthreeRenderer *renderer,
+                      GthreeMaterial *material,
+                      GthreeFog *fog,
+                      GthreeObject *object)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  GthreeProgram *program;
   GthreeShader *shader;
   GthreeProgramParameters parameters = {0};
-  GthreeUniforms *m_uniforms;
   int max_bones;
-  GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
 
   shader = gthree_material_get_shader (material);
 
@@ -1477,12 +2545,16 @@ init_material (GthreeRenderer *renderer,
   // TODO: Get encoding from currentRenderTarget if set
   parameters.output_encoding = GTHREE_ENCODING_FORMAT_GAMMA;
   parameters.physically_correct_lights = priv->physically_correct_lights;
+  parameters.clustered_lights = priv->light_setup.hash.clustered;
 
   gthree_material_set_params (material, &parameters);
   parameters.num_dir_lights = priv->light_setup.directional->len;
   parameters.num_point_lights = priv->light_setup.point->len;
   parameters.num_spot_lights = priv->light_setup.spot->len;
   parameters.num_hemi_lights = priv->light_setup.hemi->len;
+  parameters.num_point_light_shadows = priv->light_setup.hash.num_point_shadow;
+  parameters.num_spot_light_shadows = priv->light_setup.hash.num_spot_shadow;
+  parameters.max_object_lights = priv->light_setup.hash.max_object_lights;
 
   max_bones = 0;
   if (GTHREE_IS_SKINNED_MESH (object))
@@ -1499,10 +2571,16 @@ init_material (GthreeRenderer *renderer,
   parameters.morph_targets = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material));
   parameters.morph_normals = GTHREE_IS_MESH_MATERIAL (material) && gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material));
 
+  parameters.instancing = GTHREE_IS_INSTANCED_MESH (object);
+  parameters.instancing_color = GTHREE_IS_INSTANCED_MESH (object) &&
+    gthree_instanced_mesh_get_instance_color (GTHREE_INSTANCED_MESH (object)) != NULL;
+
   parameters.num_clipping_planes = priv->num_clipping_planes;
   parameters.num_clip_intersection = priv->num_clipping_intersections;
 
   parameters.shadow_map_enabled = priv->shadowmap_enabled && gthree_object_get_receive_shadow (object) && priv->shadows != NULL;
+  parameters.shadow_cascades = parameters.shadow_map_enabled && priv->light_setup.hash.shadow_cascades;
+  parameters.shadow_atlas = parameters.shadow_map_enabled && priv->light_setup.hash.shadow_atlas;
   parameters.shadow_map_type = priv->shadowmap_type;
 
   parameters.fog = fog != NULL;
@@ -1524,10 +2602,29 @@ init_material (GthreeRenderer *renderer,
     };
 #endif
 
-  program = gthree_program_cache_get (priv->program_cache, shader, &parameters, renderer);
-  /* This is owned by the cache, so it will live as long as the renderer (as it owns the cache and it never frees) */
-  /* This isn't a ref to avoid leaking the program until something else uses the material */
+  return gthree_program_cache_get (priv->program_cache, shader, &parameters, renderer);
+}
+
+static GthreeProgram *
+init_material (GthreeRenderer *renderer,
+               GthreeMaterial *material,
+               GthreeFog *fog,
+               GthreeObject *object)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeProgram *program;
+  GthreeShader *shader;
+  GthreeUniforms *m_uniforms;
+  GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  gboolean instancing = GTHREE_IS_INSTANCED_MESH (object);
+
+  shader = gthree_material_get_shader (material);
+
+  program = get_material_program (renderer, material, fog, object);
+  /* This is owned by the cache, which keeps it alive as long as some material uses it */
+  gthree_program_cache_set_material_program (priv->program_cache, material, program);
   material_properties->program = program;
+  material_properties->program_id = gthree_program_get_id (program);
 
   // TODO: thee.js uses the lightstate current_hash and other stuff to avoid some stuff here?
   // I think it caches the material uniforms we calculate here and avoid reloading if switching to a new program?
@@ -1589,6 +2686,9 @@ init_material (GthreeRenderer *renderer,
     }
 
   material_properties->fog = fog;
+  material_properties->instancing = instancing;
+  material_properties->instancing_color = instancing &&
+    gthree_instanced_mesh_get_instance_color (GTHREE_INSTANCED_MESH (object)) != NULL;
 
   material_apply_light_setup (m_uniforms, &priv->light_setup, FALSE);
 
@@ -1622,6 +2722,129 @@ print_matrix4 (float *s)
 }
 #endif
 
+static gboolean
+light_casts_shadow (GthreeRenderer *renderer,
+                    GthreeLight    *light)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->shadowmap_enabled && gthree_object_get_cast_shadow (GTHREE_OBJECT (light));
+}
+
+/* Remembers where a point or spot light went in the light setup, so
+ * pick_object_lights() can choose between them */
+static void
+add_object_light (GthreeRenderer *renderer,
+                  GthreeLight    *light)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  const graphene_matrix_t *world_matrix = gthree_object_get_world_matrix (GTHREE_OBJECT (light));
+  const graphene_vec3_t *color = gthree_light_get_color (light);
+  ObjectLight ol = { { 0 } };
+  graphene_vec4_t position;
+
+  graphene_matrix_get_row (world_matrix, 3, &position);
+  graphene_point3d_init (&ol.position,
+                         graphene_vec4_get_x (&position),
+                         graphene_vec4_get_y (&position),
+                         graphene_vec4_get_z (&position));
+  ol.strength = gthree_light_get_intensity (light) *
+    MAX (graphene_vec3_get_x (color), MAX (graphene_vec3_get_y (color), graphene_vec3_get_z (color)));
+  ol.casts_shadow = light_casts_shadow (renderer, light);
+
+  if (GTHREE_IS_SPOT_LIGHT (light))
+    {
+      GthreeSpotLight *spot = GTHREE_SPOT_LIGHT (light);
+      graphene_vec4_t target_position, direction;
+
+      graphene_matrix_get_row (gthree_object_get_world_matrix (gthree_spot_light_get_target (spot)), 3, &target_position);
+      graphene_vec4_subtract (&target_position, &position, &direction);
+      graphene_vec4_get_xyz (&direction, &ol.direction);
+      graphene_vec3_normalize (&ol.direction, &ol.direction);
+
+      ol.angle = gthree_spot_light_get_angle (spot);
+      ol.distance = gthree_spot_light_get_distance (spot);
+      ol.index = priv->light_setup.spot->len - 1;
+      ol.is_spot = TRUE;
+    }
+  else
+    {
+      ol.distance = gthree_point_light_get_distance (GTHREE_POINT_LIGHT (light));
+      ol.index = priv->light_setup.point->len - 1;
+    }
+
+  g_array_append_val (priv->object_lights, ol);
+}
+
+static void
+add_light (GthreeRenderer *renderer,
+           GthreeCamera   *camera,
+           GthreeLight    *light)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  /* Shadow casters need their shadow maps, which are per-program
+   * uniforms, so they stay in the fixed size arrays */
+  if (priv->clustered_lighting &&
+      !light_casts_shadow (renderer, light) &&
+      gthree_light_clusters_add_light (priv->light_clusters, light, camera))
+    return;
+
+  gthree_light_setup (light, camera, &priv->light_setup);
+
+  if (priv->max_object_lights > 0 &&
+      (GTHREE_IS_POINT_LIGHT (light) || GTHREE_IS_SPOT_LIGHT (light)))
+    add_object_light (renderer, light);
+}
+
+/* Adds black lights up to the next power of two, so that adding or
+ * removing a light mostly doesn't change the programs */
+static void
+pad_light_count (GthreeRenderer *renderer,
+                 GthreeCamera   *camera,
+                 GPtrArray      *lights,
+                 int             kind)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint bucket = 1;
+
+  if (lights->len == 0)
+    return;
+
+  while (bucket < lights->len)
+    bucket *= 2;
+
+  if (priv->padding_lights[kind] == NULL)
+    {
+      graphene_vec3_t black;
+      GthreeLight *light = NULL;
+
+      graphene_vec3_init (&black, 0, 0, 0);
+      switch (kind)
+        {
+        case PADDING_LIGHT_DIRECTIONAL:
+          light = GTHREE_LIGHT (gthree_directional_light_new (&black, 0));
+          break;
+        case PADDING_LIGHT_POINT:
+          light = GTHREE_LIGHT (gthree_point_light_new (&black, 0, 0));
+          break;
+        case PADDING_LIGHT_SPOT:
+          light = GTHREE_LIGHT (gthree_spot_light_new (&black, 0, 0, G_PI / 3, 0));
+          break;
+        default:
+          g_assert_not_reached ();
+        }
+
+      /* Away from the target at the origin, so the direction is defined */
+      gthree_object_set_position_xyz (GTHREE_OBJECT (light), 0, 1, 0);
+      gthree_object_update_matrix_world (GTHREE_OBJECT (light), FALSE);
+      priv->padding_lights[kind] = light;
+    }
+
+  while (lights->len < bucket)
+    gthree_light_setup (priv->padding_lights[kind], camera, &priv->light_setup);
+}
+
 static void
 setup_lights (GthreeRenderer *renderer, GthreeCamera *camera)
 {
@@ -1634,6 +2857,7 @@ setup_lights (GthreeRenderer *renderer, GthreeCamera *camera)
   g_ptr_array_set_size (setup->directional, 0);
   g_ptr_array_set_size (setup->directional_shadow_map, 0);
   g_array_set_size (setup->directional_shadow_map_matrix, 0);
+  g_array_set_size (setup->directional_shadow_cascade_matrix, 0);
   g_ptr_array_set_size (setup->point, 0);
   g_ptr_array_set_size (setup->point_shadow_map, 0);
   g_array_set_size (setup->point_shadow_map_matrix, 0);
@@ -1642,11 +2866,62 @@ setup_lights (GthreeRenderer *renderer, GthreeCamera *camera)
   g_array_set_size (setup->spot_shadow_map_matrix, 0);
   g_ptr_array_set_size (setup->hemi, 0);
 
-  for (l = priv->lights; l != NULL; l = l->next)
+  setup->hash.shadow_cascades = FALSE;
+
+  if (priv->shadow_atlas_size > 0 && priv->shadow_atlas != NULL)
+    setup->shadow_atlas = gthree_render_target_get_output_texture (priv->shadow_atlas);
+  else
+    setup->shadow_atlas = NULL;
+  setup->hash.shadow_atlas = setup->shadow_atlas != NULL;
+  setup->hash.shadow_map_type = priv->shadowmap_type;
+  setup->hash.clustered = priv->clustered_lighting;
+  if (priv->clustered_lighting)
     {
-      GthreeLight *light = l->data;
+      if (priv->light_clusters == NULL)
+        priv->light_clusters = gthree_light_clusters_new ();
+      gthree_light_clusters_begin (priv->light_clusters, camera, setup->cluster_params);
+    }
+  else
+    {
+      g_clear_pointer (&priv->light_clusters, gthree_light_clusters_free);
+      memset (setup->cluster_params, 0, sizeof (setup->cluster_params));
+    }
+
+  g_array_set_size (priv->object_lights, 0);
+  setup->hash.max_object_lights = priv->max_object_lights;
+  setup->hash.num_point_shadow = 0;
+  setup->hash.num_spot_shadow = 0;
+
+  if (priv->max_object_lights > 0)
+    {
+      /* The shaders only index the shadow maps with constants, so the
+       * shadow casters go first and are always evaluated */
+      for (l = priv->lights; l != NULL; l = l->next)
+        if (light_casts_shadow (renderer, l->data))
+          add_light (renderer, camera, l->data);
+
+      setup->hash.num_point_shadow = setup->point->len;
+      setup->hash.num_spot_shadow = setup->spot->len;
+
+      for (l = priv->lights; l != NULL; l = l->next)
+        if (!light_casts_shadow (renderer, l->data))
+          add_light (renderer, camera, l->data);
+    }
+  else
+    {
+      for (l = priv->lights; l != NULL; l = l->next)
+        add_light (renderer, camera, l->data);
+    }
+
+  if (priv->clustered_lighting)
+    gthree_light_clusters_update (priv->light_clusters,
+                                  priv->max_textures - GTHREE_CLUSTER_N_TEXTURES);
 
-      gthree_light_setup (light, camera, setup);
+  if (priv->light_count_bucketing)
+    {
+      pad_light_count (renderer, camera, setup->directional, PADDING_LIGHT_DIRECTIONAL);
+      pad_light_count (renderer, camera, setup->point, PADDING_LIGHT_POINT);
+      pad_light_count (renderer, camera, setup->spot, PADDING_LIGHT_SPOT);
     }
 
   setup->hash.num_directional = setup->directional->len;
@@ -1866,6 +3141,7 @@ getDepthMaterial (GthreeRenderer *renderer,
     {
       priv->shadowmap_depth_materials = g_ptr_array_new_with_free_func (g_object_unref);
       priv->shadowmap_distance_materials = g_ptr_array_new_with_free_func (g_object_unref);
+      priv->shadowmap_basic_depth_materials = g_ptr_array_new_with_free_func (g_object_unref);
 
       for (int i = 0; i < 4; i++)
         {
@@ -1883,6 +3159,12 @@ getDepthMaterial (GthreeRenderer *renderer,
           gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m2), useMorphing);
           gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m2), useSkinning);
           g_ptr_array_add (priv->shadowmap_distance_materials, m2);
+
+          GthreeMeshDepthMaterial *m3 = gthree_mesh_depth_material_new ();
+          gthree_mesh_depth_material_set_depth_packing_format (m3, GTHREE_DEPTH_PACKING_FORMAT_BASIC);
+          gthree_mesh_material_set_morph_targets (GTHREE_MESH_MATERIAL (m3), useMorphing);
+          gthree_mesh_material_set_skinning (GTHREE_MESH_MATERIAL (m3), useSkinning);
+          g_ptr_array_add (priv->shadowmap_basic_depth_materials, m3);
         }
     }
 
@@ -1891,7 +3173,14 @@ getDepthMaterial (GthreeRenderer *renderer,
   var customMaterial = object.customDepthMaterial;
 #endif
 
-  if (isPointLight)
+  if (priv->shadowmap_type == GTHREE_SHADOW_MAP_TYPE_PCF_HARDWARE)
+    {
+      /* The maps have no color buffer, so all that matters is that
+       * the fragment shader is cheap. Point lights then compare
+       * against the depth of their cube faces, not the distance. */
+      materialVariants = priv->shadowmap_basic_depth_materials;
+    }
+  else if (isPointLight)
     {
       materialVariants = priv->shadowmap_distance_materials;
 #ifdef TODO
@@ -1989,102 +3278,499 @@ getDepthMaterial (GthreeRenderer *renderer,
   return result;
 }
 
+/* Appends everything under @object that can cast shadows to the
+ * candidates of this frame, with its world space bounds. This walks
+ * the scene once, the lights and faces then only cull the list. */
 static void
-shadow_map_render_object (GthreeRenderer *renderer,
-                          GthreeObject *object,
-                          GthreeCamera *camera,
-                          graphene_frustum_t *frustum,
-                          GthreeCamera *shadow_camera,
-                          const graphene_vec3_t *_lightPositionWorld,
-                          gboolean is_point_light)
+collect_shadow_casters (GthreeRenderer *renderer,
+                        GthreeObject *object,
+                        GthreeCamera *camera)
 {
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
   GthreeObject *child;
   GthreeObjectIter iter;
 
-  if (!gthree_object_get_visible (object))
+  if (!gthree_object_get_shown (object))
     return;
 
   if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))) &&
-      (GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_POINTS (object)))
+      (GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_POINTS (object)) &&
+      gthree_object_get_cast_shadow (object))
     {
-      if (gthree_object_get_cast_shadow (object) &&
-          (!gthree_object_get_is_frustum_culled (object) || gthree_object_is_in_frustum (object, frustum)))
-        {
-          GthreeGeometry *geometry = NULL;
-          GthreeMaterial *material = NULL;
-          gboolean uses_groups = FALSE;
-
-          gthree_object_update_matrix_view (object, gthree_camera_get_world_inverse_matrix (shadow_camera));
-          gthree_object_update (object, renderer);
-
-          // TODO: Abstract this out into vfuncs
-          if (GTHREE_IS_MESH (object))
-            {
-              // TODO: Handle multi material
-              geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
-              uses_groups = gthree_mesh_get_n_materials (GTHREE_MESH (object)) > 1;
-              material = gthree_mesh_get_material (GTHREE_MESH (object), 0);
-            }
-          else
-            {
-              g_warning ("Unsupported object type for shadows: %s", g_type_name_from_instance ((gpointer)object));
-            }
+      ShadowCasterCandidate candidate = { { object, NULL, gthree_object_get_bounds_serial (object), 0 } };
+      graphene_point3d_t center = { 0, 0, 0 };
+      float radius = INFINITY;
+      graphene_sphere_t sphere, world_sphere;
 
-          if (uses_groups)
-            {
-#ifdef TODO
-              var groups = geometry.groups;
+      if (gthree_object_get_is_frustum_culled (object))
+        {
+          /* Nothing to draw */
+          if (!gthree_object_get_bounding_sphere (object, &sphere))
+            goto children;
 
-              for ( var k = 0, kl = groups.length; k < kl; k ++ )
-                {
-                  var group = groups[ k ];
-                  var groupMaterial = material[ group.materialIndex ];
+          graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object), &sphere, &world_sphere);
+          graphene_sphere_get_center (&world_sphere, &center);
+          radius = graphene_sphere_get_radius (&world_sphere);
+        }
 
-                  if ( groupMaterial && groupMaterial.visible )
-                    {
-                      var depthMaterial = getDepthMaterial( object, groupMaterial, is_point_light, _lightPositionWorld, shadow_camera.near, shadow_camera.far );
-                      _renderer.renderBufferDirect( shadow_camera, null, geometry, depthMaterial, object, group );
-                    }
-                }
-#endif
-            }
-          else if (gthree_material_get_is_visible (material))
-            {
-              GthreeMaterial *depthMaterial = getDepthMaterial (renderer, object, geometry, material, is_point_light, _lightPositionWorld,
-                                                                gthree_camera_get_near (shadow_camera), gthree_camera_get_far (shadow_camera));
-              GthreeRenderListItem item = { object, geometry, depthMaterial, NULL, 0.0 };
-              render_item (renderer, shadow_camera, NULL, depthMaterial, &item);
-            }
+      if (GTHREE_IS_MESH (object))
+        {
+          GthreeGeometry *geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
+
+          candidate.caster.material = gthree_mesh_get_material (GTHREE_MESH (object), 0);
+          if (candidate.caster.material)
+            candidate.caster.material_serial = gthree_material_get_serial (candidate.caster.material);
+          if (geometry)
+            candidate.caster.shape_serial = gthree_geometry_get_shape_serial (geometry);
+
+          /* The vertices move without anything we can track */
+          candidate.dynamic =
+            GTHREE_IS_SKINNED_MESH (object) ||
+            (GTHREE_IS_MESH_MATERIAL (candidate.caster.material) &&
+             gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (candidate.caster.material)));
         }
+
+      g_array_append_val (priv->shadow_caster_candidates, candidate);
+      g_array_append_val (priv->shadow_caster_x, center.x);
+      g_array_append_val (priv->shadow_caster_y, center.y);
+      g_array_append_val (priv->shadow_caster_z, center.z);
+      g_array_append_val (priv->shadow_caster_radius, radius);
     }
 
+ children:
   gthree_object_iter_init (&iter, object);
   while (gthree_object_iter_next (&iter, &child))
-    shadow_map_render_object (renderer, child, camera, frustum, shadow_camera, _lightPositionWorld, is_point_light);
+    collect_shadow_casters (renderer, child, camera);
 }
 
-
+/* Gets the planes of @frustum, a point p is inside a plane if
+ * dot (p, plane.xyz) + plane.w >= 0 */
 static void
-render_shadow_map (GthreeRenderer *renderer,
-                   GthreeScene *scene,
-                   GthreeCamera *camera)
+get_frustum_planes (const graphene_frustum_t *frustum,
+                    float planes[6][4])
 {
-  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  g_autoptr(GthreeRenderTarget) current_render_target = NULL;
-  GList *l;
-  int faceCount;
-  graphene_vec3_t c;
+  graphene_plane_t gplanes[6];
+  int i;
 
-  if (!priv->shadowmap_enabled)
-    return;
+  graphene_frustum_get_planes (frustum, gplanes);
+  for (i = 0; i < 6; i++)
+    {
+      graphene_vec3_t normal;
 
-  if (!priv->shadowmap_auto_update && !priv->shadowmap_needs_update)
-    return;
+      graphene_plane_get_normal (&gplanes[i], &normal);
+      planes[i][0] = graphene_vec3_get_x (&normal);
+      planes[i][1] = graphene_vec3_get_y (&normal);
+      planes[i][2] = graphene_vec3_get_z (&normal);
+      planes[i][3] = graphene_plane_get_constant (&gplanes[i]);
+    }
+}
+
+/* Gets the planes of the camera frustum, changed so that they keep
+ * everything that can shadow something inside the frustum when lit by
+ * @light, and returns how many there are. The shadow of a sphere
+ * sweeps away from the light, so planes it sweeps into are dropped
+ * for directional lights, and for point and spot lights planes with
+ * the light outside are pushed out to the light. */
+static int
+get_shadow_receiver_planes (GthreeRenderer *renderer,
+                            GthreeLight *light,
+                            GthreeCamera *shadow_camera,
+                            float planes[6][4])
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  float frustum_planes[6][4];
+  graphene_vec4_t v;
+  float x, y, z;
+  int i, n;
+
+  get_frustum_planes (&priv->frustum, frustum_planes);
+
+  if (GTHREE_IS_DIRECTIONAL_LIGHT (light))
+    {
+      /* The shadow camera looks along -z, the way the light goes */
+      graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (shadow_camera)), 2, &v);
+      x = -graphene_vec4_get_x (&v);
+      y = -graphene_vec4_get_y (&v);
+      z = -graphene_vec4_get_z (&v);
+
+      for (i = 0, n = 0; i < 6; i++)
+        {
+          const float *plane = frustum_planes[i];
+
+          if (plane[0] * x + plane[1] * y + plane[2] * z <= 0)
+            memcpy (planes[n++], plane, sizeof (float) * 4);
+        }
+    }
+  else
+    {
+      graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (light)), 3, &v);
+      x = graphene_vec4_get_x (&v);
+      y = graphene_vec4_get_y (&v);
+      z = graphene_vec4_get_z (&v);
+
+      for (i = 0, n = 0; i < 6; i++)
+        {
+          const float *plane = frustum_planes[i];
+          float light_distance = plane[0] * x + plane[1] * y + plane[2] * z + plane[3];
+
+          memcpy (planes[n], plane, sizeof (float) * 4);
+          planes[n][3] -= MIN (light_distance, 0);
+          n++;
+        }
+    }
+
+  return n;
+}
+
+/* Appends the candidates that are not completely outside any of
+ * @planes to priv->shadow_casters. This runs for every light and face,
+ * so it goes over the bounds one plane at a time, in loops without
+ * branches over the separate coordinate arrays that the compiler can
+ * vectorize. */
+static void
+cull_shadow_casters (GthreeRenderer *renderer,
+                     float planes[][4],
+                     int n_planes,
+                     gboolean *dynamic)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  const float *restrict x = (const float *) priv->shadow_caster_x->data;
+  const float *restrict y = (const float *) priv->shadow_caster_y->data;
+  const float *restrict z = (const float *) priv->shadow_caster_z->data;
+  const float *restrict radius = (const float *) priv->shadow_caster_radius->data;
+  guint n = priv->shadow_caster_candidates->len;
+  guint8 *restrict visible;
+  guint i;
+  int p;
+
+  g_array_set_size (priv->shadow_caster_visible, n);
+  visible = (guint8 *) priv->shadow_caster_visible->data;
+  memset (visible, 1, n);
+
+  for (p = 0; p < n_planes; p++)
+    {
+      const float a = planes[p][0], b = planes[p][1], c = planes[p][2], d = planes[p][3];
+
+      for (i = 0; i < n; i++)
+        visible[i] &= a * x[i] + b * y[i] + c * z[i] + d >= -radius[i];
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      ShadowCasterCandidate *candidate;
+
+      if (!visible[i])
+        continue;
+
+      candidate = &g_array_index (priv->shadow_caster_candidates, ShadowCasterCandidate, i);
+      g_array_append_val (priv->shadow_casters, candidate->caster);
+      g_array_append_val (priv->shadow_caster_sources, i);
+      *dynamic |= candidate->dynamic;
+    }
+}
+
+static void
+shadow_map_render_object (GthreeRenderer *renderer,
+                          GthreeObject *object,
+                          GthreeCamera *shadow_camera,
+                          const graphene_vec3_t *_lightPositionWorld,
+                          gboolean is_point_light)
+{
+  GthreeGeometry *geometry = NULL;
+  GthreeMaterial *material = NULL;
+  gboolean uses_groups = FALSE;
+
+  gthree_object_update_matrix_view (object, gthree_camera_get_world_inverse_matrix (shadow_camera));
+
+  // TODO: Abstract this out into vfuncs
+  if (GTHREE_IS_MESH (object))
+    {
+      // TODO: Handle multi material
+      geometry = gthree_mesh_get_geometry (GTHREE_MESH (object));
+      uses_groups = gthree_mesh_get_n_materials (GTHREE_MESH (object)) > 1;
+      material = gthree_mesh_get_material (GTHREE_MESH (object), 0);
+    }
+  else
+    {
+      g_warning ("Unsupported object type for shadows: %s", g_type_name_from_instance ((gpointer)object));
+      return;
+    }
+
+  if (uses_groups)
+    {
+#ifdef TODO
+      var groups = geometry.groups;
+
+      for ( var k = 0, kl = groups.length; k < kl; k ++ )
+        {
+          var group = groups[ k ];
+          var groupMaterial = material[ group.materialIndex ];
+
+          if ( groupMaterial && groupMaterial.visible )
+            {
+              var depthMaterial = getDepthMaterial( object, groupMaterial, is_point_light, _lightPositionWorld, shadow_camera.near, shadow_camera.far );
+              _renderer.renderBufferDirect( shadow_camera, null, geometry, depthMaterial, object, group );
+            }
+        }
+#endif
+    }
+  else if (gthree_material_get_is_visible (material))
+    {
+      GthreeMaterial *depthMaterial = getDepthMaterial (renderer, object, geometry, material, is_point_light, _lightPositionWorld,
+                                                        gthree_camera_get_near (shadow_camera), gthree_camera_get_far (shadow_camera));
+      GthreeRenderListItem item = { object, geometry, depthMaterial, NULL, 0.0 };
+      render_item (renderer, shadow_camera, NULL, depthMaterial, &item);
+    }
+}
+
+/* Points the shadow camera of a point light at a cube face */
+static void
+set_shadow_cube_face (GthreeCamera *shadow_camera,
+                      int           face)
+{
+  graphene_vec3_t _lookTarget;
+
+  graphene_vec3_add (gthree_object_get_position (GTHREE_OBJECT (shadow_camera)),
+                     &cube_directions[face], &_lookTarget);
+
+  gthree_object_set_up (GTHREE_OBJECT (shadow_camera), &cube_ups[face]);
+  gthree_object_look_at (GTHREE_OBJECT (shadow_camera), &_lookTarget);
+
+  gthree_object_update_matrix_world (GTHREE_OBJECT (shadow_camera), FALSE);
+  gthree_camera_update_matrix (shadow_camera);
+}
+
+
+/* The number of map sized tiles the shadow map of @light is made of */
+static void
+get_shadow_map_layout (GthreeLight       *light,
+                       GthreeLightShadow *shadow,
+                       int               *columns,
+                       int               *rows)
+{
+  if (GTHREE_IS_POINT_LIGHT (light))
+    {
+      *columns = 4;
+      *rows = 2;
+    }
+  else if (GTHREE_IS_DIRECTIONAL_LIGHT_SHADOW (shadow))
+    gthree_directional_light_shadow_get_atlas_size (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow), columns, rows);
+  else
+    {
+      *columns = 1;
+      *rows = 1;
+    }
+}
+
+static int
+compare_shadow_atlas_entries (gconstpointer _a,
+                              gconstpointer _b)
+{
+  const ShadowAtlasEntry *a = _a;
+  const ShadowAtlasEntry *b = _b;
+  int height_a = a->height * a->rows;
+  int height_b = b->height * b->rows;
+
+  if (height_a != height_b)
+    return height_b - height_a;
+
+  return a->index - b->index;
+}
+
+/* Packs the entries on shelves, tallest first. Returns FALSE if they
+ * don't fit in @size with the map sizes scaled by @scale */
+static gboolean
+pack_shadow_atlas_entries (GArray *entries,
+                           int     size,
+                           float   scale)
+{
+  int x = 0, y = 0, shelf_height = 0;
+  int i;
+
+  for (i = 0; i < entries->len; i++)
+    {
+      ShadowAtlasEntry *entry = &g_array_index (entries, ShadowAtlasEntry, i);
+      int width = (int) (entry->width * scale) * entry->columns;
+      int height = (int) (entry->height * scale) * entry->rows;
+
+      if (x + width > size)
+        {
+          x = 0;
+          y += shelf_height;
+          shelf_height = 0;
+        }
+
+      if (width > size || y + height > size)
+        return FALSE;
+
+      entry->x = x;
+      entry->y = y;
+      x += width;
+      shelf_height = MAX (shelf_height, height);
+    }
+
+  return TRUE;
+}
+
+/* Makes a render target for shadow maps. With hardware PCF that is a
+ * depth texture with comparison, otherwise the depth is packed in the
+ * colors by the depth materials. */
+static GthreeRenderTarget *
+shadow_map_new (GthreeRenderer *renderer,
+                int width,
+                int height)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeRenderTarget *shadow_map = gthree_render_target_new (width, height);
+  GthreeTexture *texture;
+
+  if (priv->shadowmap_type == GTHREE_SHADOW_MAP_TYPE_PCF_HARDWARE)
+    {
+      texture = gthree_texture_new (NULL);
+      gthree_texture_set_format (texture, GTHREE_TEXTURE_FORMAT_DEPTH);
+      gthree_texture_set_data_type (texture, GTHREE_DATA_TYPE_UNSIGNED_INT);
+      gthree_texture_set_wrap_s (texture, GTHREE_WRAPPING_CLAMP);
+      gthree_texture_set_wrap_t (texture, GTHREE_WRAPPING_CLAMP);
+      gthree_texture_set_generate_mipmaps (texture, FALSE);
+      gthree_texture_set_mag_filter (texture, GTHREE_FILTER_LINEAR);
+      gthree_texture_set_min_filter (texture, GTHREE_FILTER_LINEAR);
+      gthree_texture_set_compare (texture, TRUE);
+
+      gthree_render_target_set_color_buffer (shadow_map, FALSE);
+      gthree_render_target_set_stencil_buffer (shadow_map, FALSE);
+      gthree_render_target_set_depth_texture (shadow_map, texture);
+      g_object_unref (texture);
+    }
+  else
+    {
+      texture = gthree_render_target_get_texture (shadow_map);
+      gthree_texture_set_mag_filter (texture, GTHREE_FILTER_NEAREST);
+      gthree_texture_set_min_filter (texture, GTHREE_FILTER_NEAREST);
+    }
+
+  return shadow_map;
+}
+
+/* Whether @shadow_map was made for the current shadow map type */
+static gboolean
+shadow_map_has_type (GthreeRenderer *renderer,
+                     GthreeRenderTarget *shadow_map)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return
+    gthree_render_target_get_color_buffer (shadow_map) ==
+    (priv->shadowmap_type != GTHREE_SHADOW_MAP_TYPE_PCF_HARDWARE);
+}
+
+/* Gives each light that casts shadows a region of the shadow atlas. The
+ * packing only depends on the map sizes and the order of the lights, so
+ * it is the same every frame, which keeps the cached maps valid. */
+static void
+update_shadow_atlas (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int size = MIN (priv->shadow_atlas_size, priv->max_texture_size);
+  float scale;
+  GList *l;
+  int i;
+
+  if (priv->shadow_atlas == NULL ||
+      gthree_render_target_get_width (priv->shadow_atlas) != size ||
+      !shadow_map_has_type (renderer, priv->shadow_atlas))
+    {
+      g_clear_object (&priv->shadow_atlas);
+      priv->shadow_atlas = shadow_map_new (renderer, size, size);
+    }
+
+  g_array_set_size (priv->shadow_atlas_entries, 0);
+  for (l = priv->shadows, i = 0; l != NULL; l = l->next, i++)
+    {
+      GthreeLight *light = l->data;
+      ShadowAtlasEntry entry = { gthree_light_get_shadow (light), i };
+
+      if (entry.shadow == NULL)
+        continue;
+
+      entry.width = gthree_light_shadow_get_map_width (entry.shadow);
+      entry.height = gthree_light_shadow_get_map_height (entry.shadow);
+      get_shadow_map_layout (light, entry.shadow, &entry.columns, &entry.rows);
+      g_array_append_val (priv->shadow_atlas_entries, entry);
+    }
+
+  g_array_sort (priv->shadow_atlas_entries, compare_shadow_atlas_entries);
+
+  /* If the maps don't fit, shrink them all alike */
+  scale = 1;
+  while (!pack_shadow_atlas_entries (priv->shadow_atlas_entries, size, scale))
+    {
+      scale /= 2;
+      if (scale < 1.0 / 64)
+        {
+          g_warning ("Shadow maps don't fit in the shadow atlas");
+          break;
+        }
+    }
+
+  for (i = 0; i < priv->shadow_atlas_entries->len; i++)
+    {
+      ShadowAtlasEntry *entry = &g_array_index (priv->shadow_atlas_entries, ShadowAtlasEntry, i);
+
+      gthree_light_shadow_set_atlas_region (entry->shadow, priv->shadow_atlas,
+                                            entry->x, entry->y,
+                                            (int) (entry->width * scale) * entry->columns,
+                                            (int) (entry->height * scale) * entry->rows,
+                                            scale);
+    }
+}
+
+static void
+render_shadow_map (GthreeRenderer *renderer,
+                   GthreeScene *scene,
+                   GthreeCamera *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  g_autoptr(GthreeRenderTarget) current_render_target = NULL;
+  const GthreeShadowCaster face_separator = { NULL };
+  guint face_ends[6];
+  float cull_planes[12][4]; /* The face, then the receivers */
+  int n_receiver_planes;
+  gboolean dynamic;
+  GList *l;
+  int faceCount;
+  graphene_vec3_t c;
+
+  if (!priv->shadowmap_enabled)
+    return;
+
+  if (!priv->shadowmap_auto_update && !priv->shadowmap_needs_update)
+    return;
 
   if (priv->shadows == NULL)
     return;
 
-  push_debug_group ("rendering shadow maps");
+  push_debug_group (renderer, "rendering shadow maps");
+
+  if (priv->shadow_atlas_size > 0)
+    update_shadow_atlas (renderer);
+  else
+    {
+      g_clear_object (&priv->shadow_atlas);
+      for (l = priv->shadows; l != NULL; l = l->next)
+        {
+          GthreeLightShadow *shadow = gthree_light_get_shadow (l->data);
+          if (shadow)
+            gthree_light_shadow_set_atlas_region (shadow, NULL, 0, 0, 0, 0, 0);
+        }
+    }
+
+  /* Everything that may cast a shadow, each light culls it */
+  g_array_set_size (priv->shadow_caster_candidates, 0);
+  g_array_set_size (priv->shadow_caster_x, 0);
+  g_array_set_size (priv->shadow_caster_y, 0);
+  g_array_set_size (priv->shadow_caster_z, 0);
+  g_array_set_size (priv->shadow_caster_radius, 0);
+  collect_shadow_casters (renderer, GTHREE_OBJECT (scene), camera);
 
   g_set_object (&current_render_target,  priv->current_render_target);
 
@@ -2103,6 +3789,12 @@ render_shadow_map (GthreeRenderer *renderer,
     {
       GthreeLight *light = l->data;
       GthreeLightShadow *shadow = gthree_light_get_shadow (light);
+      GthreeDirectionalLightShadow *cascaded = NULL;
+      gboolean cascades_moved = FALSE;
+      int cascade_width = 0, cascade_height = 0;
+      int map_x = 0, map_y = 0;
+      float map_scale = 1;
+      gboolean in_atlas;
       graphene_vec4_t cube2DViewPorts[6];
 
       if (shadow == NULL)
@@ -2116,7 +3808,29 @@ render_shadow_map (GthreeRenderer *renderer,
       int shadow_map_width = MIN (gthree_light_shadow_get_map_width (shadow), priv->max_texture_size);
       int shadow_map_height = MIN (gthree_light_shadow_get_map_height (shadow), priv->max_texture_size);
 
-      push_debug_group ("shadow maps light %p", light);
+      in_atlas = gthree_light_shadow_get_atlas_region (shadow, &map_x, &map_y, &map_scale);
+      if (in_atlas)
+        {
+          shadow_map_width = gthree_light_shadow_get_map_width (shadow) * map_scale;
+          shadow_map_height = gthree_light_shadow_get_map_height (shadow) * map_scale;
+        }
+
+      push_debug_group (renderer, "shadow maps light %p", light);
+
+      if (GTHREE_IS_DIRECTIONAL_LIGHT_SHADOW (shadow) &&
+          gthree_directional_light_shadow_get_n_cascades (GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow)) > 1)
+        {
+          int columns, rows;
+
+          // The cascades are tiled in one map, each the size of a
+          // non-cascaded map
+          cascaded = GTHREE_DIRECTIONAL_LIGHT_SHADOW (shadow);
+          gthree_directional_light_shadow_get_atlas_size (cascaded, &columns, &rows);
+          cascade_width = MIN (shadow_map_width, priv->max_texture_size / columns);
+          cascade_height = MIN (shadow_map_height, priv->max_texture_size / rows);
+          shadow_map_width = cascade_width * columns;
+          shadow_map_height = cascade_height * rows;
+        }
 
       if (GTHREE_IS_POINT_LIGHT (light))
         {
@@ -2138,22 +3852,22 @@ render_shadow_map (GthreeRenderer *renderer,
 
           // positive X
           graphene_vec4_init (&cube2DViewPorts[0],
-                              vpWidth * 2, vpHeight, vpWidth, vpHeight);
+                              map_x + vpWidth * 2, map_y + vpHeight, vpWidth, vpHeight);
           // negative X
           graphene_vec4_init (&cube2DViewPorts[1],
-                              0, vpHeight, vpWidth, vpHeight );
+                              map_x, map_y + vpHeight, vpWidth, vpHeight );
           // positive Z
           graphene_vec4_init (&cube2DViewPorts[2],
-                              vpWidth * 3, vpHeight, vpWidth, vpHeight );
+                              map_x + vpWidth * 3, map_y + vpHeight, vpWidth, vpHeight );
           // negative Z
           graphene_vec4_init (&cube2DViewPorts[3],
-                              vpWidth, vpHeight, vpWidth, vpHeight );
+                              map_x + vpWidth, map_y + vpHeight, vpWidth, vpHeight );
           // positive Y
           graphene_vec4_init (&cube2DViewPorts[4],
-                              vpWidth * 3, 0, vpWidth, vpHeight );
+                              map_x + vpWidth * 3, map_y, vpWidth, vpHeight );
           // negative Y
           graphene_vec4_init (&cube2DViewPorts[5],
-                              vpWidth, 0, vpWidth, vpHeight );
+                              map_x + vpWidth, map_y, vpWidth, vpHeight );
 
           shadow_map_width *= 4;
           shadow_map_height *= 2;
@@ -2161,15 +3875,11 @@ render_shadow_map (GthreeRenderer *renderer,
 
       GthreeRenderTarget *shadow_map = gthree_light_shadow_get_map (shadow);
 
-      if (shadow_map == NULL)
+      if (shadow_map == NULL || !shadow_map_has_type (renderer, shadow_map))
         {
-          shadow_map = gthree_render_target_new (shadow_map_width, shadow_map_height);
-
-          GthreeTexture *texture = gthree_render_target_get_texture (shadow_map);
-          gthree_texture_set_mag_filter (texture, GTHREE_FILTER_NEAREST);
-          gthree_texture_set_min_filter (texture, GTHREE_FILTER_NEAREST);
-
+          shadow_map = shadow_map_new (renderer, shadow_map_width, shadow_map_height);
           gthree_light_shadow_set_map (shadow, shadow_map);
+          g_object_unref (shadow_map);
 
 #ifdef TODO
           texture.name = light.name + ".shadowMap";
@@ -2223,138 +3933,305 @@ render_shadow_map (GthreeRenderer *renderer,
           gthree_object_update_matrix_world (GTHREE_OBJECT (shadow_camera), FALSE);
           gthree_camera_update_matrix (shadow_camera);
 
-          // compute shadow matrix
-          graphene_matrix_init_scale (shadowMatrix, 0.5, 0.5, 0.5);
-          graphene_matrix_translate (shadowMatrix, graphene_point3d_init (&p, 0.5, 0.5, 0.5));
+          if (cascaded)
+            {
+              faceCount = gthree_directional_light_shadow_get_n_cascades (cascaded);
+              cascades_moved = gthree_directional_light_shadow_update_cascades (cascaded, camera,
+                                                                                cascade_width,
+                                                                                cascade_height);
+              gthree_directional_light_shadow_update_matrices (cascaded);
+            }
+          else
+            {
+              // compute shadow matrix
+              graphene_matrix_init_scale (shadowMatrix, 0.5, 0.5, 0.5);
+              graphene_matrix_translate (shadowMatrix, graphene_point3d_init (&p, 0.5, 0.5, 0.5));
+
+              graphene_matrix_multiply (gthree_camera_get_projection_matrix (shadow_camera),
+                                        shadowMatrix,
+                                        shadowMatrix);
+              graphene_matrix_multiply (gthree_camera_get_world_inverse_matrix (shadow_camera),
+                                        shadowMatrix,
+                                        shadowMatrix);
+            }
+        }
+
+      /* Find what each face would draw, to see if the map is still
+       * valid. That is what is in the face, and can shadow something
+       * the camera sees. */
+      g_array_set_size (priv->shadow_casters, 0);
+      g_array_set_size (priv->shadow_caster_sources, 0);
+      dynamic = FALSE;
+
+      n_receiver_planes = get_shadow_receiver_planes (renderer, light, shadow_camera, cull_planes + 6);
+
+      for (int face = 0; face < faceCount; face++)
+        {
+          graphene_matrix_t _projScreenMatrix;
+          graphene_frustum_t frustum;
+          const guint no_source = G_MAXUINT;
+
+          if (GTHREE_IS_POINT_LIGHT (light))
+            set_shadow_cube_face (shadow_camera, face);
+          else if (cascaded)
+            gthree_directional_light_shadow_set_cascade (cascaded, face);
+
+          gthree_camera_get_proj_screen_matrix (shadow_camera, &_projScreenMatrix);
+          graphene_frustum_init_from_matrix (&frustum, &_projScreenMatrix);
+          get_frustum_planes (&frustum, cull_planes);
+
+          cull_shadow_casters (renderer, cull_planes, 6 + n_receiver_planes, &dynamic);
+          face_ends[face] = priv->shadow_casters->len;
+          g_array_append_val (priv->shadow_casters, face_separator);
+          g_array_append_val (priv->shadow_caster_sources, no_source);
+        }
+
+      if (cascaded)
+        gthree_directional_light_shadow_set_cascade (cascaded, -1);
 
-          graphene_matrix_multiply (gthree_camera_get_projection_matrix (shadow_camera),
-                                    shadowMatrix,
-                                    shadowMatrix);
-          graphene_matrix_multiply (gthree_camera_get_world_inverse_matrix (shadow_camera),
-                                    shadowMatrix,
-                                    shadowMatrix);
+      if (dynamic || cascades_moved || priv->shadowmap_needs_update)
+        gthree_light_shadow_invalidate_cache (shadow);
+
+      if (gthree_light_shadow_update_cache (shadow,
+                                            gthree_camera_get_projection_matrix (shadow_camera),
+                                            priv->shadow_casters))
+        {
+          priv->info.shadow_maps_reused++;
+          pop_debug_group (renderer);
+          continue;
         }
 
       gthree_renderer_set_render_target (renderer, shadow_map, 0, 0);
-      gthree_renderer_clear (renderer, TRUE, TRUE, TRUE);
+
+      if (in_atlas)
+        {
+          // Other lights may be reusing their part of the atlas
+          glEnable (GL_SCISSOR_TEST);
+          glScissor (map_x, map_y, shadow_map_width, shadow_map_height);
+          gthree_renderer_clear (renderer, TRUE, TRUE, TRUE);
+          glDisable (GL_SCISSOR_TEST);
+
+          glViewport (map_x, map_y, shadow_map_width, shadow_map_height);
+        }
+      else
+        gthree_renderer_clear (renderer, TRUE, TRUE, TRUE);
 
       // render shadow map for each cube face (if omni-directional) or
       // run a single pass if not
       for (int face = 0; face < faceCount; face++)
         {
+          guint first = face == 0 ? 0 : face_ends[face - 1] + 1;
+
           if (GTHREE_IS_POINT_LIGHT (light))
             {
-              graphene_vec3_t _lookTarget;
-              graphene_vec3_add (gthree_object_get_position (GTHREE_OBJECT (shadow_camera)),
-                                 &cube_directions[face], &_lookTarget);
-
-              gthree_object_set_up (GTHREE_OBJECT (shadow_camera), &cube_ups[face]);
-              gthree_object_look_at (GTHREE_OBJECT (shadow_camera), &_lookTarget);
-
-              gthree_object_update_matrix_world (GTHREE_OBJECT (shadow_camera), FALSE);
-              gthree_camera_update_matrix (shadow_camera);
-
               graphene_vec4_t *vpDimensions = &cube2DViewPorts[face];
 
+              set_shadow_cube_face (shadow_camera, face);
+
               glViewport (graphene_vec4_get_x (vpDimensions),
                           graphene_vec4_get_y (vpDimensions),
                           graphene_vec4_get_z (vpDimensions),
                           graphene_vec4_get_w (vpDimensions));
             }
+          else if (cascaded)
+            {
+              int tile_x, tile_y;
 
-          // update camera matrices and frustum
-          graphene_matrix_t _projScreenMatrix;
-          graphene_frustum_t frustum;
+              gthree_directional_light_shadow_set_cascade (cascaded, face);
+              gthree_directional_light_shadow_get_cascade_tile (cascaded, face, &tile_x, &tile_y);
 
-          gthree_camera_get_proj_screen_matrix (shadow_camera, &_projScreenMatrix);
-          graphene_frustum_init_from_matrix (&frustum, &_projScreenMatrix);
+              glViewport (map_x + tile_x * cascade_width, map_y + tile_y * cascade_height,
+                          cascade_width, cascade_height);
+            }
+
+          // The shadow camera moved, so force a new GthreeCamera block
+          priv->current_camera = NULL;
+
+          priv->info.shadow_map_passes++;
+
+          for (guint i = first; i < face_ends[face]; i++)
+            {
+              guint source = g_array_index (priv->shadow_caster_sources, guint, i);
+              ShadowCasterCandidate *candidate =
+                &g_array_index (priv->shadow_caster_candidates, ShadowCasterCandidate, source);
+
+              if (!candidate->updated)
+                {
+                  gthree_object_update (candidate->caster.object, renderer);
+                  candidate->updated = TRUE;
+                }
 
-          // set object matrices & frustum culling
-          shadow_map_render_object (renderer, GTHREE_OBJECT (scene), camera, &frustum, shadow_camera,
-                                    &_lightPositionWorld,
-                                    GTHREE_IS_POINT_LIGHT (light));
+              shadow_map_render_object (renderer, candidate->caster.object,
+                                        shadow_camera, &_lightPositionWorld,
+                                        GTHREE_IS_POINT_LIGHT (light));
+            }
         }
 
-      pop_debug_group ();
+      if (cascaded)
+        gthree_directional_light_shadow_set_cascade (cascaded, -1);
+
+      pop_debug_group (renderer);
     }
 
   priv->shadowmap_needs_update = FALSE;
 
   gthree_renderer_set_render_target (renderer, current_render_target, 0, 0);
 
-  pop_debug_group ();
+  pop_debug_group (renderer);
 }
 
 
-// If uniforms are marked as clean, they don't need to be loaded to the GPU.
-static void
-mark_uniforms_lights_needs_update (GthreeUniforms *uniforms, gboolean needs_update)
+
+static gboolean
+material_needs_init (GthreeRenderer *renderer,
+                     GthreeMaterial *material,
+                     GthreeFog *fog,
+                     GthreeObject *object)
 {
-  GthreeUniform *uni;
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
+  gboolean instancing = GTHREE_IS_INSTANCED_MESH (object);
+  gboolean instancing_color = instancing &&
+    gthree_instanced_mesh_get_instance_color (GTHREE_INSTANCED_MESH (object)) != NULL;
+
+  return
+    !gthree_material_is_valid_for (material, priv->renderer_id) ||
+    !gthree_light_setup_hash_equal (&material_properties->light_hash, &priv->light_setup.hash) ||
+    (gthree_material_get_fog (material) && material_properties->fog != fog) ||
+    material_properties->num_clipping_planes != priv->num_clipping_planes ||
+    material_properties->num_intersection != priv->num_clipping_intersections ||
+    material_properties->instancing != instancing ||
+    material_properties->instancing_color != instancing_color;
+}
 
-  uni = gthree_uniforms_lookup (uniforms, q_ambientLightColor);
-  if (uni)
-    gthree_uniform_set_needs_update (uni, needs_update);
+/* How much a light can contribute to anything in @sphere, or zero if
+ * it can't reach it at all */
+static float
+object_light_influence (const ObjectLight       *light,
+                        const graphene_sphere_t *sphere)
+{
+  graphene_point3d_t center;
+  float radius, distance, gap;
 
-  uni = gthree_uniforms_lookup (uniforms, q_directionalLights);
-  if (uni)
-    gthree_uniform_set_needs_update (uni, needs_update);
+  if (sphere == NULL)
+    return light->strength;
 
-  uni = gthree_uniforms_lookup (uniforms, q_pointLights);
-  if (uni)
-    gthree_uniform_set_needs_update (uni, needs_update);
+  graphene_sphere_get_center (sphere, &center);
+  radius = graphene_sphere_get_radius (sphere);
+  distance = graphene_point3d_distance (&light->position, &center, NULL);
+  gap = MAX (distance - radius, 0);
 
-  uni = gthree_uniforms_lookup (uniforms, q_hemisphereLights);
-  if (uni)
-    gthree_uniform_set_needs_update (uni, needs_update);
+  if (light->distance > 0 && gap >= light->distance)
+    return 0;
 
-  uni = gthree_uniforms_lookup (uniforms, q_spotLights);
-  if (uni)
-    gthree_uniform_set_needs_update (uni, needs_update);
+  if (light->is_spot && distance > radius)
+    {
+      graphene_vec3_t to_center;
+      float cos_angle;
+
+      graphene_vec3_init (&to_center,
+                          center.x - light->position.x,
+                          center.y - light->position.y,
+                          center.z - light->position.z);
+      cos_angle = graphene_vec3_dot (&to_center, &light->direction) / distance;
+
+      /* Outside the cone widened by the angle the sphere covers */
+      if (acosf (CLAMP (cos_angle, -1, 1)) - asinf (radius / distance) > light->angle)
+        return 0;
+    }
 
+  return light->strength / (1 + gap * gap);
 }
 
 static void
-refresh_uniforms_fog (GthreeRenderer *renderer,
-                      GthreeUniforms *uniforms,
-                      GthreeFog *fog)
+upload_object_lights (GthreeRenderer *renderer,
+                      GthreeProgram  *program,
+                      GQuark          name,
+                      const int      *indices,
+                      guint           n_indices)
 {
-  GthreeUniform *uni;
+  int location = gthree_program_lookup_uniform_location (program, name);
 
-  uni = gthree_uniforms_lookup_from_string (uniforms, "fogColor");
-  if (uni != NULL)
-    gthree_uniform_set_vec3 (uni, gthree_fog_get_color (fog));
-
-  if (gthree_fog_get_style (fog) == GTHREE_FOG_STYLE_LINEAR)
-    {
-      uni = gthree_uniforms_lookup_from_string (uniforms, "fogNear");
-      if (uni != NULL)
-        gthree_uniform_set_float (uni, gthree_fog_get_near (fog));
-      uni = gthree_uniforms_lookup_from_string (uniforms, "fogFar");
-      if (uni != NULL)
-        gthree_uniform_set_float (uni, gthree_fog_get_far (fog));
-    }
-  else
-    {
-      uni = gthree_uniforms_lookup_from_string (uniforms, "fogDensity");
-      if (uni != NULL)
-        gthree_uniform_set_float (uni, gthree_fog_get_density (fog));
-    }
+  if (location >= 0 &&
+      gthree_renderer_update_uniform_value (renderer, location, indices, n_indices * sizeof (int)))
+    glUniform1iv (location, n_indices, indices);
 }
 
-
-static GthreeProgram *
-set_program (GthreeRenderer *renderer,
-             GthreeCamera *camera,
-             GthreeFog *fog,
-             GthreeMaterial *material,
-             GthreeObject *object)
+/* Chooses the point and spot lights with the most influence on the
+ * bounding sphere of @object for the objectPointLights and
+ * objectSpotLights uniforms, see gthree_renderer_set_max_object_lights() */
+static void
+pick_object_lights (GthreeRenderer *renderer,
+                    GthreeProgram  *program,
+                    GthreeObject   *object)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  gboolean refreshProgram = false;
-  gboolean refreshMaterial = false;
-  gboolean refreshLights = false;
-  GthreeProgram *program;
+  guint max_lights = priv->light_setup.hash.max_object_lights;
+  /* The shadow casters are evaluated separately when the program has shadows */
+  gboolean skip_casters = priv->light_setup.hash.obj_receive_shadow;
+  int picked[2][MAX_OBJECT_LIGHTS];
+  float influence[2][MAX_OBJECT_LIGHTS];
+  guint n_picked[2] = { 0, 0 };
+  graphene_sphere_t sphere;
+  gboolean has_sphere;
+  guint i, j;
+
+  has_sphere = gthree_object_get_bounding_sphere (object, &sphere);
+  if (has_sphere)
+    graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object), &sphere, &sphere);
+
+  for (i = 0; i < priv->object_lights->len; i++)
+    {
+      ObjectLight *light = &g_array_index (priv->object_lights, ObjectLight, i);
+      int kind = light->is_spot;
+      float f;
+
+      if (light->casts_shadow && skip_casters)
+        continue;
+
+      f = object_light_influence (light, has_sphere ? &sphere : NULL);
+      if (f <= 0)
+        continue;
+
+      /* Insertion into the lists sorted by decreasing influence */
+      j = n_picked[kind];
+      if (j == max_lights)
+        {
+          if (f <= influence[kind][j - 1])
+            continue;
+          j--;
+        }
+      else
+        n_picked[kind]++;
+
+      for (; j > 0 && influence[kind][j - 1] < f; j--)
+        {
+          influence[kind][j] = influence[kind][j - 1];
+          picked[kind][j] = picked[kind][j - 1];
+        }
+      influence[kind][j] = f;
+      picked[kind][j] = light->index;
+    }
+
+  for (i = 0; i < 2; i++)
+    for (j = n_picked[i]; j < max_lights; j++)
+      picked[i][j] = -1;
+
+  upload_object_lights (renderer, program, q_objectPointLights, picked[0], max_lights);
+  upload_object_lights (renderer, program, q_objectSpotLights, picked[1], max_lights);
+}
+
+static GthreeProgram *
+set_program (GthreeRenderer *renderer,
+             GthreeCamera *camera,
+             GthreeFog *fog,
+             GthreeMaterial *material,
+             GthreeObject *object)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  gboolean refreshMaterial = false;
+  gboolean refreshLights = false;
+  GthreeProgram *program;
   GthreeShader *shader;
   GthreeUniforms *m_uniforms;
   GthreeMaterialProperties *material_properties = gthree_material_get_properties (material);
@@ -2376,11 +4253,7 @@ set_program (GthreeRenderer *renderer,
      object) changed since we last initialized the material, even if
      the material itself didn't change */
   priv->light_setup.hash.obj_receive_shadow = gthree_object_get_receive_shadow (object) && priv->shadowmap_enabled;
-  if (!gthree_material_is_valid_for (material, priv->renderer_id) ||
-      !gthree_light_setup_hash_equal (&material_properties->light_hash, &priv->light_setup.hash) ||
-      (gthree_material_get_fog (material) && material_properties->fog != fog) ||
-      material_properties->num_clipping_planes != priv->num_clipping_planes ||
-      material_properties->num_intersection != priv->num_clipping_intersections)
+  if (material_needs_init (renderer, material, fog, object))
     {
       init_material (renderer, material, fog, object);
       gthree_material_mark_valid_for (material, priv->renderer_id);
@@ -2394,8 +4267,18 @@ set_program (GthreeRenderer *renderer,
     {
       gthree_program_use (program);
       priv->current_program = program;
+      priv->info.program_switches++;
+
+      /* The light clusters stay bound to the last texture units */
+      if (priv->light_setup.hash.clustered)
+        {
+          int first_unit = priv->max_textures - GTHREE_CLUSTER_N_TEXTURES;
+
+          glUniform1i (gthree_program_lookup_uniform_location (program, q_clusterLightData), first_unit);
+          glUniform1i (gthree_program_lookup_uniform_location (program, q_clusterGrid), first_unit + 1);
+          glUniform1i (gthree_program_lookup_uniform_location (program, q_clusterLightIndices), first_unit + 2);
+        }
 
-      refreshProgram = TRUE;
       refreshMaterial = TRUE;
       refreshLights = TRUE;
     }
@@ -2403,66 +4286,27 @@ set_program (GthreeRenderer *renderer,
   if (material != priv->current_material)
     {
       priv->current_material = material;
+      priv->info.material_switches++;
       refreshMaterial = TRUE;
     }
 
-  if (refreshProgram || camera != priv->current_camera)
+  if (camera != priv->current_camera)
     {
-      const graphene_matrix_t *projection_matrix = gthree_camera_get_projection_matrix (camera);
-      float projection_matrixv[16];
-      gint proction_matrix_location = gthree_program_lookup_uniform_location (program, q_projectionMatrix);
-
-      graphene_matrix_to_float (projection_matrix, projection_matrixv);
-      glUniformMatrix4fv (proction_matrix_location, 1, FALSE, projection_matrixv);
+      /* The camera matrices are in the GthreeCamera uniform block, shared by all programs */
+      upload_camera_block (renderer, camera);
+      priv->current_camera = camera;
+
+      // lighting uniforms depend on the camera so enforce an update
+      // now, in case this material supports lights - or later, when
+      // the next material that does gets activated:
+      refreshMaterial = TRUE;	// set to true on material change
+      refreshLights = TRUE;		// remains set until update done
+    }
 
 #ifdef TODO
-      if ( _logarithmicDepthBuffer )
-        glUniform1f (uniform_locations.logDepthBufFC, 2.0 / ( Math.log( camera.far + 1.0 ) / Math.LN2 ));
-
-#endif
-      if (camera != priv->current_camera)
-        {
-          priv->current_camera = camera;
-
-          // lighting uniforms depend on the camera so enforce an update
-          // now, in case this material supports lights - or later, when
-          // the next material that does gets activated:
-          refreshMaterial = TRUE;	// set to true on material change
-          refreshLights = TRUE;		// remains set until update done
-        }
-
-      // load material specific uniforms
-      // (shader material also gets them for the sake of genericity)
-
-      if (gthree_material_needs_camera_pos (material)
-#if TODO
-          || material.envMap
+  if ( _logarithmicDepthBuffer )
+    glUniform1f (uniform_locations.logDepthBufFC, 2.0 / ( Math.log( camera.far + 1.0 ) / Math.LN2 ));
 #endif
-          )
-        {
-          gint camera_position_location = gthree_program_lookup_uniform_location (program, q_cameraPosition);
-          if (camera_position_location >= 0)
-            {
-              const graphene_matrix_t *camera_matrix_world = gthree_object_get_world_matrix (GTHREE_OBJECT (camera));
-              graphene_vec4_t pos;
-              graphene_matrix_get_row (camera_matrix_world, 3, &pos);
-              glUniform3f (camera_position_location,
-                           graphene_vec4_get_x (&pos), graphene_vec4_get_y (&pos), graphene_vec4_get_z (&pos));
-            }
-        }
-
-      if (gthree_material_needs_view_matrix (material))
-        {
-          gint view_matrix_location = gthree_program_lookup_uniform_location (program, q_viewMatrix);
-          if (view_matrix_location >= 0)
-            {
-              const graphene_matrix_t *m = gthree_camera_get_world_inverse_matrix (camera);
-              float floats[16];
-              graphene_matrix_to_float (m, floats);
-              glUniformMatrix4fv (view_matrix_location, 1, FALSE, floats);
-            }
-        }
-    }
 
   // skinning uniforms must be set even if material didn't change
   // auto-setting of texture unit for bone texture must go before other textures
@@ -2537,25 +4381,14 @@ set_program (GthreeRenderer *renderer,
 
   if ( refreshMaterial )
     {
-      if (gthree_material_needs_lights (material))
+      if (gthree_material_needs_lights (material) && refreshLights)
         {
-          mark_uniforms_lights_needs_update (m_uniforms, refreshLights);
-          if (refreshLights)
-            {
-              /* We marked the uniforms so they are uploaded, but we also need to sync
-               * the actual values from the light uniforms into the material uniforms
-               * (these are not the same because the location differs for each instance)
-               */
-              material_apply_light_setup (m_uniforms, &priv->light_setup, TRUE);
-            }
+          /* Sync the shadow maps and matrices from the light setup into the material uniforms */
+          material_apply_light_setup (m_uniforms, &priv->light_setup, TRUE);
         }
 
       gthree_material_set_uniforms (material, m_uniforms, camera, renderer);
 
-      // refresh uniforms common to several materials
-      if (fog != NULL && gthree_material_get_fog (material))
-        refresh_uniforms_fog (renderer, m_uniforms, fog);
-
       // refresh single material specific uniforms
 
 #if TODO
@@ -2593,6 +4426,9 @@ set_program (GthreeRenderer *renderer,
 
   gthree_object_set_direct_uniforms (object, program, renderer);
 
+  if (priv->light_setup.hash.max_object_lights > 0 && gthree_material_needs_lights (material))
+    pick_object_lights (renderer, program, object);
+
   return program;
 }
 
@@ -2607,40 +4443,95 @@ init_attributes (GthreeRenderer *renderer)
 }
 
 static void
-enable_attribute (GthreeRenderer *renderer,
-                  guint attribute)
+enable_attribute_and_divisor (GthreeRenderer *renderer,
+                              guint attribute,
+                              guint divisor)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
 
+  GthreeVertexArrayState *state = priv->current_vertex_array;
+
+  g_return_if_fail (attribute < MAX_VERTEX_ATTRIBUTES);
+
   priv->new_attributes[attribute] = 1;
-  if (priv->enabled_attributes[attribute] == 0)
+  if (state->enabled_attributes[attribute] == 0)
     {
       glEnableVertexAttribArray(attribute);
-      priv->enabled_attributes[attribute] = 1;
+      state->enabled_attributes[attribute] = 1;
+    }
+
+  if (state->attribute_divisors[attribute] != divisor)
+    {
+      glVertexAttribDivisor (attribute, divisor);
+      state->attribute_divisors[attribute] = divisor;
     }
 }
 
+static void
+enable_attribute (GthreeRenderer *renderer,
+                  guint attribute)
+{
+  enable_attribute_and_divisor (renderer, attribute, 0);
+}
+
 static void
 disable_unused_attributes (GthreeRenderer *renderer)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeVertexArrayState *state = priv->current_vertex_array;
   int i;
 
   for (i = 0; i < G_N_ELEMENTS(priv->new_attributes); i++)
     {
-      if (priv->enabled_attributes[i] != priv->new_attributes[i])
+      if (state->enabled_attributes[i] != priv->new_attributes[i])
         {
           glDisableVertexAttribArray(i);
-          priv->enabled_attributes[i] = 0;
+          state->enabled_attributes[i] = 0;
         }
     }
 }
 
+static GthreeAttribute *
+get_instance_attribute (GthreeObject *object,
+                        GQuark        nameq)
+{
+  GthreeInstancedMesh *instanced_mesh;
+
+  if (!GTHREE_IS_INSTANCED_MESH (object))
+    return NULL;
+
+  instanced_mesh = GTHREE_INSTANCED_MESH (object);
+
+  if (nameq == q_instanceMatrix)
+    return gthree_instanced_mesh_get_instance_matrix (instanced_mesh);
+  if (nameq == q_instanceColor)
+    return gthree_instanced_mesh_get_instance_color (instanced_mesh);
+
+  return NULL;
+}
+
+static void
+bind_vertex_array (GthreeRenderer *renderer,
+                   GthreeVertexArrayState *state)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->current_vertex_array != state)
+    {
+      glBindVertexArray (state->vao);
+      priv->current_vertex_array = state;
+    }
+}
+
+/* Sets up the attributes of the currently bound vao, and if default_attributes
+ * is not NULL, records the program attributes that got default values */
 static void
 setup_vertex_attributes (GthreeRenderer *renderer,
+                         GthreeObject *object,
                          GthreeMaterial *material,
                          GthreeProgram *program,
-                         GthreeGeometry *geometry)
+                         GthreeGeometry *geometry,
+                         GArray *default_attributes)
 {
   GHashTable *program_attributes;
   GHashTableIter iter;
@@ -2660,6 +4551,15 @@ setup_vertex_attributes (GthreeRenderer *renderer,
       if (program_attribute >= 0)
         {
           GthreeAttribute *geometry_attribute = gthree_geometry_get_attribute (geometry, name);
+          guint divisor = 0;
+
+          if (geometry_attribute == NULL)
+            {
+              geometry_attribute = get_instance_attribute (object, nameq);
+              if (geometry_attribute != NULL)
+                divisor = 1;
+            }
+
           if (geometry_attribute != NULL)
             {
               gboolean normalized = gthree_attribute_get_normalized (geometry_attribute);
@@ -2671,33 +4571,128 @@ setup_vertex_attributes (GthreeRenderer *renderer,
               int type = gthree_attribute_get_gl_type (geometry_attribute);
               int bytes_per_element = gthree_attribute_get_gl_bytes_per_element (geometry_attribute);
 
-              /*
-                if ( geometryAttribute.isInstancedBufferAttribute )
-                {
-                state.enableAttributeAndDivisor( programAttribute, geometryAttribute.meshPerAttribute );
-                if ( geometry.maxInstancedCount === undefined )
+              glBindBuffer (GL_ARRAY_BUFFER, buffer);
+
+              if (size == 16)
                 {
-                geometry.maxInstancedCount = geometryAttribute.meshPerAttribute * geometryAttribute.count;
+                  if (program_attribute + 4 > MAX_VERTEX_ATTRIBUTES)
+                    {
+                      g_warning ("Attribute %s at location %d doesn't fit in %d vertex attributes",
+                                 name, program_attribute, MAX_VERTEX_ATTRIBUTES);
+                      continue;
+                    }
+
+                  /* mat4 attributes take up 4 consecutive locations, one per column */
+                  for (int i = 0; i < 4; i++)
+                    {
+                      enable_attribute_and_divisor (renderer, program_attribute + i, divisor);
+                      glVertexAttribPointer (program_attribute + i, 4, type, normalized, stride * bytes_per_element,
+                                             GINT_TO_POINTER ((offset + i * 4) * bytes_per_element));
+                    }
                 }
+              else
+                {
+                  enable_attribute_and_divisor (renderer, program_attribute, divisor);
+                  glVertexAttribPointer (program_attribute, size, type, normalized, stride * bytes_per_element, GINT_TO_POINTER (offset * bytes_per_element));
                 }
-                else
-              */
-              {
-                enable_attribute (renderer, program_attribute);
-              }
-              glBindBuffer (GL_ARRAY_BUFFER, buffer);
-              glVertexAttribPointer (program_attribute, size, type, normalized, stride * bytes_per_element, GINT_TO_POINTER (offset * bytes_per_element));
             }
           else
             {
               gthree_material_load_default_attribute (material, program_attribute, nameq);
+
+              if (default_attributes)
+                {
+                  GthreeDefaultAttribute default_attribute = { program_attribute, nameq };
+                  g_array_append_val (default_attributes, default_attribute);
+                }
             }
         }
     }
 
+  disable_unused_attributes (renderer);
+}
+
+static void
+use_vertex_array (GthreeRenderer *renderer,
+                  GthreeObject *object,
+                  GthreeMaterial *material,
+                  GthreeProgram *program,
+                  GthreeGeometry *geometry,
+                  GthreeInstancedMesh *instances,
+                  gboolean wireframe,
+                  GthreeAttribute *index)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeVertexArray key = { { 0 } };
+  GthreeVertexArray *va;
+  guint geometry_serial, index_serial;
+  guint instance_matrix_serial = 0, instance_color_serial = 0;
+  gboolean needs_setup = FALSE;
+  int i;
+
+  geometry_serial = gthree_geometry_get_layout_serial (geometry);
+  index_serial = index ? gthree_attribute_get_layout_serial (index) : 0;
+  if (instances)
+    {
+      GthreeAttribute *instance_color = gthree_instanced_mesh_get_instance_color (instances);
+
+      instance_matrix_serial = gthree_attribute_get_layout_serial (gthree_instanced_mesh_get_instance_matrix (instances));
+      if (instance_color)
+        instance_color_serial = gthree_attribute_get_layout_serial (instance_color);
+    }
+
+  key.geometry = geometry;
+  key.program = program;
+  key.instances = instances;
+  key.wireframe = wireframe;
 
+  va = g_hash_table_lookup (priv->vertex_arrays, &key);
+  if (va == NULL)
+    {
+      va = g_new0 (GthreeVertexArray, 1);
+      va->renderer = renderer;
+      va->geometry = geometry;
+      va->program = program;
+      va->instances = instances;
+      va->wireframe = wireframe;
+      va->default_attributes = g_array_new (FALSE, FALSE, sizeof (GthreeDefaultAttribute));
+
+      g_object_weak_ref (G_OBJECT (geometry), vertex_array_weak_notify, va);
+      g_object_weak_ref (G_OBJECT (program), vertex_array_weak_notify, va);
+      if (instances)
+        g_object_weak_ref (G_OBJECT (instances), vertex_array_weak_notify, va);
+
+      glGenVertexArrays (1, &va->state.vao);
+      g_hash_table_add (priv->vertex_arrays, va);
+      needs_setup = TRUE;
+    }
+  else if (va->geometry_serial != geometry_serial ||
+           va->index_serial != index_serial ||
+           va->instance_matrix_serial != instance_matrix_serial ||
+           va->instance_color_serial != instance_color_serial)
+    needs_setup = TRUE;
 
-  disable_unused_attributes (renderer);
+  bind_vertex_array (renderer, &va->state);
+
+  if (needs_setup)
+    {
+      va->geometry_serial = geometry_serial;
+      va->index_serial = index_serial;
+      va->instance_matrix_serial = instance_matrix_serial;
+      va->instance_color_serial = instance_color_serial;
+
+      g_array_set_size (va->default_attributes, 0);
+      setup_vertex_attributes (renderer, object, material, program, geometry, va->default_attributes);
+      glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, index ? gthree_attribute_get_gl_buffer (index, renderer) : 0);
+    }
+  else
+    {
+      for (i = 0; i < va->default_attributes->len; i++)
+        {
+          GthreeDefaultAttribute *default_attribute = &g_array_index (va->default_attributes, GthreeDefaultAttribute, i);
+          gthree_material_load_default_attribute (material, default_attribute->location, default_attribute->name);
+        }
+    }
 }
 
 //	var influencesList = {};
@@ -2827,6 +4822,39 @@ update_morphtargets (GthreeRenderer *renderer,
     g_warning ("No morphTargetInfluences uniform");
 }
 
+static void
+count_primitives (GthreeRenderer *renderer,
+                  int             draw_mode,
+                  int             count,
+                  int             instance_count)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->info.draw_calls++;
+
+  switch (draw_mode)
+    {
+    case GL_TRIANGLES:
+      priv->info.triangles += instance_count * (count / 3);
+      break;
+    case GL_TRIANGLE_STRIP:
+    case GL_TRIANGLE_FAN:
+      priv->info.triangles += instance_count * MAX (count - 2, 0);
+      break;
+    case GL_LINES:
+      priv->info.lines += instance_count * (count / 2);
+      break;
+    case GL_LINE_STRIP:
+      priv->info.lines += instance_count * MAX (count - 1, 0);
+      break;
+    case GL_POINTS:
+      priv->info.points += instance_count * count;
+      break;
+    default:
+      break;
+    }
+}
+
 static void
 render_item (GthreeRenderer *renderer,
              GthreeCamera *camera,
@@ -2838,10 +4866,12 @@ render_item (GthreeRenderer *renderer,
   GthreeGeometry *geometry = item->geometry;
   GthreeGeometryGroup *group = item->group;
   GthreeObject *object = item->object;
+  GthreeInstancedMesh *instances = NULL;
   GthreeProgram *program;
   GthreeAttribute *position, *index;
-  gboolean update_buffers = FALSE;
+  gboolean morph_targets = FALSE;
   gboolean wireframe = FALSE;
+  int instance_count = 0;
   int data_count;
   int range_factor, range_start, range_count, group_start, group_count, draw_start, draw_end, draw_count;
   int draw_mode = GL_TRIANGLES;
@@ -2853,24 +4883,22 @@ render_item (GthreeRenderer *renderer,
       gthree_mesh_material_get_is_wireframe (GTHREE_MESH_MATERIAL (material)))
     wireframe = TRUE;
 
-  program = set_program (renderer, camera, fog, material, object);
-
-  if (geometry != priv->current_geometry_program_geometry ||
-      program != priv->current_geometry_program_program ||
-      wireframe != priv->current_geometry_program_wireframe)
+  if (GTHREE_IS_INSTANCED_MESH (object))
     {
-      priv->current_geometry_program_geometry = geometry;
-      priv->current_geometry_program_program = program;
-      priv->current_geometry_program_wireframe = wireframe;
-      update_buffers = true;
+      instances = GTHREE_INSTANCED_MESH (object);
+      instance_count = gthree_instanced_mesh_get_count (instances);
+      if (instance_count == 0)
+        return;
     }
 
+  program = set_program (renderer, camera, fog, material, object);
+
   if (GTHREE_IS_MESH (object) &&
       gthree_mesh_has_morph_targets (GTHREE_MESH (object)) &&
       GTHREE_IS_MESH_MATERIAL (material))
     {
       update_morphtargets (renderer, GTHREE_MESH (object), geometry, GTHREE_MESH_MATERIAL (material), program);
-      update_buffers = TRUE;
+      morph_targets = TRUE;
     }
 
   index = gthree_geometry_get_index (geometry);
@@ -2884,11 +4912,28 @@ render_item (GthreeRenderer *renderer,
       range_factor = 2;
     }
 
-  if (update_buffers)
+  if (morph_targets)
     {
-      setup_vertex_attributes (renderer, material, program, geometry);
+      /* The morph attributes change per draw, so don't cache these */
+      bind_vertex_array (renderer, &priv->default_vertex_array);
+      setup_vertex_attributes (renderer, object, material, program, geometry, NULL);
       if (index != NULL)
         glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, gthree_attribute_get_gl_buffer (index, renderer));
+
+      priv->current_geometry_program_geometry = NULL;
+    }
+  /* The instance attributes live in the object, so they need rebinding when that changes */
+  else if (geometry != priv->current_geometry_program_geometry ||
+           program != priv->current_geometry_program_program ||
+           wireframe != priv->current_geometry_program_wireframe ||
+           instances != priv->current_geometry_program_instances)
+    {
+      priv->current_geometry_program_geometry = geometry;
+      priv->current_geometry_program_program = program;
+      priv->current_geometry_program_wireframe = wireframe;
+      priv->current_geometry_program_instances = instances;
+
+      use_vertex_array (renderer, object, material, program, geometry, instances, wireframe, index);
     }
 
   data_count = -1;
@@ -2963,17 +5008,25 @@ render_item (GthreeRenderer *renderer,
       draw_mode = GL_POINTS;
     }
 
+  count_primitives (renderer, draw_mode, draw_count, instances ? instance_count : 1);
+
   if (index)
     {
       int index_type = gthree_attribute_get_gl_type (index);
       int index_bytes_per_element = gthree_attribute_get_gl_bytes_per_element (index);
       int index_offset = gthree_attribute_get_item_offset (index);
 
-      glDrawElements (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element));
+      if (instances)
+        glDrawElementsInstanced (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element), instance_count);
+      else
+        glDrawElements (draw_mode, draw_count, index_type, GINT_TO_POINTER ((index_offset + draw_start) * index_bytes_per_element));
     }
   else
     {
-      glDrawArrays (draw_mode, draw_start, draw_count);
+      if (instances)
+        glDrawArraysInstanced (draw_mode, draw_start, draw_count, instance_count);
+      else
+        glDrawArrays (draw_mode, draw_start, draw_count);
     }
 }
 
@@ -2984,7 +5037,8 @@ render_objects (GthreeRenderer *renderer,
                 GthreeCamera *camera,
                 GthreeFog *fog,
                 gboolean use_blending,
-                GthreeMaterial *override_material)
+                GthreeMaterial *override_material,
+                gboolean occlusion_cull)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
   GthreeMaterial *material;
@@ -2995,6 +5049,10 @@ render_objects (GthreeRenderer *renderer,
       int render_list_index = g_array_index (render_list_indexes, int, i);
       GthreeRenderListItem *item = &g_array_index (priv->current_render_list->items, GthreeRenderListItem, render_list_index);
 
+      if (occlusion_cull &&
+          gthree_occlusion_culler_is_occluded (priv->occlusion_culler, item->object))
+        continue;
+
       gthree_object_call_before_render_callback (item->object, scene, camera);
 
       gthree_object_update_matrix_view (item->object, gthree_camera_get_world_inverse_matrix (camera));
@@ -3031,6 +5089,129 @@ render_objects (GthreeRenderer *renderer,
     }
 }
 
+/* Creates or frees the occlusion culler to match the setting, returns
+ * TRUE if occlusion culling should be done this frame */
+static gboolean
+update_occlusion_culler (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (!priv->occlusion_culling || !priv->supports_occlusion_query)
+    {
+      g_clear_pointer (&priv->occlusion_culler, gthree_occlusion_culler_free);
+      return FALSE;
+    }
+
+  if (priv->occlusion_culler == NULL)
+    priv->occlusion_culler = gthree_occlusion_culler_new ();
+
+  gthree_occlusion_culler_begin_frame (priv->occlusion_culler);
+
+  return TRUE;
+}
+
+typedef struct {
+  GthreeRenderer *renderer;
+  GthreeCamera *camera;
+} OcclusionDrawData;
+
+static void
+draw_occlusion_box (const graphene_box_t *box,
+                    gpointer              user_data)
+{
+  OcclusionDrawData *data = user_data;
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (data->renderer);
+  GthreeObject *box_object = GTHREE_OBJECT (priv->occlusion_box_mesh);
+  GthreeRenderListItem item = { box_object, NULL, NULL, NULL, 0.0 };
+  graphene_point3d_t center;
+  graphene_vec3_t size;
+  graphene_matrix_t matrix;
+
+  graphene_box_get_center (box, &center);
+  graphene_box_get_size (box, &size);
+  graphene_matrix_init_scale (&matrix,
+                              graphene_vec3_get_x (&size),
+                              graphene_vec3_get_y (&size),
+                              graphene_vec3_get_z (&size));
+  graphene_matrix_translate (&matrix, &center);
+
+  gthree_object_set_world_matrix (box_object, &matrix);
+  gthree_object_update_matrix_view (box_object, gthree_camera_get_world_inverse_matrix (data->camera));
+
+  item.geometry = gthree_mesh_get_geometry (priv->occlusion_box_mesh);
+  item.material = gthree_mesh_get_material (priv->occlusion_box_mesh, 0);
+  render_item (data->renderer, data->camera, NULL, item.material, &item);
+}
+
+/* Tests are registered as objects are drawn, but the transparent ones
+ * are drawn after the queries run, so register those up front */
+static void
+add_occlusion_tests (GthreeRenderer *renderer,
+                     GArray         *render_list_indexes)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  int i;
+
+  for (i = 0; i < render_list_indexes->len; i++)
+    {
+      int render_list_index = g_array_index (render_list_indexes, int, i);
+      GthreeRenderListItem *item = &g_array_index (priv->current_render_list->items, GthreeRenderListItem, render_list_index);
+
+      gthree_occlusion_culler_is_occluded (priv->occlusion_culler, item->object);
+    }
+}
+
+static void
+run_occlusion_queries (GthreeRenderer *renderer,
+                       GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  OcclusionDrawData data = { renderer, camera };
+  GthreeMaterial *material;
+  graphene_point3d_t eye;
+  graphene_vec4_t pos;
+  guint draw_calls, triangles;
+
+  if (priv->occlusion_box_mesh == NULL)
+    {
+      g_autoptr(GthreeGeometry) geometry = gthree_geometry_new_box (1, 1, 1, 1, 1, 1);
+      g_autoptr(GthreeMeshBasicMaterial) box_material = gthree_mesh_basic_material_new ();
+
+      gthree_material_set_depth_write (GTHREE_MATERIAL (box_material), FALSE);
+      gthree_material_set_side (GTHREE_MATERIAL (box_material), GTHREE_SIDE_DOUBLE);
+      gthree_material_set_fog (GTHREE_MATERIAL (box_material), FALSE);
+
+      priv->occlusion_box_mesh = gthree_mesh_new (geometry, GTHREE_MATERIAL (box_material));
+      gthree_object_set_matrix_auto_update (GTHREE_OBJECT (priv->occlusion_box_mesh), FALSE);
+    }
+
+  gthree_object_update (GTHREE_OBJECT (priv->occlusion_box_mesh), renderer);
+
+  material = gthree_mesh_get_material (priv->occlusion_box_mesh, 0);
+  set_depth_test (renderer, TRUE);
+  set_depth_write (renderer, FALSE);
+  set_polygon_offset (renderer, FALSE, 0, 0);
+  set_material_faces (renderer, material);
+  glColorMask (GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+  graphene_matrix_get_row (gthree_object_get_world_matrix (GTHREE_OBJECT (camera)), 3, &pos);
+  graphene_point3d_init (&eye, graphene_vec4_get_x (&pos), graphene_vec4_get_y (&pos), graphene_vec4_get_z (&pos));
+
+  /* The boxes are counted in occlusion_queries, not as what was drawn */
+  draw_calls = priv->info.draw_calls;
+  triangles = priv->info.triangles;
+
+  priv->info.occlusion_queries +=
+    gthree_occlusion_culler_run_tests (priv->occlusion_culler, &eye,
+                                       gthree_camera_get_near (camera),
+                                       draw_occlusion_box, &data);
+
+  priv->info.draw_calls = draw_calls;
+  priv->info.triangles = triangles;
+
+  glColorMask (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
 static void
 clear (gboolean color, gboolean depth, gboolean stencil)
 {
@@ -3215,7 +5396,7 @@ gthree_renderer_render (GthreeRenderer *renderer,
 
   gthree_renderer_push_current (renderer);
 
-  push_debug_group ("gthree render to %p", priv->current_render_target);
+  push_debug_group (renderer, "gthree render to %p", priv->current_render_target);
 
   g_list_free (priv->lights);
   priv->lights = NULL;
@@ -3223,11 +5404,23 @@ gthree_renderer_render (GthreeRenderer *renderer,
   g_list_free (priv->shadows);
   priv->shadows = NULL;
 
+  /* Evicting programs here is safe, nothing points to unused ones */
+  priv->current_program = NULL;
+  gthree_program_cache_trim (priv->program_cache, priv->supports_parallel_shader_compile);
+
   priv->current_material = NULL;
   priv->current_camera = NULL;
+  if (priv->auto_reset_info)
+    gthree_renderer_reset_info (renderer);
   priv->current_geometry_program_geometry = NULL;
   priv->current_geometry_program_program = NULL;
   priv->current_geometry_program_wireframe = FALSE;
+  priv->current_geometry_program_instances = NULL;
+  /* Someone else may have bound a vao since the last frame */
+  priv->current_vertex_array = NULL;
+
+  for (int i = 0; i < GTHREE_UNIFORM_BLOCK_N_BLOCKS; i++)
+    glBindBufferBase (GL_UNIFORM_BUFFER, i, priv->uniform_buffers[i]);
 
   /* update scene graph */
 
@@ -3242,18 +5435,29 @@ gthree_renderer_render (GthreeRenderer *renderer,
 
   gthree_camera_get_proj_screen_matrix (camera, &priv->proj_screen_matrix);
   graphene_frustum_init_from_matrix (&priv->frustum, &priv->proj_screen_matrix);
+  priv->bvh_serial = gthree_scene_bvh_cull (scene, &priv->frustum);
+
+  update_depth_culler (renderer, scene, camera);
 
   priv->clipping_enabled = clipping_init (renderer, camera);
 
   /* Flush lazily deleted resources to avoid leaking until widget unrealize */
   gthree_renderer_flush_deletes (renderer);
 
-  gthree_render_list_init (priv->current_render_list);
+  if (priv->retained_render_lists)
+    project_retained (renderer, scene, camera);
+  else
+    {
+      priv->current_render_list = priv->immediate_render_list;
+      gthree_render_list_init (priv->current_render_list);
 
-  project_object (renderer, scene, GTHREE_OBJECT (scene), camera);
+      project_object (renderer, scene, GTHREE_OBJECT (scene), camera);
+      priv->lights = g_list_reverse (priv->lights);
+      priv->shadows = g_list_reverse (priv->shadows);
 
-  if (priv->sort_objects)
-    gthree_render_list_sort (priv->current_render_list);
+      if (priv->sort_objects)
+        gthree_render_list_sort (priv->current_render_list);
+    }
 
   if (priv->clipping_enabled )
     clipping_begin_shadows (renderer);
@@ -3261,17 +5465,23 @@ gthree_renderer_render (GthreeRenderer *renderer,
   render_shadow_map (renderer, scene, camera);
 
   setup_lights (renderer, camera);
+  upload_lights_block (renderer);
 
   if (priv->clipping_enabled)
     clipping_end_shadows (renderer);
 
   gthree_renderer_set_render_target (renderer, priv->current_render_target, 0, 0);
 
+  push_debug_group (renderer, "background");
   gthree_renderer_render_background (renderer, scene);
+  pop_debug_group (renderer);
 
   /* set matrices for regular objects (frustum culled) */
 
   fog = gthree_scene_get_fog (scene);
+  if (fog)
+    upload_fog_block (renderer, fog);
+
   override_material = gthree_scene_get_override_material (scene);
   if (override_material)
     {
@@ -3287,21 +5497,43 @@ gthree_renderer_render (GthreeRenderer *renderer,
       polygon_offset = gthree_material_get_polygon_offset (override_material, &factor, &units);
       set_polygon_offset (renderer, polygon_offset, factor, units);
 
-      render_objects (renderer, scene, priv->current_render_list->background, camera, fog, TRUE, override_material );
-      render_objects (renderer, scene, priv->current_render_list->opaque, camera, fog, TRUE, override_material );
-      render_objects (renderer, scene, priv->current_render_list->transparent, camera, fog, TRUE, override_material );
+      push_debug_group (renderer, "override material");
+      render_objects (renderer, scene, priv->current_render_list->background, camera, fog, TRUE, override_material, FALSE);
+      render_objects (renderer, scene, priv->current_render_list->opaque, camera, fog, TRUE, override_material, FALSE);
+      render_objects (renderer, scene, priv->current_render_list->transparent, camera, fog, TRUE, override_material, FALSE);
+      pop_debug_group (renderer);
     }
   else
     {
+      gboolean occlusion_cull = update_occlusion_culler (renderer);
+
       set_blending (renderer, GTHREE_BLEND_NO, 0, 0, 0);
 
-      render_objects (renderer, scene, priv->current_render_list->background, camera, fog, FALSE, NULL);
+      push_debug_group (renderer, "opaque");
+
+      render_objects (renderer, scene, priv->current_render_list->background, camera, fog, FALSE, NULL, FALSE);
 
       // opaque pass (front-to-back order)
-      render_objects (renderer, scene, priv->current_render_list->opaque, camera, fog, FALSE, NULL);
+      render_objects (renderer, scene, priv->current_render_list->opaque, camera, fog, FALSE, NULL, occlusion_cull);
+
+      pop_debug_group (renderer);
+
+      // test what was hidden by the opaque objects, for the next frame
+      if (occlusion_cull)
+        {
+          push_debug_group (renderer, "occlusion queries");
+          add_occlusion_tests (renderer, priv->current_render_list->transparent);
+          run_occlusion_queries (renderer, camera);
+          pop_debug_group (renderer);
+        }
 
       // transparent pass (back-to-front order)
-      render_objects (renderer, scene, priv->current_render_list->transparent, camera, fog, TRUE, NULL);
+      push_debug_group (renderer, "transparent");
+      render_objects (renderer, scene, priv->current_render_list->transparent, camera, fog, TRUE, NULL, occlusion_cull);
+      pop_debug_group (renderer);
+
+      if (occlusion_cull)
+        priv->info.objects_occluded += gthree_occlusion_culler_get_n_occluded (priv->occlusion_culler);
     }
 
   if (priv->current_render_target != NULL)
@@ -3312,28 +5544,658 @@ gthree_renderer_render (GthreeRenderer *renderer,
       update_multisample_render_target (renderer, priv->current_render_target);
     }
 
-  pop_debug_group ();
+  pop_debug_group (renderer);
 
   gthree_renderer_pop_current (renderer);
 }
 
-guint
-gthree_renderer_allocate_texture_unit (GthreeRenderer *renderer)
+static void
+compile_project_object (GthreeRenderer   *renderer,
+                        GthreeObject     *object,
+                        GthreeCamera     *camera,
+                        GthreeRenderList *list)
 {
   GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
-  guint texture_unit = priv->used_texture_units;
+  GthreeObject *child;
+  GthreeObjectIter iter;
 
-  if (texture_unit >= priv->max_textures )
-    g_warning ("Trying to use %dtexture units while this GPU supports only %d",  texture_unit,priv->max_textures);
+  /* Unused LOD levels too, they can be switched to at any time */
+  if (!gthree_object_get_visible (object))
+    return;
 
-  priv->used_texture_units += 1;
+  if (gthree_object_check_layer (object, gthree_object_get_layer_mask (GTHREE_OBJECT (camera))))
+    {
+      if (GTHREE_IS_LIGHT (object))
+        {
+          priv->lights = g_list_prepend (priv->lights, object);
+          if (gthree_object_get_cast_shadow (object))
+            priv->shadows = g_list_prepend (priv->shadows, object);
+        }
+      else if (GTHREE_IS_MESH (object) || GTHREE_IS_LINE (object) || GTHREE_IS_SPRITE (object) || GTHREE_IS_POINTS (object))
+        {
+          /* Unlike project_object() this skips frustum culling, as
+             objects outside the view now may be visible later */
+          gthree_object_update (object, renderer);
+          gthree_object_fill_render_list (object, list);
+        }
+    }
 
-  return texture_unit;
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    compile_project_object (renderer, child, camera, list);
 }
 
-
-GthreeRenderList *
-gthree_render_list_new ()
+/**
+ * gthree_renderer_compile:
+ * @renderer: a #GthreeRenderer
+ * @scene: a #GthreeScene
+ * @camera: the #GthreeCamera the scene will be rendered with
+ *
+ * Builds the shader programs for all visible objects in the scene,
+ * with the lights and fog the scene currently has, so that the first
+ * gthree_renderer_render() doesn't stall on shader compilation.
+ *
+ * If the driver supports GL_KHR_parallel_shader_compile the programs
+ * are compiled in the background, and this returns %FALSE while some
+ * are still being built. Call it again (e.g. once per frame while
+ * showing a loading screen) until it returns %TRUE. Without the
+ * extension this blocks until everything is built.
+ *
+ * Returns: %TRUE if all programs for the scene are ready
+ */
+gboolean
+gthree_renderer_compile (GthreeRenderer *renderer,
+                         GthreeScene    *scene,
+                         GthreeCamera   *camera)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  GthreeRenderList *list;
+  GthreeMaterial *override_material;
+  GthreeFog *fog;
+  gboolean ready = TRUE;
+  int i;
+
+  gthree_renderer_push_current (renderer);
+
+  g_list_free (priv->lights);
+  priv->lights = NULL;
+
+  g_list_free (priv->shadows);
+  priv->shadows = NULL;
+
+  gthree_object_update_matrix_world (GTHREE_OBJECT (scene), FALSE);
+
+  if (gthree_object_get_parent (GTHREE_OBJECT (camera)) == NULL)
+    gthree_object_update_matrix_world (GTHREE_OBJECT (camera), FALSE);
+
+  gthree_camera_update_matrix (camera);
+
+  priv->clipping_enabled = clipping_init (renderer, camera);
+
+  list = gthree_render_list_new ();
+  compile_project_object (renderer, GTHREE_OBJECT (scene), camera, list);
+  priv->lights = g_list_reverse (priv->lights);
+  priv->shadows = g_list_reverse (priv->shadows);
+
+  setup_lights (renderer, camera);
+
+  fog = gthree_scene_get_fog (scene);
+  override_material = gthree_scene_get_override_material (scene);
+
+  for (i = 0; i < list->items->len; i++)
+    {
+      GthreeRenderListItem *item = &g_array_index (list->items, GthreeRenderListItem, i);
+      GthreeMaterial *material = override_material ? override_material : item->material;
+      GthreeProgram *program;
+
+      if (material == NULL)
+        continue;
+
+      /* Same state setup as set_program() */
+      if (priv->clipping_enabled)
+        clipping_set_state (renderer, camera, material, FALSE);
+
+      priv->light_setup.hash.obj_receive_shadow = gthree_object_get_receive_shadow (item->object) && priv->shadowmap_enabled;
+      if (!material_needs_init (renderer, material, fog, item->object))
+        continue;
+
+      program = get_material_program (renderer, material, fog, item->object);
+      if (priv->supports_parallel_shader_compile && !gthree_program_is_ready (program))
+        {
+          ready = FALSE;
+          continue;
+        }
+
+      init_material (renderer, material, fog, item->object);
+      gthree_material_mark_valid_for (material, priv->renderer_id);
+    }
+
+  gthree_render_list_free (list);
+
+  gthree_renderer_pop_current (renderer);
+
+  return ready;
+}
+
+/* Called before uploading a uniform value to the current program,
+ * returns FALSE if the program already has that value. */
+gboolean
+gthree_renderer_update_uniform_value (GthreeRenderer *renderer,
+                                      gint            location,
+                                      gconstpointer   value,
+                                      gsize           size)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->current_program != NULL &&
+      !gthree_program_update_uniform_value (priv->current_program, location, value, size))
+    {
+      priv->info.uniform_uploads_skipped++;
+      return FALSE;
+    }
+
+  priv->info.uniform_uploads++;
+  return TRUE;
+}
+
+void
+gthree_renderer_count_buffer_upload (GthreeRenderer *renderer,
+                                     gsize           bytes)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->info.buffer_bytes_uploaded += bytes;
+}
+
+void
+gthree_renderer_count_texture_upload (GthreeRenderer *renderer,
+                                      gsize           bytes)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->info.texture_bytes_uploaded += bytes;
+}
+
+void
+gthree_renderer_count_texture_bind (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->info.texture_binds++;
+}
+
+/**
+ * gthree_renderer_get_info:
+ * @renderer: a #GthreeRenderer
+ *
+ * Gets counters for the work the renderer submitted to GL, like draw
+ * calls, primitives, state changes and uploaded bytes.
+ *
+ * By default these are reset at the start of each
+ * gthree_renderer_render(), so they describe the last render. If a
+ * frame is made from several renders, disable this with
+ * gthree_renderer_set_auto_reset_info() and call
+ * gthree_renderer_reset_info() once per frame instead.
+ *
+ * Returns: (transfer none): the counters, valid until @renderer is freed
+ */
+const GthreeRenderInfo *
+gthree_renderer_get_info (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return &priv->info;
+}
+
+void
+gthree_renderer_reset_info (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  memset (&priv->info, 0, sizeof (priv->info));
+}
+
+void
+gthree_renderer_set_auto_reset_info (GthreeRenderer *renderer,
+                                     gboolean        auto_reset)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->auto_reset_info = !!auto_reset;
+}
+
+gboolean
+gthree_renderer_get_auto_reset_info (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->auto_reset_info;
+}
+
+/**
+ * gthree_renderer_set_program_cache_dir:
+ * @renderer: a #GthreeRenderer
+ * @path: (nullable): a directory, or %NULL to disable the cache
+ *
+ * Sets a directory where linked shader programs are stored, so that
+ * later runs can load them instead of compiling the shaders again.
+ * Entries are keyed by the shader source and the GL driver, and are
+ * recompiled automatically if the driver rejects them.
+ */
+void
+gthree_renderer_set_program_cache_dir (GthreeRenderer *renderer,
+                                       const char     *path)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  gthree_program_cache_set_binary_dir (priv->program_cache, path);
+}
+
+const char *
+gthree_renderer_get_program_cache_dir (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return gthree_program_cache_get_binary_dir (priv->program_cache);
+}
+
+/**
+ * gthree_renderer_get_program_cache_stats:
+ * @renderer: a #GthreeRenderer
+ * @hits: (out) (optional): programs loaded from the cache directory
+ * @misses: (out) (optional): programs that had no cache entry
+ * @stale: (out) (optional): cache entries that were unusable and got replaced
+ *
+ * Gets the counters of the on-disk program cache set with
+ * gthree_renderer_set_program_cache_dir().
+ */
+void
+gthree_renderer_get_program_cache_stats (GthreeRenderer *renderer,
+                                         guint          *hits,
+                                         guint          *misses,
+                                         guint          *stale)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  gthree_program_cache_get_binary_stats (priv->program_cache, hits, misses, stale);
+}
+
+/**
+ * gthree_renderer_set_max_unused_programs:
+ * @renderer: a #GthreeRenderer
+ * @max_unused: the number of programs to keep
+ *
+ * Sets how many shader programs no longer used by any material are
+ * kept around in case they are needed again. Beyond that, the least
+ * recently used ones are freed at the start of the next render.
+ *
+ * Programs that gthree_renderer_compile() started building but that no
+ * material uses yet are not freed while the driver is still building
+ * them, and once built are kept until the render after that, so they are
+ * still there when it is called again to check whether they are ready.
+ */
+void
+gthree_renderer_set_max_unused_programs (GthreeRenderer *renderer,
+                                         guint           max_unused)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  gthree_program_cache_set_max_unused (priv->program_cache, max_unused);
+}
+
+guint
+gthree_renderer_get_max_unused_programs (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return gthree_program_cache_get_max_unused (priv->program_cache);
+}
+
+/**
+ * gthree_renderer_get_program_stats:
+ * @renderer: a #GthreeRenderer
+ * @n_programs: (out) (optional): number of programs currently alive
+ * @n_unused: (out) (optional): how many of those are not used by any material
+ * @n_evicted: (out) (optional): number of programs freed so far
+ * @source_time: (out) (optional): part of @compile_time spent generating shader source
+ * @compile_time: (out) (optional): total time spent building programs, in microseconds
+ *
+ * Gets the state of the renderer's shader program cache.
+ */
+void
+gthree_renderer_get_program_stats (GthreeRenderer *renderer,
+                                   guint          *n_programs,
+                                   guint          *n_unused,
+                                   guint          *n_evicted,
+                                   gint64         *source_time,
+                                   gint64         *compile_time)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  gthree_program_cache_get_stats (priv->program_cache, n_programs, n_unused, n_evicted, source_time, compile_time);
+}
+
+/**
+ * gthree_renderer_set_gpu_timing_enabled:
+ * @renderer: a #GthreeRenderer
+ * @enabled: whether to measure GPU times
+ *
+ * Enables timing the phases of each frame on the GPU: the shadow maps
+ * for each light, the background, the opaque and transparent objects,
+ * and each pass of a #GthreeEffectComposer. Apps can time their own
+ * phases with gthree_renderer_push_gpu_timer().
+ *
+ * Results are read back a few frames later without waiting for the
+ * GPU, and #GthreeRenderer::gpu-timings is emitted when they are
+ * available. This needs timer queries, so it does nothing on OpenGL ES
+ * or before OpenGL 3.3 without GL_ARB_timer_query.
+ */
+void
+gthree_renderer_set_gpu_timing_enabled (GthreeRenderer *renderer,
+                                        gboolean        enabled)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->gpu_timing_enabled = !!enabled;
+}
+
+gboolean
+gthree_renderer_get_gpu_timing_enabled (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->gpu_timing_enabled;
+}
+
+/**
+ * gthree_renderer_get_gpu_timings:
+ * @renderer: a #GthreeRenderer
+ * @n_timings: (out): return location for the number of timings
+ *
+ * Gets the GPU times of the phases in the most recent frame that was
+ * read back. The phases are in the order they started, and @depth
+ * says how they nest, so the time of a phase includes its children.
+ *
+ * Returns: (array length=n_timings) (transfer none): the timings,
+ *   valid until the next frame
+ */
+const GthreeGpuTiming *
+gthree_renderer_get_gpu_timings (GthreeRenderer *renderer,
+                                 guint          *n_timings)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->gpu_timer == NULL)
+    {
+      *n_timings = 0;
+      return NULL;
+    }
+
+  return gthree_gpu_timer_get_timings (priv->gpu_timer, n_timings);
+}
+
+/**
+ * gthree_renderer_push_gpu_timer:
+ * @renderer: a #GthreeRenderer
+ * @name: name of the phase
+ *
+ * Starts timing a phase on the GPU, it ends with the matching
+ * gthree_renderer_pop_gpu_timer(). Phases can nest, and the outermost
+ * one delimits a frame. This must be called with the GL context of
+ * @renderer current, and does nothing unless GPU timing is enabled.
+ */
+void
+gthree_renderer_push_gpu_timer (GthreeRenderer *renderer,
+                                const char     *name)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (!priv->gpu_timing_enabled && priv->gpu_timer == NULL)
+    return;
+
+  /* Only start or stop timing between frames */
+  if (priv->gpu_timer == NULL)
+    {
+      if (!priv->supports_timer_query)
+        return;
+      priv->gpu_timer = gthree_gpu_timer_new ();
+    }
+  else if (!priv->gpu_timing_enabled && gthree_gpu_timer_get_depth (priv->gpu_timer) == 0)
+    {
+      gthree_gpu_timer_free (priv->gpu_timer);
+      priv->gpu_timer = NULL;
+      return;
+    }
+
+  gthree_gpu_timer_push (priv->gpu_timer, name);
+}
+
+void
+gthree_renderer_pop_gpu_timer (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  if (priv->gpu_timer && gthree_gpu_timer_pop (priv->gpu_timer))
+    g_signal_emit (renderer, signals[GPU_TIMINGS], 0);
+}
+
+/**
+ * gthree_renderer_set_occlusion_culling:
+ * @renderer: a #GthreeRenderer
+ * @occlusion_culling: whether to skip objects hidden behind others
+ *
+ * Enables occlusion culling, for scenes where most objects are hidden
+ * behind others, like building interiors. After the opaque objects are
+ * drawn, the bounding boxes of objects that were hidden, and every few
+ * frames of those that were visible, are tested against the depth
+ * buffer with occlusion queries. Objects found hidden are skipped until
+ * a later test sees them again.
+ *
+ * Results are read back in later frames without waiting for the GPU,
+ * so an object that comes into view can appear a frame late. What is
+ * hidden depends on the point of view, so this works best when the
+ * renderer draws the scene from a single camera. It needs OpenGL 3.3,
+ * OpenGL ES 3.0 or GL_ARB_occlusion_query2 and does nothing otherwise.
+ * It is not used with a scene override material.
+ */
+void
+gthree_renderer_set_occlusion_culling (GthreeRenderer *renderer,
+                                       gboolean        occlusion_culling)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->occlusion_culling = !!occlusion_culling;
+}
+
+gboolean
+gthree_renderer_get_occlusion_culling (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->occlusion_culling;
+}
+
+/**
+ * gthree_renderer_set_software_occlusion_culling:
+ * @renderer: a #GthreeRenderer
+ * @occlusion_culling: whether to skip objects hidden behind occluders
+ *
+ * Enables occlusion culling on the CPU. Each frame, the meshes marked
+ * with gthree_object_set_is_occluder() are rasterized into a small depth
+ * buffer on worker threads, and objects whose bounding box is entirely
+ * behind that are not drawn. Unlike gthree_renderer_set_occlusion_culling()
+ * this has no latency and needs nothing from the GPU, but only the
+ * occluders hide anything, so it depends on picking good ones.
+ */
+void
+gthree_renderer_set_software_occlusion_culling (GthreeRenderer *renderer,
+                                                gboolean        occlusion_culling)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->software_occlusion_culling = !!occlusion_culling;
+}
+
+gboolean
+gthree_renderer_get_software_occlusion_culling (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->software_occlusion_culling;
+}
+
+/**
+ * gthree_renderer_set_retained_render_lists:
+ * @renderer: a #GthreeRenderer
+ * @retained: whether to keep render lists between frames
+ *
+ * Normally each gthree_renderer_render() walks the whole scene graph to
+ * find what to draw, culls and sorts it all. With retained render lists
+ * the renderer instead remembers, per scene and camera, what it found
+ * in the last frame. The scene graph is only walked again after
+ * objects are added, removed, hidden, moved to another layer or given
+ * other materials, and only objects that moved since the last frame
+ * are culled again. If nothing moved, not even the camera, the last
+ * render list is drawn as is.
+ *
+ * This saves CPU time for large scenes that are mostly static.
+ */
+void
+gthree_renderer_set_retained_render_lists (GthreeRenderer *renderer,
+                                           gboolean        retained)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->retained_render_lists = !!retained;
+
+  if (!priv->retained_render_lists)
+    {
+      g_ptr_array_set_size (priv->retained_lists, 0);
+      priv->current_render_list = priv->immediate_render_list;
+    }
+}
+
+gboolean
+gthree_renderer_get_retained_render_lists (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->retained_render_lists;
+}
+
+/**
+ * gthree_renderer_set_light_count_bucketing:
+ * @renderer: a #GthreeRenderer
+ * @bucketing: whether to round up light counts
+ *
+ * The number of directional, point and spot lights is compiled into
+ * the programs, so normally adding, removing or hiding a light rebuilds
+ * the programs of every lit material. With bucketing enabled the counts
+ * are rounded up to the next power of two and the extra slots are
+ * filled with black lights, so most such changes reuse the programs.
+ */
+void
+gthree_renderer_set_light_count_bucketing (GthreeRenderer *renderer,
+                                           gboolean        bucketing)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->light_count_bucketing = !!bucketing;
+}
+
+gboolean
+gthree_renderer_get_light_count_bucketing (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->light_count_bucketing;
+}
+
+/**
+ * gthree_renderer_set_max_object_lights:
+ * @renderer: a #GthreeRenderer
+ * @max_lights: the maximum number of point and of spot lights per object,
+ *   or 0 to light objects with all lights
+ *
+ * Limits the point and spot lights each object is lit by. For every
+ * draw, the lights are ranked by how much they can contribute to the
+ * bounding sphere of the object, and only the @max_lights strongest
+ * point lights and spot lights are evaluated by the shader. Lights whose
+ * distance doesn't reach the object are never picked.
+ *
+ * Shadow casting lights are always evaluated for objects that receive
+ * shadows. Combine this with gthree_renderer_set_light_count_bucketing()
+ * for scenes where lights come and go.
+ */
+void
+gthree_renderer_set_max_object_lights (GthreeRenderer *renderer,
+                                       guint           max_lights)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  g_return_if_fail (max_lights <= MAX_OBJECT_LIGHTS);
+
+  priv->max_object_lights = max_lights;
+}
+
+guint
+gthree_renderer_get_max_object_lights (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->max_object_lights;
+}
+
+/**
+ * gthree_renderer_set_clustered_lighting:
+ * @renderer: a #GthreeRenderer
+ * @clustered_lighting: whether to use clustered lighting
+ *
+ * Enables clustered forward lighting. Each frame, the point and spot
+ * lights that don't cast shadows are sorted into a grid of clusters
+ * covering the view frustum, and each fragment only evaluates the
+ * lights of its cluster. This makes scenes with many small lights
+ * much cheaper, and adding or removing such lights no longer rebuilds
+ * the programs.
+ *
+ * Three texture units at the top of the range are reserved for this.
+ */
+void
+gthree_renderer_set_clustered_lighting (GthreeRenderer *renderer,
+                                        gboolean        clustered_lighting)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  priv->clustered_lighting = !!clustered_lighting;
+}
+
+gboolean
+gthree_renderer_get_clustered_lighting (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+
+  return priv->clustered_lighting;
+}
+
+guint
+gthree_renderer_allocate_texture_unit (GthreeRenderer *renderer)
+{
+  GthreeRendererPrivate *priv = gthree_renderer_get_instance_private (renderer);
+  guint texture_unit = priv->used_texture_units;
+
+  if (texture_unit >= priv->max_textures )
+    g_warning ("Trying to use %dtexture units while this GPU supports only %d",  texture_unit,priv->max_textures);
+  else if (priv->light_clusters && texture_unit >= priv->max_textures - GTHREE_CLUSTER_N_TEXTURES)
+    g_warning ("Texture unit %d is reserved for clustered lighting", texture_unit);
+
+  priv->used_texture_units += 1;
+
+  return texture_unit;
+}
+
+
+GthreeRenderList *
+gthree_render_list_new ()
 {
   GthreeRenderList *list = g_new0 (GthreeRenderList, 1);
 
@@ -3341,6 +6203,8 @@ gthree_render_list_new ()
   list->opaque = g_array_new (FALSE, FALSE, sizeof (int));
   list->transparent = g_array_new (FALSE, FALSE, sizeof (int));
   list->background = g_array_new (FALSE, FALSE, sizeof (int));
+  list->sort_items = g_array_new (FALSE, FALSE, sizeof (GthreeRenderListSortItem));
+  list->sort_tmp = g_array_new (FALSE, FALSE, sizeof (GthreeRenderListSortItem));
 
   return list;
 }
@@ -3352,6 +6216,8 @@ gthree_render_list_free (GthreeRenderList *list)
   g_array_unref (list->opaque);
   g_array_unref (list->transparent);
   g_array_unref (list->background);
+  g_array_unref (list->sort_items);
+  g_array_unref (list->sort_tmp);
   g_free (list);
 }
 
@@ -3366,65 +6232,139 @@ gthree_render_list_init (GthreeRenderList *list)
   g_array_set_size (list->background, 0);
 }
 
-static gint
-render_list_painter_sort_stable (gconstpointer _a, gconstpointer _b, gpointer user_data)
+static guint32 render_lists_serial = 1;
+
+/* Changes whenever anything retained render lists depend on changes,
+ * like the scene graph, visibility, layers or materials of objects */
+guint32
+gthree_render_lists_get_serial (void)
+{
+  return render_lists_serial;
+}
+
+void
+gthree_render_lists_invalidate (void)
 {
-  GthreeRenderList *list = user_data;
-  int ai = *(int *)_a;
-  int bi = *(int *)_b;
-  GthreeRenderListItem *a = &g_array_index (list->items, GthreeRenderListItem, ai);
-  GthreeRenderListItem *b = &g_array_index (list->items, GthreeRenderListItem, bi);
+  render_lists_serial++;
+}
+
+/* Maps a float to an unsigned int with the same ordering */
+static inline guint32
+float_to_sortable_uint (float f)
+{
+  union {
+    float f;
+    guint32 u;
+  } v;
+
+  v.f = f;
+  if (v.u & 0x80000000)
+    return ~v.u;
+  return v.u | 0x80000000;
+}
 
-  if (a->z != b->z)
+/* Opaque items are ordered by state to minimize program, material and
+ * geometry switches, then roughly front-to-back to help early z rejection.
+ * The ids are truncated, which at worst makes the grouping less ideal. */
+static guint64
+render_list_opaque_key (GthreeRenderListItem *item)
+{
+  GthreeMaterialProperties *material_properties = gthree_material_get_properties (item->material);
+  guint64 program_id = material_properties->program_id & 0xffff;
+  guint64 material_id = gthree_material_get_id (item->material) & 0xffff;
+  guint64 geometry_id = item->geometry ? gthree_geometry_get_id (item->geometry) & 0xffff : 0;
+  guint64 depth = float_to_sortable_uint (item->z) >> 16;
+
+  return program_id << 48 | material_id << 32 | geometry_id << 16 | depth;
+}
+
+/* Transparent items must be drawn back-to-front, the sort is stable so
+ * equal depths are drawn in the order they were added */
+static guint64
+render_list_transparent_key (GthreeRenderListItem *item)
+{
+  return (guint64)~float_to_sortable_uint (item->z) << 32;
+}
+
+/* Stable LSD radix sort of the item indexes by their sort_key */
+static void
+render_list_radix_sort (GthreeRenderList *list,
+                        GArray *indexes)
+{
+  GthreeRenderListSortItem *src, *dst, *tmp;
+  guint n = indexes->len;
+  guint count[256];
+  int shift, i;
+
+  if (n < 2)
+    return;
+
+  g_array_set_size (list->sort_items, n);
+  g_array_set_size (list->sort_tmp, n);
+  src = (GthreeRenderListSortItem *)list->sort_items->data;
+  dst = (GthreeRenderListSortItem *)list->sort_tmp->data;
+
+  for (i = 0; i < n; i++)
     {
-      if (a->z > b->z)
-        return 1;
-      else
-        return -1;
+      int index = g_array_index (indexes, int, i);
+
+      src[i].index = index;
+      src[i].key = g_array_index (list->items, GthreeRenderListItem, index).sort_key;
     }
-  else if (a->object != b->object)
+
+  for (shift = 0; shift < 64; shift += 8)
     {
-      if ((gsize)a->object > (gsize)b->object)
-        return 1;
-      else
-        return -1;
+      guint offset = 0;
+
+      memset (count, 0, sizeof (count));
+      for (i = 0; i < n; i++)
+        count[(src[i].key >> shift) & 0xff]++;
+
+      /* All keys share this byte, nothing to do */
+      if (count[(src[0].key >> shift) & 0xff] == n)
+        continue;
+
+      for (i = 0; i < 256; i++)
+        {
+          guint c = count[i];
+          count[i] = offset;
+          offset += c;
+        }
+
+      for (i = 0; i < n; i++)
+        dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+
+      tmp = src;
+      src = dst;
+      dst = tmp;
     }
 
-  return 0;
+  for (i = 0; i < n; i++)
+    g_array_index (indexes, int, i) = src[i].index;
 }
 
-static gint
-render_list_reverse_painter_sort_stable (gconstpointer _a, gconstpointer _b, gpointer user_data)
+/* Recomputes the sort keys after the depth or programs of items changed */
+static void
+render_list_update_keys (GthreeRenderList *list)
 {
-  GthreeRenderList *list = user_data;
-  int ai = *(int *)_a;
-  int bi = *(int *)_b;
-  GthreeRenderListItem *a = &g_array_index (list->items, GthreeRenderListItem, ai);
-  GthreeRenderListItem *b = &g_array_index (list->items, GthreeRenderListItem, bi);
+  int i;
 
-  if (a->z != b->z)
-    {
-      if (b->z > a->z)
-        return 1;
-      else
-        return -1;
-    }
-  else if (a->object != b->object)
+  for (i = 0; i < list->items->len; i++)
     {
-      if ((gsize)a->object > (gsize)b->object)
-        return 1;
+      GthreeRenderListItem *item = &g_array_index (list->items, GthreeRenderListItem, i);
+
+      if (gthree_material_get_is_transparent (item->material))
+        item->sort_key = render_list_transparent_key (item);
       else
-        return -1;
+        item->sort_key = render_list_opaque_key (item);
     }
-
-  return 0;
 }
 
 void
 gthree_render_list_sort (GthreeRenderList *list)
 {
-  g_array_sort_with_data (list->opaque, render_list_painter_sort_stable, list);
-  g_array_sort_with_data (list->transparent, render_list_reverse_painter_sort_stable, list);
+  render_list_radix_sort (list, list->opaque);
+  render_list_radix_sort (list, list->transparent);
 }
 
 void
@@ -3437,12 +6377,21 @@ gthree_render_list_push (GthreeRenderList *list,
   GthreeRenderListItem item = { object, geometry, material, group, list->current_z };
   int index = list->items->len;
 
-  g_array_append_val (list->items, item);
-
   if (list->use_background)
-    g_array_append_val (list->background, index);
+    {
+      g_array_append_val (list->items, item);
+      g_array_append_val (list->background, index);
+    }
   else if (gthree_material_get_is_transparent (material))
-    g_array_append_val (list->transparent, index);
+    {
+      item.sort_key = render_list_transparent_key (&item);
+      g_array_append_val (list->items, item);
+      g_array_append_val (list->transparent, index);
+    }
   else
-    g_array_append_val (list->opaque, index);
+    {
+      item.sort_key = render_list_opaque_key (&item);
+      g_array_append_val (list->items, item);
+      g_array_append_val (list->opaque, index);
+    }
 }
@@ -29,6 +29,67 @@ typedef struct {
 
 } GthreeRendererClass;
 
+/**
+ * GthreeRenderInfo:
+ * @draw_calls: the glDraw*() calls, including the ones for shadow maps
+ * @triangles: the triangles drawn, counting each instance
+ * @lines: the line segments drawn, counting each instance
+ * @points: the points drawn, counting each instance
+ * @program_switches: how often a different shader program was made current
+ * @material_switches: how often a different material was set up
+ * @texture_binds: the textures bound to texture units
+ * @uniform_uploads: the uniform values sent to GL
+ * @uniform_uploads_skipped: the uniform values not sent because the
+ *   program already had them; these are not included in @uniform_uploads
+ * @buffer_bytes_uploaded: the bytes uploaded to vertex, index and
+ *   uniform buffers
+ * @texture_bytes_uploaded: the bytes of texture data uploaded
+ * @shadow_map_passes: the shadow maps rendered, one per light, or one
+ *   per cube face for point lights
+ * @objects_drawn: the objects that passed frustum culling, including
+ *   the ones in @objects_occluded
+ * @objects_culled: the objects skipped because they were outside the
+ *   view frustum
+ * @objects_occluded: the objects that passed frustum culling, but were
+ *   not drawn because occlusion culling found them hidden; they are
+ *   also counted in @objects_drawn
+ * @occlusion_queries: the GPU occlusion queries issued; the boxes they
+ *   draw are not counted in @draw_calls or @triangles
+ * @occluder_triangles: the triangles rasterized for software occlusion
+ *   culling
+ * @shadow_maps_reused: the shadow maps kept from an earlier frame
+ *   instead of being rendered, as nothing they show changed
+ *
+ * Counters for the work a #GthreeRenderer did, see
+ * gthree_renderer_get_info().
+ */
+typedef struct {
+  guint draw_calls;
+  guint triangles;
+  guint lines;
+  guint points;
+  guint program_switches;
+  guint material_switches;
+  guint texture_binds;
+  guint uniform_uploads;
+  guint uniform_uploads_skipped;
+  guint64 buffer_bytes_uploaded;
+  guint64 texture_bytes_uploaded;
+  guint shadow_map_passes;
+  guint objects_drawn;
+  guint objects_culled;
+  guint objects_occluded;
+  guint occlusion_queries;
+  guint occluder_triangles;
+  guint shadow_maps_reused;
+} GthreeRenderInfo;
+
+typedef struct {
+  const char *name;
+  int depth;
+  guint64 gpu_time; /* In nanoseconds */
+} GthreeGpuTiming;
+
 GTHREE_API
 GthreeRenderer *gthree_renderer_new ();
 GTHREE_API
@@ -92,6 +153,11 @@ GTHREE_API
 void                gthree_renderer_set_shadow_map_enabled    (GthreeRenderer     *renderer,
                                                                gboolean            enabled);
 GTHREE_API
+GthreeShadowMapType gthree_renderer_get_shadow_map_type       (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_shadow_map_type       (GthreeRenderer     *renderer,
+                                                               GthreeShadowMapType type);
+GTHREE_API
 gboolean            gthree_renderer_get_shadow_map_auto_update (GthreeRenderer     *renderer);
 GTHREE_API
 void                gthree_renderer_set_shadow_map_auto_update (GthreeRenderer     *renderer,
@@ -102,6 +168,11 @@ GTHREE_API
 void                gthree_renderer_set_shadow_map_needs_update (GthreeRenderer     *renderer,
                                                                  gboolean            needs_update);
 GTHREE_API
+void                gthree_renderer_set_shadow_atlas_size     (GthreeRenderer     *renderer,
+                                                               int                 size);
+GTHREE_API
+int                 gthree_renderer_get_shadow_atlas_size     (GthreeRenderer     *renderer);
+GTHREE_API
 gboolean            gthree_renderer_get_local_clipping_enabled  (GthreeRenderer     *renderer);
 GTHREE_API
 void                gthree_renderer_set_local_clipping_enabled  (GthreeRenderer     *renderer,
@@ -146,7 +217,85 @@ void                gthree_renderer_render                    (GthreeRenderer
                                                                GthreeScene        *scene,
                                                                GthreeCamera       *camera);
 GTHREE_API
+gboolean            gthree_renderer_compile                   (GthreeRenderer     *renderer,
+                                                               GthreeScene        *scene,
+                                                               GthreeCamera       *camera);
+GTHREE_API
 void                gthree_renderer_unrealize                 (GthreeRenderer     *renderer);
+GTHREE_API
+const GthreeRenderInfo *gthree_renderer_get_info              (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_reset_info                (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_auto_reset_info       (GthreeRenderer     *renderer,
+                                                               gboolean            auto_reset);
+GTHREE_API
+gboolean            gthree_renderer_get_auto_reset_info       (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_gpu_timing_enabled    (GthreeRenderer     *renderer,
+                                                               gboolean            enabled);
+GTHREE_API
+gboolean            gthree_renderer_get_gpu_timing_enabled    (GthreeRenderer     *renderer);
+GTHREE_API
+const GthreeGpuTiming *gthree_renderer_get_gpu_timings        (GthreeRenderer     *renderer,
+                                                               guint              *n_timings);
+GTHREE_API
+void                gthree_renderer_push_gpu_timer            (GthreeRenderer     *renderer,
+                                                               const char         *name);
+GTHREE_API
+void                gthree_renderer_pop_gpu_timer             (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_occlusion_culling     (GthreeRenderer     *renderer,
+                                                               gboolean            occlusion_culling);
+GTHREE_API
+gboolean            gthree_renderer_get_occlusion_culling     (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_software_occlusion_culling (GthreeRenderer *renderer,
+                                                                    gboolean        occlusion_culling);
+GTHREE_API
+gboolean            gthree_renderer_get_software_occlusion_culling (GthreeRenderer *renderer);
+GTHREE_API
+void                gthree_renderer_set_retained_render_lists (GthreeRenderer     *renderer,
+                                                               gboolean            retained);
+GTHREE_API
+gboolean            gthree_renderer_get_retained_render_lists (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_clustered_lighting    (GthreeRenderer     *renderer,
+                                                               gboolean            clustered_lighting);
+GTHREE_API
+gboolean            gthree_renderer_get_clustered_lighting    (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_light_count_bucketing (GthreeRenderer     *renderer,
+                                                               gboolean            bucketing);
+GTHREE_API
+gboolean            gthree_renderer_get_light_count_bucketing (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_max_object_lights     (GthreeRenderer     *renderer,
+                                                               guint               max_lights);
+GTHREE_API
+guint               gthree_renderer_get_max_object_lights     (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_set_program_cache_dir     (GthreeRenderer     *renderer,
+                                                               const char         *path);
+GTHREE_API
+const char         *gthree_renderer_get_program_cache_dir     (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_get_program_cache_stats   (GthreeRenderer     *renderer,
+                                                               guint              *hits,
+                                                               guint              *misses,
+                                                               guint              *stale);
+GTHREE_API
+void                gthree_renderer_set_max_unused_programs   (GthreeRenderer     *renderer,
+                                                               guint               max_unused);
+GTHREE_API
+guint               gthree_renderer_get_max_unused_programs   (GthreeRenderer     *renderer);
+GTHREE_API
+void                gthree_renderer_get_program_stats         (GthreeRenderer     *renderer,
+                                                               guint              *n_programs,
+                                                               guint              *n_unused,
+                                                               guint              *n_evicted,
+                                                               gint64             *source_time,
+                                                               gint64             *compile_time);
 
 
 G_END_DECLS
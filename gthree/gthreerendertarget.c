@@ -18,6 +18,7 @@ typedef struct {
 
   graphene_rect_t viewport;
 
+  gboolean color_buffer;
   gboolean depth_buffer;
   gboolean stencil_buffer;
 
@@ -65,6 +66,7 @@ gthree_render_target_init (GthreeRenderTarget *target)
   gthree_texture_set_data_type (priv->texture, GTHREE_DATA_TYPE_UNSIGNED_BYTE);
   gthree_texture_set_anisotropy (priv->texture, 1);
 
+  priv->color_buffer = TRUE;
   priv->depth_buffer = TRUE;
   priv->stencil_buffer = TRUE;
 }
@@ -159,6 +161,7 @@ gthree_render_target_clone (GthreeRenderTarget *target)
   clone_priv->scissor_test = priv->scissor_test;
 
   clone_priv->viewport = priv->viewport;
+  clone_priv->color_buffer = priv->color_buffer;
   clone_priv->depth_buffer = priv->depth_buffer;
   clone_priv->stencil_buffer = priv->stencil_buffer;
 
@@ -204,6 +207,31 @@ gthree_render_target_set_size (GthreeRenderTarget *target,
   graphene_rect_init (&priv->viewport, 0, 0, width, height);
 }
 
+gboolean
+gthree_render_target_get_color_buffer (GthreeRenderTarget *target)
+{
+  GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (target);
+  return priv->color_buffer;
+}
+
+/**
+ * gthree_render_target_set_color_buffer:
+ * @target: a #GthreeRenderTarget
+ * @color_buffer: whether the target has a color buffer
+ *
+ * Sets whether rendering into @target writes colors into its texture.
+ * A target without a color buffer is only useful with a depth texture,
+ * see gthree_render_target_set_depth_texture(), for instance to render
+ * shadow maps. This has to be set before the target is first used.
+ */
+void
+gthree_render_target_set_color_buffer (GthreeRenderTarget *target,
+                                       gboolean            color_buffer)
+{
+  GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (target);
+  priv->color_buffer = color_buffer;
+}
+
 gboolean
 gthree_render_target_get_depth_buffer (GthreeRenderTarget *target)
 {
@@ -234,6 +262,19 @@ gthree_render_target_set_stencil_buffer (GthreeRenderTarget *target,
   priv->stencil_buffer = stencil_buffer;
 }
 
+/* The texture that has what was rendered, which is the depth if there
+ * are no colors */
+GthreeTexture *
+gthree_render_target_get_output_texture (GthreeRenderTarget *target)
+{
+  GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (target);
+
+  if (!priv->color_buffer && priv->depth_texture)
+    return priv->depth_texture;
+
+  return priv->texture;
+}
+
 GthreeTexture *
 gthree_render_target_get_depth_texture (GthreeRenderTarget *target)
 {
@@ -241,6 +282,15 @@ gthree_render_target_get_depth_texture (GthreeRenderTarget *target)
   return priv->depth_texture;
 }
 
+/**
+ * gthree_render_target_set_depth_texture:
+ * @target: a #GthreeRenderTarget
+ * @texture: (nullable): a %GTHREE_TEXTURE_FORMAT_DEPTH texture, or %NULL
+ *
+ * Makes @target render depth into @texture rather than into a
+ * renderbuffer, so that it can be sampled later. There is no stencil
+ * buffer when rendering into a depth texture.
+ */
 void
 gthree_render_target_set_depth_texture (GthreeRenderTarget *target,
                                         GthreeTexture *texture)
@@ -303,9 +353,29 @@ setup_renderbuffer_storage (GthreeRenderTarget *render_target, guint gl_renderbu
   glBindRenderbuffer (GL_RENDERBUFFER, 0);
 }
 
-// Setup GL resources for a non-texture depth buffer
+// Setup a depth texture and attach it to the framebuffer
+static void
+setup_depth_texture (GthreeRenderTarget *render_target, GthreeRenderer *renderer, GthreeRenderTargetRealizeData *data)
+{
+  GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (render_target);
+
+  if (gthree_texture_get_format (priv->depth_texture) != GTHREE_TEXTURE_FORMAT_DEPTH)
+    g_warning ("The depth texture of a render target should use GTHREE_TEXTURE_FORMAT_DEPTH");
+
+  gthree_texture_bind (priv->depth_texture, renderer, -1, GL_TEXTURE_2D);
+  gthree_texture_set_parameters (GL_TEXTURE_2D, priv->depth_texture,
+                                 gthree_render_target_is_power_of_two (render_target));
+  gthree_texture_setup_framebuffer (priv->depth_texture, renderer,
+                                    priv->width,
+                                    priv->height,
+                                    data->gl_framebuffer,
+                                    GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D);
+  glBindTexture (GL_TEXTURE_2D, 0);
+}
+
+// Setup GL resources for the depth buffer
 static void
-setup_depth_renderbuffer (GthreeRenderTarget *render_target, GthreeRenderTargetRealizeData *data)
+setup_depth_renderbuffer (GthreeRenderTarget *render_target, GthreeRenderer *renderer, GthreeRenderTargetRealizeData *data)
 {
   GthreeRenderTargetPrivate *priv = gthree_render_target_get_instance_private (render_target);
   gboolean is_cube = FALSE;
@@ -320,9 +390,7 @@ setup_depth_renderbuffer (GthreeRenderTarget *render_target, GthreeRenderTargetR
         {
           g_error ("target.depthTexture not supported in Cube render targets");
         }
-#ifdef TODO
-    setupDepthTexture( renderTargetProperties.__webglFramebuffer, renderTarget );
-#endif
+      setup_depth_texture (render_target, renderer, data);
     }
   else
     {
@@ -513,6 +581,15 @@ gthree_render_target_realize (GthreeRenderTarget *target,
       state.bindTexture( _gl.TEXTURE_CUBE_MAP, null );
 #endif
     }
+  else if (!priv->color_buffer)
+    {
+      GLenum none = GL_NONE;
+
+      glBindFramebuffer (GL_FRAMEBUFFER, data->gl_framebuffer);
+      glDrawBuffers (1, &none);
+      glReadBuffer (GL_NONE);
+      glBindFramebuffer (GL_FRAMEBUFFER, 0);
+    }
   else
     {
       gthree_texture_bind (texture, renderer, -1, GL_TEXTURE_2D);
@@ -529,7 +606,7 @@ gthree_render_target_realize (GthreeRenderTarget *target,
 
   // Setup depth and stencil buffers
   if (priv->depth_buffer)
-    setup_depth_renderbuffer (target, data);
+    setup_depth_renderbuffer (target, renderer, data);
 }
 
 void
@@ -55,6 +55,11 @@ void           gthree_render_target_set_size          (GthreeRenderTarget *targe
 GTHREE_API
 GthreeTexture *gthree_render_target_get_texture       (GthreeRenderTarget *target);
 GTHREE_API
+gboolean       gthree_render_target_get_color_buffer  (GthreeRenderTarget *target);
+GTHREE_API
+void           gthree_render_target_set_color_buffer  (GthreeRenderTarget *target,
+                                                       gboolean            color_buffer);
+GTHREE_API
 gboolean       gthree_render_target_get_depth_buffer  (GthreeRenderTarget *target);
 GTHREE_API
 void           gthree_render_target_set_depth_buffer  (GthreeRenderTarget *target,
@@ -5,6 +5,7 @@
 #include "gthreelight.h"
 
 #include "gthreeobjectprivate.h"
+#include "gthreeprivate.h"
 
 typedef struct {
   graphene_vec3_t bg_color;
@@ -13,8 +14,11 @@ typedef struct {
   GthreeTexture *bg_texture;
   GthreeMaterial *override_material;
   GthreeFog *fog;
+  GthreeBvh *bvh;
 } GthreeScenePrivate;
 
+static guint32 bvh_serial;
+
 
 G_DEFINE_TYPE_WITH_PRIVATE (GthreeScene, gthree_scene, GTHREE_TYPE_OBJECT);
 
@@ -48,6 +52,8 @@ gthree_scene_finalize (GObject *obj)
 
   g_clear_object (&priv->override_material);
 
+  gthree_scene_set_use_bvh (scene, FALSE);
+
   G_OBJECT_CLASS (gthree_scene_parent_class)->finalize (obj);
 }
 
@@ -148,6 +154,171 @@ gthree_scene_set_fog (GthreeScene *scene,
   g_set_object (&priv->fog, fog);
 }
 
+static void
+get_world_box (GthreeObject   *object,
+               graphene_box_t *box)
+{
+  graphene_sphere_t sphere, world_sphere;
+
+  if (!gthree_object_get_bounding_sphere (object, &sphere))
+    {
+      graphene_box_init_from_box (box, graphene_box_empty ());
+      return;
+    }
+
+  graphene_matrix_transform_sphere (gthree_object_get_world_matrix (object), &sphere, &world_sphere);
+  graphene_sphere_get_bounding_box (&world_sphere, box);
+}
+
+void
+gthree_scene_bvh_add_subtree (GthreeScene  *scene,
+                              GthreeObject *object)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+  GthreeObjectIter iter;
+  GthreeObject *child;
+
+  if (priv->bvh == NULL)
+    return;
+
+  if (gthree_object_has_bounds (object) && gthree_object_get_bvh_leaf (object) < 0)
+    {
+      graphene_box_t box;
+      int leaf;
+
+      get_world_box (object, &box);
+      leaf = gthree_bvh_insert (priv->bvh, &box, object);
+      gthree_object_set_bvh_leaf (object, scene, leaf);
+
+      /* The world matrix may not be up to date yet */
+      gthree_bvh_mark_dirty (priv->bvh, leaf);
+    }
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    gthree_scene_bvh_add_subtree (scene, child);
+}
+
+void
+gthree_scene_bvh_remove_subtree (GthreeScene  *scene,
+                                 GthreeObject *object)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+  GthreeObjectIter iter;
+  GthreeObject *child;
+  int leaf;
+
+  if (priv->bvh == NULL)
+    return;
+
+  leaf = gthree_object_get_bvh_leaf (object);
+  if (leaf >= 0)
+    {
+      gthree_bvh_remove (priv->bvh, leaf);
+      gthree_object_set_bvh_leaf (object, NULL, -1);
+    }
+
+  gthree_object_iter_init (&iter, object);
+  while (gthree_object_iter_next (&iter, &child))
+    gthree_scene_bvh_remove_subtree (scene, child);
+}
+
+void
+gthree_scene_bvh_mark_dirty (GthreeScene *scene,
+                             int          leaf)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  gthree_bvh_mark_dirty (priv->bvh, leaf);
+}
+
+static void
+refit_leaf (int      leaf,
+            gpointer data,
+            gpointer user_data)
+{
+  GthreeBvh *bvh = user_data;
+  graphene_box_t box;
+
+  get_world_box (data, &box);
+  gthree_bvh_move (bvh, leaf, &box);
+}
+
+static void
+mark_visible (int      leaf,
+              gpointer data,
+              gboolean inside,
+              gpointer user_data)
+{
+  gthree_object_set_bvh_serial (data, GPOINTER_TO_UINT (user_data), inside);
+}
+
+/* Marks all objects in the hierarchy that may be in the frustum with
+ * a new serial and returns it, or returns 0 if the scene has no
+ * hierarchy. Objects whose box is entirely in the frustum are also
+ * flagged as such, see gthree_object_get_bvh_inside(). Needs up to
+ * date world matrices. */
+guint32
+gthree_scene_bvh_cull (GthreeScene              *scene,
+                       const graphene_frustum_t *frustum)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+  guint32 serial;
+
+  if (priv->bvh == NULL)
+    return 0;
+
+  gthree_bvh_foreach_dirty (priv->bvh, refit_leaf, priv->bvh);
+
+  serial = ++bvh_serial;
+  if (serial == 0)
+    serial = ++bvh_serial;
+
+  gthree_bvh_query_frustum (priv->bvh, frustum, mark_visible, GUINT_TO_POINTER (serial));
+
+  return serial;
+}
+
+/**
+ * gthree_scene_set_use_bvh:
+ * @scene: a #GthreeScene
+ * @use_bvh: whether to use a bounding volume hierarchy
+ *
+ * Keeps the bounds of all meshes, lines, points and sprites in the scene
+ * in a tree, which lets the renderer frustum cull whole groups of them
+ * at once. This is worth it for scenes with many objects, most of which
+ * are usually out of view. The tree is updated as objects are added,
+ * removed or moved.
+ */
+void
+gthree_scene_set_use_bvh (GthreeScene *scene,
+                          gboolean     use_bvh)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  if (!!use_bvh == (priv->bvh != NULL))
+    return;
+
+  if (use_bvh)
+    {
+      priv->bvh = gthree_bvh_new ();
+      gthree_scene_bvh_add_subtree (scene, GTHREE_OBJECT (scene));
+    }
+  else
+    {
+      gthree_scene_bvh_remove_subtree (scene, GTHREE_OBJECT (scene));
+      g_clear_pointer (&priv->bvh, gthree_bvh_free);
+    }
+}
+
+gboolean
+gthree_scene_get_use_bvh (GthreeScene *scene)
+{
+  GthreeScenePrivate *priv = gthree_scene_get_instance_private (scene);
+
+  return priv->bvh != NULL;
+}
+
 static void
 gthree_scene_class_init (GthreeSceneClass *klass)
 {
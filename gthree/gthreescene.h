@@ -60,6 +60,11 @@ GthreeFog *     gthree_scene_get_fog                (GthreeScene   *scene);
 GTHREE_API
 void            gthree_scene_set_fog                (GthreeScene   *scene,
                                                      GthreeFog     *fog);
+GTHREE_API
+void            gthree_scene_set_use_bvh            (GthreeScene   *scene,
+                                                     gboolean       use_bvh);
+GTHREE_API
+gboolean        gthree_scene_get_use_bvh            (GthreeScene   *scene);
 
 G_END_DECLS
 
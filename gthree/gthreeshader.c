@@ -14,6 +14,8 @@ typedef struct {
   char *vertex_shader_text;
   char *fragment_shader_text;
   GthreeShader *owner_of_shader_text;
+  /* Fully expanded text per light/clipping configuration, only used on the text owner */
+  GHashTable *expanded_text;
   guint hash;
 } GthreeShaderPrivate;
 
@@ -81,6 +83,7 @@ gthree_shader_finalize (GObject *obj)
       g_clear_pointer (&priv->vertex_shader_text, g_free);
       g_clear_pointer (&priv->fragment_shader_text, g_free);
     }
+  g_clear_pointer (&priv->expanded_text, g_hash_table_unref);
 
   G_OBJECT_CLASS (gthree_shader_parent_class)->finalize (obj);
 }
@@ -313,6 +316,22 @@ gthree_shader_get_fragment_shader_text (GthreeShader  *shader)
   return priv->fragment_shader_text;
 }
 
+/* Maps a key describing the expansion to the expanded text, shared by
+ * all clones as they have the same text */
+GHashTable *
+gthree_shader_get_expanded_text_cache (GthreeShader *shader)
+{
+  GthreeShaderPrivate *priv = gthree_shader_get_instance_private (shader);
+
+  if (priv->owner_of_shader_text)
+    priv = gthree_shader_get_instance_private (priv->owner_of_shader_text);
+
+  if (priv->expanded_text == NULL)
+    priv->expanded_text = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  return priv->expanded_text;
+}
+
 GthreeShader *
 gthree_shader_clone (GthreeShader *orig)
 {
@@ -0,0 +1,1186 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gthreesimplify.h"
+#include "gthreeskinnedmesh.h"
+#include "gthreeinstancedmesh.h"
+#include "gthreemeshmaterial.h"
+#include "gthreeprivate.h"
+
+/* Mesh simplification by edge collapse, ordered by quadric error
+ * (Garland and Heckbert). Vertices are only ever collapsed onto one of
+ * their neighbours, never moved, so a simplified geometry is just a new
+ * index buffer over the same vertex attributes.
+ *
+ * Vertices are grouped by position, so the several vertices that make
+ * up a uv or normal seam move together, each onto the vertex on its own
+ * side of the seam. Edges on the border of the mesh, along a seam or
+ * between two geometry groups are only collapsed along themselves, so
+ * those outlines are kept.
+ *
+ * Collapses are done in passes, cheapest first, skipping any that touch
+ * a position already changed in the same pass. All of this works on
+ * plain arrays and never touches GObjects, so that the geometries of a
+ * whole scene can be simplified in parallel.
+ */
+
+/* Border and seam planes are weighted this much more than faces */
+#define BOUNDARY_WEIGHT 10.0
+
+#define MAX_PASSES 100
+
+/* Positions split in more vertices than this are never collapsed */
+#define MAX_WEDGES 16
+
+#define MAX_LOD_LEVELS 8
+
+typedef struct {
+  double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+  double weight;
+} Quadric;
+
+typedef struct {
+  guint32 a, b;
+  int group;
+  guint triangle;
+} Edge;
+
+typedef struct {
+  guint p, q;
+  double cost;
+} Collapse;
+
+typedef struct {
+  guint from[MAX_WEDGES];
+  guint to[MAX_WEDGES];
+  int n;
+} WedgeMap;
+
+typedef struct {
+  const float *positions; /* xyz per vertex */
+  guint n_vertices;
+
+  guint *vertex_position; /* vertex -> position */
+  guint n_positions;
+  guint *wedge_offsets;   /* position -> range in wedges */
+  guint *wedges;          /* Vertices, sorted by position */
+
+  guint *remap;           /* vertex -> vertex it was collapsed onto */
+  Quadric *quadrics;      /* Per position */
+  guint8 *collapsed;      /* Per position */
+  guint8 *locked;         /* Per position, changed this pass */
+
+  /* Per position, neighbours along border, seam or group edges. More
+   * than two means it's a corner, and it never moves. */
+  guint8 *n_boundary;
+  guint *boundary;
+
+  GArray *triangles;      /* guint32 triplets */
+  GArray *groups;         /* int per triangle */
+
+  guint *triangle_offsets; /* position -> range in position_triangles */
+  guint *position_triangles;
+} Simplifier;
+
+typedef struct {
+  /* Input, set up in the main thread */
+  float *positions;
+  guint n_vertices;
+  guint32 *indices;
+  int *groups;
+  guint n_indices;
+  int n_levels;
+  guint target_n_indices[MAX_LOD_LEVELS];
+  float max_error[MAX_LOD_LEVELS];
+
+  /* Output, one per level */
+  GArray *level_indices[MAX_LOD_LEVELS];
+  GArray *level_groups[MAX_LOD_LEVELS];
+
+  /* Shared by all the meshes using the geometry */
+  GthreeGeometry *level_geometries[MAX_LOD_LEVELS];
+} SimplifyJob;
+
+static void
+quadric_add_plane (Quadric *q,
+                   double   a,
+                   double   b,
+                   double   c,
+                   double   d,
+                   double   weight)
+{
+  q->a2 += weight * a * a;
+  q->ab += weight * a * b;
+  q->ac += weight * a * c;
+  q->ad += weight * a * d;
+  q->b2 += weight * b * b;
+  q->bc += weight * b * c;
+  q->bd += weight * b * d;
+  q->c2 += weight * c * c;
+  q->cd += weight * c * d;
+  q->d2 += weight * d * d;
+  q->weight += weight;
+}
+
+static void
+quadric_add (Quadric       *q,
+             const Quadric *other)
+{
+  q->a2 += other->a2;
+  q->ab += other->ab;
+  q->ac += other->ac;
+  q->ad += other->ad;
+  q->b2 += other->b2;
+  q->bc += other->bc;
+  q->bd += other->bd;
+  q->c2 += other->c2;
+  q->cd += other->cd;
+  q->d2 += other->d2;
+  q->weight += other->weight;
+}
+
+/* Weighted sum of the squared distances to the planes */
+static double
+quadric_error (const Quadric *q,
+               const float   *p)
+{
+  double x = p[0], y = p[1], z = p[2];
+
+  return
+    q->a2 * x * x + 2 * q->ab * x * y + 2 * q->ac * x * z + 2 * q->ad * x +
+    q->b2 * y * y + 2 * q->bc * y * z + 2 * q->bd * y +
+    q->c2 * z * z + 2 * q->cd * z +
+    q->d2;
+}
+
+static void
+triangle_normal (const float *p0,
+                 const float *p1,
+                 const float *p2,
+                 double      *n)
+{
+  double e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+  double e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+
+  n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+  n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+  n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+/* Normals more than about 75 degrees apart count as a flip, just
+ * checking for opposite normals lets slivers flip over several passes */
+static gboolean
+similar_normals (const double *a,
+                 const double *b)
+{
+  double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+  double len_a = sqrt (a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+  double len_b = sqrt (b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+
+  return dot > 0.25 * len_a * len_b;
+}
+
+static const float *
+position_coords (Simplifier *s,
+                 guint       p)
+{
+  return &s->positions[s->wedges[s->wedge_offsets[p]] * 3];
+}
+
+static guint
+resolve (Simplifier *s,
+         guint       v)
+{
+  while (s->remap[v] != v)
+    v = s->remap[v];
+  return v;
+}
+
+static guint
+position_hash (gconstpointer key)
+{
+  guint32 p[3];
+
+  memcpy (p, key, sizeof (p));
+  return (p[0] * 73856093u) ^ (p[1] * 19349663u) ^ (p[2] * 83492791u);
+}
+
+static gboolean
+position_equal (gconstpointer a,
+                gconstpointer b)
+{
+  return memcmp (a, b, 3 * sizeof (float)) == 0;
+}
+
+static void
+weld_positions (Simplifier *s)
+{
+  GHashTable *ids = g_hash_table_new (position_hash, position_equal);
+  guint *fill;
+  guint v, p;
+
+  s->vertex_position = g_new (guint, s->n_vertices);
+  s->n_positions = 0;
+
+  for (v = 0; v < s->n_vertices; v++)
+    {
+      const float *key = &s->positions[v * 3];
+      gpointer id;
+
+      if (g_hash_table_lookup_extended (ids, key, NULL, &id))
+        s->vertex_position[v] = GPOINTER_TO_UINT (id);
+      else
+        {
+          s->vertex_position[v] = s->n_positions;
+          g_hash_table_insert (ids, (gpointer) key, GUINT_TO_POINTER (s->n_positions));
+          s->n_positions++;
+        }
+    }
+
+  g_hash_table_unref (ids);
+
+  s->wedge_offsets = g_new0 (guint, s->n_positions + 1);
+  for (v = 0; v < s->n_vertices; v++)
+    s->wedge_offsets[s->vertex_position[v] + 1]++;
+  for (p = 0; p < s->n_positions; p++)
+    s->wedge_offsets[p + 1] += s->wedge_offsets[p];
+
+  s->wedges = g_new (guint, s->n_vertices);
+  fill = g_new (guint, MAX (s->n_positions, 1));
+  memcpy (fill, s->wedge_offsets, s->n_positions * sizeof (guint));
+  for (v = 0; v < s->n_vertices; v++)
+    s->wedges[fill[s->vertex_position[v]]++] = v;
+  g_free (fill);
+}
+
+static gboolean
+is_degenerate (const guint *pos)
+{
+  return pos[0] == pos[1] || pos[1] == pos[2] || pos[0] == pos[2];
+}
+
+/* Applies the collapses to the triangles and drops the ones that vanished */
+static void
+compact_triangles (Simplifier *s)
+{
+  guint32 *tris = (guint32 *) s->triangles->data;
+  int *groups = (int *) s->groups->data;
+  guint n = s->triangles->len / 3;
+  guint i, k, out = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      guint v[3], pos[3];
+
+      for (k = 0; k < 3; k++)
+        {
+          v[k] = resolve (s, tris[i * 3 + k]);
+          pos[k] = s->vertex_position[v[k]];
+        }
+
+      if (is_degenerate (pos))
+        continue;
+
+      for (k = 0; k < 3; k++)
+        tris[out * 3 + k] = v[k];
+      groups[out] = groups[i];
+      out++;
+    }
+
+  g_array_set_size (s->triangles, out * 3);
+  g_array_set_size (s->groups, out);
+}
+
+static void
+build_adjacency (Simplifier *s)
+{
+  const guint32 *tris = (const guint32 *) s->triangles->data;
+  guint n = s->triangles->len / 3;
+  guint *fill;
+  guint i, p;
+
+  memset (s->triangle_offsets, 0, (s->n_positions + 1) * sizeof (guint));
+  for (i = 0; i < n * 3; i++)
+    s->triangle_offsets[s->vertex_position[tris[i]] + 1]++;
+  for (p = 0; p < s->n_positions; p++)
+    s->triangle_offsets[p + 1] += s->triangle_offsets[p];
+
+  g_free (s->position_triangles);
+  s->position_triangles = g_new (guint, MAX (n * 3, 1));
+  fill = g_new (guint, MAX (s->n_positions, 1));
+  memcpy (fill, s->triangle_offsets, s->n_positions * sizeof (guint));
+  for (i = 0; i < n * 3; i++)
+    s->position_triangles[fill[s->vertex_position[tris[i]]]++] = i / 3;
+  g_free (fill);
+}
+
+static void
+add_boundary (Simplifier *s,
+              guint       p,
+              guint       q)
+{
+  int i;
+
+  if (s->n_boundary[p] > 2)
+    return;
+
+  for (i = 0; i < s->n_boundary[p]; i++)
+    if (s->boundary[p * 2 + i] == q)
+      return;
+
+  if (s->n_boundary[p] == 2)
+    s->n_boundary[p] = 3;
+  else
+    s->boundary[p * 2 + s->n_boundary[p]++] = q;
+}
+
+static int
+compare_edges (const void *a,
+               const void *b)
+{
+  const Edge *ea = a, *eb = b;
+
+  if (ea->a != eb->a)
+    return ea->a < eb->a ? -1 : 1;
+  if (ea->b != eb->b)
+    return ea->b < eb->b ? -1 : 1;
+  if (ea->group != eb->group)
+    return ea->group < eb->group ? -1 : 1;
+  return 0;
+}
+
+/* Edges used by a single triangle of a group, counting vertices, not
+ * positions, are on a border, a seam or between groups. */
+static void
+find_boundaries (Simplifier *s,
+                 gboolean    add_quadrics)
+{
+  const guint32 *tris = (const guint32 *) s->triangles->data;
+  const int *groups = (const int *) s->groups->data;
+  guint n = s->triangles->len / 3;
+  Edge *edges = g_new (Edge, MAX (n * 3, 1));
+  guint i, j, k;
+
+  for (i = 0; i < n; i++)
+    for (k = 0; k < 3; k++)
+      {
+        Edge *e = &edges[i * 3 + k];
+        guint32 a = tris[i * 3 + k], b = tris[i * 3 + (k + 1) % 3];
+
+        e->a = MIN (a, b);
+        e->b = MAX (a, b);
+        e->group = groups[i];
+        e->triangle = i;
+      }
+
+  qsort (edges, n * 3, sizeof (Edge), compare_edges);
+
+  memset (s->n_boundary, 0, s->n_positions);
+
+  for (i = 0; i < n * 3; i = j)
+    {
+      const Edge *e = &edges[i];
+      guint pa, pb;
+
+      for (j = i + 1; j < n * 3 && compare_edges (&edges[j], e) == 0; j++)
+        ;
+
+      if (j - i != 1)
+        continue;
+
+      pa = s->vertex_position[e->a];
+      pb = s->vertex_position[e->b];
+      if (pa == pb)
+        continue;
+
+      add_boundary (s, pa, pb);
+      add_boundary (s, pb, pa);
+
+      if (add_quadrics)
+        {
+          const guint32 *t = &tris[e->triangle * 3];
+          const float *a = position_coords (s, pa);
+          const float *b = position_coords (s, pb);
+          double edge[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+          double normal[3], plane[3], len;
+
+          /* The plane through the edge, perpendicular to the triangle */
+          triangle_normal (&s->positions[t[0] * 3], &s->positions[t[1] * 3], &s->positions[t[2] * 3], normal);
+          plane[0] = edge[1] * normal[2] - edge[2] * normal[1];
+          plane[1] = edge[2] * normal[0] - edge[0] * normal[2];
+          plane[2] = edge[0] * normal[1] - edge[1] * normal[0];
+
+          len = sqrt (plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+          if (len == 0)
+            continue;
+
+          for (k = 0; k < 3; k++)
+            plane[k] /= len;
+
+          len = edge[0] * edge[0] + edge[1] * edge[1] + edge[2] * edge[2];
+          for (k = 0; k < 2; k++)
+            quadric_add_plane (&s->quadrics[k == 0 ? pa : pb],
+                               plane[0], plane[1], plane[2],
+                               -(plane[0] * a[0] + plane[1] * a[1] + plane[2] * a[2]),
+                               len * BOUNDARY_WEIGHT);
+        }
+    }
+
+  g_free (edges);
+}
+
+static void
+init_quadrics (Simplifier *s)
+{
+  const guint32 *tris = (const guint32 *) s->triangles->data;
+  guint n = s->triangles->len / 3;
+  guint i, k;
+
+  for (i = 0; i < n; i++)
+    {
+      const float *p0 = &s->positions[tris[i * 3 + 0] * 3];
+      const float *p1 = &s->positions[tris[i * 3 + 1] * 3];
+      const float *p2 = &s->positions[tris[i * 3 + 2] * 3];
+      double normal[3], len;
+
+      triangle_normal (p0, p1, p2, normal);
+      len = sqrt (normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+      if (len == 0)
+        continue;
+
+      for (k = 0; k < 3; k++)
+        normal[k] /= len;
+
+      /* Weighted by area */
+      for (k = 0; k < 3; k++)
+        quadric_add_plane (&s->quadrics[s->vertex_position[tris[i * 3 + k]]],
+                           normal[0], normal[1], normal[2],
+                           -(normal[0] * p0[0] + normal[1] * p0[1] + normal[2] * p0[2]),
+                           len / 2);
+    }
+}
+
+static gboolean
+wedge_map_add (WedgeMap *map,
+               guint     from,
+               guint     to)
+{
+  int i;
+
+  for (i = 0; i < map->n; i++)
+    {
+      if (map->from[i] != from)
+        continue;
+
+      if (to == G_MAXUINT)
+        return TRUE;
+
+      if (map->to[i] == G_MAXUINT)
+        map->to[i] = to;
+
+      return map->to[i] == to;
+    }
+
+  if (map->n == MAX_WEDGES)
+    return FALSE;
+
+  map->from[map->n] = from;
+  map->to[map->n] = to;
+  map->n++;
+
+  return TRUE;
+}
+
+/* Works out which vertex each vertex at p turns into when p is collapsed
+ * onto q, and checks that the collapse doesn't flip any triangle */
+static gboolean
+check_collapse (Simplifier *s,
+                guint       p,
+                guint       q,
+                WedgeMap   *map,
+                guint      *n_removed)
+{
+  const float *target = position_coords (s, q);
+  guint i;
+  int j;
+
+  if (s->n_boundary[p] > 0)
+    {
+      if (s->n_boundary[p] != 2)
+        return FALSE;
+
+      if (s->boundary[p * 2] != q && s->boundary[p * 2 + 1] != q)
+        return FALSE;
+    }
+
+  map->n = 0;
+  if (n_removed)
+    *n_removed = 0;
+
+  for (i = s->triangle_offsets[p]; i < s->triangle_offsets[p + 1]; i++)
+    {
+      const guint32 *tri = &g_array_index (s->triangles, guint32, s->position_triangles[i] * 3);
+      guint v[3], pos[3];
+      int k, kp = -1, kq = -1;
+
+      for (k = 0; k < 3; k++)
+        {
+          v[k] = resolve (s, tri[k]);
+          pos[k] = s->vertex_position[v[k]];
+          if (pos[k] == p)
+            kp = k;
+          else if (pos[k] == q)
+            kq = k;
+        }
+
+      /* Vanished in an earlier collapse of this pass */
+      if (kp < 0 || is_degenerate (pos))
+        continue;
+
+      if (kq >= 0)
+        {
+          if (!wedge_map_add (map, v[kp], v[kq]))
+            return FALSE;
+
+          if (n_removed)
+            (*n_removed)++;
+        }
+      else
+        {
+          const float *c[3];
+          double before[3], after[3];
+
+          for (k = 0; k < 3; k++)
+            c[k] = position_coords (s, pos[k]);
+          triangle_normal (c[0], c[1], c[2], before);
+          c[kp] = target;
+          triangle_normal (c[0], c[1], c[2], after);
+
+          if (!similar_normals (before, after))
+            return FALSE;
+
+          if (!wedge_map_add (map, v[kp], G_MAXUINT))
+            return FALSE;
+        }
+    }
+
+  /* Each vertex needs a vertex at q on its own side of any seam */
+  for (j = 0; j < map->n; j++)
+    if (map->to[j] == G_MAXUINT)
+      return FALSE;
+
+  return map->n > 0;
+}
+
+static double
+collapse_cost (Simplifier *s,
+               guint       p,
+               guint       q)
+{
+  Quadric sum = s->quadrics[p];
+
+  quadric_add (&sum, &s->quadrics[q]);
+  if (sum.weight <= 0)
+    return 0;
+
+  /* Mean squared distance to the original surface */
+  return MAX (quadric_error (&sum, position_coords (s, q)), 0) / sum.weight;
+}
+
+static int
+compare_collapses (const void *a,
+                   const void *b)
+{
+  const Collapse *ca = a, *cb = b;
+
+  if (ca->cost != cb->cost)
+    return ca->cost < cb->cost ? -1 : 1;
+  return 0;
+}
+
+/* Returns the number of collapses done */
+static guint
+simplify_pass (Simplifier *s,
+               guint       target_n_triangles,
+               double      max_cost)
+{
+  GArray *collapses = g_array_new (FALSE, FALSE, sizeof (Collapse));
+  guint n_triangles = s->triangles->len / 3;
+  guint n_collapses = 0;
+  WedgeMap map;
+  guint p, i;
+
+  /* The cheapest valid collapse of each position */
+  for (p = 0; p < s->n_positions; p++)
+    {
+      Collapse best = { p, G_MAXUINT, G_MAXDOUBLE };
+
+      if (s->collapsed[p])
+        continue;
+
+      for (i = s->triangle_offsets[p]; i < s->triangle_offsets[p + 1]; i++)
+        {
+          const guint32 *tri = &g_array_index (s->triangles, guint32, s->position_triangles[i] * 3);
+          int k;
+
+          for (k = 0; k < 3; k++)
+            {
+              guint q = s->vertex_position[tri[k]];
+              double cost;
+
+              if (q == p || q == best.q)
+                continue;
+
+              cost = collapse_cost (s, p, q);
+              if (cost > max_cost || cost >= best.cost)
+                continue;
+
+              if (!check_collapse (s, p, q, &map, NULL))
+                continue;
+
+              best.q = q;
+              best.cost = cost;
+            }
+        }
+
+      if (best.q != G_MAXUINT)
+        g_array_append_val (collapses, best);
+    }
+
+  qsort (collapses->data, collapses->len, sizeof (Collapse), compare_collapses);
+
+  memset (s->locked, 0, s->n_positions);
+
+  for (i = 0; i < collapses->len && n_triangles > target_n_triangles; i++)
+    {
+      const Collapse *c = &g_array_index (collapses, Collapse, i);
+      guint n_removed;
+      int j;
+
+      if (s->locked[c->p] || s->locked[c->q])
+        continue;
+
+      /* Neighbours may have moved since the costs were computed */
+      if (!check_collapse (s, c->p, c->q, &map, &n_removed))
+        continue;
+
+      for (j = 0; j < map.n; j++)
+        s->remap[map.from[j]] = map.to[j];
+
+      quadric_add (&s->quadrics[c->q], &s->quadrics[c->p]);
+      s->collapsed[c->p] = TRUE;
+      s->locked[c->p] = TRUE;
+      s->locked[c->q] = TRUE;
+
+      n_triangles -= MIN (n_removed, n_triangles);
+      n_collapses++;
+    }
+
+  g_array_unref (collapses);
+
+  return n_collapses;
+}
+
+static void
+simplify_job_run (SimplifyJob *job)
+{
+  Simplifier s = { 0, };
+  float min[3] = { G_MAXFLOAT, G_MAXFLOAT, G_MAXFLOAT };
+  float max[3] = { -G_MAXFLOAT, -G_MAXFLOAT, -G_MAXFLOAT };
+  float extent = 0;
+  guint v, i;
+  int level, pass, k;
+
+  s.positions = job->positions;
+  s.n_vertices = job->n_vertices;
+  weld_positions (&s);
+
+  s.remap = g_new (guint, s.n_vertices);
+  for (v = 0; v < s.n_vertices; v++)
+    s.remap[v] = v;
+
+  s.quadrics = g_new0 (Quadric, s.n_positions);
+  s.collapsed = g_new0 (guint8, s.n_positions);
+  s.locked = g_new0 (guint8, s.n_positions);
+  s.n_boundary = g_new0 (guint8, s.n_positions);
+  s.boundary = g_new0 (guint, s.n_positions * 2);
+  s.triangle_offsets = g_new0 (guint, s.n_positions + 1);
+
+  s.triangles = g_array_sized_new (FALSE, FALSE, sizeof (guint32), job->n_indices);
+  g_array_append_vals (s.triangles, job->indices, job->n_indices);
+  s.groups = g_array_sized_new (FALSE, FALSE, sizeof (int), job->n_indices / 3);
+  g_array_append_vals (s.groups, job->groups, job->n_indices / 3);
+
+  /* Errors are relative to the size of the mesh */
+  for (i = 0; i < s.triangles->len; i++)
+    {
+      const float *p = &s.positions[g_array_index (s.triangles, guint32, i) * 3];
+
+      for (k = 0; k < 3; k++)
+        {
+          min[k] = MIN (min[k], p[k]);
+          max[k] = MAX (max[k], p[k]);
+        }
+    }
+  for (k = 0; k < 3; k++)
+    extent = MAX (extent, max[k] - min[k]);
+
+  compact_triangles (&s);
+  build_adjacency (&s);
+  init_quadrics (&s);
+  find_boundaries (&s, TRUE);
+
+  for (level = 0; level < job->n_levels; level++)
+    {
+      double max_distance = job->max_error[level] * extent;
+
+      for (pass = 0; pass < MAX_PASSES && s.triangles->len > job->target_n_indices[level]; pass++)
+        {
+          if (pass > 0 || level > 0)
+            {
+              build_adjacency (&s);
+              find_boundaries (&s, FALSE);
+            }
+
+          if (simplify_pass (&s, job->target_n_indices[level] / 3,
+                             max_distance * max_distance) == 0)
+            break;
+
+          compact_triangles (&s);
+        }
+
+      job->level_indices[level] = g_array_sized_new (FALSE, FALSE, sizeof (guint32), s.triangles->len);
+      g_array_append_vals (job->level_indices[level], s.triangles->data, s.triangles->len);
+      job->level_groups[level] = g_array_sized_new (FALSE, FALSE, sizeof (int), s.groups->len);
+      g_array_append_vals (job->level_groups[level], s.groups->data, s.groups->len);
+    }
+
+  g_free (s.vertex_position);
+  g_free (s.wedge_offsets);
+  g_free (s.wedges);
+  g_free (s.remap);
+  g_free (s.quadrics);
+  g_free (s.collapsed);
+  g_free (s.locked);
+  g_free (s.n_boundary);
+  g_free (s.boundary);
+  g_free (s.triangle_offsets);
+  g_free (s.position_triangles);
+  g_array_unref (s.triangles);
+  g_array_unref (s.groups);
+}
+
+static void
+simplify_job_free (SimplifyJob *job)
+{
+  int i;
+
+  for (i = 0; i < job->n_levels; i++)
+    {
+      if (job->level_indices[i])
+        g_array_unref (job->level_indices[i]);
+      if (job->level_groups[i])
+        g_array_unref (job->level_groups[i]);
+      g_clear_object (&job->level_geometries[i]);
+    }
+
+  g_free (job->positions);
+  g_free (job->indices);
+  g_free (job->groups);
+  g_free (job);
+}
+
+static gboolean
+can_simplify (GthreeGeometry *geometry)
+{
+  GthreeAttribute *position = gthree_geometry_get_position (geometry);
+
+  return
+    position != NULL &&
+    gthree_attribute_get_item_size (position) >= 3 &&
+    gthree_geometry_get_index (geometry) != NULL;
+}
+
+/* Copies what the simplifier needs out of the geometry, in the draw range */
+static SimplifyJob *
+simplify_job_new (GthreeGeometry *geometry)
+{
+  GthreeAttribute *position = gthree_geometry_get_position (geometry);
+  GthreeAttribute *index = gthree_geometry_get_index (geometry);
+  SimplifyJob *job = g_new0 (SimplifyJob, 1);
+  int start, count, n_groups, i, g;
+
+  job->n_vertices = gthree_attribute_get_count (position);
+  job->positions = g_new (float, job->n_vertices * 3);
+  for (i = 0; i < job->n_vertices; i++)
+    gthree_attribute_get_xyz (position, i,
+                              &job->positions[i * 3 + 0],
+                              &job->positions[i * 3 + 1],
+                              &job->positions[i * 3 + 2]);
+
+  start = MAX (gthree_geometry_get_draw_range_start (geometry), 0);
+  count = gthree_attribute_get_count (index) - start;
+  if (gthree_geometry_get_draw_range_count (geometry) >= 0)
+    count = MIN (count, gthree_geometry_get_draw_range_count (geometry));
+  count = MAX (count, 0) / 3 * 3;
+
+  job->n_indices = 0;
+  job->indices = g_new (guint32, MAX (count, 1));
+  job->groups = g_new (int, MAX (count / 3, 1));
+  n_groups = gthree_geometry_get_n_groups (geometry);
+
+  for (i = 0; i < count; i += 3)
+    {
+      guint32 a = gthree_attribute_get_uint (index, start + i);
+      guint32 b = gthree_attribute_get_uint (index, start + i + 1);
+      guint32 c = gthree_attribute_get_uint (index, start + i + 2);
+      int group = -1;
+
+      if (a >= job->n_vertices || b >= job->n_vertices || c >= job->n_vertices)
+        continue;
+
+      for (g = 0; g < n_groups; g++)
+        {
+          GthreeGeometryGroup *gg = gthree_geometry_get_group (geometry, g);
+
+          if (start + i >= gg->start && start + i < gg->start + gg->count)
+            {
+              group = g;
+              break;
+            }
+        }
+
+      job->indices[job->n_indices++] = a;
+      job->indices[job->n_indices++] = b;
+      job->indices[job->n_indices++] = c;
+      job->groups[job->n_indices / 3 - 1] = group;
+    }
+
+  return job;
+}
+
+static GthreeGeometry *
+simplify_job_create_geometry (SimplifyJob    *job,
+                              int             level,
+                              GthreeGeometry *geometry)
+{
+  GArray *indices = job->level_indices[level];
+  GArray *groups = job->level_groups[level];
+  g_autoptr(GthreeAttribute) index = NULL;
+  GthreeGeometry *simplified;
+  int n_groups, g;
+  guint i;
+
+  index = gthree_attribute_new_from_uint32 ("index", (guint32 *) indices->data, indices->len, 1);
+  simplified = gthree_geometry_new_with_shared_attributes (geometry, index);
+
+  /* The triangles are still in the same order, so each group is still
+   * in one piece */
+  n_groups = gthree_geometry_get_n_groups (geometry);
+  for (g = 0; g < n_groups; g++)
+    {
+      int first = -1, count = 0;
+
+      for (i = 0; i < groups->len; i++)
+        if (g_array_index (groups, int, i) == g)
+          {
+            if (first < 0)
+              first = i;
+            count++;
+          }
+
+      if (count > 0)
+        gthree_geometry_add_group (simplified, first * 3, count * 3,
+                                   gthree_geometry_get_group (geometry, g)->material_index);
+    }
+
+  return simplified;
+}
+
+/**
+ * gthree_geometry_simplify:
+ * @geometry: an indexed triangle #GthreeGeometry
+ * @target_ratio: the fraction of the triangles to keep
+ * @max_error: the largest allowed deviation from the original surface,
+ *   relative to the size of the geometry
+ *
+ * Reduces the number of triangles in @geometry by collapsing edges,
+ * cheapest first, until only @target_ratio of the triangles are left or
+ * every remaining collapse would move the surface by more than
+ * @max_error. The outline of the geometry, seams in its uvs or normals,
+ * and the boundaries between its groups are kept.
+ *
+ * Vertices are never moved, so the returned geometry shares all its
+ * vertex attributes with @geometry, and only has a new index.
+ *
+ * Returns: (transfer full) (nullable): a new #GthreeGeometry, or %NULL
+ *   if @geometry has no index or positions
+ */
+GthreeGeometry *
+gthree_geometry_simplify (GthreeGeometry *geometry,
+                          float           target_ratio,
+                          float           max_error)
+{
+  SimplifyJob *job;
+  GthreeGeometry *simplified;
+
+  g_return_val_if_fail (GTHREE_IS_GEOMETRY (geometry), NULL);
+
+  if (!can_simplify (geometry))
+    {
+      g_warning ("Can only simplify indexed geometries with positions");
+      return NULL;
+    }
+
+  job = simplify_job_new (geometry);
+  job->n_levels = 1;
+  job->target_n_indices[0] = (guint) (job->n_indices / 3 * CLAMP (target_ratio, 0.f, 1.f)) * 3;
+  job->max_error[0] = max_error;
+
+  simplify_job_run (job);
+  simplified = simplify_job_create_geometry (job, 0, geometry);
+
+  simplify_job_free (job);
+
+  return simplified;
+}
+
+/* The simplified levels don't carry the morph attributes along with
+ * their new index, so they would lose the animation */
+static gboolean
+is_morphed (GthreeMesh *mesh)
+{
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (mesh);
+  int i;
+
+  if (geometry != NULL && gthree_geometry_has_morph_attributes (geometry))
+    return TRUE;
+
+  for (i = 0; i < gthree_mesh_get_n_materials (mesh); i++)
+    {
+      GthreeMaterial *material = gthree_mesh_get_material (mesh, i);
+
+      if (GTHREE_IS_MESH_MATERIAL (material) &&
+          (gthree_mesh_material_get_morph_targets (GTHREE_MESH_MATERIAL (material)) ||
+           gthree_mesh_material_get_morph_normals (GTHREE_MESH_MATERIAL (material))))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+can_make_lod (GthreeMesh *mesh)
+{
+  GthreeObject *object = GTHREE_OBJECT (mesh);
+  GthreeObject *parent = gthree_object_get_parent (object);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (mesh);
+
+  return
+    !GTHREE_IS_SKINNED_MESH (mesh) &&
+    !GTHREE_IS_INSTANCED_MESH (mesh) &&
+    !is_morphed (mesh) &&
+    gthree_mesh_get_draw_mode (mesh) == GTHREE_DRAW_MODE_TRIANGLES &&
+    gthree_object_get_n_children (object) == 0 &&
+    (parent == NULL || !GTHREE_IS_LOD (parent)) &&
+    geometry != NULL && can_simplify (geometry);
+}
+
+static SimplifyJob *
+lod_job_new (GthreeGeometry *geometry,
+             int             n_levels,
+             float           ratio,
+             float           max_error)
+{
+  SimplifyJob *job = simplify_job_new (geometry);
+  float level_ratio = 1;
+  int i;
+
+  /* The first level is the mesh itself */
+  job->n_levels = CLAMP (n_levels - 1, 0, MAX_LOD_LEVELS);
+  for (i = 0; i < job->n_levels; i++)
+    {
+      level_ratio *= CLAMP (ratio, 0.f, 1.f);
+      job->target_n_indices[i] = (guint) (job->n_indices / 3 * level_ratio) * 3;
+      /* Each level is seen from twice as far, so errors show half as much */
+      job->max_error[i] = max_error * (1 << i);
+    }
+
+  return job;
+}
+
+static void
+lod_job_thread (gpointer data,
+                gpointer user_data)
+{
+  simplify_job_run (data);
+}
+
+/* Puts the levels of job in a lod in place of mesh */
+static GthreeLOD *
+replace_with_lod (GthreeMesh  *mesh,
+                  SimplifyJob *job,
+                  float        distance)
+{
+  GthreeObject *object = GTHREE_OBJECT (mesh);
+  GthreeObject *parent = gthree_object_get_parent (object);
+  GthreeGeometry *geometry = gthree_mesh_get_geometry (mesh);
+  GthreeLOD *lod = gthree_lod_new ();
+  graphene_matrix_t matrix;
+  guint last_n_indices = job->n_indices;
+  float level_distance = distance;
+  int i, m;
+
+  /* The lod takes over the transform, so distances are from the mesh */
+  gthree_object_update_matrix (object);
+  matrix = *gthree_object_get_matrix (object);
+  gthree_object_set_matrix (GTHREE_OBJECT (lod), &matrix);
+  graphene_matrix_init_identity (&matrix);
+  gthree_object_set_matrix (object, &matrix);
+  gthree_object_set_name (GTHREE_OBJECT (lod), gthree_object_get_name (object));
+
+  g_object_ref (mesh);
+  if (parent)
+    {
+      gthree_object_remove_child (parent, object);
+      gthree_object_add_child (parent, GTHREE_OBJECT (lod));
+    }
+  gthree_lod_add_level (lod, object, 0);
+  g_object_unref (mesh);
+
+  for (i = 0; i < job->n_levels; i++)
+    {
+      g_autoptr(GthreeMesh) level = NULL;
+
+      /* No point in a level that isn't much simpler */
+      if (job->level_indices[i]->len == 0 ||
+          job->level_indices[i]->len > last_n_indices * 9 / 10)
+        break;
+      last_n_indices = job->level_indices[i]->len;
+
+      if (job->level_geometries[i] == NULL)
+        job->level_geometries[i] = simplify_job_create_geometry (job, i, geometry);
+
+      level = gthree_mesh_new (job->level_geometries[i], NULL);
+      for (m = 0; m < gthree_mesh_get_n_materials (mesh); m++)
+        gthree_mesh_add_material (level, gthree_mesh_get_material (mesh, m));
+      gthree_object_set_cast_shadow (GTHREE_OBJECT (level), gthree_object_get_cast_shadow (object));
+      gthree_object_set_receive_shadow (GTHREE_OBJECT (level), gthree_object_get_receive_shadow (object));
+
+      gthree_lod_add_level (lod, GTHREE_OBJECT (level), level_distance);
+      level_distance *= 2;
+    }
+
+  return lod;
+}
+
+/**
+ * gthree_lod_new_from_mesh:
+ * @mesh: a #GthreeMesh with indexed triangles
+ * @n_levels: the number of levels, including @mesh itself
+ * @ratio: the fraction of the triangles of each level kept in the next
+ * @max_error: the largest deviation from the surface of @mesh allowed in
+ *   the second level, relative to its size. It doubles for each level.
+ * @distance: the distance from which the second level is used. It doubles
+ *   for each level.
+ *
+ * Builds a #GthreeLOD with @mesh as the most detailed level, followed by
+ * versions simplified with gthree_geometry_simplify(). If @mesh has a
+ * parent the lod takes its place there, along with its transform. Levels
+ * that wouldn't save much are left out.
+ *
+ * Returns: (transfer full): the new #GthreeLOD
+ */
+GthreeLOD *
+gthree_lod_new_from_mesh (GthreeMesh *mesh,
+                          int         n_levels,
+                          float       ratio,
+                          float       max_error,
+                          float       distance)
+{
+  SimplifyJob *job;
+  GthreeLOD *lod;
+
+  g_return_val_if_fail (GTHREE_IS_MESH (mesh), NULL);
+  g_return_val_if_fail (can_make_lod (mesh), NULL);
+
+  job = lod_job_new (gthree_mesh_get_geometry (mesh), n_levels, ratio, max_error);
+  simplify_job_run (job);
+  lod = replace_with_lod (mesh, job, distance);
+  simplify_job_free (job);
+
+  return lod;
+}
+
+static gboolean
+collect_lod_meshes (GthreeObject *object,
+                    gpointer      user_data)
+{
+  GPtrArray *meshes = user_data;
+
+  /* The lods take the place of the meshes, so they need a parent */
+  if (GTHREE_IS_MESH (object) && can_make_lod (GTHREE_MESH (object)) &&
+      gthree_object_get_parent (object) != NULL)
+    g_ptr_array_add (meshes, g_object_ref (object));
+
+  return TRUE;
+}
+
+/**
+ * gthree_object_generate_lods:
+ * @root: a #GthreeObject, like a loaded scene
+ * @n_levels: the number of levels, including the original meshes
+ * @ratio: the fraction of the triangles of each level kept in the next
+ * @max_error: the largest deviation allowed in the second level, relative
+ *   to the size of each mesh. It doubles for each level.
+ * @distance: the distance from which the second level is used. It doubles
+ *   for each level.
+ *
+ * Does gthree_lod_new_from_mesh() for every mesh under @root that can be
+ * simplified. Geometries are only simplified once, even if several
+ * meshes use them, and different geometries are simplified in parallel
+ * on all the available cores.
+ */
+void
+gthree_object_generate_lods (GthreeObject *root,
+                             int           n_levels,
+                             float         ratio,
+                             float         max_error,
+                             float         distance)
+{
+  g_autoptr(GPtrArray) meshes = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr(GHashTable) jobs = NULL;
+  GThreadPool *pool;
+  GHashTableIter iter;
+  gpointer job;
+  guint i;
+
+  g_return_if_fail (GTHREE_IS_OBJECT (root));
+
+  gthree_object_traverse (root, collect_lod_meshes, meshes);
+
+  jobs = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)simplify_job_free);
+  for (i = 0; i < meshes->len; i++)
+    {
+      GthreeGeometry *geometry = gthree_mesh_get_geometry (g_ptr_array_index (meshes, i));
+
+      if (!g_hash_table_contains (jobs, geometry))
+        g_hash_table_insert (jobs, geometry, lod_job_new (geometry, n_levels, ratio, max_error));
+    }
+
+  pool = g_thread_pool_new (lod_job_thread, NULL, g_get_num_processors (), FALSE, NULL);
+  g_hash_table_iter_init (&iter, jobs);
+  while (g_hash_table_iter_next (&iter, NULL, &job))
+    g_thread_pool_push (pool, job, NULL);
+  /* Waits for all the jobs */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (i = 0; i < meshes->len; i++)
+    {
+      GthreeMesh *mesh = g_ptr_array_index (meshes, i);
+
+      /* The parent keeps the lod */
+      g_object_unref (replace_with_lod (mesh, g_hash_table_lookup (jobs, gthree_mesh_get_geometry (mesh)), distance));
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef __GTHREE_SIMPLIFY_H__
+#define __GTHREE_SIMPLIFY_H__
+
+#if !defined (__GTHREE_H_INSIDE__) && !defined (GTHREE_COMPILATION)
+#error "Only <gthree/gthree.h> can be included directly."
+#endif
+
+#include <gthree/gthreegeometry.h>
+#include <gthree/gthreemesh.h>
+#include <gthree/gthreelod.h>
+
+G_BEGIN_DECLS
+
+GTHREE_API
+GthreeGeometry *gthree_geometry_simplify    (GthreeGeometry *geometry,
+                                             float           target_ratio,
+                                             float           max_error);
+GTHREE_API
+GthreeLOD *     gthree_lod_new_from_mesh    (GthreeMesh     *mesh,
+                                             int             n_levels,
+                                             float           ratio,
+                                             float           max_error,
+                                             float           distance);
+GTHREE_API
+void            gthree_object_generate_lods (GthreeObject   *root,
+                                             int             n_levels,
+                                             float           ratio,
+                                             float           max_error,
+                                             float           distance);
+
+G_END_DECLS
+
+#endif /* __GTHREE_SIMPLIFY_H__ */
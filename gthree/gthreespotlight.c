@@ -53,6 +53,7 @@ static int i0 = 0;
 static float f0 = 0.0;
 static float f1 = 1.0;
 static float zerov2[2] = { 0, 0 };
+static float unit_rect[4] = { 0, 0, 1, 1 };
 
 static GthreeUniformsDefinition light_uniforms[] = {
   {"position", GTHREE_UNIFORM_TYPE_VECTOR3, &zerov3},
@@ -67,6 +68,7 @@ static GthreeUniformsDefinition light_uniforms[] = {
   {"shadowBias", GTHREE_UNIFORM_TYPE_FLOAT, &f0 },
   {"shadowRadius", GTHREE_UNIFORM_TYPE_FLOAT, &f1 },
   {"shadowMapSize", GTHREE_UNIFORM_TYPE_VECTOR2, &zerov2 },
+  {"shadowMapRect", GTHREE_UNIFORM_TYPE_VECTOR4, &unit_rect },
 };
 
 static void
@@ -145,18 +147,18 @@ gthree_spot_light_real_setup (GthreeLight *light,
     {
       GthreeLightShadow *shadow = gthree_light_get_shadow (light);
       graphene_vec2_t size;
+      graphene_vec4_t rect;
 
       gthree_uniforms_set_float (priv->uniforms, "shadowBias", gthree_light_shadow_get_bias (shadow));
       gthree_uniforms_set_float (priv->uniforms, "shadowRadius", gthree_light_shadow_get_radius (shadow));
 
-      graphene_vec2_init (&size,
-                          gthree_light_shadow_get_map_width (shadow),
-                          gthree_light_shadow_get_map_height (shadow));
+      gthree_light_shadow_get_map_info (shadow, &size, &rect);
       gthree_uniforms_set_vec2 (priv->uniforms, "shadowMapSize", &size);
+      gthree_uniforms_set_vec4 (priv->uniforms, "shadowMapRect", &rect);
 
       GthreeRenderTarget *shadow_map = gthree_light_shadow_get_map (shadow);
       if (shadow_map)
-        shadow_map_texture = gthree_render_target_get_texture (shadow_map);
+        shadow_map_texture = gthree_render_target_get_output_texture (shadow_map);
 
       shadow_matrix = *gthree_light_shadow_get_matrix (shadow);
     }
@@ -166,6 +166,14 @@ gthree_sprite_in_frustum (GthreeObject *object,
   return graphene_frustum_intersects_sphere (frustum, &sphere);
 }
 
+static gboolean
+gthree_sprite_get_bounding_sphere (GthreeObject      *object,
+                                   graphene_sphere_t *sphere)
+{
+  graphene_sphere_init (sphere, graphene_point3d_zero (), 0.7071067811865476);
+  return TRUE;
+}
+
 static void
 gthree_sprite_set_property (GObject *obj,
                           guint prop_id,
@@ -220,6 +228,7 @@ gthree_sprite_set_material (GthreeSprite *sprite,
   GthreeSpritePrivate *priv = gthree_sprite_get_instance_private (sprite);
 
   g_set_object (&priv->material, material);
+  gthree_render_lists_invalidate ();
 }
 
 const graphene_vec2_t *
@@ -259,6 +268,7 @@ gthree_sprite_class_init (GthreeSpriteClass *klass)
   gobject_class->finalize = gthree_sprite_finalize;
 
   object_class->in_frustum = gthree_sprite_in_frustum;
+  object_class->get_bounding_sphere = gthree_sprite_get_bounding_sphere;
   object_class->update = gthree_sprite_update;
   object_class->fill_render_list = gthree_sprite_fill_render_list;
   object_class->set_direct_uniforms = gthree_sprite_set_direct_uniforms;
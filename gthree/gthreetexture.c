@@ -45,6 +45,7 @@ typedef struct {
   gboolean premultiply_alpha;
   gboolean flip_y;
   int unpack_alignment;
+  gboolean compare;
 
   guint max_mip_level;
 } GthreeTexturePrivate;
@@ -131,6 +132,7 @@ gthree_texture_copy_settings (GthreeTexture        *texture,
   priv->premultiply_alpha = source_priv->premultiply_alpha;
   priv->flip_y = source_priv->flip_y;
   priv->unpack_alignment = source_priv->unpack_alignment;
+  priv->compare = source_priv->compare;
 }
 
 static void
@@ -504,6 +506,12 @@ gthree_texture_set_parameters (guint texture_type, GthreeTexture *texture, gbool
       glTexParameteri( texture_type, GL_TEXTURE_MIN_FILTER, filter_fallback (priv->min_filter));
     }
 
+  if (priv->compare)
+    {
+      glTexParameteri (texture_type, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+      glTexParameteri (texture_type, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    }
+
 #if TODO
   if ( _glExtensionTextureFilterAnisotropic && texture.type !== THREE.FloatType ) {
     if ( texture.anisotropy > 1 || texture.__oldAnisotropy ) {
@@ -565,6 +573,7 @@ gthree_texture_bind (GthreeTexture *texture, GthreeRenderer *renderer, int slot,
   if (slot >= 0)
     glActiveTexture (GL_TEXTURE0 + slot);
   glBindTexture (target, data->gl_texture);
+  gthree_renderer_count_texture_bind (renderer);
 }
 
 int
@@ -577,6 +586,8 @@ gthree_texture_data_type_to_gl (GthreeDataType type)
       return GL_UNSIGNED_BYTE;
     case GTHREE_DATA_TYPE_BYTE:
       return GL_BYTE;
+    case GTHREE_DATA_TYPE_UNSIGNED_INT:
+      return GL_UNSIGNED_INT;
     }
 }
 
@@ -590,6 +601,8 @@ gthree_texture_format_to_gl (GthreeTextureFormat format)
       return GL_RGBA;
     case GTHREE_TEXTURE_FORMAT_RGB:
       return GL_RGB;
+    case GTHREE_TEXTURE_FORMAT_DEPTH:
+      return GL_DEPTH_COMPONENT;
     }
 }
 
@@ -629,6 +642,16 @@ gthree_texture_get_internal_gl_format (guint gl_format,
         internal_format = GL_RGBA8;
   }
 
+  if (gl_format == GL_DEPTH_COMPONENT)
+    {
+      if (gl_type == GL_FLOAT)
+        internal_format = GL_DEPTH_COMPONENT32F;
+      if (gl_type == GL_UNSIGNED_INT)
+        internal_format = GL_DEPTH_COMPONENT24;
+      if (gl_type == GL_UNSIGNED_SHORT)
+        internal_format = GL_DEPTH_COMPONENT16;
+    }
+
   return internal_format;
 }
 
@@ -761,6 +784,7 @@ gthree_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer, int
 
                   glTexImage2D (GL_TEXTURE_2D, 0, gl_format, width, height, 0, gl_format, gl_type,
                                 gdk_pixbuf_get_pixels (pixbuf));
+                  gthree_renderer_count_texture_upload (renderer, (gsize) width * height * gdk_pixbuf_get_n_channels (pixbuf));
                   g_object_unref (pixbuf);
                 }
               else
@@ -774,6 +798,7 @@ gthree_texture_real_load (GthreeTexture *texture, GthreeRenderer *renderer, int
                   glTexImage2D (GL_TEXTURE_2D, 0, gl_format, width, height, 0,
                                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
                                 cairo_image_surface_get_data (priv->surface));
+                  gthree_renderer_count_texture_upload (renderer, (gsize) width * height * 4);
                 }
             }
         }
@@ -917,6 +942,34 @@ gthree_texture_get_anisotropy (GthreeTexture *texture)
   return priv->anisotropy;
 }
 
+/**
+ * gthree_texture_set_compare:
+ * @texture: a #GthreeTexture
+ * @compare: whether sampling compares against the texture
+ *
+ * Sets whether a %GTHREE_TEXTURE_FORMAT_DEPTH texture is sampled with
+ * depth comparison. Such a texture has to be declared as a
+ * sampler2DShadow in the shader, and sampling it with a reference depth
+ * returns the fraction of the filtered texels that are not closer than
+ * the reference.
+ */
+void
+gthree_texture_set_compare (GthreeTexture *texture,
+                            gboolean compare)
+{
+  GthreeTexturePrivate *priv = gthree_texture_get_instance_private (texture);
+
+  priv->compare = !!compare;
+}
+
+gboolean
+gthree_texture_get_compare (GthreeTexture *texture)
+{
+  GthreeTexturePrivate *priv = gthree_texture_get_instance_private (texture);
+
+  return priv->compare;
+}
+
 int
 gthree_texture_get_gl_texture (GthreeTexture *texture,
                                GthreeRenderer *renderer)
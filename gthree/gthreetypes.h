@@ -4,6 +4,7 @@
 typedef struct _GthreeScene GthreeScene;
 typedef struct _GthreeCamera GthreeCamera;
 typedef struct _GthreeGroup GthreeGroup;
+typedef struct _GthreeLOD GthreeLOD;
 typedef struct _GthreeBone GthreeBone;
 typedef struct _GthreeSkeleton GthreeSkeleton;
 typedef struct _GthreePerspectiveCamera GthreePerspectiveCamera;
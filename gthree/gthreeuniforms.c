@@ -770,6 +770,25 @@ gthree_uniform_get_uarray (GthreeUniform *uniform)
   return uniform->value.ptr_array;
 }
 
+static gboolean
+uniform_value_changed (GthreeUniform  *uniform,
+                       GthreeRenderer *renderer,
+                       gconstpointer   value,
+                       gsize           size)
+{
+  return gthree_renderer_update_uniform_value (renderer, uniform->location, value, size);
+}
+
+static gboolean
+uniform_array_changed (GthreeUniform  *uniform,
+                       GthreeRenderer *renderer)
+{
+  GArray *array = uniform->value.array;
+
+  return uniform_value_changed (uniform, renderer, array->data,
+                                array->len * g_array_get_element_size (array));
+}
+
 void
 gthree_uniform_load (GthreeUniform *uniform,
                      GthreeRenderer *renderer)
@@ -780,54 +799,64 @@ gthree_uniform_load (GthreeUniform *uniform,
   if (!uniform->needs_update)
     return;
 
+  /* Even if the uniform is marked as needing an update it often has
+     the same value as last time, so each upload is checked against
+     what the program already has. */
   switch (uniform->type)
     {
     case GTHREE_UNIFORM_TYPE_INT:
-      glUniform1i (uniform->location, uniform->value.ints[0]);
+      if (uniform_value_changed (uniform, renderer, uniform->value.ints, sizeof (int)))
+        glUniform1i (uniform->location, uniform->value.ints[0]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT:
-      glUniform1f (uniform->location, uniform->value.floats[0]);
+      if (uniform_value_changed (uniform, renderer, uniform->value.floats, sizeof (float)))
+        glUniform1f (uniform->location, uniform->value.floats[0]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT2:
     case GTHREE_UNIFORM_TYPE_VECTOR2:
-      glUniform2f (uniform->location, uniform->value.floats[0], uniform->value.floats[1]);
+      if (uniform_value_changed (uniform, renderer, uniform->value.floats, 2 * sizeof (float)))
+        glUniform2f (uniform->location, uniform->value.floats[0], uniform->value.floats[1]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT3:
     case GTHREE_UNIFORM_TYPE_VECTOR3:
-      glUniform3f (uniform->location, uniform->value.floats[0], uniform->value.floats[1], uniform->value.floats[2]);
+      if (uniform_value_changed (uniform, renderer, uniform->value.floats, 3 * sizeof (float)))
+        glUniform3f (uniform->location, uniform->value.floats[0], uniform->value.floats[1], uniform->value.floats[2]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT4:
     case GTHREE_UNIFORM_TYPE_VECTOR4:
-      glUniform4f (uniform->location, uniform->value.floats[0], uniform->value.floats[1], uniform->value.floats[2], uniform->value.floats[3]);
+      if (uniform_value_changed (uniform, renderer, uniform->value.floats, 4 * sizeof (float)))
+        glUniform4f (uniform->location, uniform->value.floats[0], uniform->value.floats[1], uniform->value.floats[2], uniform->value.floats[3]);
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT_ARRAY:
-      if (uniform->value.array)
+      if (uniform->value.array && uniform_array_changed (uniform, renderer))
         glUniform1fv (uniform->location, uniform->value.array->len, &g_array_index (uniform->value.array, float, 0));
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT2_ARRAY:
-      if (uniform->value.array)
+      if (uniform->value.array && uniform_array_changed (uniform, renderer))
         glUniform2fv (uniform->location, uniform->value.array->len / 2, &g_array_index (uniform->value.array, float, 0));
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT3_ARRAY:
-      if (uniform->value.array)
+      if (uniform->value.array && uniform_array_changed (uniform, renderer))
         glUniform3fv (uniform->location, uniform->value.array->len / 3, &g_array_index (uniform->value.array, float, 0));
       break;
     case GTHREE_UNIFORM_TYPE_FLOAT4_ARRAY:
-      if (uniform->value.array)
+      if (uniform->value.array && uniform_array_changed (uniform, renderer))
         glUniform4fv (uniform->location, uniform->value.array->len / 4, &g_array_index (uniform->value.array, float, 0));
       break;
     case GTHREE_UNIFORM_TYPE_MATRIX3:
-      glUniformMatrix3fv (uniform->location, 1, FALSE, uniform->value.more_floats);
+      if (uniform_value_changed (uniform, renderer, uniform->value.more_floats, 9 * sizeof (float)))
+        glUniformMatrix3fv (uniform->location, 1, FALSE, uniform->value.more_floats);
       break;
     case GTHREE_UNIFORM_TYPE_MATRIX4:
-      glUniformMatrix4fv (uniform->location, 1, FALSE, uniform->value.more_floats);
+      if (uniform_value_changed (uniform, renderer, uniform->value.more_floats, 16 * sizeof (float)))
+        glUniformMatrix4fv (uniform->location, 1, FALSE, uniform->value.more_floats);
       break;
     case GTHREE_UNIFORM_TYPE_INT_ARRAY:
-      if (uniform->value.array)
+      if (uniform->value.array && uniform_array_changed (uniform, renderer))
         glUniform1iv (uniform->location, uniform->value.array->len, &g_array_index (uniform->value.array, int, 0));
       break;
     case GTHREE_UNIFORM_TYPE_INT3_ARRAY:
-      if (uniform->value.array)
+      if (uniform->value.array && uniform_array_changed (uniform, renderer))
         glUniform3iv (uniform->location, uniform->value.array->len, &g_array_index (uniform->value.array, int, 0));
       break;
     case GTHREE_UNIFORM_TYPE_TEXTURE:
@@ -835,7 +864,8 @@ gthree_uniform_load (GthreeUniform *uniform,
         {
           int unit = gthree_renderer_allocate_texture_unit (renderer);
           gthree_texture_load (uniform->value.texture, renderer, unit);
-          glUniform1i(uniform->location, unit);
+          if (uniform_value_changed (uniform, renderer, &unit, sizeof (int)))
+            glUniform1i(uniform->location, unit);
         }
 
       break;
@@ -855,16 +885,22 @@ gthree_uniform_load (GthreeUniform *uniform,
         {
           guint i, len = uniform->value.ptr_array->len;
           int *units = g_alloca (len * sizeof (int));
+          gboolean any_texture = FALSE;
+
           for (i = 0; i < len; i++)
             {
               GthreeTexture *texture = g_ptr_array_index (uniform->value.ptr_array, i);
+              units[i] = 0;
               if (texture)
                 {
                   units[i] = gthree_renderer_allocate_texture_unit (renderer);
                   gthree_texture_load (texture, renderer, units[i]);
-                  glUniform1iv (uniform->location, len, units);
+                  any_texture = TRUE;
                 }
             }
+
+          if (any_texture && uniform_value_changed (uniform, renderer, units, len * sizeof (int)))
+            glUniform1iv (uniform->location, len, units);
         }
 
       break;
@@ -880,7 +916,8 @@ gthree_uniform_load (GthreeUniform *uniform,
               graphene_matrix_to_float (m, &floats[16*i]);
             }
 
-          glUniformMatrix4fv (uniform->location, len, FALSE, floats);
+          if (uniform_value_changed (uniform, renderer, floats, len * sizeof (float) * 16))
+            glUniformMatrix4fv (uniform->location, len, FALSE, floats);
         }
       break;
     case GTHREE_UNIFORM_TYPE_VEC2_ARRAY:
@@ -891,6 +928,68 @@ gthree_uniform_load (GthreeUniform *uniform,
     }
 }
 
+/* Stores the value at the first std140 aligned position at or after
+ * offset, growing data as needed. Returns the offset after the value. */
+gsize
+gthree_uniform_pack_std140 (GthreeUniform *uniform,
+                            GByteArray    *data,
+                            gsize          offset)
+{
+  static const float zero_matrix[16] = { 0 };
+  const void *value;
+  gsize size, alignment;
+
+  switch (uniform->type)
+    {
+    case GTHREE_UNIFORM_TYPE_INT:
+      value = uniform->value.ints;
+      size = alignment = 4;
+      break;
+    case GTHREE_UNIFORM_TYPE_FLOAT:
+      value = uniform->value.floats;
+      size = alignment = 4;
+      break;
+    case GTHREE_UNIFORM_TYPE_FLOAT2:
+    case GTHREE_UNIFORM_TYPE_VECTOR2:
+      value = uniform->value.floats;
+      size = alignment = 8;
+      break;
+    case GTHREE_UNIFORM_TYPE_FLOAT3:
+    case GTHREE_UNIFORM_TYPE_VECTOR3:
+      value = uniform->value.floats;
+      size = 12;
+      alignment = 16;
+      break;
+    case GTHREE_UNIFORM_TYPE_FLOAT4:
+    case GTHREE_UNIFORM_TYPE_VECTOR4:
+      value = uniform->value.floats;
+      size = alignment = 16;
+      break;
+    case GTHREE_UNIFORM_TYPE_MATRIX4:
+      value = uniform->value.more_floats ? uniform->value.more_floats : zero_matrix;
+      size = 64;
+      alignment = 16;
+      break;
+    default:
+      g_warning ("gthree_uniform_pack_std140() - unsupported uniform type %d\n", uniform->type);
+      return offset;
+    }
+
+  offset = (offset + alignment - 1) & ~(alignment - 1);
+
+  if (data->len < offset + size)
+    {
+      gsize old_len = data->len;
+
+      g_byte_array_set_size (data, offset + size);
+      memset (data->data + old_len, 0, offset + size - old_len);
+    }
+
+  memcpy (data->data + offset, value, size);
+
+  return offset + size;
+}
+
 static int i0 = 0;
 static float f0 = 0.0;
 static float f1 = 1.0;
@@ -1008,6 +1107,8 @@ static GthreeUniformsDefinition lights_lib[] = {
   {"directionalLights", GTHREE_UNIFORM_TYPE_UNIFORMS_ARRAY, NULL},
   {"directionalShadowMap", GTHREE_UNIFORM_TYPE_TEXTURE_ARRAY, NULL},
   {"directionalShadowMatrix", GTHREE_UNIFORM_TYPE_MATRIX4_ARRAY, NULL},
+  {"directionalShadowCascadeMatrix", GTHREE_UNIFORM_TYPE_MATRIX4_ARRAY, NULL},
+  {"shadowAtlas", GTHREE_UNIFORM_TYPE_TEXTURE, NULL},
   /*
     properties: {
       direction: {},
@@ -1015,7 +1116,9 @@ static GthreeUniformsDefinition lights_lib[] = {
       shadow: {},
       shadowBias: {},
       shadowRadius: {},
-      shadowMapSize: {}
+      shadowMapSize: {},
+      shadowCascades: {},
+      shadowMapRect: {}
       }
   */
 
@@ -1,17 +1,13 @@
 #ifdef USE_FOG
 
-	uniform vec3 fogColor;
-	varying float fogDepth;
-
-	#ifdef FOG_EXP2
-
-		uniform float fogDensity;
+	// Shared by all programs, filled once per frame by the renderer
+	layout(std140) uniform GthreeFog {
+		vec3 fogColor;
+		float fogNear;
+		float fogFar;
+		float fogDensity;
+	};
 
-	#else
-
-		uniform float fogNear;
-		uniform float fogFar;
-
-	#endif
+	varying float fogDepth;
 
 #endif
@@ -21,7 +21,39 @@ geometry.viewDir = normalize( vViewPosition );
 
 IncidentLight directLight;
 
-#if ( NUM_POINT_LIGHTS > 0 ) && defined( RE_Direct )
+#if ( NUM_POINT_LIGHTS > 0 ) && defined( RE_Direct ) && defined( MAX_OBJECT_LIGHTS )
+
+	PointLight pointLight;
+
+	#ifdef USE_SHADOWMAP
+
+	#pragma unroll_loop
+	for ( int i = 0; i < NUM_POINT_LIGHT_SHADOWS; i ++ ) {
+
+		pointLight = pointLights[ i ];
+
+		getPointDirectLightIrradiance( pointLight, geometry, directLight );
+
+		directLight.color *= directLight.visible ? getPointShadow( SHADOW_MAP( pointShadowMap[ i ] ), pointLight.shadowMapSize, pointLight.shadowBias, pointLight.shadowRadius, vPointShadowCoord[ i ], pointLight.shadowMapRect, pointLight.shadowCameraNear, pointLight.shadowCameraFar ) : 1.0;
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+	#endif
+
+	for ( int j = 0; j < MAX_OBJECT_LIGHTS; j ++ ) {
+
+		int lightIndex = objectPointLights[ j ];
+		if ( lightIndex < 0 ) break;
+
+		getPointDirectLightIrradiance( pointLights[ lightIndex ], geometry, directLight );
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+#elif ( NUM_POINT_LIGHTS > 0 ) && defined( RE_Direct )
 
 	PointLight pointLight;
 
@@ -33,7 +65,7 @@ IncidentLight directLight;
 		getPointDirectLightIrradiance( pointLight, geometry, directLight );
 
 		#ifdef USE_SHADOWMAP
-		directLight.color *= all( bvec2( pointLight.shadow, directLight.visible ) ) ? getPointShadow( pointShadowMap[ i ], pointLight.shadowMapSize, pointLight.shadowBias, pointLight.shadowRadius, vPointShadowCoord[ i ], pointLight.shadowCameraNear, pointLight.shadowCameraFar ) : 1.0;
+		directLight.color *= all( bvec2( pointLight.shadow, directLight.visible ) ) ? getPointShadow( SHADOW_MAP( pointShadowMap[ i ] ), pointLight.shadowMapSize, pointLight.shadowBias, pointLight.shadowRadius, vPointShadowCoord[ i ], pointLight.shadowMapRect, pointLight.shadowCameraNear, pointLight.shadowCameraFar ) : 1.0;
 		#endif
 
 		RE_Direct( directLight, geometry, material, reflectedLight );
@@ -42,7 +74,39 @@ IncidentLight directLight;
 
 #endif
 
-#if ( NUM_SPOT_LIGHTS > 0 ) && defined( RE_Direct )
+#if ( NUM_SPOT_LIGHTS > 0 ) && defined( RE_Direct ) && defined( MAX_OBJECT_LIGHTS )
+
+	SpotLight spotLight;
+
+	#ifdef USE_SHADOWMAP
+
+	#pragma unroll_loop
+	for ( int i = 0; i < NUM_SPOT_LIGHT_SHADOWS; i ++ ) {
+
+		spotLight = spotLights[ i ];
+
+		getSpotDirectLightIrradiance( spotLight, geometry, directLight );
+
+		directLight.color *= directLight.visible ? getShadow( SHADOW_MAP( spotShadowMap[ i ] ), spotLight.shadowMapSize, spotLight.shadowBias, spotLight.shadowRadius, vSpotShadowCoord[ i ], spotLight.shadowMapRect ) : 1.0;
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+	#endif
+
+	for ( int j = 0; j < MAX_OBJECT_LIGHTS; j ++ ) {
+
+		int lightIndex = objectSpotLights[ j ];
+		if ( lightIndex < 0 ) break;
+
+		getSpotDirectLightIrradiance( spotLights[ lightIndex ], geometry, directLight );
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+#elif ( NUM_SPOT_LIGHTS > 0 ) && defined( RE_Direct )
 
 	SpotLight spotLight;
 
@@ -54,7 +118,7 @@ IncidentLight directLight;
 		getSpotDirectLightIrradiance( spotLight, geometry, directLight );
 
 		#ifdef USE_SHADOWMAP
-		directLight.color *= all( bvec2( spotLight.shadow, directLight.visible ) ) ? getShadow( spotShadowMap[ i ], spotLight.shadowMapSize, spotLight.shadowBias, spotLight.shadowRadius, vSpotShadowCoord[ i ] ) : 1.0;
+		directLight.color *= all( bvec2( spotLight.shadow, directLight.visible ) ) ? getShadow( SHADOW_MAP( spotShadowMap[ i ] ), spotLight.shadowMapSize, spotLight.shadowBias, spotLight.shadowRadius, vSpotShadowCoord[ i ], spotLight.shadowMapRect ) : 1.0;
 		#endif
 
 		RE_Direct( directLight, geometry, material, reflectedLight );
@@ -63,6 +127,20 @@ IncidentLight directLight;
 
 #endif
 
+#if defined( USE_CLUSTERED_LIGHTS ) && defined( RE_Direct )
+
+	uvec2 cluster = getLightCluster( geometry.position );
+
+	for ( uint i = 0u; i < cluster.y; i ++ ) {
+
+		getClusteredDirectLightIrradiance( getClusterLightIndex( cluster.x + i ), geometry, directLight );
+
+		RE_Direct( directLight, geometry, material, reflectedLight );
+
+	}
+
+#endif
+
 #if ( NUM_DIR_LIGHTS > 0 ) && defined( RE_Direct )
 
 	DirectionalLight directionalLight;
@@ -74,8 +152,10 @@ IncidentLight directLight;
 
 		getDirectionalDirectLightIrradiance( directionalLight, geometry, directLight );
 
-		#ifdef USE_SHADOWMAP
-		directLight.color *= all( bvec2( directionalLight.shadow, directLight.visible ) ) ? getShadow( directionalShadowMap[ i ], directionalLight.shadowMapSize, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ] ) : 1.0;
+		#if defined( USE_SHADOWMAP ) && defined( USE_SHADOW_CASCADES )
+		directLight.color *= all( bvec2( directionalLight.shadow, directLight.visible ) ) ? getCascadedShadow( SHADOW_MAP( directionalShadowMap[ i ] ), directionalLight.shadowMapSize, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ], directionalLight.shadowMapRect, UNROLLED_LOOP_INDEX, directionalLight.shadowCascades ) : 1.0;
+		#elif defined( USE_SHADOWMAP )
+		directLight.color *= all( bvec2( directionalLight.shadow, directLight.visible ) ) ? getShadow( SHADOW_MAP( directionalShadowMap[ i ] ), directionalLight.shadowMapSize, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ], directionalLight.shadowMapRect ) : 1.0;
 		#endif
 
 		RE_Direct( directLight, geometry, material, reflectedLight );
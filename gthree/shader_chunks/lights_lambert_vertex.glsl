@@ -22,7 +22,54 @@ IncidentLight directLight;
 float dotNL;
 vec3 directLightColor_Diffuse;
 
-#if NUM_POINT_LIGHTS > 0
+#if ( NUM_POINT_LIGHTS > 0 ) && defined( MAX_OBJECT_LIGHTS )
+
+	// The shadow casters are not in the per-object lists with USE_SHADOWMAP,
+	// see lights_pars_begin
+
+	#ifdef USE_SHADOWMAP
+
+	#pragma unroll_loop
+	for ( int i = 0; i < NUM_POINT_LIGHT_SHADOWS; i ++ ) {
+
+		getPointDirectLightIrradiance( pointLights[ i ], geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+	#endif
+
+	for ( int j = 0; j < MAX_OBJECT_LIGHTS; j ++ ) {
+
+		int lightIndex = objectPointLights[ j ];
+		if ( lightIndex < 0 ) break;
+
+		getPointDirectLightIrradiance( pointLights[ lightIndex ], geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+#elif NUM_POINT_LIGHTS > 0
 
 	#pragma unroll_loop
 	for ( int i = 0; i < NUM_POINT_LIGHTS; i ++ ) {
@@ -44,7 +91,54 @@ vec3 directLightColor_Diffuse;
 
 #endif
 
-#if NUM_SPOT_LIGHTS > 0
+#if ( NUM_SPOT_LIGHTS > 0 ) && defined( MAX_OBJECT_LIGHTS )
+
+	// The shadow casters are not in the per-object lists with USE_SHADOWMAP,
+	// see lights_pars_begin
+
+	#ifdef USE_SHADOWMAP
+
+	#pragma unroll_loop
+	for ( int i = 0; i < NUM_SPOT_LIGHT_SHADOWS; i ++ ) {
+
+		getSpotDirectLightIrradiance( spotLights[ i ], geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+	#endif
+
+	for ( int j = 0; j < MAX_OBJECT_LIGHTS; j ++ ) {
+
+		int lightIndex = objectSpotLights[ j ];
+		if ( lightIndex < 0 ) break;
+
+		getSpotDirectLightIrradiance( spotLights[ lightIndex ], geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+#elif NUM_SPOT_LIGHTS > 0
 
 	#pragma unroll_loop
 	for ( int i = 0; i < NUM_SPOT_LIGHTS; i ++ ) {
@@ -65,6 +159,30 @@ vec3 directLightColor_Diffuse;
 
 #endif
 
+#ifdef USE_CLUSTERED_LIGHTS
+
+	// Binned per vertex, so big triangles can miss lights of neighbouring clusters
+	uvec2 cluster = getLightCluster( geometry.position );
+
+	for ( uint i = 0u; i < cluster.y; i ++ ) {
+
+		getClusteredDirectLightIrradiance( getClusterLightIndex( cluster.x + i ), geometry, directLight );
+
+		dotNL = dot( geometry.normal, directLight.direction );
+		directLightColor_Diffuse = PI * directLight.color;
+
+		vLightFront += saturate( dotNL ) * directLightColor_Diffuse;
+
+		#ifdef DOUBLE_SIDED
+
+			vLightBack += saturate( -dotNL ) * directLightColor_Diffuse;
+
+		#endif
+
+	}
+
+#endif
+
 /*
 #if NUM_RECT_AREA_LIGHTS > 0
 
@@ -1,4 +1,111 @@
-uniform vec3 ambientLightColor;
+#if NUM_DIR_LIGHTS > 0
+
+	struct DirectionalLight {
+		vec3 direction;
+		vec3 color;
+
+		int shadow;
+		float shadowBias;
+		float shadowRadius;
+		vec2 shadowMapSize;
+		int shadowCascades;
+		vec4 shadowMapRect;
+	};
+
+#endif
+
+#if NUM_POINT_LIGHTS > 0
+
+	struct PointLight {
+		vec3 position;
+		vec3 color;
+		float distance;
+		float decay;
+
+		int shadow;
+		float shadowBias;
+		float shadowRadius;
+		vec2 shadowMapSize;
+		float shadowCameraNear;
+		float shadowCameraFar;
+		vec4 shadowMapRect;
+	};
+
+#endif
+
+#if NUM_SPOT_LIGHTS > 0
+
+	struct SpotLight {
+		vec3 position;
+		vec3 direction;
+		vec3 color;
+		float distance;
+		float decay;
+		float coneCos;
+		float penumbraCos;
+
+		int shadow;
+		float shadowBias;
+		float shadowRadius;
+		vec2 shadowMapSize;
+		vec4 shadowMapRect;
+	};
+
+#endif
+
+#if NUM_HEMI_LIGHTS > 0
+
+	struct HemisphereLight {
+		vec3 direction;
+		vec3 skyColor;
+		vec3 groundColor;
+	};
+
+#endif
+
+// Shared by all programs, filled once per frame by the renderer
+layout(std140) uniform GthreeLights {
+
+	vec3 ambientLightColor;
+
+	// Near plane and depth slice scale of the light clusters
+	vec4 clusterParams;
+
+	#if NUM_DIR_LIGHTS > 0
+		DirectionalLight directionalLights[ NUM_DIR_LIGHTS ];
+	#endif
+
+	#if NUM_POINT_LIGHTS > 0
+		PointLight pointLights[ NUM_POINT_LIGHTS ];
+	#endif
+
+	#if NUM_SPOT_LIGHTS > 0
+		SpotLight spotLights[ NUM_SPOT_LIGHTS ];
+	#endif
+
+	#if NUM_HEMI_LIGHTS > 0
+		HemisphereLight hemisphereLights[ NUM_HEMI_LIGHTS ];
+	#endif
+
+};
+
+#ifdef MAX_OBJECT_LIGHTS
+
+	// The lights reaching the object, picked per draw by the renderer.
+	// Shadow casting lights come first in the arrays and are not in these
+	// when USE_SHADOWMAP is defined, as their shadow maps need constant indices.
+	// Unused entries are -1.
+
+	#if NUM_POINT_LIGHTS > 0
+		uniform int objectPointLights[ MAX_OBJECT_LIGHTS ];
+	#endif
+
+	#if NUM_SPOT_LIGHTS > 0
+		uniform int objectSpotLights[ MAX_OBJECT_LIGHTS ];
+	#endif
+
+#endif
+
 uniform vec3 lightProbe[ 9 ];
 
 // get the irradiance (radiance convolved with cosine lobe) at the point 'normal' on the unit sphere
@@ -54,18 +161,6 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 
 #if NUM_DIR_LIGHTS > 0
 
-	struct DirectionalLight {
-		vec3 direction;
-		vec3 color;
-
-		int shadow;
-		float shadowBias;
-		float shadowRadius;
-		vec2 shadowMapSize;
-	};
-
-	uniform DirectionalLight directionalLights[ NUM_DIR_LIGHTS ];
-
 	void getDirectionalDirectLightIrradiance( const in DirectionalLight directionalLight, const in GeometricContext geometry, out IncidentLight directLight ) {
 
 		directLight.color = directionalLight.color;
@@ -79,22 +174,6 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 
 #if NUM_POINT_LIGHTS > 0
 
-	struct PointLight {
-		vec3 position;
-		vec3 color;
-		float distance;
-		float decay;
-
-		int shadow;
-		float shadowBias;
-		float shadowRadius;
-		vec2 shadowMapSize;
-		float shadowCameraNear;
-		float shadowCameraFar;
-	};
-
-	uniform PointLight pointLights[ NUM_POINT_LIGHTS ];
-
 	// directLight is an out parameter as having it as a return value caused compiler errors on some devices
 	void getPointDirectLightIrradiance( const in PointLight pointLight, const in GeometricContext geometry, out IncidentLight directLight ) {
 
@@ -114,23 +193,6 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 
 #if NUM_SPOT_LIGHTS > 0
 
-	struct SpotLight {
-		vec3 position;
-		vec3 direction;
-		vec3 color;
-		float distance;
-		float decay;
-		float coneCos;
-		float penumbraCos;
-
-		int shadow;
-		float shadowBias;
-		float shadowRadius;
-		vec2 shadowMapSize;
-	};
-
-	uniform SpotLight spotLights[ NUM_SPOT_LIGHTS ];
-
 	// directLight is an out parameter as having it as a return value caused compiler errors on some devices
 	void getSpotDirectLightIrradiance( const in SpotLight spotLight, const in GeometricContext geometry, out IncidentLight directLight  ) {
 
@@ -180,14 +242,6 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 
 #if NUM_HEMI_LIGHTS > 0
 
-	struct HemisphereLight {
-		vec3 direction;
-		vec3 skyColor;
-		vec3 groundColor;
-	};
-
-	uniform HemisphereLight hemisphereLights[ NUM_HEMI_LIGHTS ];
-
 	vec3 getHemisphereLightIrradiance( const in HemisphereLight hemiLight, const in GeometricContext geometry ) {
 
 		float dotNL = dot( geometry.normal, hemiLight.direction );
@@ -206,3 +260,61 @@ vec3 getAmbientLightIrradiance( const in vec3 ambientLightColor ) {
 	}
 
 #endif
+
+
+#ifdef USE_CLUSTERED_LIGHTS
+
+	// Filled by the renderer, see gthreeclusters.c
+	uniform sampler2D clusterLightData;
+	uniform usampler2D clusterGrid;
+	uniform usampler2D clusterLightIndices;
+
+	// Returns the first index and the number of lights of the cluster
+	uvec2 getLightCluster( const in vec3 viewPosition ) {
+
+		vec4 clipPosition = projectionMatrix * vec4( viewPosition, 1.0 );
+		vec2 ndc = clamp( clipPosition.xy / clipPosition.w, -1.0, 0.999999 );
+		ivec2 tile = ivec2( ( ndc * 0.5 + 0.5 ) * vec2( CLUSTER_GRID_X, CLUSTER_GRID_Y ) );
+
+		float depth = max( - viewPosition.z, clusterParams.x );
+		int slice = clamp( int( floor( log( depth / clusterParams.x ) * clusterParams.y ) ), 0, CLUSTER_GRID_Z - 1 );
+
+		return texelFetch( clusterGrid, ivec2( tile.y * CLUSTER_GRID_X + tile.x, slice ), 0 ).xy;
+
+	}
+
+	int getClusterLightIndex( const in uint index ) {
+
+		int i = int( index );
+		return int( texelFetch( clusterLightIndices, ivec2( i % CLUSTER_INDEX_WIDTH, i / CLUSTER_INDEX_WIDTH ), 0 ).x );
+
+	}
+
+	void getClusteredDirectLightIrradiance( const in int lightIndex, const in GeometricContext geometry, out IncidentLight directLight ) {
+
+		vec4 position = texelFetch( clusterLightData, ivec2( 0, lightIndex ), 0 );
+		vec4 color = texelFetch( clusterLightData, ivec2( 1, lightIndex ), 0 );
+		vec4 direction = texelFetch( clusterLightData, ivec2( 2, lightIndex ), 0 );
+
+		vec3 lVector = position.xyz - geometry.position;
+		directLight.direction = normalize( lVector );
+
+		float lightDistance = length( lVector );
+
+		directLight.color = color.rgb * punctualLightIntensityToIrradianceFactor( lightDistance, color.w, direction.w );
+
+		// Spot light
+		if ( position.w > 0.5 ) {
+
+			vec4 cone = texelFetch( clusterLightData, ivec2( 3, lightIndex ), 0 );
+			float angleCos = dot( directLight.direction, direction.xyz );
+
+			directLight.color *= angleCos > cone.x ? smoothstep( cone.x, cone.y, angleCos ) : 0.0;
+
+		}
+
+		directLight.visible = ( directLight.color != vec3( 0.0 ) );
+
+	}
+
+#endif
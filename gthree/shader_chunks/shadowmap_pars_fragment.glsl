@@ -1,22 +1,53 @@
 #ifdef USE_SHADOWMAP
 
+	// With hardware PCF the maps are depth textures, and sampling them
+	// does the comparison and the bilinear filtering
+	#ifdef SHADOWMAP_TYPE_PCF_HARDWARE
+
+		#define SHADOW_SAMPLER sampler2DShadow
+
+	#else
+
+		#define SHADOW_SAMPLER sampler2D
+
+	#endif
+
+	// With a shadow atlas all the maps are parts of one texture, the
+	// shadowMapRect of each light says which part
+	#ifdef USE_SHADOW_ATLAS
+
+		uniform SHADOW_SAMPLER shadowAtlas;
+		#define SHADOW_MAP( map ) shadowAtlas
+
+	#else
+
+		#define SHADOW_MAP( map ) map
+
+	#endif
+
 	#if NUM_DIR_LIGHTS > 0
 
-		uniform sampler2D directionalShadowMap[ NUM_DIR_LIGHTS ];
+		#ifndef USE_SHADOW_ATLAS
+		uniform SHADOW_SAMPLER directionalShadowMap[ NUM_DIR_LIGHTS ];
+		#endif
 		varying vec4 vDirectionalShadowCoord[ NUM_DIR_LIGHTS ];
 
 	#endif
 
 	#if NUM_SPOT_LIGHTS > 0
 
-		uniform sampler2D spotShadowMap[ NUM_SPOT_LIGHTS ];
+		#ifndef USE_SHADOW_ATLAS
+		uniform SHADOW_SAMPLER spotShadowMap[ NUM_SPOT_LIGHTS ];
+		#endif
 		varying vec4 vSpotShadowCoord[ NUM_SPOT_LIGHTS ];
 
 	#endif
 
 	#if NUM_POINT_LIGHTS > 0
 
-		uniform sampler2D pointShadowMap[ NUM_POINT_LIGHTS ];
+		#ifndef USE_SHADOW_ATLAS
+		uniform SHADOW_SAMPLER pointShadowMap[ NUM_POINT_LIGHTS ];
+		#endif
 		varying vec4 vPointShadowCoord[ NUM_POINT_LIGHTS ];
 
 	#endif
@@ -29,13 +60,25 @@
 	#endif
 	*/
 
-	float texture2DCompare( sampler2D depths, vec2 uv, float compare ) {
+	#ifdef SHADOWMAP_TYPE_PCF_HARDWARE
+
+	float texture2DCompare( SHADOW_SAMPLER depths, vec2 uv, float compare ) {
+
+		return texture( depths, vec3( uv, compare ) );
+
+	}
+
+	#else
+
+	float texture2DCompare( SHADOW_SAMPLER depths, vec2 uv, float compare ) {
 
 		return step( compare, unpackRGBAToDepth( texture2D( depths, uv ) ) );
 
 	}
 
-	float texture2DShadowLerp( sampler2D depths, vec2 size, vec2 uv, float compare ) {
+	#endif
+
+	float texture2DShadowLerp( SHADOW_SAMPLER depths, vec2 size, vec2 uv, float compare ) {
 
 		const vec2 offset = vec2( 0.0, 1.0 );
 
@@ -57,7 +100,7 @@
 
 	}
 
-	float getShadow( sampler2D shadowMap, vec2 shadowMapSize, float shadowBias, float shadowRadius, vec4 shadowCoord ) {
+	float getShadow( SHADOW_SAMPLER shadowMap, vec2 shadowMapSize, float shadowBias, float shadowRadius, vec4 shadowCoord, vec4 shadowMapRect ) {
 
 		float shadow = 1.0;
 
@@ -76,6 +119,9 @@
 
 		if ( frustumTest ) {
 
+		shadowCoord.xy = shadowMapRect.xy + shadowMapRect.zw * shadowCoord.xy;
+		shadowMapSize /= shadowMapRect.zw;
+
 		#if defined( SHADOWMAP_TYPE_PCF )
 
 			vec2 texelSize = vec2( 1.0 ) / shadowMapSize;
@@ -118,6 +164,19 @@
 				texture2DShadowLerp( shadowMap, shadowMapSize, shadowCoord.xy + vec2( dx1, dy1 ), shadowCoord.z )
 			) * ( 1.0 / 9.0 );
 
+		#elif defined( SHADOWMAP_TYPE_PCF_HARDWARE )
+
+			// Each lookup already filters 2x2 texels, so four lookups
+			// half a texel apart cover as much as the nine above
+			vec2 d = 0.5 * shadowRadius / shadowMapSize;
+
+			shadow = (
+				texture2DCompare( shadowMap, shadowCoord.xy + vec2( - d.x, - d.y ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, shadowCoord.xy + vec2( d.x, - d.y ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, shadowCoord.xy + vec2( - d.x, d.y ), shadowCoord.z ) +
+				texture2DCompare( shadowMap, shadowCoord.xy + vec2( d.x, d.y ), shadowCoord.z )
+			) * ( 1.0 / 4.0 );
+
 		#else // no percentage-closer filtering:
 
 			shadow = texture2DCompare( shadowMap, shadowCoord.xy, shadowCoord.z );
@@ -130,6 +189,45 @@
 
 	}
 
+	#if defined( USE_SHADOW_CASCADES ) && NUM_DIR_LIGHTS > 0
+
+	uniform mat4 directionalShadowCascadeMatrix[ NUM_DIR_LIGHTS * MAX_SHADOW_CASCADES ];
+
+	// The cascades of a directional light are tiled two per row in its
+	// shadow map. shadowCoord is in the coordinates of the first cascade,
+	// the cascade matrices map it to the others. Use the first (and thus
+	// most detailed) cascade that covers the fragment.
+	float getCascadedShadow( SHADOW_SAMPLER shadowMap, vec2 shadowMapSize, float shadowBias, float shadowRadius, vec4 shadowCoord, vec4 shadowMapRect, int lightIndex, int cascades ) {
+
+		if ( cascades <= 1 ) return getShadow( shadowMap, shadowMapSize, shadowBias, shadowRadius, shadowCoord, shadowMapRect );
+
+		vec2 tiles = vec2( 2.0, float( ( cascades + 1 ) / 2 ) );
+
+		// Keep the filter taps inside the tile
+		vec2 margin = vec2( shadowRadius + 1.0 ) / shadowMapSize;
+
+		for ( int k = 0; k < MAX_SHADOW_CASCADES; k ++ ) {
+
+			if ( k >= cascades ) break;
+
+			vec4 coord = directionalShadowCascadeMatrix[ lightIndex * MAX_SHADOW_CASCADES + k ] * shadowCoord;
+
+			if ( all( greaterThanEqual( coord.xy, margin ) ) && all( lessThanEqual( coord.xy, vec2( 1.0 ) - margin ) ) ) {
+
+				coord.xy = ( coord.xy + vec2( float( k - 2 * ( k / 2 ) ), float( k / 2 ) ) ) / tiles;
+
+				return getShadow( shadowMap, shadowMapSize * tiles, shadowBias, shadowRadius, coord, shadowMapRect );
+
+			}
+
+		}
+
+		return 1.0;
+
+	}
+
+	#endif
+
 	// cubeToUV() maps a 3D direction vector suitable for cube texture mapping to a 2D
 	// vector suitable for 2D texture mapping. This code uses the following layout for the
 	// 2D texture:
@@ -201,7 +299,13 @@
 
 	}
 
-	float getPointShadow( sampler2D shadowMap, vec2 shadowMapSize, float shadowBias, float shadowRadius, vec4 shadowCoord, float shadowCameraNear, float shadowCameraFar ) {
+	vec2 cubeToUV( vec3 v, float texelSizeY, vec4 rect ) {
+
+		return rect.xy + rect.zw * cubeToUV( v, texelSizeY );
+
+	}
+
+	float getPointShadow( SHADOW_SAMPLER shadowMap, vec2 shadowMapSize, float shadowBias, float shadowRadius, vec4 shadowCoord, vec4 shadowMapRect, float shadowCameraNear, float shadowCameraFar ) {
 
 		vec2 texelSize = vec2( 1.0 ) / ( shadowMapSize * vec2( 4.0, 2.0 ) );
 
@@ -209,32 +313,58 @@
 		// the vector from the light to the world-space position of the fragment.
 		vec3 lightToPosition = shadowCoord.xyz;
 
-		// dp = normalized distance from light to fragment position
-		float dp = ( length( lightToPosition ) - shadowCameraNear ) / ( shadowCameraFar - shadowCameraNear ); // need to clamp?
-		dp += shadowBias;
+		#if defined( SHADOWMAP_TYPE_PCF_HARDWARE )
+
+			// dp = depth of the fragment as seen by the cube face camera
+			// looking along the major axis, with the bias in the same
+			// units as below
+			float lightDistance = length( lightToPosition );
+			vec3 absV = abs( lightToPosition ) * ( 1.0 + shadowBias * ( shadowCameraFar - shadowCameraNear ) / lightDistance );
+			float z = max( absV.x, max( absV.y, absV.z ) );
+			float dp = shadowCameraFar * ( z - shadowCameraNear ) / ( ( shadowCameraFar - shadowCameraNear ) * z );
+
+		#else
+
+			// dp = normalized distance from light to fragment position
+			float dp = ( length( lightToPosition ) - shadowCameraNear ) / ( shadowCameraFar - shadowCameraNear ); // need to clamp?
+			dp += shadowBias;
+
+		#endif
 
 		// bd3D = base direction 3D
 		vec3 bd3D = normalize( lightToPosition );
 
-		#if defined( SHADOWMAP_TYPE_PCF ) || defined( SHADOWMAP_TYPE_PCF_SOFT )
+		#if defined( SHADOWMAP_TYPE_PCF_HARDWARE )
+
+			// Each lookup already filters 2x2 texels
+			vec2 offset = vec2( - 1, 1 ) * 0.5 * shadowRadius * texelSize.y;
+
+			return (
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xxy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yyy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xyx, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yxx, texelSize.y, shadowMapRect ), dp )
+			) * ( 1.0 / 4.0 );
+
+		#elif defined( SHADOWMAP_TYPE_PCF ) || defined( SHADOWMAP_TYPE_PCF_SOFT )
 
 			vec2 offset = vec2( - 1, 1 ) * shadowRadius * texelSize.y;
 
 			return (
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xyy, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yyy, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xyx, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yyx, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xxy, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yxy, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xxx, texelSize.y ), dp ) +
-				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yxx, texelSize.y ), dp )
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xyy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yyy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xyx, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yyx, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xxy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yxy, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.xxx, texelSize.y, shadowMapRect ), dp ) +
+				texture2DCompare( shadowMap, cubeToUV( bd3D + offset.yxx, texelSize.y, shadowMapRect ), dp )
 			) * ( 1.0 / 9.0 );
 
 		#else // no percentage-closer filtering
 
-			return texture2DCompare( shadowMap, cubeToUV( bd3D, texelSize.y ), dp );
+			return texture2DCompare( shadowMap, cubeToUV( bd3D, texelSize.y, shadowMapRect ), dp );
 
 		#endif
 
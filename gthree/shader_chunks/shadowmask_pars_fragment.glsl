@@ -12,7 +12,11 @@ float getShadowMask() {
 	for ( int i = 0; i < NUM_DIR_LIGHTS; i ++ ) {
 
 		directionalLight = directionalLights[ i ];
-		shadow *= bool( directionalLight.shadow ) ? getShadow( directionalShadowMap[ i ], directionalLight.shadowMapSize, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ] ) : 1.0;
+		#ifdef USE_SHADOW_CASCADES
+		shadow *= bool( directionalLight.shadow ) ? getCascadedShadow( SHADOW_MAP( directionalShadowMap[ i ] ), directionalLight.shadowMapSize, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ], directionalLight.shadowMapRect, UNROLLED_LOOP_INDEX, directionalLight.shadowCascades ) : 1.0;
+		#else
+		shadow *= bool( directionalLight.shadow ) ? getShadow( SHADOW_MAP( directionalShadowMap[ i ] ), directionalLight.shadowMapSize, directionalLight.shadowBias, directionalLight.shadowRadius, vDirectionalShadowCoord[ i ], directionalLight.shadowMapRect ) : 1.0;
+		#endif
 
 	}
 
@@ -26,7 +30,7 @@ float getShadowMask() {
 	for ( int i = 0; i < NUM_SPOT_LIGHTS; i ++ ) {
 
 		spotLight = spotLights[ i ];
-		shadow *= bool( spotLight.shadow ) ? getShadow( spotShadowMap[ i ], spotLight.shadowMapSize, spotLight.shadowBias, spotLight.shadowRadius, vSpotShadowCoord[ i ] ) : 1.0;
+		shadow *= bool( spotLight.shadow ) ? getShadow( SHADOW_MAP( spotShadowMap[ i ] ), spotLight.shadowMapSize, spotLight.shadowBias, spotLight.shadowRadius, vSpotShadowCoord[ i ], spotLight.shadowMapRect ) : 1.0;
 
 	}
 
@@ -40,7 +44,7 @@ float getShadowMask() {
 	for ( int i = 0; i < NUM_POINT_LIGHTS; i ++ ) {
 
 		pointLight = pointLights[ i ];
-		shadow *= bool( pointLight.shadow ) ? getPointShadow( pointShadowMap[ i ], pointLight.shadowMapSize, pointLight.shadowBias, pointLight.shadowRadius, vPointShadowCoord[ i ], pointLight.shadowCameraNear, pointLight.shadowCameraFar ) : 1.0;
+		shadow *= bool( pointLight.shadow ) ? getPointShadow( SHADOW_MAP( pointShadowMap[ i ] ), pointLight.shadowMapSize, pointLight.shadowBias, pointLight.shadowRadius, vPointShadowCoord[ i ], pointLight.shadowMapRect, pointLight.shadowCameraNear, pointLight.shadowCameraFar ) : 1.0;
 
 	}
 